@@ -245,7 +245,7 @@ int main(int argc, char **argv)
         return -2;
     }
 
-    asset_memstore_init(&assets);
+    asset_memstore_init(&assets, NULL);
     
     intent = allo_client_intent_create();
     intent->wants_stick_movement = true;
@@ -14,6 +14,16 @@
 #include <stddef.h>
 #include <cJSON/cJSON.h>
 
+/// How much a store that keeps asset data may hold. Static assets, registered by the app, don't count.
+typedef struct assetstore_limits {
+    /// Maximum number of assets to keep
+    size_t max_count;
+    /// Maximum number of bytes to keep
+    size_t max_bytes;
+    /// Seconds after its last use that an asset is removed, even if the store is within its limits
+    double max_age;
+} assetstore_limits;
+
 /// Api for asset handling
 typedef struct assetstore {
     
@@ -58,22 +68,30 @@ typedef struct assetstore {
     
     void *_impl;
     
-    cJSON *state;
+    /// Per-asset state, private to the store
+    void *state;
     
     /// If 0, assetstore will only be used to track transfer states.
     int use_cache;
-    /// Number of assets in the cache.
+    /// When to remove the least recently used assets from the cache.
+    assetstore_limits limits;
+    /// Number of assets in the cache, not counting static assets.
     size_t cache_count;
-    /// Number of bytes in the cache.
+    /// Number of bytes in the cache, not counting static assets.
     size_t cache_size;
-    /// Cache pruning is done now and then. This tracks the next invocation.
-    double next_state_prune;
+    /// Number of static assets, which are never removed.
+    size_t pinned_count;
+    /// Number of bytes of static assets.
+    size_t pinned_size;
+    /// Current time in seconds, for when assets were last used. `get_ts_monod` unless replaced.
+    double (*clock)(void);
     
     void *lock;
 } assetstore;
 
 
-int assetstore_init(assetstore *store);
+/// @param limits Optional. Only used by stores that keep asset data, like the memstore. NULL for defaults.
+int assetstore_init(assetstore *store, const assetstore_limits *limits);
 void assetstore_deinit(assetstore *store);
 
 /// Reads some data from an asset
@@ -125,9 +143,21 @@ typedef struct asset_memstore {
     struct assetstore *_interface;
 } asset_memstore;
 
-int asset_memstore_init(assetstore *store);
+int asset_memstore_init(assetstore *store, const assetstore_limits *limits);
 void asset_memstore_deinit(assetstore *store);
 int asset_memstore_register_asset_nocopy(assetstore *store, const char *asset_id, const uint8_t *data, size_t length);
 uint8_t *asset_memstore_get_data_pointer(assetstore *store, const char *asset_id);
 
+/// A store that keeps assets as files in `path`, named by their hash, so that they survive restarts.
+/// Only `asset:sha256:` ids can be stored, and a downloaded asset is only kept if its bytes match its id.
+/// Partial downloads are kept too, and continue where they left off.
+/// @param path A directory to keep the assets in. Created if it doesn't exist.
+/// @param max_bytes How much disk to use. The least recently used assets are deleted to stay below it.
+/// @return 0 on success, or negative if `path` can't be used.
+int asset_diskstore_init(assetstore *store, const char *path, size_t max_bytes);
+void asset_diskstore_deinit(assetstore *store);
+/// @return 1 if a disk store can keep `asset_id`. It only tracks the transfer state of other assets,
+/// like a store made with `assetstore_init`.
+int asset_diskstore_can_keep(const char *asset_id);
+
 #endif /* asset_store_h */
@@ -36,6 +36,10 @@ typedef enum allopicture_format {
   allopicture_format_rgb1555,
   allopicture_format_xrgb8888,
   allopicture_format_rgb565,
+  // planar: full size Y plane, then quarter size U and V planes. One byte per sample.
+  allopicture_format_yuv420p,
+  // planar: full size Y plane, then a quarter size plane of interleaved U and V samples.
+  allopicture_format_nv12,
 } allopicture_format;
 
 #define ALLOPICTURE_MAX_PLANE_COUNT 4
@@ -61,6 +65,7 @@ typedef struct allopicture {
   void *userdata;
 } allopicture;
 void allopicture_free(allopicture *picture);
+// bytes per pixel in the first plane
 int allopicture_bpp(allopicture_format fmt);
 
 
@@ -96,12 +101,15 @@ typedef struct alloclient {
      *  in an incoming audio stream track. Match it to a live_media component
      *  to figure out which entity is transmitting it, and thus at what
      *  location in 3d space to play it at. 
+     *  Frames come in order. Frames lost on the way are already filled in with
+     *  concealed audio, so several frames can come at once after a hiccup.
      * 
      *  @param track_id: which track/entity is transmitting this audio
      *  @param pcm: n samples of 48000 Hz mono PCM audio data (most often 480 samples, 10ms, 960 bytes)
      *  @param samples_decoded: 'n': how many samples in pcm
-     *  @return bool: whether the caller should free the pcm afterwards (if you return false,
-     *                you have to free(pcm) yourself later).
+     *  @return bool: whether the caller should reuse the pcm afterwards (if you return false,
+     *                give it back with alloclient_audio_buffer_return(pcm) when you're done with it,
+     *                or free(pcm) it yourself).
      */
     bool (*audio_callback)(
         alloclient *client,
@@ -110,6 +118,17 @@ typedef struct alloclient {
         int32_t samples_decoded
     );
 
+    /** Set this to get a callback when a frame of video has arrived in an incoming video
+     *  track. Frames are decoded in the background and handed over from alloclient_poll.
+     *  Only the newest frame of each track is kept, so a slow app sees fewer frames
+     *  rather than older ones.
+     *
+     *  @param track_id: which track/entity is transmitting this video
+     *  @param pixels: pixels_wide * pixels_high RGBA pixels, row by row
+     *  @return bool: whether the caller should reuse the pixels afterwards (if you return false,
+     *                give them back with alloclient_video_buffer_return() when you're done with them,
+     *                or free(pixels) them yourself).
+     */
     bool (*video_callback)(
         alloclient *client,
         uint32_t track_id,
@@ -118,6 +137,24 @@ typedef struct alloclient {
         int32_t pixels_high
     );
 
+    /** Like video_callback, but hands you the decoded picture as it came out of the decoder,
+     *  usually YUV planes (see picture->format, planes and plane_strides) that you can upload
+     *  and convert on the GPU. Nothing is converted or copied; H.264 pictures hold on to the
+     *  decoder's own frame until they're freed. If set, video_callback isn't called.
+     *  Must be set before alloclient_connect.
+     *
+     *  @param track_id: which track/entity is transmitting this video
+     *  @param picture: the decoded picture
+     *  @return bool: whether the caller should free the picture afterwards (if you return false,
+     *                allopicture_free(picture) yourself when you're done with it, and
+     *                soon, as the decoder only has so many frames to go around).
+     */
+    bool (*video_picture_callback)(
+        alloclient *client,
+        uint32_t track_id,
+        allopicture *picture
+    );
+
 
     /** You were disconnected from the server. This is
      *  never called in response to a local alloclient_disconnect;
@@ -205,6 +242,7 @@ typedef struct alloclient {
     void (*alloclient_simulate)(alloclient* client);
     double (*alloclient_get_time)(alloclient* client);
     void (*alloclient_get_stats)(alloclient* client, char *buffer, size_t bufferlen);
+    int (*alloclient_get_event_fd)(alloclient* client);
     
     // -- Assets
         
@@ -216,6 +254,8 @@ typedef struct alloclient {
     
     void (*alloclient_asset_send)(alloclient *client, const char *asset_id, const uint8_t *data, size_t offset, size_t length, size_t total_size);
     
+    void (*alloclient_set_asset_cache)(alloclient *client, const char *path, size_t max_bytes);
+    
 } alloclient;
 
 /**
@@ -246,6 +286,18 @@ void alloclient_disconnect(alloclient *client, int reason);
  */
 bool alloclient_poll(alloclient *client, int timeout_ms);
 
+/** Get an OS-level handle that becomes readable when alloclient_poll() has work to do,
+  * so that you can add the client to your own epoll/select/libuv/asyncio loop instead
+  * of polling on a timer. Never read from or close the handle yourself; just call
+  * alloclient_poll() when it becomes readable.
+  * - Threaded clients: an eventfd on Linux (a pipe on other POSIX systems) that is
+  *   signalled whenever the network thread has queued callbacks for you.
+  * - Non-threaded clients: the client's UDP socket; becomes readable on incoming traffic.
+  *   You still need to poll regularly to send outgoing data.
+  * @return file descriptor, or -1 if not available (not connected, or unsupported platform)
+  */
+int alloclient_get_event_fd(alloclient *client);
+
 
 /** Have one of your entites interact with another entity.
   * Use this same method to send back a response when you get a request. 
@@ -266,15 +318,27 @@ void alloclient_set_intent(alloclient *client, const allo_client_intent *intent)
   * track_id to send from beforehand, to associate a particular audio stream with a specific
   * entity.
   * Everyone nearby your entity will hear the audio.
+  * Audio is sent unreliably; lost frames are rebuilt or concealed on the receiving end.
+  * Bitrate, FEC and frame duration follow how the connection is doing, and encoder
+  * complexity follows how much CPU encoding takes.
+  * Nothing is sent until the track's live_media component has arrived in the state.
+  * Call it from one thread only, e g your audio capture thread: the encoder and what's buffered
+  * up towards each track's next frame belong to that thread, and aren't locked.
   * @param track_id Track allocated from `allocate_track` interaction on which to send audio
   * @param pcm 48000 Hz mono PCM audio data
-  * @param sample_count Number of samples in `pcm`. Must be 480 or 960 (10ms or 20ms worth of audio)
+  * @param sample_count Number of samples in `pcm`. Any amount; it's buffered up into frames of
+  *   whatever duration the connection currently calls for.
   *   
   */
 void alloclient_send_audio(alloclient *client, int32_t track_id, const int16_t *pcm, size_t sample_count);
 
 void alloclient_send_audio_data(alloclient *client, int32_t track_id, const char *pcmdata, size_t sample_count);
 
+/** Give back a pcm buffer that you kept by returning false from audio_callback,
+  * so that it can be reused for incoming audio. Can be called from any thread.
+  */
+void alloclient_audio_buffer_return(int16_t *pcm);
+
 /** Transmit video from an entity, e g camera video or screen sharing.
  *  Like alloclient_send_audio, you must `allocate_track` first to receive
  *  a track_id.
@@ -287,8 +351,41 @@ void alloclient_send_audio_data(alloclient *client, int32_t track_id, const char
  */
 void alloclient_send_video(alloclient *client, int32_t track_id, allopicture *picture);
 
+/** Give back pixels that you kept by returning false from video_callback, so that they
+  * can be reused for incoming video. Can be called from any thread.
+  */
+void alloclient_video_buffer_return(allopixel *pixels, int32_t pixels_wide, int32_t pixels_high);
+
+/// Only for formats with a single plane.
 void alloclient_send_video_pixels(alloclient *client, int32_t track_id, void *pixels, int width, int height, allopicture_format format, int stride);
 
+typedef enum allo_video_threading {
+    /// each frame is split up between the threads. Adds no latency.
+    allo_video_threading_slice,
+    /// consecutive frames are encoded on different threads. Faster, but every frame comes out
+    /// about a frame later per extra thread.
+    allo_video_threading_frame,
+} allo_video_threading;
+
+/** How H.264 video is encoded: on how many threads (0 for as many as there are cores), and how
+  * the work is split between them. Applies to tracks that send their first frame after this call.
+  * Defaults to slice threading on as many threads as there are cores.
+  */
+void alloclient_set_video_encoder_threads(int thread_count, allo_video_threading threading);
+
+typedef enum allo_video_scaler {
+    /// cheapest, but blocky chroma
+    allo_video_scaler_fast_bilinear,
+    allo_video_scaler_bilinear,
+    /// sharpest, and several times slower than bilinear
+    allo_video_scaler_bicubic,
+} allo_video_scaler;
+
+/** How decoded H.264 video is converted into RGBA for video_callback. Defaults to bilinear.
+  * Doesn't matter if you use video_picture_callback, as that skips the conversion.
+  */
+void alloclient_set_video_scaler(allo_video_scaler scaler);
+
 /*!
  * Request an asset. This might be a texture, a model, a sound or something that
  * you need. You might need it because it's referenced from a component in an entity
@@ -304,6 +401,17 @@ void alloclient_asset_request(alloclient* client, const char* asset_id, const ch
  */
 void alloclient_asset_send(alloclient *client, const char *asset_id, const uint8_t *data, size_t offset, size_t length, size_t total_size);
 
+/*!
+ * Keep downloaded assets as files in `path`, using at most `max_bytes` of disk, so that they
+ * don't have to be downloaded again next time. Requesting an asset that's already there delivers it
+ * from disk through `asset_receive_callback` during the next `alloclient_poll`s, as if it had been
+ * downloaded, and the client can then also send it to others. Assets that go into the cache are
+ * delivered that way once complete, too, rather than a chunk at a time as they arrive, as a download
+ * that was interrupted last time only fetches what's still missing.
+ * Call before `alloclient_connect`.
+ */
+void alloclient_set_asset_cache(alloclient *client, const char *path, size_t max_bytes);
+
 /**
   * Run allo_simulate() on the internal world state with our latest intent, so that we get local interpolation
   * of hand movement etc
@@ -320,6 +428,26 @@ double alloclient_get_time(alloclient* client);
 
 void alloclient_get_stats(alloclient* client, char *buffer, size_t bufferlen);
 
+/// How far past the latest received transform alloclient_get_interpolated_transform() will extrapolate, in seconds
+#define ALLO_INTERPOLATION_MAX_EXTRAPOLATION 0.25
+
+/** Opt in to keeping a short, time-stamped history of every entity's transform, so that
+  * alloclient_get_interpolated_transform() can smooth over the place's low state update rate.
+  * Disabling it drops all recorded history.
+  */
+void alloclient_set_interpolation_enabled(alloclient *client, bool enabled);
+
+/** Get an entity's transform (relative to its parent, like entity_get_transform) as it was
+  * at `render_time`, interpolated between received states. Render slightly in the past,
+  * e g `alloclient_get_time(client) - 0.25` for a place that updates at 5 Hz, so that there
+  * is always a newer state to interpolate towards. If render_time is past the newest state,
+  * the latest motion is continued for at most ALLO_INTERPOLATION_MAX_EXTRAPOLATION seconds.
+  * Entities that the place didn't mention in a state are taken to have stood still through it.
+  * Falls back to the current transform if interpolation is disabled or there's no history yet.
+  * @param render_time  server time, as per alloclient_get_time()
+  */
+allo_m4x4 alloclient_get_interpolated_transform(alloclient *client, allo_entity *entity, double render_time);
+
 /** Returns a pointer to the state
  */
 allo_state *alloclient_get_state(alloclient *client);
@@ -16,6 +16,12 @@ static const int allo_client_count_max = 128;
 
 typedef struct alloserver_client {
     allo_client_intent *intent;
+    // seq of the latest binary intent received into `intent`; 0 if the client sends json intents
+    uint32_t intent_seq;
+    // client frames its audio with a seq header (announced feature "audio.sequenced")
+    bool sequenced_audio;
+    // client sends video in fragments (announced feature "video.fragmented")
+    bool fragmented_video;
     char *avatar_entity_id;
     char agent_id[AGENT_ID_LENGTH+1];
     cJSON *identity;
@@ -26,6 +32,8 @@ typedef struct alloserver_client {
     LIST_ENTRY(alloserver_client) pointers;
 } alloserver_client;
 
+struct _ENetPacket;
+
 typedef struct alloserver alloserver;
 struct alloserver {
     // handle incoming events for at most duration_ms. returns true if event was handled
@@ -33,6 +41,11 @@ struct alloserver {
     
     // raw json as delivered from client (intent or interaction)
     void (*raw_indata_callback)(alloserver *serv, alloserver_client *client, allochannel channel, const uint8_t *data, size_t data_length);
+
+    // media (audio/video) as delivered from client, as the received packet itself, so that it can be
+    // forwarded to any number of clients with alloserv_send_enet without copying it. Don't destroy it;
+    // it's freed once every peer it was queued on has sent it. If not set, media goes to raw_indata_callback.
+    void (*media_packet_callback)(alloserver *serv, alloserver_client *client, allochannel channel, struct _ENetPacket *packet);
     
     // list of clients changed; either `added` or `removed` is set.
     void (*clients_callback)(alloserver *serv, alloserver_client *added, alloserver_client *removed);
@@ -51,9 +64,14 @@ struct alloserver {
 // send 0 for any host or any port
 alloserver *allo_listen(int listenhost, int port);
 
-struct _ENetPacket;
+// queue `packet` on `client`. The same packet may be sent to several clients; ENet refcounts it.
+// Returns 0 if it was queued. If no client took it, destroy it yourself.
+int alloserv_send_enet(alloserver *serv, alloserver_client *client, allochannel channel, struct _ENetPacket *packet);
 
-void alloserv_send_enet(alloserver *serv, alloserver_client *client, allochannel channel, struct _ENetPacket *packet);
+// Keep assets that pass through the server as files in `path` instead of in memory, so that they're
+// still there after a restart. At most `max_bytes` are kept; the least recently used go first.
+// Call before clients connect. Returns false if `path` can't be used; then assets stay in memory.
+bool alloserv_set_asset_cache(alloserver *serv, const char *path, size_t max_bytes);
 
 // immediately shutdown the server
 void alloserv_stop(alloserver* serv);
@@ -64,6 +82,15 @@ void alloserv_disconnect(alloserver *serv, alloserver_client *client, int reason
 
 size_t alloserv_get_client_stats(alloserver* serv, alloserver_client *client, char *buffer, size_t bufferlen, bool header);
 
+typedef struct alloserver_link_stats {
+    double loss;     // fraction of packets lost lately, 0-1
+    double rtt;      // round trip time in seconds
+    double throttle; // fraction of unreliable packets that ENet lets through, 0-1
+} alloserver_link_stats;
+
+// how well the connection to a client is keeping up, e g to pick what quality of media to send it
+alloserver_link_stats alloserv_get_client_link(alloserver *serv, alloserver_client *client);
+
 void alloserv_get_stats(alloserver* serv, char *buffer, size_t bufferlen);
 
 // run a minimal standalone C server. returns when it shuts down. false means it broke.
@@ -71,6 +98,15 @@ bool alloserv_run_standalone(const char *public_hostname, int listenhost, int po
 
 // start it but don't run it. returns allosocket.
 alloserver *alloserv_start_standalone(const char *public_hostname, int listenhost, int port, const char *placename);
+// Mix audio on the place into one stream per listener (track 0, on the place entity), instead of
+// forwarding every subscribed track to every listener. Trades place CPU for bandwidth in big rooms.
+// Only clients that support sequenced audio get mixes; others are forwarded to as usual.
+// Call after alloserv_start_standalone.
+void alloserv_enable_audio_mixing_standalone(int worker_threads);
+// Only send a listener audio from tracks within `audible_radius` meters of its avatar, and of those
+// only its `loudest_speakers` loudest, going by the audio level senders put in each packet.
+// 0 means no limit. Applies to both forwarded and mixed audio. Updated every simulation step.
+void alloserv_set_audio_culling_standalone(double audible_radius, int loudest_speakers);
 // call this frequently to run it. returns false if server has broken and shut down; then you should call stop on it to clean up.
 bool alloserv_poll_standalone(int allosocket);
 // and then call this to stop and clean up state.
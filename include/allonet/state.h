@@ -56,6 +56,49 @@ extern void allo_client_intent_free(allo_client_intent* intent);
 extern void allo_client_intent_clone(const allo_client_intent* original, allo_client_intent* destination);
 extern cJSON* allo_client_intent_to_cjson(const allo_client_intent *intent);
 extern allo_client_intent *allo_client_intent_parse_cjson(const cJSON* from);
+/// Like allo_client_intent_parse_cjson, but parses into an existing intent, reusing its
+/// strings where they haven't changed. entity_id is left alone if `from` doesn't have one.
+extern void allo_client_intent_parse_cjson_into(allo_client_intent *intent, const cJSON* from);
+
+/// First byte of a binary intent packet. JSON intents always start with '{'.
+#define ALLO_INTENT_BINARY_MAGIC 0xA1
+/// First byte of a state diff packet that is prefixed with a big-endian u32 of the latest binary intent seq the place has received.
+#define ALLO_INTENT_ACK_MAGIC 0xA2
+/// Worst case size of an encoded binary intent
+#define ALLO_INTENT_BINARY_MAX_SIZE (36 + 5*65 + 2*ALLO_HAND_SKELETON_JOINT_COUNT*65 + 2*(256+65))
+
+/// Parts of an intent that can be left out of a binary intent if they haven't changed
+typedef enum allo_intent_part
+{
+    allo_intent_part_root = 1 << 0,
+    allo_intent_part_head = 1 << 1,
+    allo_intent_part_torso = 1 << 2,
+    allo_intent_part_left_hand = 1 << 3,
+    allo_intent_part_left_skeleton = 1 << 4,
+    allo_intent_part_left_grab = 1 << 5,
+    allo_intent_part_right_hand = 1 << 6,
+    allo_intent_part_right_skeleton = 1 << 7,
+    allo_intent_part_right_grab = 1 << 8,
+    allo_intent_part_all = (1 << 9) - 1,
+} allo_intent_part;
+#define ALLO_INTENT_PART_COUNT 9
+
+/// Which allo_intent_parts differ between a and b
+extern uint16_t allo_client_intent_changed_parts(const allo_client_intent *a, const allo_client_intent *b);
+/** Encode an intent into a compact binary packet with quantized poses.
+ * @param mask          allo_intent_parts to include; the rest must not have changed since baseline_seq
+ * @param seq           sequence number of this intent. Must increase with every intent sent.
+ * @param baseline_seq  latest seq that the receiver has acknowledged, or 0 if none
+ * @return number of bytes written to buffer, or 0 if it didn't fit
+ */
+extern size_t allo_client_intent_encode_binary(const allo_client_intent *intent, uint16_t mask, uint32_t seq, uint32_t baseline_seq, uint8_t *buffer, size_t buffer_length);
+/** Decode a binary intent packet in place into an existing intent, without intermediate allocations.
+ * Parts not included in the packet are kept from `intent`.
+ * @param latest_seq    seq of the intent currently in `intent` (0 if none); updated on success
+ * @return false if the packet is corrupt, out of date or can't be applied on top of `intent`.
+ *         `intent` is unmodified in that case.
+ */
+extern bool allo_client_intent_decode_binary(allo_client_intent *intent, uint32_t *latest_seq, const uint8_t *data, size_t length);
 
 // generate an identifier of 'len'-1 chars, and null the last byte in str.
 extern void allo_generate_id(char *str, size_t len);
@@ -163,6 +206,33 @@ extern allo_interaction *allo_interaction_parse_cjson(const cJSON* from);
 extern allo_interaction *allo_interaction_clone(const allo_interaction *interaction);
 extern void allo_interaction_free(allo_interaction *interaction);
 
+/**
+ * Variant of allo_interaction that keeps the body as parsed JSON, for code that routes and
+ * handles interactions (e g the place) and would otherwise print and re-parse the body for
+ * every hop. Strings and body are borrowed from the command it was parsed from.
+ * The text version of the body is only created if asked for.
+ */
+typedef struct allo_interaction_parsed
+{
+    const char *type;
+    const char *sender_entity_id;
+    const char *receiver_entity_id;
+    const char *request_id;
+    cJSON *body;
+    char *_body_text;
+} allo_interaction_parsed;
+
+/// Parse an ["interaction", type, from, to, request_id, body] command. `from` must outlive `interaction`.
+/// @return false if `from` is not a valid interaction
+extern bool allo_interaction_parsed_init(allo_interaction_parsed *interaction, const cJSON *from);
+extern void allo_interaction_parsed_deinit(allo_interaction_parsed *interaction);
+/// The body as text, printed on first use and kept until deinit.
+extern const char *allo_interaction_parsed_get_body(allo_interaction_parsed *interaction);
+/// Make a standalone allo_interaction that outlives the command it was parsed from.
+extern allo_interaction *allo_interaction_parsed_to_interaction(allo_interaction_parsed *interaction);
+/// Build an interaction command from an already parsed body. Takes ownership of `body`.
+extern cJSON *allo_interaction_create_cjson(const char *type, const char *sender_entity_id, const char *receiver_entity_id, const char *request_id, cJSON *body);
+
 /**
  * Initialize the Allonet library. Must be called before any other Allonet calls.
  */
@@ -5,11 +5,44 @@
 #include <string.h>
 #include "util.h"
 #include "asset.h"
+#include <allonet/assetstore.h>
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
 
-// try to use a decent size. enets default max waiting data is 32Mb (ENET_HOST_DEFAULT_MAXIMUM_WAITING_DATA)
-#define ASSET_CHUNK_SIZE 1024*1024
+/// A range that has been asked for but hasn't arrived yet
+typedef struct asset_transfer_request {
+    size_t offset;
+    size_t length;
+    /// who it was asked of, or NULL if it was asked of everyone
+    const void *source;
+    double sent_at;
+} asset_transfer_request;
+
+/// Somebody that is sending us an asset
+typedef struct asset_transfer_source {
+    const void *source;
+    /// bytes per second, smoothed
+    double throughput;
+    /// when it last delivered anything, or when it was first asked
+    double last_heard;
+} asset_transfer_source;
+
+/// An asset being downloaded; see `asset_transfers`
+typedef struct asset_transfer {
+    char *asset_id;
+    size_t total_size;
+    /// where its bytes are written, to ask which are still missing; see `asset_transfers.store`
+    struct assetstore *store;
+    arr_t(asset_transfer_request) requests;
+    arr_t(asset_transfer_source) sources;
+    /// every byte before this has been asked for, for when there's no store to ask
+    size_t requested_until;
+    /// bytes received, for when there's no store to ask
+    size_t received;
+    /// when a range was last asked of everyone
+    double probed_at;
+} asset_transfer;
 
 void _asset_request(
     const char *asset_id,
@@ -156,6 +189,17 @@ int asset_read_error_header(const cJSON *header, const char **out_id, char **out
 }
 
 
+/// The header of a data message
+static cJSON *_asset_data_header(const char *asset_id, size_t offset, size_t length, size_t total_size) {
+    int response_range[2] = {offset, length};
+    return cjson_create_object(
+                               "id", cJSON_CreateString(asset_id),
+                               "range", cJSON_CreateIntArray(response_range, 2),
+                               "total_length", cJSON_CreateNumber((double)total_size),
+                               NULL
+                               );
+}
+
 void asset_deliver_bytes(const char *asset_id, const uint8_t *data, size_t offset, size_t length, size_t total_size, asset_send_func send, void *user) {
     
     if (offset + length > total_size) {
@@ -170,14 +214,7 @@ void asset_deliver_bytes(const char *asset_id, const uint8_t *data, size_t offse
         return;
     }
     
-    int response_range[2] = {offset, length};
-    cJSON *response = cjson_create_object(
-                                          "id", cJSON_CreateString(asset_id),
-                                          "range", cJSON_CreateIntArray(response_range, 2),
-                                          "total_length", cJSON_CreateNumber((double)total_size),
-                                          NULL
-                                          );
-    
+    cJSON *response = _asset_data_header(asset_id, offset, length, total_size);
     send(asset_mid_data, response, data, length, user);
     cJSON_Delete(response);
 }
@@ -195,10 +232,276 @@ void asset_deliver_error(const char *asset_id, asset_error_code code, char *reas
     cJSON_Delete(error);
 }
 
+void asset_transfers_init(asset_transfers *transfers, struct assetstore *store) {
+    transfers->chunk_size = ASSET_CHUNK_SIZE;
+    transfers->window = ASSET_WINDOW_SIZE;
+    transfers->stall_timeout = ASSET_STALL_TIMEOUT;
+    transfers->store = store;
+    transfers->store_for = NULL;
+    transfers->clock = get_ts_monod;
+    arr_init(&transfers->active);
+}
+
+static void _asset_transfer_free(asset_transfer *transfer) {
+    free(transfer->asset_id);
+    arr_free(&transfer->requests);
+    arr_free(&transfer->sources);
+    free(transfer);
+}
+
+void asset_transfers_deinit(asset_transfers *transfers) {
+    for (size_t i = 0; i < transfers->active.length; i++) {
+        _asset_transfer_free(transfers->active.data[i]);
+    }
+    arr_free(&transfers->active);
+    arr_init(&transfers->active);
+}
+
+static asset_transfer *_asset_transfer_find(asset_transfers *transfers, const char *asset_id) {
+    for (size_t i = 0; i < transfers->active.length; i++) {
+        if (strcmp(transfers->active.data[i]->asset_id, asset_id) == 0) {
+            return transfers->active.data[i];
+        }
+    }
+    return NULL;
+}
+
+static asset_transfer *_asset_transfer_find_or_create(asset_transfers *transfers, const char *asset_id, void *user) {
+    asset_transfer *transfer = _asset_transfer_find(transfers, asset_id);
+    if (transfer == NULL) {
+        transfer = calloc(1, sizeof(asset_transfer));
+        transfer->asset_id = strdup(asset_id);
+        transfer->store = transfers->store_for ? transfers->store_for(asset_id, user) : transfers->store;
+        arr_init(&transfer->requests);
+        arr_init(&transfer->sources);
+        arr_push(&transfers->active, transfer);
+    }
+    return transfer;
+}
+
+void asset_transfers_cancel(asset_transfers *transfers, const char *asset_id) {
+    for (size_t i = 0; i < transfers->active.length; i++) {
+        if (strcmp(transfers->active.data[i]->asset_id, asset_id) == 0) {
+            _asset_transfer_free(transfers->active.data[i]);
+            arr_splice(&transfers->active, i, 1);
+            return;
+        }
+    }
+}
+
+static asset_transfer_source *_asset_transfer_source_find(asset_transfer *transfer, const void *source) {
+    for (size_t i = 0; i < transfer->sources.length; i++) {
+        if (transfer->sources.data[i].source == source) {
+            return &transfer->sources.data[i];
+        }
+    }
+    return NULL;
+}
+
+static int _asset_transfer_requests_to(asset_transfer *transfer, const void *source) {
+    int count = 0;
+    for (size_t i = 0; i < transfer->requests.length; i++) {
+        count += transfer->requests.data[i].source == source;
+    }
+    return count;
+}
+
+/// Forget a source and what it was asked for, so that those ranges go to the other sources
+static void _asset_transfer_drop_source(asset_transfer *transfer, const void *source) {
+    for (size_t i = 0; i < transfer->requests.length; ) {
+        if (transfer->requests.data[i].source == source) {
+            arr_splice(&transfer->requests, i, 1);
+        } else {
+            i++;
+        }
+    }
+    for (size_t i = 0; i < transfer->sources.length; i++) {
+        if (transfer->sources.data[i].source == source) {
+            arr_splice(&transfer->sources, i, 1);
+            break;
+        }
+    }
+}
+
+void asset_transfers_remove_source(asset_transfers *transfers, const void *source) {
+    for (size_t i = 0; i < transfers->active.length; i++) {
+        _asset_transfer_drop_source(transfers->active.data[i], source);
+    }
+}
+
+size_t asset_transfers_source_count(asset_transfers *transfers, const char *asset_id) {
+    asset_transfer *transfer = _asset_transfer_find(transfers, asset_id);
+    return transfer ? transfer->sources.length : 0;
+}
+
+/// How many requests `source` gets to have outstanding: the whole window for the fastest source,
+/// and less for slower ones, so that each source is asked for about as much as it can deliver.
+static int _asset_transfer_source_window(asset_transfers *transfers, asset_transfer *transfer, asset_transfer_source *source) {
+    double fastest = 0;
+    for (size_t i = 0; i < transfer->sources.length; i++) {
+        fastest = max(fastest, transfer->sources.data[i].throughput);
+    }
+    if (fastest <= 0 || source->throughput <= 0) {
+        return transfers->window;
+    }
+    int window = (int)(transfers->window * source->throughput / fastest + 0.5);
+    return max(window, 1);
+}
+
+/// Find the next range of `transfer` to ask for: the first missing bytes that haven't been asked for yet.
+static bool _asset_transfer_next_range(asset_transfers *transfers, asset_transfer *transfer, size_t *out_offset, size_t *out_length) {
+    if (!transfer->store) {
+        if (transfer->requested_until >= transfer->total_size) {
+            return false;
+        }
+        *out_offset = transfer->requested_until;
+        *out_length = min(transfers->chunk_size, transfer->total_size - transfer->requested_until);
+        return true;
+    }
+
+    // Each outstanding request leaves at most one missing range, so one more than that
+    // is enough to find one that hasn't been asked for if there is any.
+    size_t capacity = transfer->requests.length + 1;
+    size_t *ranges = malloc(sizeof(size_t) * 2 * capacity);
+    size_t count = assetstore_get_missing_ranges(transfer->store, transfer->asset_id, ranges, capacity);
+    bool found = false;
+    for (size_t i = 0; i < count && !found; i++) {
+        size_t start = ranges[i*2], end = ranges[i*2] + ranges[i*2+1];
+        // skip past what's already been asked for
+        bool moved = true;
+        while (moved && start < end) {
+            moved = false;
+            for (size_t r = 0; r < transfer->requests.length; r++) {
+                asset_transfer_request *request = &transfer->requests.data[r];
+                if (request->offset <= start && start < request->offset + request->length) {
+                    start = request->offset + request->length;
+                    moved = true;
+                }
+            }
+        }
+        if (start >= end) {
+            continue;
+        }
+        // and stop at the next thing that has been
+        for (size_t r = 0; r < transfer->requests.length; r++) {
+            asset_transfer_request *request = &transfer->requests.data[r];
+            if (request->offset > start && request->offset < end) {
+                end = request->offset;
+            }
+        }
+        *out_offset = start;
+        *out_length = min(transfers->chunk_size, end - start);
+        found = true;
+    }
+    free(ranges);
+    return found;
+}
+
+static void _asset_transfer_send_request(asset_transfers *transfers, asset_transfer *transfer, const void *source, const char *entity_id, size_t offset, size_t length, asset_send_func send, void *user) {
+    asset_transfer_request request = { offset, length, source, transfers->clock() };
+    arr_push(&transfer->requests, request);
+    transfer->requested_until = max(transfer->requested_until, offset + length);
+    _asset_request(transfer->asset_id, entity_id, offset, length, send, user);
+}
+
+/// Ask `source` for more of `transfer` until it has its share of the window outstanding
+static void _asset_transfer_fill_window(asset_transfers *transfers, asset_transfer *transfer, asset_transfer_source *source, asset_send_func send, void *user) {
+    int window = _asset_transfer_source_window(transfers, transfer, source);
+    while (_asset_transfer_requests_to(transfer, source->source) < window) {
+        size_t offset, length;
+        if (!_asset_transfer_next_range(transfers, transfer, &offset, &length)) {
+            break;
+        }
+        _asset_transfer_send_request(transfers, transfer, source->source, NULL, offset, length, send, user);
+    }
+}
+
+/// `length` bytes at `offset` of an asset were received from `source` and stored: keep the transfer going, or finish it.
+static void _asset_transfer_received(asset_transfers *transfers, const void *source, const char *asset_id, size_t offset, size_t length, size_t total_length, asset_send_func send, asset_state_func callback, void *user) {
+    asset_transfer *transfer = _asset_transfer_find_or_create(transfers, asset_id, user);
+    double now = transfers->clock();
+    transfer->total_size = total_length;
+    transfer->received += length;
+    transfer->requested_until = max(transfer->requested_until, offset + length);
+
+    asset_transfer_source *from = _asset_transfer_source_find(transfer, source);
+    if (from == NULL) {
+        // it answered a request that was asked of everyone
+        asset_transfer_source added = { source, 0, transfer->probed_at };
+        arr_push(&transfer->sources, added);
+        from = &transfer->sources.data[transfer->sources.length - 1];
+    }
+    // the time it took to arrive since the previous one, or since it was asked for if the source was idle
+    double since = from->last_heard;
+    for (size_t i = 0; i < transfer->requests.length; i++) {
+        asset_transfer_request *request = &transfer->requests.data[i];
+        if (request->offset == offset && (request->source == source || request->source == NULL)) {
+            since = max(since, request->sent_at);
+            arr_splice(&transfer->requests, i, 1);
+            break;
+        }
+    }
+    double rate = length / max(now - since, 0.001);
+    from->throughput = from->throughput > 0 ? from->throughput * 0.7 + rate * 0.3 : rate;
+    from->last_heard = now;
+
+    bool complete = transfer->store ? assetstore_get_is_asset_complete(transfer->store, asset_id) : transfer->received >= total_length;
+    if (complete) {
+        asset_log(ALLO_LOG_DEBUG, asset_id, "Completed", NULL);
+        asset_transfers_cancel(transfers, asset_id);
+        callback(asset_id, asset_state_now_available, user);
+        return;
+    }
+    _asset_transfer_fill_window(transfers, transfer, from, send, user);
+}
+
+void asset_transfers_check_stalls(asset_transfers *transfers, asset_stalled_func stalled, void *user) {
+    double now = transfers->clock();
+    for (size_t t = 0; t < transfers->active.length; t++) {
+        asset_transfer *transfer = transfers->active.data[t];
+        char *asset_id = strdup(transfer->asset_id);
+        for (size_t i = 0; i < transfer->sources.length; ) {
+            asset_transfer_source source = transfer->sources.data[i];
+            if (_asset_transfer_requests_to(transfer, source.source) > 0 && now - source.last_heard > transfers->stall_timeout) {
+                asset_log(ALLO_LOG_INFO, asset_id, "Source %p stalled; asking others for its ranges", source.source);
+                _asset_transfer_drop_source(transfer, source.source);
+                stalled(asset_id, source.source, user);
+                // `stalled` may have changed the list of transfers
+                if (_asset_transfer_find(transfers, asset_id) != transfer) break;
+            } else {
+                i++;
+            }
+        }
+        if (_asset_transfer_find(transfers, asset_id) != transfer) {
+            free(asset_id);
+            t--;
+            continue;
+        }
+        // nobody is sending it, and nobody has answered the request that was asked of everyone
+        if (transfer->sources.length == 0) {
+            bool waiting = false;
+            for (size_t i = 0; i < transfer->requests.length; i++) {
+                waiting |= now - transfer->requests.data[i].sent_at <= transfers->stall_timeout;
+            }
+            if (!waiting) {
+                asset_log(ALLO_LOG_INFO, asset_id, "Nobody answered", NULL);
+                transfer->requests.length = 0;
+                stalled(asset_id, NULL, user);
+                if (_asset_transfer_find(transfers, asset_id) != transfer) {
+                    t--;
+                }
+            }
+        }
+        free(asset_id);
+    }
+}
+
 /// Does all the work with a package from the asset data channel, via function pointers provided
 void asset_handle(
     const uint8_t* _data,
     size_t data_length,
+    asset_transfers *transfers,
+    const void *source,
     asset_request_func request,
     asset_write_func write,
     asset_send_func send,
@@ -245,7 +548,9 @@ void asset_handle(
             return;
         }
         int bytes_written = write(asset_id, data, offset, length, total_length, user);
-        if (bytes_written > 0) {
+        if (bytes_written > 0 && transfers) {
+            _asset_transfer_received(transfers, source, asset_id, offset, length, total_length, send, callback, user);
+        } else if (bytes_written > 0) {
             // request more?
             // TODO: check missing ranges instead
             if (offset + length < total_length) {
@@ -266,17 +571,24 @@ void asset_handle(
         asset_read_error_header(json, &asset_id, &error_reason, &error_code);
         asset_log(ALLO_LOG_ERROR, asset_id, "Received error code %d: %s", error_code, error_reason);
         
+        // stop asking that source, or forget the transfer unless another source is already sending it
+        asset_transfer *transfer = transfers && asset_id ? _asset_transfer_find(transfers, asset_id) : NULL;
+        if (transfer && source) {
+            _asset_transfer_drop_source(transfer, source);
+        } else if (transfer && transfer->received == 0) {
+            asset_transfers_cancel(transfers, asset_id);
+        }
         callback(asset_id, asset_state_now_unavailable, user);
     } else {
         asset_log(ALLO_LOG_ERROR, NULL, "Received weird mid: %d", mid);
     }
     
     if (json != NULL) {
-        cJSON_free(json);
+        cJSON_Delete(json);
     }
     
     if (error != NULL) {
-        cJSON_free(error);
+        cJSON_Delete(error);
     }
 }
 
@@ -307,10 +619,23 @@ void _asset_request(
 void asset_request(
     const char *asset_id,
     const char *entity_id,
+    asset_transfers *transfers,
     asset_send_func send,
     void *user
 ) {
-    _asset_request(asset_id, entity_id, 0, ASSET_CHUNK_SIZE, send, user);
+    if (transfers == NULL) {
+        _asset_request(asset_id, entity_id, 0, ASSET_CHUNK_SIZE, send, user);
+        return;
+    }
+    // Ask everyone for a range. Whoever answers gets asked for more, at the pace they deliver.
+    asset_transfer *transfer = _asset_transfer_find_or_create(transfers, asset_id, user);
+    size_t offset = 0, length = transfers->chunk_size;
+    if (transfer->total_size > 0 && !_asset_transfer_next_range(transfers, transfer, &offset, &length)) {
+        // everything that's missing has already been asked for
+        return;
+    }
+    transfer->probed_at = transfers->clock();
+    _asset_transfer_send_request(transfers, transfer, NULL, entity_id, offset, length, send, user);
 }
 
 int asset_read_header(uint8_t const **data, size_t *data_length, uint16_t *out_mid, cJSON **out_json) {
@@ -352,12 +677,68 @@ ENetPacket *asset_build_enet_packet(uint16_t mid, const cJSON *header, const uin
     ENetPacket *packet = enet_packet_create(NULL, sizeof(asset_packet_header) + jsonlength + data_length, ENET_PACKET_FLAG_RELIABLE);
     memcpy(packet->data, &h, sizeof(asset_packet_header));
     memcpy(packet->data + sizeof(asset_packet_header), json, jsonlength);
-    memcpy(packet->data + sizeof(asset_packet_header) + jsonlength, data, data_length);
+    if (data_length > 0) {
+        memcpy(packet->data + sizeof(asset_packet_header) + jsonlength, data, data_length);
+    }
     
     free((void*)json);
     return packet;
 }
 
+struct asset_packed_message {
+    int refs;
+    size_t length;
+    size_t data_offset;
+    uint8_t bytes[];
+};
+
+asset_packed_message *asset_pack_bytes(const char *asset_id, size_t offset, size_t length, size_t total_size) {
+    cJSON *header = _asset_data_header(asset_id, offset, length, total_size);
+    char *json = cJSON_Print(header);
+    cJSON_Delete(header);
+    size_t jsonlength = strlen(json);
+    
+    asset_packet_header h;
+    h.mid = htons(asset_mid_data);
+    h.hlen = htons(jsonlength);
+    
+    size_t data_offset = sizeof(asset_packet_header) + jsonlength;
+    asset_packed_message *message = malloc(sizeof(asset_packed_message) + data_offset + length);
+    message->refs = 1;
+    message->length = data_offset + length;
+    message->data_offset = data_offset;
+    memcpy(message->bytes, &h, sizeof(asset_packet_header));
+    memcpy(message->bytes + sizeof(asset_packet_header), json, jsonlength);
+    free(json);
+    return message;
+}
+
+uint8_t *asset_packed_message_data(asset_packed_message *message) {
+    return message->bytes + message->data_offset;
+}
+
+void asset_packed_message_retain(asset_packed_message *message) {
+    message->refs++;
+}
+
+void asset_packed_message_release(asset_packed_message *message) {
+    if (--message->refs == 0) {
+        free(message);
+    }
+}
+
+static void _asset_packed_packet_free(ENetPacket *packet) {
+    asset_packed_message_release((asset_packed_message *)packet->userData);
+}
+
+ENetPacket *asset_packed_message_enet_packet(asset_packed_message *message) {
+    ENetPacket *packet = enet_packet_create(message->bytes, message->length, ENET_PACKET_FLAG_RELIABLE | ENET_PACKET_FLAG_NO_ALLOCATE);
+    packet->freeCallback = _asset_packed_packet_free;
+    packet->userData = message;
+    asset_packed_message_retain(message);
+    return packet;
+}
+
 #include "sha1.h"
 
 char *_asset_generate_identifier_sha1(const uint8_t *bytes, size_t size) {
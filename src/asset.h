@@ -8,6 +8,8 @@
 #ifndef asset_h
 #define asset_h
 
+#include <allonet/arr.h>
+
 // types
 
 /// The protocol message header of asset protocol
@@ -67,15 +69,79 @@ typedef int (*asset_write_func)(const char *asset_id, const uint8_t *buffer, siz
 /// A callback for when the state of an asset changes, for example when asset availability changes.
 typedef void(*asset_state_func)(const char *asset_id, asset_state state, void *user);
 
+/// Bytes to ask for per range request, unless configured otherwise.
+/// Try to use a decent size. enets default max waiting data is 32Mb (ENET_HOST_DEFAULT_MAXIMUM_WAITING_DATA)
+#define ASSET_CHUNK_SIZE (1024*1024)
+/// Range requests to keep outstanding per asset, unless configured otherwise.
+/// `ASSET_WINDOW_SIZE * ASSET_CHUNK_SIZE` must stay well below what enet lets wait in a peer's queue.
+#define ASSET_WINDOW_SIZE 8
+/// Seconds a source can leave requests unanswered before its ranges are asked of someone else.
+#define ASSET_STALL_TIMEOUT 5.0
+
+struct assetstore;
+struct asset_transfer;
+
+/// Assets being downloaded. Rather than asking for the next chunk of an asset once the previous one
+/// has arrived, up to `window` range requests are kept outstanding per asset, so that the transfer
+/// fills the link rather than waiting a round trip per chunk.
+///
+/// An asset can come from several sources at once. The first request is asked of everyone (see `asset_request`),
+/// and every source that answers is then asked for ranges of its own, the fastest one up to `window` at a time
+/// and slower ones proportionally fewer, so that each is kept busy without holding up the end of the download.
+typedef struct asset_transfers {
+    /// Bytes to ask for per request
+    size_t chunk_size;
+    /// Requests to keep outstanding per asset, for the fastest source
+    int window;
+    /// Seconds a source can leave requests unanswered before `asset_transfers_check_stalls` gives up on it
+    double stall_timeout;
+    /// Optional. The store that received bytes are written to, to ask it which ranges are still missing.
+    /// Without one, ranges are asked for in order and an asset is done once all of its bytes have arrived.
+    struct assetstore *store;
+    /// Optional. Picks the store for each asset as its transfer starts, instead of `store`, for when
+    /// only some assets' bytes are kept. `user` is the one given to `asset_request` or `asset_handle`.
+    struct assetstore *(*store_for)(const char *asset_id, void *user);
+    /// Current time in seconds. `get_ts_monod` unless replaced.
+    double (*clock)(void);
+    arr_t(struct asset_transfer *) active;
+} asset_transfers;
+
+/// @param store Optional. See `asset_transfers.store`
+void asset_transfers_init(asset_transfers *transfers, struct assetstore *store);
+void asset_transfers_deinit(asset_transfers *transfers);
+
+/// Stop downloading an asset and forget what's been asked for
+void asset_transfers_cancel(asset_transfers *transfers, const char *asset_id);
+
+/// Stop asking `source` for anything, e g because it disconnected. Its outstanding ranges are
+/// asked of the other sources as they deliver, or of everyone with the next `asset_request`.
+void asset_transfers_remove_source(asset_transfers *transfers, const void *source);
+
+/// @return How many sources are currently sending `asset_id`
+size_t asset_transfers_source_count(asset_transfers *transfers, const char *asset_id);
+
+/// A source hasn't answered in `stall_timeout` seconds and has been removed from the transfer.
+/// @param source The source that stalled, or NULL if nobody answered the request that was asked of everyone
+typedef void (*asset_stalled_func)(const char *asset_id, const void *source, void *user);
+
+/// Find sources that have stopped answering, and forget what they were asked for so that it can be asked of others.
+/// Call this now and then, e g once a second.
+/// @param stalled Called for each stalled source. Usually asks everyone else with `asset_request`, or cancels the transfer.
+void asset_transfers_check_stalls(asset_transfers *transfers, asset_stalled_func stalled, void *user);
+
 /// Provide assets a way to process infoming data
 /// @param data The received data to be processed
 /// @param data_length The size of the `data` buffer
+/// @param transfers Optional. Downloads in progress, to keep their windows full. Without it, the next chunk is asked for once the previous one arrives.
+/// @param source Optional. Who sent `data`, to tell sources of the same asset apart. Replies are sent to them through `send` and `user`.
 /// @param send A function to send data over the network
 /// @param callback A function that gets called when the state of an asset changes.
 /// @param user Passed to the `read_range`, `write_range` and `send` methods.
 void asset_handle(
     const uint8_t* data,
     size_t data_length,
+    asset_transfers *transfers,
+    const void *source,
     asset_request_func request,
     asset_write_func write,
     asset_send_func send,
@@ -86,11 +152,14 @@ void asset_handle(
 /// Make an asset request
 /// @param id The asset id to request
 /// @param entity_id Optional id of the entity that needs the asset
+/// @param transfers Optional. Where to keep track of the download, for `asset_handle` to continue it.
+///        If the asset is already being downloaded, asks for the next range that nobody has been asked for yet.
 /// @param send A function to send data over the network
 /// @param user Passed to `send`.
 void asset_request(
     const char *asset_id,
     const char *entity_id,
+    asset_transfers *transfers,
     asset_send_func send,
     void *user
 );
@@ -139,6 +208,22 @@ struct _ENetPacket;
 /// @param data_length The size of the `data` buffer
 struct _ENetPacket *asset_build_enet_packet(uint16_t mid, const cJSON *header, const uint8_t *data, size_t data_length);
 
+/// A data message packed the way it goes on the wire, so that it can be sent to any number of
+/// peers without being copied again. Reference counted, from the thread that runs the enet host.
+typedef struct asset_packed_message asset_packed_message;
+
+/// Packs the header of a data message like `asset_deliver_bytes` sends, leaving room for `length` bytes
+/// of data. Fill them in through `asset_packed_message_data` before making packets of it.
+/// @return The message, with one reference for the caller
+asset_packed_message *asset_pack_bytes(const char *asset_id, size_t offset, size_t length, size_t total_size);
+/// @return Where the message's `length` bytes of data go
+uint8_t *asset_packed_message_data(asset_packed_message *message);
+void asset_packed_message_retain(asset_packed_message *message);
+void asset_packed_message_release(asset_packed_message *message);
+/// A reliable packet that refers to the message's bytes instead of copying them, using
+/// `ENET_PACKET_FLAG_NO_ALLOCATE`. The packet keeps a reference to the message until enet frees it.
+struct _ENetPacket *asset_packed_message_enet_packet(asset_packed_message *message);
+
 
 /// Safe parsing of the request message header
 /// `out_id` will point to data in `header` and only valid as long as header is.
@@ -19,130 +19,257 @@
 #define max(a,b) a > b ? a : b
 #define log(f_, ...) printf((f_), ##__VA_ARGS__)
 
-// Minimum number of seconds between cache prune checks
-static const double kCacheCheckInterval = 10.0;
 // Minimum number of seconds after last use to keep an asset in the cache.
 // Before this an asset will not leave the cache even if memory or count demands it
 // This guards assets that are currently being sent or received from disappearing.
 static const double kCacheMinAge = 5.0;
-// Maximum number of seconds after last use to keep an asset in the cache.
-// After being left untouched for this long the asset is always removed
-static const double kCacheMaxAge = 60.0*10;
-// Maximum number of assets to keep in the cache (not counting static assets)
-// This is useful because lookup times gets bad after a while...
-static const int kCacheMaxCount = 400;
-// Maximum number of bytes to keep in the store.
-static const size_t kCacheMaxBytes = 1024*1024*1024;
+// Used when `assetstore_init` isn't given any limits
+static const assetstore_limits kCacheDefaultLimits = {
+    .max_count = 400,
+    .max_bytes = 1024*1024*1024,
+    .max_age = 60.0*10,
+};
 
 
-size_t _first(cJSON *range) {
-    return (size_t)cJSON_GetArrayItem(range, 0)->valueint;
+// ---- Asset state
+//
+// Each asset the store knows about has an `asset_state`, found by id in a hash map. While an asset
+// is incomplete its received bytes are a sorted list of disjoint [start, end) ranges.
+
+typedef struct asset_range {
+    uint64_t start, end;
+} asset_range;
+
+typedef struct asset_state {
+    char *asset_id;
+    uint64_t total_size;
+    int complete;
+    /// Received ranges, sorted by start. Ranges that touch are merged. Empty once complete.
+    arr_t(asset_range) ranges;
+    /// The asset's bytes, for stores that keep them in memory. Owned by the state.
+    uint8_t *data;
+    /// Last use, in the store's clock time
+    double lru;
+    /// Never pruned, e g assets registered by the app itself
+    int pinned;
+    /// Disk store: the asset has files in the store's directory. Other states only track a transfer.
+    int on_disk;
+    /// Disk store: the file's mtime has been updated this session
+    int touched;
+    /// Disk store: the complete file, mapped on first read
+    uint8_t *map;
+    /// Disk store: bytes written since the ranges were last saved
+    size_t unsynced;
+    struct asset_state *next_in_bucket;
+    /// Neighbours in the LRU list. Pinned states aren't in it.
+    struct asset_state *lru_prev, *lru_next;
+} asset_state;
+
+typedef struct asset_states {
+    asset_state **buckets;
+    size_t bucket_count; // always a power of two
+    size_t count;
+    /// Unpinned states, least recently used first
+    asset_state *lru_head, *lru_tail;
+} asset_states;
+
+static asset_states *_states(assetstore *store) {
+    return (asset_states *)store->state;
 }
 
-size_t _last(cJSON *range) {
-    return (size_t)cJSON_GetArrayItem(range, 1)->valueint;
+static uint64_t _hash(const char *asset_id) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char *c = asset_id; *c; c++) {
+        hash ^= (uint8_t)*c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
 }
 
-cJSON *_range(cJSON *ranges, int index) {
-    return cJSON_GetArrayItem(ranges, index);
+static asset_state **_state_slot(asset_states *states, const char *asset_id) {
+    asset_state **slot = &states->buckets[_hash(asset_id) & (states->bucket_count - 1)];
+    while (*slot && strcmp((*slot)->asset_id, asset_id) != 0) {
+        slot = &(*slot)->next_in_bucket;
+    }
+    return slot;
 }
 
+static asset_state *_state_get(assetstore *store, const char *asset_id) {
+    return *_state_slot(_states(store), asset_id);
+}
 
-/// Returns missing ranges
-/// @param ranges The ranges
-/// @param total_size The total size of the asset
-/// @param count_max Stop counting after this many hits
-/// @param out_ranges To store found ranges on the format [start, end]. Must be at least `size_t * count_max * 2` large
-int _missing_ranges(cJSON *ranges, size_t total_size, size_t *out_ranges, size_t count_max) {
-    if (count_max == 0) return 0;
-    
-    cJSON *range;
-    size_t low = 0;
-    size_t count = 0;
-    size_t i = 0;
-    cJSON_ArrayForEach(range, ranges) {
-        if (count >= count_max) return count;
-        if (low < _first(range)) {
-            if (out_ranges) {
-                out_ranges[i++] = low;
-                out_ranges[i++] = _first(range) - 1;
-            }
-            ++count;
+static void _states_grow(asset_states *states) {
+    size_t bucket_count = states->bucket_count * 2;
+    asset_state **buckets = calloc(bucket_count, sizeof(asset_state *));
+    for (size_t i = 0; i < states->bucket_count; i++) {
+        asset_state *state = states->buckets[i];
+        while (state) {
+            asset_state *next = state->next_in_bucket;
+            size_t bucket = _hash(state->asset_id) & (bucket_count - 1);
+            state->next_in_bucket = buckets[bucket];
+            buckets[bucket] = state;
+            state = next;
         }
-        low = _last(range) + 1;
     }
-    if (low < total_size && count < count_max) {
-        if (out_ranges) {
-            out_ranges[i++] = low;
-            out_ranges[i++] = total_size;
+    free(states->buckets);
+    states->buckets = buckets;
+    states->bucket_count = bucket_count;
+}
+
+static void _lru_unlink(asset_states *states, asset_state *state) {
+    if (state->lru_prev) state->lru_prev->lru_next = state->lru_next;
+    else states->lru_head = state->lru_next;
+    if (state->lru_next) state->lru_next->lru_prev = state->lru_prev;
+    else states->lru_tail = state->lru_prev;
+    state->lru_prev = state->lru_next = NULL;
+}
+
+static void _lru_append(asset_states *states, asset_state *state) {
+    state->lru_prev = states->lru_tail;
+    state->lru_next = NULL;
+    if (states->lru_tail) states->lru_tail->lru_next = state;
+    else states->lru_head = state;
+    states->lru_tail = state;
+}
+
+/// Adds a new, empty and incomplete state. There must not already be one for `asset_id`.
+static asset_state *_state_add(assetstore *store, const char *asset_id, uint64_t total_size) {
+    asset_states *states = _states(store);
+    if (states->count >= states->bucket_count) {
+        _states_grow(states);
+    }
+    asset_state **slot = _state_slot(states, asset_id);
+    assert(*slot == NULL);
+    asset_state *state = calloc(1, sizeof(asset_state));
+    state->asset_id = strdup(asset_id);
+    state->total_size = total_size;
+    state->lru = store->clock();
+    arr_init(&state->ranges);
+    *slot = state;
+    states->count++;
+    _lru_append(states, state);
+    store->cache_count++;
+    store->cache_size += total_size;
+    return state;
+}
+
+/// Takes a state out of the LRU list so that it's never pruned
+static void _state_pin(assetstore *store, asset_state *state) {
+    assert(!state->pinned);
+    _lru_unlink(_states(store), state);
+    store->cache_count--;
+    store->cache_size -= state->total_size;
+    store->pinned_count++;
+    store->pinned_size += state->total_size;
+    state->pinned = 1;
+}
+
+static void _state_free(asset_state *state) {
+    arr_free(&state->ranges);
+    free(state->data);
+    free(state->asset_id);
+    free(state);
+}
+
+static void _state_remove(assetstore *store, const char *asset_id) {
+    asset_states *states = _states(store);
+    asset_state **slot = _state_slot(states, asset_id);
+    asset_state *state = *slot;
+    if (state == NULL) return;
+    *slot = state->next_in_bucket;
+    states->count--;
+    if (state->pinned) {
+        store->pinned_count--;
+        store->pinned_size -= state->total_size;
+    } else {
+        _lru_unlink(states, state);
+        store->cache_count--;
+        store->cache_size -= state->total_size;
+    }
+    _state_free(state);
+}
+
+/// @return The number of gaps between the received ranges of an incomplete asset
+static size_t _missing_ranges_count(asset_state *state) {
+    if (state->complete) return 0;
+    size_t count = state->ranges.length;
+    if (count == 0) return state->total_size > 0 ? 1 : 0;
+    // gaps between ranges, plus before the first and after the last
+    return count - 1 + (state->ranges.data[0].start > 0) + (state->ranges.data[count-1].end < state->total_size);
+}
+
+/// @return The index of the first range that ends at or after `offset`
+static size_t _range_index(asset_state *state, uint64_t offset) {
+    size_t low = 0, high = state->ranges.length;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (state->ranges.data[mid].end < offset) {
+            low = mid + 1;
+        } else {
+            high = mid;
         }
-        ++count;
     }
-    return count;
+    return low;
 }
 
-size_t __missing_ranges_count(cJSON *ranges, size_t total_size) {
-    return _missing_ranges(ranges, total_size, NULL, ULONG_MAX);
+/// Ranges are [start, end), and ranges that touch are merged.
+static void _merge_range(asset_state *state, uint64_t start, uint64_t end) {
+    assert(start <= end);
+    size_t first = _range_index(state, start);
+    // every range from `first` that starts at or before `end` touches the new one
+    size_t last = first;
+    while (last < state->ranges.length && state->ranges.data[last].start <= end) {
+        last++;
+    }
+    if (first == last) {
+        asset_range range = { start, end };
+        arr_reserve(&state->ranges, state->ranges.length + 1);
+        memmove(state->ranges.data + first + 1, state->ranges.data + first, (state->ranges.length - first) * sizeof(asset_range));
+        state->ranges.data[first] = range;
+        state->ranges.length++;
+        return;
+    }
+    asset_range *merged = &state->ranges.data[first];
+    if (start < merged->start) merged->start = start;
+    uint64_t last_end = state->ranges.data[last-1].end;
+    merged->end = end > last_end ? end : last_end;
+    if (last - first > 1) {
+        arr_splice(&state->ranges, first + 1, last - first - 1);
+    }
 }
 
-size_t _missing_ranges_count(assetstore *store, const char *asset_id) {
-    cJSON *state = cJSON_GetObjectItem(store->state, asset_id);
-    assert(cJSON_IsObject(state));
-    // No missing ranges if asset is complete
-    if (cJSON_IsTrue(cJSON_GetObjectItem(state, "complete"))) {
-        return 0;
+/// Marks the asset complete once it has exactly 1 range that is 0...total_size
+static void _update_asset_state(asset_state *state) {
+    // TODO: confirm that the file sha is equal to the asset_id
+    if (state->ranges.length == 1 && state->ranges.data[0].start == 0 && state->ranges.data[0].end == state->total_size) {
+        state->complete = 1;
+        arr_free(&state->ranges);
+        arr_init(&state->ranges);
     }
-    cJSON *ranges = cJSON_GetObjectItem(state, "ranges");
-    assert(cJSON_IsArray(ranges));
-    cJSON *j_top = cJSON_GetObjectItem(state, "total_size");
-    assert(cJSON_IsNumber(j_top));
-    return __missing_ranges_count(ranges, j_top->valueint);
 }
 
-int _memstore_state(assetstore *store, const char *asset_id, int *out_exists, int *out_complete, size_t *out_regions_count, size_t *out_total_size) {
+static int _memstore_state(assetstore *store, const char *asset_id, int *out_exists, int *out_complete, size_t *out_regions_count, size_t *out_total_size) {
     assert(asset_id);
     
     mtx_lock((mtx_t*)store->lock);
-    cJSON *state = cJSON_GetObjectItem(store->state, asset_id);
+    asset_state *state = _state_get(store, asset_id);
     // check existance
     if (state == NULL) {
         if (out_exists) *out_exists = 0;
         if (out_complete) *out_complete = 0;
         mtx_unlock((mtx_t*)store->lock);
         return 0;
-    } else {
-        if (out_exists) *out_exists = 1;
-    }
-    assert(cJSON_IsObject(state));
-    if (!cJSON_IsObject(state)) {
-        cJSON_DeleteItemFromObject(store->state, asset_id);
-        mtx_unlock((mtx_t*)store->lock);
-        return 1;
-    }
-    
-    if (out_regions_count) {
-        *out_regions_count = _missing_ranges_count(store, asset_id);
-    }
-    
-    cJSON *total_size = cJSON_GetObjectItemCaseSensitive(state, "total_size");
-    if (out_total_size && cJSON_IsNumber(total_size)) {
-        *out_total_size = (size_t)total_size->valueint;
-    }
-    
-    if (out_complete) {
-        cJSON *complete = cJSON_GetObjectItem(state, "complete");
-        if (complete == NULL) {
-            *out_complete = 0;
-        } else {
-            assert(cJSON_IsBool(complete));
-            *out_complete = cJSON_IsTrue(complete);
-        }
     }
+    if (out_exists) *out_exists = 1;
+    if (out_regions_count) *out_regions_count = _missing_ranges_count(state);
+    if (out_total_size) *out_total_size = (size_t)state->total_size;
+    if (out_complete) *out_complete = state->complete;
     mtx_unlock((mtx_t*)store->lock);
     return 0;
 }
 
-size_t _memstore_get_missing_ranges(assetstore *store, const char *asset_id, size_t *out_ranges, size_t count) {
+static size_t _memstore_get_missing_ranges(assetstore *store, const char *asset_id, size_t *out_ranges, size_t count) {
     
     assert(store);
     assert(asset_id);
@@ -152,286 +279,75 @@ size_t _memstore_get_missing_ranges(assetstore *store, const char *asset_id, siz
     
     mtx_lock((mtx_t*)store->lock);
     
-    cJSON *state = cJSON_GetObjectItem(store->state, asset_id);
-    // check existance
-    if (state == NULL) {
+    asset_state *state = _state_get(store, asset_id);
+    // nothing missing if unknown or complete
+    if (state == NULL || state->complete) {
         mtx_unlock((mtx_t*)store->lock);
         return 0;
     }
-    cJSON *_total_size = cJSON_GetObjectItem(state, "total_size");
-    assert(cJSON_IsNumber(_total_size));
-    size_t total_size = (size_t)_total_size->valueint;
-    
-    cJSON *ranges = cJSON_GetObjectItem(state, "ranges");
-    assert(cJSON_IsArray(ranges));
-    
-    size_t result = _missing_ranges(ranges, total_size, out_ranges, count);
-    if (out_ranges == NULL) {
-        mtx_unlock((mtx_t*)store->lock);
-        return result;
-    }
     
-    // Adjust internal [start,end] to public [offset, length] format.
-    for (size_t i = 0; i < result; i++) {
-        out_ranges[i+1] = out_ranges[i+1] - out_ranges[i];
+    // the gaps between received ranges, on the public [offset, length] format
+    size_t result = 0;
+    uint64_t low = 0;
+    for (size_t i = 0; i <= state->ranges.length && result < count; i++) {
+        uint64_t high = i < state->ranges.length ? state->ranges.data[i].start : state->total_size;
+        if (low < high) {
+            out_ranges[result*2] = (size_t)low;
+            out_ranges[result*2+1] = (size_t)(high - low);
+            result++;
+        }
+        if (i < state->ranges.length) low = state->ranges.data[i].end;
     }
     mtx_unlock((mtx_t*)store->lock);
     return result;
 }
 
-/// Note that rages are inclusive; easier to reason about and there's no point storing a zero range.
-void _merge_range(cJSON *ranges, size_t start, size_t end) {
-    assert(start <= end);
-    
-    int ranges_count = cJSON_GetArraySize(ranges);
-    if (ranges_count == 0) {
-        int numbers[2] = {(int)start, (int)end };
-        cJSON *r = cJSON_CreateIntArray(numbers, 2);
-        cJSON_AddItemToArray(ranges, r);
-        return;
-    }
-    
-    int i = 0, low = 0, high = cJSON_GetArraySize(ranges) - 1;
-    size_t value;
-    cJSON *range;
-    // find the index `i` where to insert the new range, based on start value
-    while (low <= high) {
-        i = (low + high) / 2;
-        range = cJSON_GetArrayItem(ranges, i);
-        assert(range);
-        value = _first(range);
-        if (value < start) {
-            low = i + 1;
-        } else if (value > start) {
-            high = i - 1;
-        } else {
-            break;
-        }
-    }
-    // We want to end at the range that is bigger, or at end of list
-    if (start >= value) {
-        ++i;
-    }
-    
-    // Merge all ranges that intersects to the right
-    // Can be many as the length is unconstrained
-    range = cJSON_GetArrayItem(ranges, i);
-    while (range != NULL && (end >= _first(range) - 1 && start <= _last(range) + 1)) {
-        start = min(start, _first(range));
-        end = max(end, _last(range));
-        cJSON_DeleteItemFromArray(ranges, i);
-        range = cJSON_GetArrayItem(ranges, i);
-    }
-    
-    // Merge all intersecting to the left
-    // Can be at most one as we sorted by start
-    range = i > 0 ? _range(ranges, i-1) : NULL;
-    if (range && start <= _last(range) + 1) {
-        start = min(start, _first(range));
-        end = max(end, _last(range));
-        cJSON_DeleteItemFromArray(ranges, i-1);
-        --i;
-    }
-    
-    // Insert the new range
-    int numbers[2] = {(int)start, (int)end };
-    cJSON *r = cJSON_CreateIntArray(numbers, 2);
-    cJSON_InsertItemInArray(ranges, i, r);
-    return;
-}
-void _lru_prune(assetstore *store);
-void _update_asset_state(assetstore *store, const char *asset_id) {
-    cJSON *state = cJSON_GetObjectItem(store->state, asset_id);
-    cJSON *ranges = cJSON_GetObjectItem(state, "ranges");
-    
-    // if we have exactly 1 range that is 0...total_size:
-    // TODO: confirm that the file sha is equal to the asset_id
-    // then we have the complete file
-    cJSON *total_size = cJSON_GetObjectItem(state, "total_size");
-    if (cJSON_GetArraySize(ranges) == 1) {
-        cJSON *range = _range(ranges, 0);
-        if (_first(range) == 0 && _last(range) == (size_t)total_size->valueint) {
-            cJSON_ReplaceItemInObjectCaseSensitive(state, "complete", cJSON_CreateBool(1));
-            cJSON_DeleteItemFromObject(state, "ranges");
-            log("assetstore: Asset %s is complete\n", asset_id);
-        }
-    }
-}
-
-// clears allocated data
-void _clear_state(cJSON *state) {
-    if (cJSON_IsObject(state)) {
-        cJSON *file = cJSON_GetObjectItem(state, "data");
-        if (cJSON_IsString(file)) {
-            // warning: hacky hack-hack
-            uint8_t *data = (uint8_t *)strtol(file->valuestring, NULL, 10);
-            free(data);
-        }
+/// Marks an asset as just used, moving it to the end of the LRU list
+static void _lru_tag(assetstore *store, asset_state *state) {
+    if (state->pinned) return;
+    state->lru = store->clock();
+    asset_states *states = _states(store);
+    if (states->lru_tail != state) {
+        _lru_unlink(states, state);
+        _lru_append(states, state);
     }
 }
 
-void _lru_tag(cJSON *state) {
-    double mono = get_ts_monod();
-    cJSON *lru = cJSON_GetObjectItem(state, "lru");
-    if (cJSON_IsNumber(lru)) {
-        lru->valuedouble = mono;
-    } else if (lru == NULL) {
-        cJSON_AddNumberToObject(state, "lru", mono);
-    } // lru can also be a bool:true, which means never prune
-}
-
-int _lru_compare_size(const void *a, const void *b) {
-    double x = cJSON_GetObjectItemCaseSensitive((cJSON*)(*(cJSON**)a), "total_size")->valueint;
-    double y = cJSON_GetObjectItemCaseSensitive((cJSON*)(*(cJSON**)b), "total_size")->valueint;
-    return y - x;
-}
-int _lru_compare_age(const void *a, const void *b) {
-    double x = cJSON_GetObjectItemCaseSensitive((cJSON*)(*(cJSON**)a), "lru")->valuedouble;
-    double y = cJSON_GetObjectItemCaseSensitive((cJSON*)(*(cJSON**)b), "lru")->valuedouble;
-    return x - y;
-}
-
-void _lru_prune(assetstore *store) {
-    double time = get_ts_monod();
-    
+/// Removes assets from the front of the LRU list while they are too old, or while the store is
+/// over its limits. Assets used in the last `kCacheMinAge` seconds are always kept.
+static void _lru_prune(assetstore *store) {
     if (store->use_cache == 0) {
         return;
     }
     
-    int check_count = store->cache_count > kCacheMaxCount;
-    int check_size = store->cache_size > kCacheMaxBytes;
+    asset_states *states = _states(store);
+    double time = store->clock();
+    double max_barrier = time - store->limits.max_age;
+    double min_barrier = time - kCacheMinAge;
     
-    if (store->next_state_prune < time || check_count || check_size) {
-        store->next_state_prune = time + kCacheCheckInterval;
-    } else {
-        return;
-    }
-    
-    double max_barrier = time - kCacheMaxAge;
-    cJSON *state = store->state->child;
-    int total_asset_count = 0;
-    int static_asset_count = 0;
-    size_t total_memory_usage = 0;
-    size_t static_memory_usage = 0;
-    int pruned_old_count = 0;
-    size_t pruned_old_size = 0;
-    int pruned_max_count = 0;
-    size_t pruned_max_size = 0;
-    int pruned_memory_count = 0;
-    size_t pruned_memory_size = 0;
-    
-    // Prune too old entries
-    while (state) {
-        cJSON *next = state->next;
-        cJSON *lru = cJSON_GetObjectItemCaseSensitive(state, "lru");
-        size_t size = cJSON_GetObjectItemCaseSensitive(state, "total_size")->valueint;
-        total_memory_usage += size;
-        total_asset_count += 1;
-        
-        if (cJSON_IsNumber(lru)) {
-            if (lru->valuedouble < max_barrier) {
-                _clear_state(state);
-                cJSON_DetachItemViaPointer(store->state, state);
-                cJSON_Delete(state);
-                pruned_old_count += 1;
-                pruned_old_size += size;
-            }
-        } else if (lru == NULL) {
-            printf("missing lru\n");
-        } else if (cJSON_IsBool(lru)) {
-            static_asset_count += 1;
-            static_memory_usage += size;
-        }
-        state = next;
-    }
-    
-    // If we just have too many assets then prune some more
-    if (total_asset_count > kCacheMaxCount || total_memory_usage > kCacheMaxBytes) { // todo: check memory usage and sort on impact as well.
-        printf("assetstore: %d assets in cache using %zu bytes\n", total_asset_count, total_memory_usage);
-        printf("assetstore: Limits are set to %d assets using %zu bytes\n", kCacheMaxCount, kCacheMaxBytes);
-        int mode = total_memory_usage > kCacheMaxBytes ? 1 : 0;
-        
-        int count_to_evict = (mode == 0) ? total_asset_count - kCacheMaxCount : 0;
-        size_t bytes_to_free = (mode == 1) ? total_memory_usage - kCacheMaxBytes : 0;
-        
-        if (mode == 0) {
-            printf("assetstore: Trying to remove %d assets\n", count_to_evict);
-        }
-        if (mode == 1) {
-            printf("assetstore: Trying to free up %zu bytes\n", bytes_to_free);
-        }
-        
-        cJSON **candidates = malloc(total_asset_count * sizeof(cJSON*));
-        cJSON **cursor = candidates;
-        int candidates_count = 0;
-        state = store->state->child;
-        double min_barrier = time - kCacheMinAge; // don't evict items used too recently
-        while(state) {
-            cJSON *lru = cJSON_GetObjectItemCaseSensitive(state, "lru");
-            // skips static (lru is a bool:true), and too recently used
-            // too recently used: obviously in use right now, or at least is being downloaded
-            if (cJSON_IsNumber(lru) && lru->valuedouble < min_barrier) {
-                *cursor = state;
-                ++cursor;
-                ++candidates_count;
-            }
-            state = state->next;
-        }
-        if (mode == 1) {
-            qsort(candidates, candidates_count, sizeof(cJSON*), _lru_compare_size);
+    asset_state *oldest;
+    while ((oldest = states->lru_head) != NULL) {
+        int over_limits = store->cache_count > store->limits.max_count || store->cache_size > store->limits.max_bytes;
+        if (oldest->lru < max_barrier || (over_limits && oldest->lru < min_barrier)) {
+            _state_remove(store, oldest->asset_id);
         } else {
-            qsort(candidates, candidates_count, sizeof(cJSON*), _lru_compare_age);
-        }
-        for(int i = 0; i < candidates_count; i++) {
-            cJSON *state = candidates[i];
-            size_t size = cJSON_GetObjectItemCaseSensitive(state, "total_size")->valueint;
-            _clear_state(state);
-            cJSON_DetachItemViaPointer(store->state, state);
-            cJSON_Delete(state);
-            
-            if (mode == 0) {
-                pruned_max_count += 1;
-                pruned_max_size += size;
-                
-                if (--count_to_evict <= 0) {
-                    break;
-                }
-            } else if (mode == 1) {
-                pruned_memory_count += 1;
-                pruned_memory_size += size;
-                
-                bytes_to_free -= size;
-                if (bytes_to_free < kCacheMaxBytes) {
-                    break;
-                }
-            }
+            break;
         }
-        free(candidates);
     }
-    int pruned_total_count = pruned_old_count + pruned_max_count + pruned_memory_count;
-    size_t pruned_total_size = pruned_old_size + pruned_max_size + pruned_memory_size;
-    
-    total_asset_count -= pruned_total_count;
-    total_memory_usage -= pruned_total_size;
-    
-    if (pruned_total_count > 0) {
-        printf("assetstore: Removed %d assets freeing %zu bytes.\n", pruned_total_count, pruned_total_size);
-    }
-    printf("assetstore: %d assets in cache using %zu bytes, whereof %d are static using %zu bytes.\n", total_asset_count, total_memory_usage, static_asset_count, static_memory_usage);
 }
 
-int _assetstore_read(assetstore *store, const char *asset_id, size_t offset, uint8_t *buffer, size_t length, size_t *out_total_size) {
+static int _assetstore_read(assetstore *store, const char *asset_id, size_t offset, uint8_t *buffer, size_t length, size_t *out_total_size) {
     
     mtx_lock((mtx_t*)store->lock);
     (void)offset; (void)buffer; (void)length; (void)out_total_size;
     
-    cJSON *state = cJSON_GetObjectItem(store->state, asset_id);
-    if (!cJSON_IsObject(state)) {
+    asset_state *state = _state_get(store, asset_id);
+    if (state == NULL) {
         mtx_unlock((mtx_t*)store->lock);
         return -1;
     }
     
-    _lru_tag(state);
+    _lru_tag(store, state);
     _lru_prune(store);
     
     mtx_unlock((mtx_t*)store->lock);
@@ -439,33 +355,24 @@ int _assetstore_read(assetstore *store, const char *asset_id, size_t offset, uin
     return -1;
 }
 
-int _assetstore_write(assetstore *store, const char *asset_id, size_t offset, const uint8_t *data, size_t length, size_t total_size) {
+static int _assetstore_write(assetstore *store, const char *asset_id, size_t offset, const uint8_t *data, size_t length, size_t total_size) {
     assert(store);
     assert(asset_id);
     assert(data);
     
     mtx_lock((mtx_t*)store->lock);
-    // get or create the ranges from asset state in the store state
-    cJSON *state = cJSON_GetObjectItem(store->state, asset_id);
-    cJSON *ranges = NULL;
-    if (cJSON_IsObject(state)) {
-        ranges = cJSON_GetObjectItem(state, "ranges");
-        cJSON *file = cJSON_GetObjectItem(state, "data");
-        
-        // if there is a state then there is a "ranges" and "data"
-        assert(ranges || (cJSON_IsTrue(cJSON_GetObjectItem(state, "complete"))));
-        assert(cJSON_IsString(file));
-    } else {
-        state = cJSON_AddObjectToObject(store->state, asset_id);
-        cJSON_AddBoolToObject(state, "complete", 0);
-        cJSON_AddItemToObject(state, "total_size", cJSON_CreateNumber((double)total_size));
-        ranges = cJSON_AddArrayToObject(state, "ranges");
+    // get or create the asset state
+    asset_state *state = _state_get(store, asset_id);
+    if (state == NULL) {
+        state = _state_add(store, asset_id, total_size);
     }
     
-    _merge_range(ranges, offset, offset + length);
-    _update_asset_state(store, asset_id);
+    if (!state->complete) {
+        _merge_range(state, offset, (uint64_t)offset + length);
+        _update_asset_state(state);
+    }
     
-    _lru_tag(state);
+    _lru_tag(store, state);
     _lru_prune(store);
 
     mtx_unlock((mtx_t*)store->lock);
@@ -474,32 +381,28 @@ int _assetstore_write(assetstore *store, const char *asset_id, size_t offset, co
 }
 
 
-int _memstore_read(assetstore *store, const char *asset_id, size_t offset, uint8_t *buffer, size_t length, size_t *out_total_size) {
+static int _memstore_read(assetstore *store, const char *asset_id, size_t offset, uint8_t *buffer, size_t length, size_t *out_total_size) {
     mtx_lock((mtx_t*)store->lock);
     
-    cJSON *state = cJSON_GetObjectItem(store->state, asset_id);
-    if (!cJSON_IsObject(state)) {
+    asset_state *state = _state_get(store, asset_id);
+    if (state == NULL) {
         mtx_unlock((mtx_t*)store->lock);
         return -1;
     }
+    *out_total_size = (size_t)state->total_size;
     
-    cJSON *size = cJSON_GetObjectItem(state, "total_size");
-    if (!cJSON_IsNumber(size)) {
+    if (state->data == NULL) {
         mtx_unlock((mtx_t*)store->lock);
-        return -2;
+        return -3;
     }
-    *out_total_size = (size_t)cJSON_GetNumberValue(size);
-    
-    cJSON *file = cJSON_GetObjectItem(state, "data");
-    if (!cJSON_IsString(file)) {
+    if (offset >= state->total_size) {
         mtx_unlock((mtx_t*)store->lock);
-        return -3;
+        return 0;
     }
-    uint8_t *file_data = strtoll(file->valuestring, NULL, 10);
     length = min(length, *out_total_size - offset);
-    memcpy(buffer, file_data + offset, length);
+    memcpy(buffer, state->data + offset, length);
     
-    _lru_tag(state);
+    _lru_tag(store, state);
     _lru_prune(store);
     
     mtx_unlock((mtx_t*)store->lock);
@@ -507,51 +410,34 @@ int _memstore_read(assetstore *store, const char *asset_id, size_t offset, uint8
     return length;
 }
 
-int _memstorestore_write(assetstore *store, const char *asset_id, size_t offset, const uint8_t *data, size_t length, size_t total_size) {
+static int _memstorestore_write(assetstore *store, const char *asset_id, size_t offset, const uint8_t *data, size_t length, size_t total_size) {
     assert(store);
     assert(asset_id);
     assert(data);
     
     mtx_lock((mtx_t*)store->lock);
-    // get or create the ranges from asset state in the store state
-    cJSON *state = cJSON_GetObjectItem(store->state, asset_id);
-    uint8_t *file_data = NULL;
-    cJSON *ranges = NULL;
-    if (cJSON_IsObject(state)) {
-        ranges = cJSON_GetObjectItem(state, "ranges");
-        cJSON *file = cJSON_GetObjectItem(state, "data");
-        
-        // if there is a state then there is a "ranges" and "data"
-        assert(ranges || (cJSON_IsTrue(cJSON_GetObjectItem(state, "complete"))));
-        assert(cJSON_IsString(file));
-        
-        file_data = strtol(file->valuestring, NULL, 10);
-        assert(file_data);
-    } else {
-        state = cJSON_AddObjectToObject(store->state, asset_id);
-        file_data = malloc(total_size);
+    // get or create the asset state, and the memory for its bytes
+    asset_state *state = _state_get(store, asset_id);
+    if (state == NULL) {
+        uint8_t *file_data = malloc(total_size);
         if (file_data == 0) {
-            log("assetstore: Failed to allocate %ld bytes storage for asset %s", total_size, asset_id);
+            log("assetstore: Failed to allocate %zu bytes storage for asset %s", total_size, asset_id);
             mtx_unlock((mtx_t*)store->lock);
             return -1;
         }
-        cJSON_AddBoolToObject(state, "complete", 0);
-        cJSON_AddItemToObject(state, "total_size", cJSON_CreateNumber((double)total_size));
-        ranges = cJSON_AddArrayToObject(state, "ranges");
-        
-        // warning: hacky hack-hack
-        char num[255];
-        sprintf(num, "%llu", (long long unsigned int)file_data);
-        cJSON_AddStringToObject(state, "data", num);
-    }
-    assert(file_data);
-    assert(offset + length <= total_size);
-    memcpy(file_data + offset, data, length);
-    
-    _merge_range(ranges, offset, offset + length);
-    _update_asset_state(store, asset_id);
-    
-    _lru_tag(state);
+        state = _state_add(store, asset_id, total_size);
+        state->data = file_data;
+    }
+    assert(state->data);
+    assert(offset + length <= state->total_size);
+    
+    if (!state->complete) {
+        memcpy(state->data + offset, data, length);
+        _merge_range(state, offset, (uint64_t)offset + length);
+        _update_asset_state(state);
+    }
+    
+    _lru_tag(store, state);
     _lru_prune(store);
 
     mtx_unlock((mtx_t*)store->lock);
@@ -560,17 +446,8 @@ int _memstorestore_write(assetstore *store, const char *asset_id, size_t offset,
 }
 
 
-void _clear_state_asset(assetstore *store, const char *asset_id) {
-    cJSON *state = cJSON_GetObjectItem(store->state, asset_id);
-    if (cJSON_IsObject(state)) {
-        _clear_state(state);
-    }
-    cJSON_DeleteItemFromObjectCaseSensitive(store->state, asset_id);
-}
-
-
-int asset_memstore_init(assetstore *store) {
-    assetstore_init(store);
+int asset_memstore_init(assetstore *store, const assetstore_limits *limits) {
+    assetstore_init(store, limits);
     
     asset_memstore *memstore = calloc(1, sizeof(asset_memstore));
     
@@ -586,32 +463,45 @@ int asset_memstore_init(assetstore *store) {
 }
 
 void asset_memstore_deinit(assetstore *_store) {
-    cJSON *state = _store->state->child;
-    while (state) {
-        _clear_state(state);
-        state = state->next;
-    }
+    // the data is freed with the states
+    free(_store->_impl);
     assetstore_deinit(_store);
 }
 
-int assetstore_init(assetstore *store) {
+int assetstore_init(assetstore *store, const assetstore_limits *limits) {
     store->lock = malloc(sizeof(mtx_t));
     mtx_init((mtx_t*)store->lock, mtx_plain);
     store->_impl = NULL;
-    store->state = cJSON_CreateObject();
+    asset_states *states = calloc(1, sizeof(asset_states));
+    states->bucket_count = 64;
+    states->buckets = calloc(states->bucket_count, sizeof(asset_state *));
+    store->state = states;
     store->get_missing_ranges = _memstore_get_missing_ranges;
     store->get_state = _memstore_state;
     store->read = _assetstore_read;
     store->write = _assetstore_write;
-    store->next_state_prune = 0;
+    store->limits = limits ? *limits : kCacheDefaultLimits;
     store->use_cache = 0;
     store->cache_count = 0;
     store->cache_size = 0;
+    store->pinned_count = 0;
+    store->pinned_size = 0;
+    store->clock = get_ts_monod;
     return 0;
 }
 
 void assetstore_deinit(assetstore *store) {
-    cJSON_Delete(store->state);
+    asset_states *states = _states(store);
+    for (size_t i = 0; i < states->bucket_count; i++) {
+        asset_state *state = states->buckets[i];
+        while (state) {
+            asset_state *next = state->next_in_bucket;
+            _state_free(state);
+            state = next;
+        }
+    }
+    free(states->buckets);
+    free(states);
     store->state = NULL;
     store->get_missing_ranges = NULL;
     store->get_state = NULL;
@@ -654,15 +544,12 @@ int asset_memstore_register_asset_nocopy(struct assetstore *store, const char *a
     mtx_lock((mtx_t*)store->lock);
     
     char *id = asset_generate_identifier(data, length);
-    _clear_state_asset(store, id);
-    cJSON *state = cJSON_AddObjectToObject(store->state, id);
-    cJSON_AddBoolToObject(state, "complete", 1);
-    // warning: hacky hack-hack
-    char num[255];
-    sprintf(num, "%ld", (long)data);
-    cJSON_AddStringToObject(state, "data", num);
-    cJSON_AddNumberToObject(state, "total_size", length);
-    cJSON_AddBoolToObject(state, "lru", true);
+    _state_remove(store, id);
+    asset_state *state = _state_add(store, id, length);
+    state->complete = 1;
+    state->data = (uint8_t *)data;
+    _state_pin(store, state);
+    free(id);
     
     mtx_unlock((mtx_t*)store->lock);
     
@@ -672,26 +559,560 @@ int asset_memstore_register_asset_nocopy(struct assetstore *store, const char *a
 uint8_t *asset_memstore_get_data_pointer(assetstore *store, const char *asset_id) {
     mtx_lock((mtx_t*)store->lock);
     
-    cJSON *state = cJSON_GetObjectItem(store->state, asset_id);
-    if (!cJSON_IsObject(state)) {
+    asset_state *state = _state_get(store, asset_id);
+    uint8_t *file_data = state && state->complete ? state->data : NULL;
+    
+    mtx_unlock((mtx_t*)store->lock);
+    
+    return file_data;
+}
+
+
+// ---- Disk store
+//
+// Assets are files in the store's directory, named by the hex part of their `asset:sha256:` id.
+// An asset that is still downloading is `<hex>.part`, with the ranges received so far in `<hex>.ranges`.
+// The ranges file is only replaced after the data it describes has been flushed to disk, so after a
+// crash a download resumes from the last save rather than trusting bytes that never made it.
+// A finished download is checked against its hash before it's renamed to `<hex>`.
+
+#include "sha256.h"
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#if defined(_WIN32)
+    #include <windows.h>
+    #include <io.h>
+    #include <direct.h>
+    #include <sys/utime.h>
+#else
+    #include <dirent.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <utime.h>
+    #include <sys/mman.h>
+#endif
+
+#define ASSET_SHA256_PREFIX "asset:sha256:"
+#define ASSET_SHA256_HEX_LENGTH (SHA256_HASH_SIZE*2)
+// Save the received ranges of a partial asset at least this often
+static const size_t kDiskSyncBytes = 8*1024*1024;
+
+// The store's `asset_state`s carry the disk fields. Their `lru` is an estimate from the file's
+// mtime for files found at startup.
+typedef struct asset_diskstore {
+    struct assetstore *_interface;
+    char *path;
+    size_t max_bytes;
+    size_t used_bytes;
+    size_t count;
+} asset_diskstore;
+
+static asset_diskstore *_diskstore(assetstore *store) {
+    return (asset_diskstore *)store->_impl;
+}
+
+/// @return The hex part of a sha256 asset id, or NULL if it isn't one; then it can't be stored on disk.
+static const char *_disk_hex(const char *asset_id) {
+    size_t prefix = strlen(ASSET_SHA256_PREFIX);
+    if (strncmp(asset_id, ASSET_SHA256_PREFIX, prefix) != 0) return NULL;
+    const char *hex = asset_id + prefix;
+    if (strlen(hex) != ASSET_SHA256_HEX_LENGTH) return NULL;
+    for (const char *c = hex; *c; c++) {
+        if (!((*c >= '0' && *c <= '9') || (*c >= 'a' && *c <= 'f'))) return NULL;
+    }
+    return hex;
+}
+
+/// @return `<path>/<hex><suffix>`. Free it.
+static char *_disk_file(asset_diskstore *disk, const char *hex, const char *suffix) {
+    size_t len = strlen(disk->path) + 1 + strlen(hex) + strlen(suffix) + 1;
+    char *file = malloc(len);
+    snprintf(file, len, "%s/%s%s", disk->path, hex, suffix);
+    return file;
+}
+
+// -- platform
+
+#if defined(_WIN32)
+
+static int _disk_mkdir(const char *path) { return _mkdir(path) == 0 || errno == EEXIST ? 0 : -1; }
+
+static int _disk_write_at(const char *file, size_t offset, const uint8_t *data, size_t length) {
+    FILE *f = fopen(file, "r+b");
+    if (f == NULL) f = fopen(file, "w+b");
+    if (f == NULL) return -1;
+    int ok = _fseeki64(f, offset, SEEK_SET) == 0 && fwrite(data, 1, length, f) == length;
+    fclose(f);
+    return ok ? 0 : -1;
+}
+
+static int _disk_read_at(const char *file, size_t offset, uint8_t *data, size_t length) {
+    FILE *f = fopen(file, "rb");
+    if (f == NULL) return -1;
+    int ok = _fseeki64(f, offset, SEEK_SET) == 0 && fread(data, 1, length, f) == length;
+    fclose(f);
+    return ok ? 0 : -1;
+}
+
+static int _disk_flush(const char *file) {
+    FILE *f = fopen(file, "r+b");
+    if (f == NULL) return -1;
+    int ok = fflush(f) == 0 && _commit(_fileno(f)) == 0;
+    fclose(f);
+    return ok ? 0 : -1;
+}
+
+static int _disk_replace(const char *from, const char *to) {
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) ? 0 : -1;
+}
+
+static uint8_t *_disk_map(const char *file, size_t length) {
+    HANDLE f = CreateFileA(file, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (f == INVALID_HANDLE_VALUE) return NULL;
+    HANDLE mapping = CreateFileMappingA(f, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(f);
+    if (mapping == NULL) return NULL;
+    uint8_t *map = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, length);
+    CloseHandle(mapping); // the view keeps it alive
+    return map;
+}
+
+static void _disk_unmap(uint8_t *map, size_t length) {
+    (void)length;
+    UnmapViewOfFile(map);
+}
+
+/// Calls `found` with the name of each file in `path`
+static void _disk_list(const char *path, void (*found)(asset_diskstore *disk, const char *name), asset_diskstore *disk) {
+    char pattern[MAX_PATH];
+    snprintf(pattern, sizeof(pattern), "%s\\*", path);
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA(pattern, &data);
+    if (find == INVALID_HANDLE_VALUE) return;
+    do {
+        if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) found(disk, data.cFileName);
+    } while (FindNextFileA(find, &data));
+    FindClose(find);
+}
+
+#else
+
+static int _disk_mkdir(const char *path) { return mkdir(path, 0755) == 0 || errno == EEXIST ? 0 : -1; }
+
+static int _disk_write_at(const char *file, size_t offset, const uint8_t *data, size_t length) {
+    int fd = open(file, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0) return -1;
+    ssize_t written = pwrite(fd, data, length, (off_t)offset);
+    close(fd);
+    return written == (ssize_t)length ? 0 : -1;
+}
+
+static int _disk_read_at(const char *file, size_t offset, uint8_t *data, size_t length) {
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) return -1;
+    ssize_t read_length = pread(fd, data, length, (off_t)offset);
+    close(fd);
+    return read_length == (ssize_t)length ? 0 : -1;
+}
+
+static int _disk_flush(const char *file) {
+    int fd = open(file, O_RDWR);
+    if (fd < 0) return -1;
+    int result = fsync(fd);
+    close(fd);
+    return result;
+}
+
+static int _disk_replace(const char *from, const char *to) {
+    return rename(from, to);
+}
+
+static uint8_t *_disk_map(const char *file, size_t length) {
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) return NULL;
+    void *map = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps it open
+    return map == MAP_FAILED ? NULL : (uint8_t *)map;
+}
+
+static void _disk_unmap(uint8_t *map, size_t length) {
+    munmap(map, length);
+}
+
+/// Calls `found` with the name of each file in `path`
+static void _disk_list(const char *path, void (*found)(asset_diskstore *disk, const char *name), asset_diskstore *disk) {
+    DIR *dir = opendir(path);
+    if (dir == NULL) return;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] != '.') found(disk, ent->d_name);
+    }
+    closedir(dir);
+}
+
+#endif
+
+// -- entries
+
+/// @return The state of an asset with files on disk, or NULL
+static asset_state *_disk_entry(asset_diskstore *disk, const char *asset_id) {
+    asset_state *state = _state_get(disk->_interface, asset_id);
+    return state && state->on_disk ? state : NULL;
+}
+
+/// Adds the state of an asset with files on disk. There must not already be one for `asset_id`.
+static asset_state *_disk_add_entry(asset_diskstore *disk, const char *asset_id, size_t size, int complete, double last_used) {
+    asset_state *state = _state_add(disk->_interface, asset_id, size);
+    state->complete = complete;
+    state->lru = last_used;
+    state->on_disk = 1;
+    disk->count++;
+    disk->used_bytes += size;
+    return state;
+}
+
+/// Forget an asset and delete its files
+static void _disk_remove_entry(asset_diskstore *disk, asset_state *state) {
+    // Windows won't delete a file that is still mapped
+    if (state->map) _disk_unmap(state->map, (size_t)state->total_size);
+    state->map = NULL;
+    const char *hex = _disk_hex(state->asset_id);
+    const char *suffixes[] = { "", ".part", ".ranges" };
+    for (int i = 0; i < 3; i++) {
+        char *file = _disk_file(disk, hex, suffixes[i]);
+        remove(file);
+        free(file);
+    }
+    disk->count--;
+    disk->used_bytes -= (size_t)state->total_size;
+    _state_remove(disk->_interface, state->asset_id);
+}
+
+/// Delete the least recently used assets until the store fits its budget. Assets used in the last
+/// `kCacheMinAge` seconds are left alone, as they're probably being sent or received right now.
+static void _disk_evict(asset_diskstore *disk) {
+    double barrier = disk->_interface->clock() - kCacheMinAge;
+    asset_state *state = _states(disk->_interface)->lru_head;
+    while (state && state->lru < barrier && disk->used_bytes > disk->max_bytes) {
+        asset_state *next = state->lru_next;
+        // transfers of assets that can't be kept are only tracked
+        if (state->on_disk) {
+            log("assetstore: Evicting %s (%llu bytes) from disk\n", state->asset_id, (unsigned long long)state->total_size);
+            _disk_remove_entry(disk, state);
+        }
+        state = next;
+    }
+}
+
+static int _lru_compare(const void *a, const void *b) {
+    double lru_a = (*(asset_state * const *)a)->lru, lru_b = (*(asset_state * const *)b)->lru;
+    return lru_a < lru_b ? -1 : lru_a > lru_b;
+}
+
+/// Puts the LRU list in the order of the states' `lru`, which only files found at startup are out of
+static void _disk_sort_lru(asset_diskstore *disk) {
+    asset_states *states = _states(disk->_interface);
+    if (states->count == 0) return;
+    asset_state **sorted = malloc(states->count * sizeof(asset_state *));
+    size_t count = 0;
+    for (asset_state *state = states->lru_head; state; state = state->lru_next) {
+        sorted[count++] = state;
+    }
+    qsort(sorted, count, sizeof(asset_state *), _lru_compare);
+    states->lru_head = states->lru_tail = NULL;
+    for (size_t i = 0; i < count; i++) {
+        _lru_append(states, sorted[i]);
+    }
+    free(sorted);
+}
+
+/// Mark an asset as used now, and note it on disk once per session so that the order survives restarts
+static void _disk_touch(asset_diskstore *disk, asset_state *state) {
+    _lru_tag(disk->_interface, state);
+    if (!state->touched && state->complete) {
+        char *file = _disk_file(disk, _disk_hex(state->asset_id), "");
+        utime(file, NULL);
+        free(file);
+        state->touched = 1;
+    }
+}
+
+// -- ranges files
+
+/// Writes the received ranges of a partial asset, once the data they describe is on disk
+static int _disk_save_ranges(asset_diskstore *disk, asset_state *state) {
+    const char *hex = _disk_hex(state->asset_id);
+    char *part = _disk_file(disk, hex, ".part");
+    char *tmp = _disk_file(disk, hex, ".ranges.tmp");
+    char *ranges_file = _disk_file(disk, hex, ".ranges");
+    int result = -1;
+    
+    FILE *f = NULL;
+    if (_disk_flush(part) == 0 && (f = fopen(tmp, "w")) != NULL) {
+        fprintf(f, "%llu\n", (unsigned long long)state->total_size);
+        for (size_t i = 0; i < state->ranges.length; i++) {
+            fprintf(f, "%llu %llu\n", (unsigned long long)state->ranges.data[i].start, (unsigned long long)state->ranges.data[i].end);
+        }
+        int ok = fflush(f) == 0;
+        fclose(f);
+        result = ok && _disk_flush(tmp) == 0 && _disk_replace(tmp, ranges_file) == 0 ? 0 : -1;
+    }
+    if (result == 0) {
+        state->unsynced = 0;
+    } else {
+        log("assetstore: Failed to save progress of %s\n", state->asset_id);
+    }
+    free(part);
+    free(tmp);
+    free(ranges_file);
+    return result;
+}
+
+/// Reads the ranges saved by `_disk_save_ranges` into a new partial asset
+/// @return The asset's state, or NULL if there are no usable ranges
+static asset_state *_disk_load_ranges(asset_diskstore *disk, const char *asset_id, const char *hex, double last_used) {
+    char *ranges_file = _disk_file(disk, hex, ".ranges");
+    FILE *f = fopen(ranges_file, "r");
+    free(ranges_file);
+    if (f == NULL) return NULL;
+    
+    unsigned long long total_size = 0, start, end;
+    if (fscanf(f, "%llu", &total_size) != 1 || total_size == 0) {
+        fclose(f);
+        return NULL;
+    }
+    asset_state *state = _disk_add_entry(disk, asset_id, (size_t)total_size, 0, last_used);
+    while (fscanf(f, "%llu %llu", &start, &end) == 2) {
+        if (start < end && end <= total_size) {
+            _merge_range(state, start, end);
+        }
+    }
+    fclose(f);
+    return state;
+}
+
+static void _disk_found_file(asset_diskstore *disk, const char *name) {
+    char hex[ASSET_SHA256_HEX_LENGTH + 1] = {0};
+    strncpy(hex, name, ASSET_SHA256_HEX_LENGTH);
+    const char *suffix = name + strlen(hex);
+    char asset_id[sizeof(ASSET_SHA256_PREFIX) + ASSET_SHA256_HEX_LENGTH];
+    snprintf(asset_id, sizeof(asset_id), "%s%s", ASSET_SHA256_PREFIX, hex);
+    if (_disk_hex(asset_id) == NULL) return; // not ours
+    
+    char *file = _disk_file(disk, hex, suffix);
+    struct stat st;
+    if (stat(file, &st) != 0) {
+        free(file);
+        return;
+    }
+    // files found at startup are older than anything used this session, in the order they were last used
+    double last_used = disk->_interface->clock() - kCacheMinAge - (double)(time(NULL) - st.st_mtime);
+    
+    if (strcmp(suffix, "") == 0) {
+        if (_disk_entry(disk, asset_id) == NULL) {
+            _disk_add_entry(disk, asset_id, (size_t)st.st_size, 1, last_used);
+        }
+    } else if (strcmp(suffix, ".part") == 0) {
+        // a leftover from a download that finished, or one without usable ranges
+        if (_disk_entry(disk, asset_id) != NULL || _disk_load_ranges(disk, asset_id, hex, last_used) == NULL) {
+            remove(file);
+        }
+    } else if (strcmp(suffix, ".ranges") == 0) {
+        // only kept alongside its .part
+        char *part = _disk_file(disk, hex, ".part");
+        if (stat(part, &st) != 0) remove(file);
+        free(part);
+    } else {
+        remove(file); // e g a .ranges.tmp that was never renamed
+    }
+    free(file);
+}
+
+/// @return 1 if the file of a finished download has the hash in its id
+static int _disk_verify(asset_diskstore *disk, asset_state *state) {
+    const char *hex = _disk_hex(state->asset_id);
+    size_t size = (size_t)state->total_size;
+    char *part = _disk_file(disk, hex, ".part");
+    uint8_t *map = _disk_map(part, size);
+    free(part);
+    if (map == NULL) return 0;
+    
+    SHA256_CTX ctx;
+    sha256_init(&ctx);
+    for (size_t offset = 0; offset < size; offset += 64*1024*1024) {
+        size_t length = size - offset;
+        if (length > 64*1024*1024) length = 64*1024*1024;
+        sha256_update(&ctx, map + offset, (uint32_t)length);
+    }
+    uint8_t sha[SHA256_HASH_SIZE];
+    sha256_final(&ctx, sha);
+    _disk_unmap(map, size);
+    
+    char actual[ASSET_SHA256_HEX_LENGTH + 1];
+    for (int i = 0; i < SHA256_HASH_SIZE; i++) {
+        snprintf(actual + i*2, 3, "%02x", sha[i]);
+    }
+    return strcmp(actual, hex) == 0;
+}
+
+// -- assetstore functions
+
+int _diskstore_read(assetstore *store, const char *asset_id, size_t offset, uint8_t *buffer, size_t length, size_t *out_total_size) {
+    asset_diskstore *disk = _diskstore(store);
+    mtx_lock((mtx_t*)store->lock);
+    
+    asset_state *state = _disk_entry(disk, asset_id);
+    if (state == NULL) {
         mtx_unlock((mtx_t*)store->lock);
-        return 0;
+        return -1;
+    }
+    size_t size = (size_t)state->total_size;
+    *out_total_size = size;
+    if (offset >= size) {
+        mtx_unlock((mtx_t*)store->lock);
+        return -2;
+    }
+    length = min(length, size - offset);
+    
+    const char *hex = _disk_hex(asset_id);
+    int result = (int)length;
+    if (state->complete) {
+        if (state->map == NULL) {
+            char *file = _disk_file(disk, hex, "");
+            state->map = _disk_map(file, size);
+            free(file);
+        }
+        if (state->map) {
+            memcpy(buffer, state->map + offset, length);
+        } else {
+            result = -3;
+        }
+    } else {
+        char *part = _disk_file(disk, hex, ".part");
+        if (_disk_read_at(part, offset, buffer, length) != 0) {
+            result = -3;
+        }
+        free(part);
     }
+    _disk_touch(disk, state);
     
-    cJSON *complete = cJSON_GetObjectItemCaseSensitive(state, "complete");
-    if (!cJSON_IsBool(complete) || cJSON_IsFalse(complete)) {
+    mtx_unlock((mtx_t*)store->lock);
+    return result;
+}
+
+int _diskstore_write(assetstore *store, const char *asset_id, size_t offset, const uint8_t *data, size_t length, size_t total_size) {
+    assert(store);
+    assert(asset_id);
+    assert(data);
+    asset_diskstore *disk = _diskstore(store);
+    const char *hex = _disk_hex(asset_id);
+    if (hex == NULL) {
+        // can't be kept, but whoever does keep it still needs to know what's missing
+        return _assetstore_write(store, asset_id, offset, data, length, total_size);
+    }
+    if (offset + length > total_size) {
+        return -1;
+    }
+    
+    mtx_lock((mtx_t*)store->lock);
+    asset_state *state = _disk_entry(disk, asset_id);
+    if (state && state->complete) {
+        // already have all of it
+        _disk_touch(disk, state);
         mtx_unlock((mtx_t*)store->lock);
-        return 0;
+        return (int)length;
+    }
+    if (state == NULL) {
+        state = _disk_add_entry(disk, asset_id, total_size, 0, store->clock());
+        _disk_evict(disk);
     }
     
-    cJSON *file = cJSON_GetObjectItem(state, "data");
-    if (!cJSON_IsString(file)) {
+    char *part = _disk_file(disk, hex, ".part");
+    if (_disk_write_at(part, offset, data, length) != 0) {
+        log("assetstore: Failed to write %zu bytes of %s to %s\n", length, asset_id, part);
+        free(part);
         mtx_unlock((mtx_t*)store->lock);
-        return 0;
+        return -1;
+    }
+    
+    _merge_range(state, offset, (uint64_t)offset + length);
+    state->unsynced += length;
+    _lru_tag(store, state);
+    _update_asset_state(state);
+    
+    if (state->complete) {
+        // only complete once it's been checked and has its final name
+        char *file = _disk_file(disk, hex, "");
+        char *ranges_file = _disk_file(disk, hex, ".ranges");
+        if (!_disk_verify(disk, state)) {
+            log("assetstore: %s does not match its hash; discarding it\n", asset_id);
+            _disk_remove_entry(disk, state);
+            length = 0;
+        } else if (_disk_flush(part) != 0 || _disk_replace(part, file) != 0) {
+            log("assetstore: Failed to keep %s in %s; discarding it\n", asset_id, file);
+            _disk_remove_entry(disk, state);
+            length = 0;
+        } else {
+            remove(ranges_file);
+            _disk_touch(disk, state);
+        }
+        free(file);
+        free(ranges_file);
+    } else if (state->unsynced >= kDiskSyncBytes) {
+        _disk_save_ranges(disk, state);
     }
-    uint8_t *file_data = strtol(file->valuestring, NULL, 10);
+    free(part);
     
     mtx_unlock((mtx_t*)store->lock);
+    return length > 0 ? (int)length : -1;
+}
+
+int asset_diskstore_init(assetstore *store, const char *path, size_t max_bytes) {
+    if (_disk_mkdir(path) != 0) {
+        log("assetstore: Can't use %s for assets\n", path);
+        return -1;
+    }
+    assetstore_init(store, NULL);
     
-    return file_data;
+    asset_diskstore *disk = calloc(1, sizeof(asset_diskstore));
+    disk->_interface = store;
+    disk->path = strdup(path);
+    disk->max_bytes = max_bytes;
+    store->_impl = (void*)disk;
+    
+    store->get_missing_ranges = _memstore_get_missing_ranges;
+    store->get_state = _memstore_state;
+    store->read = _diskstore_read;
+    store->write = _diskstore_write;
+    
+    _disk_list(path, _disk_found_file, disk);
+    _disk_sort_lru(disk);
+    _disk_evict(disk);
+    log("assetstore: %zu assets on disk in %s using %zu of %zu bytes\n", disk->count, path, disk->used_bytes, max_bytes);
+    return 0;
+}
+
+int asset_diskstore_can_keep(const char *asset_id) {
+    return _disk_hex(asset_id) != NULL;
+}
+
+void asset_diskstore_deinit(assetstore *store) {
+    asset_diskstore *disk = _diskstore(store);
+    asset_states *states = _states(store);
+    for (size_t i = 0; i < states->bucket_count; i++) {
+        for (asset_state *state = states->buckets[i]; state; state = state->next_in_bucket) {
+            if (!state->on_disk) continue;
+            if (!state->complete && state->unsynced > 0) {
+                _disk_save_ranges(disk, state);
+            }
+            if (state->map) _disk_unmap(state->map, (size_t)state->total_size);
+            state->map = NULL;
+        }
+    }
+    free(disk->path);
+    free(disk);
+    store->_impl = NULL;
+    // the states go with the store
+    assetstore_deinit(store);
 }
@@ -0,0 +1,54 @@
+//
+//  atomics.h
+//  allonet
+//
+// The few atomic operations allonet needs, as C11 <stdatomic.h> where there is one,
+// and as Interlocked functions with MSVC, which doesn't have it.
+//
+
+#ifndef allo_atomics_h
+#define allo_atomics_h
+
+#include <stdint.h>
+
+#if defined(_MSC_VER)
+
+#include <windows.h>
+
+typedef volatile LONG allo_atomic_int;
+typedef volatile LONG64 allo_atomic_u64;
+typedef void * volatile allo_atomic_ptr;
+
+static inline int allo_atomic_int_load(allo_atomic_int *a) { return (int)InterlockedCompareExchange(a, 0, 0); }
+static inline void allo_atomic_int_store(allo_atomic_int *a, int value) { InterlockedExchange(a, value); }
+/// @return The value before adding
+static inline int allo_atomic_int_fetch_add(allo_atomic_int *a, int value) { return (int)InterlockedExchangeAdd(a, value); }
+
+static inline uint64_t allo_atomic_u64_load(allo_atomic_u64 *a) { return (uint64_t)InterlockedCompareExchange64(a, 0, 0); }
+static inline void allo_atomic_u64_store(allo_atomic_u64 *a, uint64_t value) { InterlockedExchange64(a, (LONG64)value); }
+
+static inline void *allo_atomic_ptr_load(allo_atomic_ptr *a) { return InterlockedCompareExchangePointer((void * volatile *)a, NULL, NULL); }
+static inline void allo_atomic_ptr_store(allo_atomic_ptr *a, void *value) { InterlockedExchangePointer((void * volatile *)a, value); }
+
+#else
+
+#include <stdatomic.h>
+
+typedef atomic_int allo_atomic_int;
+typedef _Atomic(uint64_t) allo_atomic_u64;
+typedef _Atomic(void *) allo_atomic_ptr;
+
+static inline int allo_atomic_int_load(allo_atomic_int *a) { return atomic_load(a); }
+static inline void allo_atomic_int_store(allo_atomic_int *a, int value) { atomic_store(a, value); }
+/// @return The value before adding
+static inline int allo_atomic_int_fetch_add(allo_atomic_int *a, int value) { return atomic_fetch_add(a, value); }
+
+static inline uint64_t allo_atomic_u64_load(allo_atomic_u64 *a) { return atomic_load(a); }
+static inline void allo_atomic_u64_store(allo_atomic_u64 *a, uint64_t value) { atomic_store(a, value); }
+
+static inline void *allo_atomic_ptr_load(allo_atomic_ptr *a) { return atomic_load(a); }
+static inline void allo_atomic_ptr_store(allo_atomic_ptr *a, void *value) { atomic_store(a, value); }
+
+#endif
+
+#endif /* allo_atomics_h */
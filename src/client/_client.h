@@ -6,6 +6,9 @@
 #include "../delta.h"
 #include "../media/media.h"
 #include <allonet/assetstore.h>
+#include "../asset.h"
+#include "../workpool.h"
+#include "../media/video/decode_queue.h"
 
 typedef struct interaction_queue {
     allo_interaction *interaction;
@@ -13,23 +16,53 @@ typedef struct interaction_queue {
 } interaction_queue;
 
 
+#define ALLO_INTERPOLATION_SAMPLE_COUNT 8
+
+typedef struct allo_transform_sample {
+    double time; // server time
+    allo_m4x4 matrix;
+} allo_transform_sample;
+
+/// ring buffer of the latest transforms of a single entity
+typedef struct allo_transform_history {
+    char *entity_id;
+    allo_transform_sample samples[ALLO_INTERPOLATION_SAMPLE_COUNT];
+    int head, count;
+} allo_transform_history;
+
+/// sorted by entity_id
+typedef arr_t(allo_transform_history) allo_transform_history_list;
+
 typedef struct {
-    mtx_t lock;
-    allo_media_track_list media_tracks;
+    allo_media_track_list *media_tracks;
 } alloclient_internal_shared;
 
 typedef struct {
     ENetHost *host;
     ENetPeer *peer;
     OpusEncoder *opus_encoder;
+    allo_audio_rate_controller *audio_rate; // how to configure opus_encoder for the current link
+    int64_t latest_audio_rate_ts;
     allo_client_intent *latest_intent;
     int64_t latest_intent_ts;
+    bool binary_intents; // place supports binary intents
+    uint32_t intent_seq; // latest binary intent sent
+    uint32_t intent_acked_seq; // latest binary intent the place says it has
+    uint32_t intent_part_changed_seq[ALLO_INTENT_PART_COUNT]; // intent_seq at which each allo_intent_part last changed
+    allo_client_intent *last_sent_intent;
     int64_t latest_clockreq_ts;
     char *avatar_id;
     statehistory_t history;
     scheduler jobs;
     assetstore assets; // asset state tracking
-    alloclient_internal_shared *shared; // only use this and derivates thereof within a  _alloclient_internal_shared_begin/_alloclient_internal_shared_end block
+    bool asset_cache; // assets is an asset_diskstore that keeps the bytes too
+    asset_transfers asset_transfers; // assets being downloaded
+    bool interpolation_enabled;
+    allo_transform_history_list transform_histories;
+    allo_workpool *audio_decoders; // created once audio arrives on more than one track at a time
+    arr_t(allo_media_track *) decode_batch; // tracks with audio waiting to be decoded
+    allo_video_decode_queue *video_decoders; // created when the first mjpeg frame arrives
+    alloclient_internal_shared *shared; // shared with the proxy client's thread; see allo_media_track_list for how to read tracks
 } alloclient_internal;
 
 static inline alloclient_internal *_internal(alloclient *client)
@@ -42,17 +75,20 @@ extern void _alloclient_media_track_find_or_create(alloclient *client, uint32_t
 /// Free up track resources
 extern void _alloclient_media_track_destroy(alloclient *client, uint32_t track_id);
 extern void _alloclient_parse_media(alloclient *client, unsigned char *data, size_t length);
+/// A message from the assets channel
+extern void _alloclient_handle_assets(alloclient *client, const uint8_t *data, size_t data_length);
 extern void _alloclient_send_audio(alloclient *client, int32_t track_id, const int16_t *pcm, size_t frameCount);
+/// Decode all audio received since last time, in parallel across tracks, and hand it to audio_callback
+extern void _alloclient_decode_audio(alloclient *client);
 extern void _alloclient_send_video(alloclient *client, int32_t track_id, allopicture *picture);
-
-
-static inline alloclient_internal_shared *_alloclient_internal_shared_begin(alloclient *client) {
-    alloclient_internal *cl = _internal(client);
-    mtx_lock(&cl->shared->lock);
-    return cl->shared;
-}
-
-static inline void _alloclient_internal_shared_end(alloclient *client) {
-    alloclient_internal *cl = _internal(client);
-    mtx_unlock(&cl->shared->lock);
-}
+/// Hand video decoded since last time to video_callback
+extern void _alloclient_deliver_video(alloclient *client);
+/// Hand a frame in a pooled buffer to video_picture_callback or video_callback, whichever the app uses
+extern void _alloclient_video_deliver(alloclient *client, uint32_t track_id, allopixel *pixels, int32_t wide, int32_t high);
+/// Set up what's common to all video formats, after the subsystem has set up the rest
+extern void _alloclient_video_track_initialize(allo_media_track *track, const cJSON *comp);
+/// A video packet, without the track id header
+extern void _alloclient_receive_video(alloclient *client, allo_media_track *track, unsigned char *data, size_t length);
+/// Remember new transforms from a state diff, if interpolation is enabled
+extern void _alloclient_interpolation_record(alloclient *client, allo_state_diff *diff);
+extern void _alloclient_interpolation_clear(alloclient *client);
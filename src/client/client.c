@@ -95,6 +95,7 @@ static void _handle_parsed_statediff(alloclient *client, cJSON *cmd, cJSON *stat
     }
 
     _alloclient_media_handle_statediff(client, diff);
+    _alloclient_interpolation_record(client, diff);
 
     // to debug state changes:
     //allo_state_diff_dump(diff);
@@ -133,6 +134,8 @@ static bool parse_interaction(alloclient *client, cJSON *inter_json)
         else
         {
             _internal(client)->avatar_id = allo_strdup(cJSON_GetStringValue(cJSON_GetArrayItem(body, 1)));
+            cJSON *features = cJSON_GetArrayItem(body, 3);
+            _internal(client)->binary_intents = cJSON_IsArray(features) && cjson_find_in_array(features, "intent.binary") != -1;
         }
     }
     allo_interaction *interaction = allo_interaction_create(type, from, to, request_id, bodystr);
@@ -179,7 +182,9 @@ static void _asset_send_func(asset_mid mid, const cJSON *header, const uint8_t *
     }
     
     ENetPacket *packet = asset_build_enet_packet(mid, header, data, data_length);
-    allo_enet_peer_send(peer, CHANNEL_ASSETS, packet);
+    if (allo_enet_peer_send(peer, CHANNEL_ASSETS, packet) != 0) {
+        enet_packet_destroy(packet);
+    }
 }
 
 static void _asset_request_bytes_func(const char *asset_id, size_t offset, size_t length, void *user) {
@@ -202,9 +207,25 @@ static void _asset_request_bytes_func(const char *asset_id, size_t offset, size_
     }
 }
 
+/// Whether `asset_id` is kept in the disk cache, rather than handled as if there were none
+static bool _asset_is_cached(alloclient *client, const char *asset_id) {
+    return _internal(client)->asset_cache && asset_id && asset_diskstore_can_keep(asset_id);
+}
+
+/// The store that knows which bytes of `asset_id` have arrived, if any does. Picked per transfer as it starts.
+static assetstore *_asset_transfer_store(const char *asset_id, void *user) {
+    alloclient *client = (alloclient *)user;
+    // if the app keeps the bytes, the store doesn't know which of them are missing
+    bool store_knows = _asset_is_cached(client, asset_id) || !client->asset_receive_callback;
+    return store_knows ? &(_internal(client)->assets) : NULL;
+}
+
 static int _asset_write_func(const char *asset_id, const uint8_t *buffer, size_t offset, size_t length, size_t total_size, void *user) {
     alloclient *client = (alloclient *)user;
-    if (client->asset_receive_callback) {
+    if (_asset_is_cached(client, asset_id)) {
+        // the app gets all of it from the cache once it's complete, including what was there from before
+        return assetstore_write(&(_internal(client)->assets), asset_id, offset, buffer, length, total_size);
+    } else if (client->asset_receive_callback) {
         client->asset_receive_callback(client, asset_id, buffer, offset, length, total_size);
         return length;
     } else {
@@ -212,16 +233,94 @@ static int _asset_write_func(const char *asset_id, const uint8_t *buffer, size_t
     }
 }
 
-static void _asset_state_callback_func(const char *asset_id, asset_state state, void *user) {
-    alloclient *client = (alloclient *)user;
+static void _asset_notify(alloclient *client, const char *asset_id, asset_state state) {
     if (client->asset_state_callback) {
         client->asset_state_callback(client, asset_id, state);
     }
 }
 
-static void handle_assets(const uint8_t *data, size_t data_length, alloclient *client) {
+typedef struct cached_asset_delivery {
+    alloclient *client;
+    char *asset_id;
+    char *entity_id;
+    size_t offset;
+} cached_asset_delivery;
+
+static void _cached_asset_delivery_free(cached_asset_delivery *delivery) {
+    free(delivery->asset_id);
+    free(delivery->entity_id);
+    free(delivery);
+}
+
+/// A job that hands a cached asset to the app from alloclient_poll as if it had arrived from the
+/// place, a transfer window's worth of chunks per poll
+static bool _deliver_cached_asset(void *data) {
+    cached_asset_delivery *delivery = (cached_asset_delivery *)data;
+    alloclient *client = delivery->client;
+    bool done = client->asset_receive_callback == NULL; // otherwise the store is all there is
+    bool evicted = false;
+    if (!done) {
+        uint8_t *buffer = malloc(ASSET_CHUNK_SIZE);
+        for (int i = 0; i < ASSET_WINDOW_SIZE && !done && !evicted; i++) {
+            size_t total_size = 0;
+            int read_bytes = assetstore_read(&_internal(client)->assets, delivery->asset_id, delivery->offset, buffer, ASSET_CHUNK_SIZE, &total_size);
+            if (read_bytes <= 0) {
+                evicted = true;
+                break;
+            }
+            client->asset_receive_callback(client, delivery->asset_id, buffer, delivery->offset, read_bytes, total_size);
+            delivery->offset += read_bytes;
+            done = delivery->offset >= total_size;
+        }
+        free(buffer);
+    }
+    if (evicted) {
+        // removed from the cache since it was asked for, so get it from the place after all
+        asset_request(delivery->asset_id, delivery->entity_id, &_internal(client)->asset_transfers, _asset_send_func, (void*)client);
+    } else if (done) {
+        _asset_notify(client, delivery->asset_id, asset_state_now_available);
+    }
+    if (done || evicted) {
+        _cached_asset_delivery_free(delivery);
+        return false;
+    }
+    return true;
+}
+
+/// Hand the app all of a complete asset from the cache, over the next few alloclient_polls
+static void _deliver_from_cache(alloclient *client, const char *asset_id, const char *entity_id) {
+    cached_asset_delivery *delivery = calloc(1, sizeof(cached_asset_delivery));
+    delivery->client = client;
+    delivery->asset_id = strdup(asset_id);
+    delivery->entity_id = entity_id ? strdup(entity_id) : NULL;
+    scheduler_add(&_internal(client)->jobs, delivery, _deliver_cached_asset);
+}
+
+static void _cancel_cached_asset_deliveries(alloclient *client) {
+    scheduler *jobs = &_internal(client)->jobs;
+    for (size_t i = 0; i < jobs->jobs.length; i++) {
+        if (jobs->jobs.data[i].work == _deliver_cached_asset) {
+            _cached_asset_delivery_free((cached_asset_delivery *)jobs->jobs.data[i].data);
+        }
+    }
+    scheduler_remove_all(jobs);
+}
+
+static void _asset_state_callback_func(const char *asset_id, asset_state state, void *user) {
+    alloclient *client = (alloclient *)user;
+    if (state == asset_state_now_available && client->asset_receive_callback && _asset_is_cached(client, asset_id)) {
+        // only the bytes that were missing arrived, so the rest has to come from the cache too
+        _deliver_from_cache(client, asset_id, NULL);
+        return;
+    }
+    _asset_notify(client, asset_id, state);
+}
+
+void _alloclient_handle_assets(alloclient *client, const uint8_t *data, size_t data_length) {
     asset_handle(
         data, data_length,
+        &_internal(client)->asset_transfers,
+        NULL, // everything comes from the server
         _asset_request_bytes_func,
         _asset_write_func,
         _asset_send_func,
@@ -240,7 +339,19 @@ static bool parse_packet_from_channel(alloclient *client, ENetPacket *packet, al
     
     switch(channel) {
     case CHANNEL_STATEDIFFS: {
-        cJSON *cmdrep = cJSON_ParseWithLengthOpts((const char*)(packet->data), packet->dataLength, NULL, 0);
+        const uint8_t *data = packet->data;
+        size_t length = packet->dataLength;
+        if(length >= 5 && data[0] == ALLO_INTENT_ACK_MAGIC) {
+            uint32_t ack;
+            memcpy(&ack, data + 1, sizeof(ack));
+            ack = ntohl(ack);
+            if(ack > _internal(client)->intent_acked_seq && ack <= _internal(client)->intent_seq) {
+                _internal(client)->intent_acked_seq = ack;
+            }
+            data += 5;
+            length -= 5;
+        }
+        cJSON *cmdrep = cJSON_ParseWithLengthOpts((const char*)data, length, NULL, 0);
         if(!cmdrep) {
             client_log(ALLO_LOG_ERROR, client, "alloclient: unparseable statediff:\n%s", packet->data);
             assert(cmdrep);
@@ -255,7 +366,7 @@ static bool parse_packet_from_channel(alloclient *client, ENetPacket *packet, al
         cJSON_Delete(cmdrep);
         break; }
     case CHANNEL_ASSETS: {
-        handle_assets(packet->data, packet->dataLength, client);
+        _alloclient_handle_assets(client, packet->data, packet->dataLength);
         } break;
     case CHANNEL_AUDIO:
     case CHANNEL_VIDEO: {
@@ -271,6 +382,32 @@ static bool parse_packet_from_channel(alloclient *client, ENetPacket *packet, al
     return remain;
 }
 
+/// Like enet_host_service, but decodes the audio that has arrived so far before waiting for more.
+/// That way everything that arrives together is decoded together, in parallel, and none of it
+/// waits for the whole poll timeout. Same for video that has finished decoding.
+static int service(alloclient *client, ENetEvent *event, int64_t timeout)
+{
+    int result = enet_host_service(_internal(client)->host, event, 0);
+    if (result != 0 || timeout <= 0) return result;
+    _alloclient_decode_audio(client);
+    _alloclient_deliver_video(client);
+    return enet_host_service(_internal(client)->host, event, (enet_uint32)timeout);
+}
+
+static void update_audio_rate(alloclient *client)
+{
+    ENetPeer *peer = _internal(client)->peer;
+    allo_audio_link_stats stats;
+    // ENet's smoothed loss, or what's been lost since it last took stock if that's worse
+    stats.loss = peer->packetLoss / (double)ENET_PEER_PACKET_LOSS_SCALE;
+    if (peer->packetsSent > 0 && peer->packetsLost / (double)peer->packetsSent > stats.loss) {
+        stats.loss = peer->packetsLost / (double)peer->packetsSent;
+    }
+    stats.rtt = peer->roundTripTime / 1000.0;
+    stats.throttle = peer->packetThrottle / (double)ENET_PEER_PACKET_THROTTLE_SCALE;
+    allo_audio_rate_update(_internal(client)->audio_rate, &stats);
+}
+
 bool alloclient_poll(alloclient *client, int timeout_ms)
 {
     return client->alloclient_poll(client, timeout_ms);
@@ -299,12 +436,19 @@ bool _alloclient_poll(alloclient *client, int timeout_ms)
         _internal(client)->latest_intent_ts = ts;
     }
     
+    // retune outgoing audio to the link at 2hz
+    if(ts > _internal(client)->latest_audio_rate_ts + 500 && _internal(client)->audio_rate)
+    {
+        update_audio_rate(client);
+        _internal(client)->latest_audio_rate_ts = ts;
+    }
+    
     ts = get_ts_mono();
     int64_t servicing_timeout = deadline - ts < 0 ? 0 : deadline - ts;
     ENetEvent event;
     bool any_messages = false;
     ENetPacket *lastDiffPacket = 0;
-    while (enet_host_service(_internal(client)->host, & event, servicing_timeout) > 0)
+    while (service(client, &event, servicing_timeout) > 0)
     {
         switch (event.type)
         {
@@ -351,6 +495,10 @@ bool _alloclient_poll(alloclient *client, int timeout_ms)
         enet_packet_destroy(lastDiffPacket);
         lastDiffPacket = 0;
     }
+    _alloclient_decode_audio(client);
+    _alloclient_deliver_video(client);
+    scheduler_tick(&_internal(client)->jobs);
+    _media_tracks_reclaim(_internal(client)->shared->media_tracks);
     return any_messages;
 }
 
@@ -366,9 +514,47 @@ static void _alloclient_set_intent(alloclient* client, const allo_client_intent
     _internal(client)->latest_intent->ack_state_rev = ack_state_rev;
 }
 
+static void send_latest_binary_intent(alloclient *client)
+{
+    alloclient_internal *cl = _internal(client);
+    allo_client_intent *intent = cl->latest_intent;
+    uint32_t seq = ++cl->intent_seq;
+
+    if(cl->last_sent_intent == NULL)
+    {
+        cl->last_sent_intent = allo_client_intent_create();
+    }
+    uint16_t changed = allo_client_intent_changed_parts(intent, cl->last_sent_intent);
+    uint16_t mask = 0;
+    for(int i = 0; i < ALLO_INTENT_PART_COUNT; i++)
+    {
+        if(changed & (1 << i)) cl->intent_part_changed_seq[i] = seq;
+        // only leave out parts that the place has seen in their current form
+        if(cl->intent_acked_seq == 0 || cl->intent_part_changed_seq[i] > cl->intent_acked_seq) mask |= 1 << i;
+    }
+
+    uint8_t buffer[ALLO_INTENT_BINARY_MAX_SIZE];
+    size_t length = allo_client_intent_encode_binary(intent, mask, seq, cl->intent_acked_seq, buffer, sizeof(buffer));
+    assert(length > 0);
+    ENetPacket *packet = enet_packet_create(buffer, length, 0 /* unreliable */);
+    if (allo_enet_peer_send(cl->peer, CHANNEL_STATEDIFFS, packet) != 0) {
+        enet_packet_destroy(packet);
+    }
+
+    if(changed)
+    {
+        allo_client_intent_clone(intent, cl->last_sent_intent);
+    }
+}
+
 static void send_latest_intent(alloclient *client)
 {
     allo_client_intent *intent = _internal(client)->latest_intent;
+    if(_internal(client)->binary_intents)
+    {
+        send_latest_binary_intent(client);
+        return;
+    }
 
     //printf("%s Sending latest intent, ACKing rev %zd.\n", _internal(client)->avatar_id, _internal(client)->latest_intent->ack_state_rev);
 
@@ -383,7 +569,9 @@ static void send_latest_intent(alloclient *client)
     int jsonlength = strlen(json);
     ENetPacket *packet = enet_packet_create(NULL, jsonlength, 0 /* unreliable */);
     memcpy(packet->data, json, jsonlength);
-    allo_enet_peer_send(_internal(client)->peer, CHANNEL_STATEDIFFS, packet);
+    if (allo_enet_peer_send(_internal(client)->peer, CHANNEL_STATEDIFFS, packet) != 0) {
+        enet_packet_destroy(packet);
+    }
     free((void*)json);
 }
 
@@ -400,7 +588,9 @@ static void send_clock_request(alloclient *client)
     ENetPacket *packet = enet_packet_create(NULL, jsonlength, 0 /* unreliable */);
     memcpy(packet->data, json, jsonlength);
     free((void*)json);
-    allo_enet_peer_send(_internal(client)->peer, CHANNEL_CLOCK, packet);
+    if (allo_enet_peer_send(_internal(client)->peer, CHANNEL_CLOCK, packet) != 0) {
+        enet_packet_destroy(packet);
+    }
 }
 
 void alloclient_send_interaction(alloclient *client, allo_interaction *interaction)
@@ -425,7 +615,9 @@ static void _alloclient_send_interaction(alloclient *client, allo_interaction *i
     ENetPacket *packet = enet_packet_create(NULL, jsonlength, ENET_PACKET_FLAG_RELIABLE);
     memcpy(packet->data, json, jsonlength);
     free((void*)json);
-    allo_enet_peer_send(_internal(client)->peer, CHANNEL_COMMANDS, packet);
+    if (allo_enet_peer_send(_internal(client)->peer, CHANNEL_COMMANDS, packet) != 0) {
+        enet_packet_destroy(packet);
+    }
 }
 
 void alloclient_disconnect(alloclient *client, int reason)
@@ -459,8 +651,22 @@ static void _alloclient_disconnect(alloclient *client, int reason)
         }
         enet_host_destroy(_internal(client)->host);
         opus_encoder_destroy(_internal(client)->opus_encoder);
+        allo_audio_rate_controller_destroy(_internal(client)->audio_rate);
+        if(_internal(client)->audio_decoders) allo_workpool_destroy(_internal(client)->audio_decoders);
+        arr_free(&_internal(client)->decode_batch);
+        allo_video_decode_queue_destroy(_internal(client)->video_decoders);
         allo_client_intent_free(_internal(client)->latest_intent);
+        if(_internal(client)->last_sent_intent) allo_client_intent_free(_internal(client)->last_sent_intent);
         allo_delta_clear(&_internal(client)->history);
+        asset_transfers_deinit(&_internal(client)->asset_transfers);
+        _cancel_cached_asset_deliveries(client);
+        arr_free(&_internal(client)->jobs.jobs);
+        if (_internal(client)->asset_cache) {
+            asset_diskstore_deinit(&_internal(client)->assets);
+        } else {
+            assetstore_deinit(&_internal(client)->assets);
+        }
+        _alloclient_interpolation_clear(client);
         free(_internal(client)->avatar_id);
         free(_internal(client));
     }
@@ -478,9 +684,12 @@ static bool announce(alloclient *client, const char *identity, const char *avata
         cJSON_Parse(identity),
         cJSON_CreateString("spawn_avatar"),
         cJSON_Parse(avatar_desc),
+        // optional protocol features we support
+        cJSON_CreateString("features"),
+        cjson_create_list(cJSON_CreateString("audio.sequenced"), cJSON_CreateString("video.fragmented"), NULL),
         NULL
     );
-    if(cJSON_GetArraySize(bodyobj) != 7)
+    if(cJSON_GetArraySize(bodyobj) != 9)
     {
         client_log(ALLO_LOG_ERROR, client, "Invalid identity or avatar_desc (must be json), disconnecting.", NULL);
         return false;
@@ -585,6 +794,10 @@ static bool _alloclient_connect(alloclient *client, const char *url, const char
         client_log(ALLO_LOG_ERROR, client, "Encoder creation failed: %d.", error);
         return false;
     }
+    // audio is sent unreliably, so put enough of each frame into the next one to rebuild it if it's lost.
+    // How much, and at what bitrate, follows the link; see update_audio_rate.
+    opus_encoder_ctl(_internal(client)->opus_encoder, OPUS_SET_INBAND_FEC(1));
+    _internal(client)->audio_rate = allo_audio_rate_controller_create();
 
     if(!announce(client, identity, avatar_desc))
     {
@@ -701,16 +914,32 @@ static void _alloclient_get_stats(alloclient* client, char *buffer, size_t buffe
     int len = strlen(buffer);
     bufferlen -= len;
     buffer += len;
-    alloclient_internal_shared *shared = _alloclient_internal_shared_begin(client);
-    allo_media_get_stats(&shared->media_tracks, buffer, bufferlen);
-    _alloclient_internal_shared_end(client);
+    allo_media_get_stats(_internal(client)->shared->media_tracks, buffer, bufferlen);
+}
+
+int alloclient_get_event_fd(alloclient* client)
+{
+    return client->alloclient_get_event_fd(client);
+}
+static int _alloclient_get_event_fd(alloclient* client)
+{
+    if (_internal(client)->host == NULL)
+    {
+        return -1;
+    }
+    return (int)_internal(client)->host->socket;
 }
 
 void alloclient_asset_request(alloclient* client, const char* asset_id, const char* entity_id) {
     client->alloclient_asset_request(client, asset_id, entity_id);
 }
 static void _alloclient_asset_request(alloclient* client, const char* asset_id, const char* entity_id) {
-    asset_request(asset_id, entity_id, _asset_send_func, (void*)client);
+    if (_asset_is_cached(client, asset_id) && assetstore_get_is_asset_complete(&_internal(client)->assets, asset_id)) {
+        // already on disk, but the app expects it to arrive later like everything else
+        _deliver_from_cache(client, asset_id, entity_id);
+        return;
+    }
+    asset_request(asset_id, entity_id, &_internal(client)->asset_transfers, _asset_send_func, (void*)client);
 }
 
 void alloclient_asset_send(alloclient *client, const char *asset_id, const uint8_t *data, size_t offset, size_t length, size_t total_size) {
@@ -721,12 +950,30 @@ static void _alloclient_asset_send(alloclient *client, const char *asset_id, con
     asset_deliver_bytes(asset_id, data, offset, length, total_size, _asset_send_func, (void*)client);
 }
 
+void alloclient_set_asset_cache(alloclient *client, const char *path, size_t max_bytes) {
+    client->alloclient_set_asset_cache(client, path, max_bytes);
+}
+static void _alloclient_set_asset_cache(alloclient *client, const char *path, size_t max_bytes) {
+    if (_internal(client)->asset_cache) {
+        asset_diskstore_deinit(&_internal(client)->assets);
+    } else {
+        assetstore_deinit(&_internal(client)->assets);
+    }
+    _internal(client)->asset_cache = asset_diskstore_init(&_internal(client)->assets, path, max_bytes) == 0;
+    if (!_internal(client)->asset_cache) {
+        client_log(ALLO_LOG_ERROR, client, "Can't keep assets in %s", path);
+        assetstore_init(&_internal(client)->assets, NULL);
+    }
+}
+
 alloclient *_alloclient_create()
 {
     alloclient *client = (alloclient*)calloc(1, sizeof(alloclient));
     client->_internal = calloc(1, sizeof(alloclient_internal));
     _internal(client)->latest_intent = allo_client_intent_create();
-    assetstore_init(&(_internal(client)->assets));
+    assetstore_init(&(_internal(client)->assets), NULL);
+    asset_transfers_init(&_internal(client)->asset_transfers, &(_internal(client)->assets));
+    _internal(client)->asset_transfers.store_for = _asset_transfer_store;
     
     scheduler_init(&_internal(client)->jobs);
     
@@ -742,6 +989,7 @@ alloclient *_alloclient_create()
     client->alloclient_simulate = _alloclient_simulate;
     client->alloclient_get_time = _alloclient_get_time;
     client->alloclient_get_stats = _alloclient_get_stats;
+    client->alloclient_get_event_fd = _alloclient_get_event_fd;
     client->asset_request_bytes_callback = NULL;
     client->asset_receive_callback = NULL;
     client->asset_state_callback = NULL;
@@ -750,6 +998,7 @@ alloclient *_alloclient_create()
     // assets
     client->alloclient_asset_request = _alloclient_asset_request;
     client->alloclient_asset_send = _alloclient_asset_send;
+    client->alloclient_set_asset_cache = _alloclient_set_asset_cache;
     
     return client;
 }
@@ -765,8 +1014,7 @@ alloclient *alloclient_create(bool threaded) {
     
     alloclient *client = _alloclient_create();
     alloclient_internal_shared *shared = malloc(sizeof(alloclient_internal_shared));
-    mtx_init(&shared->lock, mtx_plain);
-    arr_init(&shared->media_tracks);
+    shared->media_tracks = _media_tracks_create();
     _internal(client)->shared = shared;
     
     return client;
@@ -804,6 +1052,9 @@ int allopicture_bpp(allopicture_format fmt)
         case allopicture_format_xrgb8888:
         case allopicture_format_bgra8888:
             return 4;
+        case allopicture_format_yuv420p:
+        case allopicture_format_nv12:
+            return 1;
     }
     return 0;
 }
@@ -0,0 +1,219 @@
+#include "_client.h"
+#include <allonet/arr.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "../util.h"
+
+/**
+ * Client-side transform interpolation.
+ * The place only sends state at a few Hz. If enabled, we keep the last few
+ * transforms of every entity, stamped with (estimated) server time of when
+ * they were sent, so that the app can render a bit in the past and get smooth
+ * motion between updates, and a bounded guess into the future if updates are late.
+ * The place only sends transforms that changed, so every state we get also re-stamps the
+ * transforms that didn't: an entity that has stood still then starts moving from where it
+ * stood one state ago, rather than sliding there from whenever it last moved.
+ */
+
+static int _history_compare(const void *key, const void *element)
+{
+    return strcmp((const char*)key, ((const allo_transform_history*)element)->entity_id);
+}
+
+static allo_transform_history *_history_find(allo_transform_history_list *list, const char *entity_id, size_t *insertion_index)
+{
+    // binary search, since we're called once per entity per rendered frame
+    size_t lo = 0, hi = list->length;
+    while(lo < hi)
+    {
+        size_t mid = lo + (hi - lo)/2;
+        int cmp = _history_compare(entity_id, &list->data[mid]);
+        if(cmp == 0) return &list->data[mid];
+        if(cmp < 0) hi = mid;
+        else lo = mid + 1;
+    }
+    if(insertion_index) *insertion_index = lo;
+    return NULL;
+}
+
+static allo_transform_history *_history_find_or_create(allo_transform_history_list *list, const char *entity_id)
+{
+    size_t index = 0;
+    allo_transform_history *history = _history_find(list, entity_id, &index);
+    if(history) return history;
+
+    arr_reserve(list, list->length + 1);
+    memmove(list->data + index + 1, list->data + index, (list->length - index) * sizeof(*list->data));
+    list->length++;
+    history = &list->data[index];
+    memset(history, 0, sizeof(*history));
+    history->entity_id = allo_strdup(entity_id);
+    return history;
+}
+
+static void _history_remove(allo_transform_history_list *list, const char *entity_id)
+{
+    allo_transform_history *history = _history_find(list, entity_id, NULL);
+    if(!history) return;
+    free(history->entity_id);
+    arr_splice(list, history - list->data, 1);
+}
+
+static void _history_push(allo_transform_history *history, double time, allo_m4x4 matrix)
+{
+    if(history->count > 0)
+    {
+        allo_transform_sample *newest = &history->samples[(history->head + history->count - 1) % ALLO_INTERPOLATION_SAMPLE_COUNT];
+        if(time <= newest->time)
+        {
+            // several updates within the same clock tick; the later one wins
+            newest->matrix = matrix;
+            return;
+        }
+    }
+    if(history->count == ALLO_INTERPOLATION_SAMPLE_COUNT)
+    {
+        history->head = (history->head + 1) % ALLO_INTERPOLATION_SAMPLE_COUNT;
+        history->count--;
+    }
+    history->samples[(history->head + history->count) % ALLO_INTERPOLATION_SAMPLE_COUNT] = (allo_transform_sample){time, matrix};
+    history->count++;
+}
+
+static const allo_transform_sample *_history_sample(const allo_transform_history *history, int i)
+{
+    return &history->samples[(history->head + i) % ALLO_INTERPOLATION_SAMPLE_COUNT];
+}
+
+static allo_vector _column(allo_m4x4 m, int c)
+{
+    return (allo_vector){{m.v[c*4+0], m.v[c*4+1], m.v[c*4+2]}};
+}
+
+static void _set_column(allo_m4x4 *m, int c, allo_vector v)
+{
+    m->v[c*4+0] = v.x; m->v[c*4+1] = v.y; m->v[c*4+2] = v.z;
+}
+
+/// Blend from a (fraction 0) to b (fraction 1), or beyond b if fraction > 1.
+/// Plain element-wise interpolation shrinks and shears rotations, so re-orthogonalize
+/// the basis afterwards and give it the interpolated scale instead.
+static allo_m4x4 _blend(allo_m4x4 a, allo_m4x4 b, double fraction)
+{
+    allo_m4x4 out = allo_m4x4_interpolate(b, a, fraction);
+
+    double scales[3];
+    for(int c = 0; c < 3; c++)
+    {
+        double sa = allo_vector_length(_column(a, c));
+        double sb = allo_vector_length(_column(b, c));
+        scales[c] = sa + (sb - sa) * fraction;
+    }
+    allo_vector x = _column(out, 0), y = _column(out, 1), z = _column(out, 2);
+    if(allo_vector_length(x) < 1e-9 || allo_vector_length(y) < 1e-9 || allo_vector_length(z) < 1e-9)
+    {
+        // (near) half-turn between samples; can't do better than linear
+        return out;
+    }
+    x = allo_vector_normalize(x);
+    y = allo_vector_subtract(y, allo_vector_scale(x, allo_vector_dot(x, y)));
+    if(allo_vector_length(y) < 1e-9) return out;
+    y = allo_vector_normalize(y);
+    z = allo_vector_subtract(z, allo_vector_scale(x, allo_vector_dot(x, z)));
+    z = allo_vector_subtract(z, allo_vector_scale(y, allo_vector_dot(y, z)));
+    if(allo_vector_length(z) < 1e-9) return out;
+    z = allo_vector_normalize(z);
+
+    _set_column(&out, 0, allo_vector_scale(x, scales[0]));
+    _set_column(&out, 1, allo_vector_scale(y, scales[1]));
+    _set_column(&out, 2, allo_vector_scale(z, scales[2]));
+    return out;
+}
+
+void _alloclient_interpolation_record(alloclient *client, allo_state_diff *diff)
+{
+    alloclient_internal *cl = _internal(client);
+    if(!cl->interpolation_enabled) return;
+
+    // server time at which the place sent this state, as best we know
+    double time = alloclient_get_time(client) - client->clock_latency;
+    allo_component_vec *vecs[] = {&diff->new_components, &diff->updated_components};
+    for(int v = 0; v < 2; v++)
+    {
+        for(size_t i = 0; i < vecs[v]->length; i++)
+        {
+            allo_component_ref *ref = &vecs[v]->data[i];
+            if(strcmp(ref->name, "transform") != 0) continue;
+            allo_entity *entity = state_get_entity(&client->_state, ref->eid);
+            if(!entity) continue;
+            allo_transform_history *history = _history_find_or_create(&cl->transform_histories, ref->eid);
+            _history_push(history, time, entity_get_transform(entity));
+        }
+    }
+    for(size_t i = 0; i < diff->deleted_entities.length; i++)
+    {
+        _history_remove(&cl->transform_histories, diff->deleted_entities.data[i]);
+    }
+    for(size_t i = 0; i < cl->transform_histories.length; i++)
+    {
+        allo_transform_history *history = &cl->transform_histories.data[i];
+        const allo_transform_sample *newest = _history_sample(history, history->count - 1);
+        if(newest->time < time)
+        {
+            _history_push(history, time, newest->matrix);
+        }
+    }
+}
+
+void _alloclient_interpolation_clear(alloclient *client)
+{
+    allo_transform_history_list *list = &_internal(client)->transform_histories;
+    for(size_t i = 0; i < list->length; i++)
+    {
+        free(list->data[i].entity_id);
+    }
+    arr_free(list);
+    arr_init(list);
+}
+
+void alloclient_set_interpolation_enabled(alloclient *client, bool enabled)
+{
+    _internal(client)->interpolation_enabled = enabled;
+    if(!enabled)
+    {
+        _alloclient_interpolation_clear(client);
+    }
+}
+
+allo_m4x4 alloclient_get_interpolated_transform(alloclient *client, allo_entity *entity, double render_time)
+{
+    if(!entity) return allo_m4x4_identity();
+    allo_transform_history *history = _history_find(&_internal(client)->transform_histories, entity->id, NULL);
+    if(!history || history->count < 2)
+    {
+        return entity_get_transform(entity);
+    }
+
+    const allo_transform_sample *oldest = _history_sample(history, 0);
+    if(render_time <= oldest->time)
+    {
+        return oldest->matrix;
+    }
+
+    for(int i = 1; i < history->count; i++)
+    {
+        const allo_transform_sample *from = _history_sample(history, i-1);
+        const allo_transform_sample *to = _history_sample(history, i);
+        if(render_time <= to->time)
+        {
+            return _blend(from->matrix, to->matrix, (render_time - from->time) / (to->time - from->time));
+        }
+    }
+
+    // past the newest sample: continue the latest motion, but not for long
+    const allo_transform_sample *from = _history_sample(history, history->count-2);
+    const allo_transform_sample *to = _history_sample(history, history->count-1);
+    double extrapolated_time = fmin(render_time, to->time + ALLO_INTERPOLATION_MAX_EXTRAPOLATION);
+    return _blend(from->matrix, to->matrix, (extrapolated_time - from->time) / (to->time - from->time));
+}
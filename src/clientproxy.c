@@ -6,6 +6,17 @@
 #include "threading.h"
 #include "util.h"
 #include "inlinesys/queue.h"
+#include "media/audio/jitter.h"
+#include "media/audio/pcm_pool.h"
+#include "media/video/pixel_pool.h"
+#if defined(__linux__)
+    #include <sys/eventfd.h>
+    #include <unistd.h>
+    #include <fcntl.h>
+#elif !defined(_WIN32)
+    #include <unistd.h>
+    #include <fcntl.h>
+#endif
 
 // internals in client.c
 int64_t alloclient_parse_statediff(alloclient *client, cJSON *cmd);
@@ -13,6 +24,7 @@ void alloclient_ack_rev(alloclient *client, int64_t rev);
 
 // forwards in this file
 static void bridge_disconnected_callback(alloclient *bridgeclient, alloerror code, const char *message);
+static bool bridge_video_picture_callback(alloclient *bridgeclient, uint32_t track_id, allopicture *picture);
 
 /**
  * This file proxies the network client to its own thread.
@@ -39,6 +51,7 @@ typedef enum
     
     msg_asset_request,
     msg_asset_send_data,
+    msg_asset_cache,
     msg_asset_state_callback,
     msg_asset_receive_callback,
     msg_asset_request_bytes_callback,
@@ -57,6 +70,7 @@ typedef struct proxy_message
             char *url;
             char *identity;
             char *avatar_desc;
+            bool pictures;
         } connect;
         allo_interaction *interaction;
         allo_client_intent *intent;
@@ -107,6 +121,11 @@ typedef struct proxy_message
             char *asset_id;
             size_t offset, length;
         } asset_request_bytes;
+        
+        struct {
+            char *path;
+            size_t max_bytes;
+        } asset_cache;
     } value;
     STAILQ_ENTRY(proxy_message) entries;
 } proxy_message;
@@ -132,6 +151,10 @@ typedef struct {
     int32_t proxy_to_bridge_len;
     proxy_message_stailq bridge_to_proxy;
     int32_t bridge_to_proxy_len;
+    // readable whenever bridge_to_proxy is non-empty. -1 if unsupported.
+    int event_fd;
+    // write end of event_fd when it's a pipe rather than an eventfd
+    int event_write_fd;
 } clientproxy_internal;
 
 static clientproxy_internal *_internal(alloclient *client)
@@ -139,6 +162,84 @@ static clientproxy_internal *_internal(alloclient *client)
     return (clientproxy_internal*)client->_internal2;
 }
 
+//////// Readiness handle for hosts that want to integrate with their own run loop
+
+static void event_fd_create(clientproxy_internal *internal)
+{
+    internal->event_fd = internal->event_write_fd = -1;
+#if defined(__linux__)
+    internal->event_fd = internal->event_write_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#elif !defined(_WIN32)
+    int fds[2];
+    if(pipe(fds) == 0)
+    {
+        for(int i = 0; i < 2; i++)
+        {
+            fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+            fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+        }
+        internal->event_fd = fds[0];
+        internal->event_write_fd = fds[1];
+    }
+#endif
+    if(internal->event_fd == -1)
+    {
+        fprintf(stderr, "alloclient[clientproxy]: no event fd available on this platform, hosts must poll on a timer\n");
+    }
+}
+
+static void event_fd_destroy(clientproxy_internal *internal)
+{
+#if !defined(_WIN32)
+    if(internal->event_write_fd != -1 && internal->event_write_fd != internal->event_fd)
+    {
+        close(internal->event_write_fd);
+    }
+    if(internal->event_fd != -1)
+    {
+        close(internal->event_fd);
+    }
+#endif
+    internal->event_fd = internal->event_write_fd = -1;
+}
+
+// call with bridge_to_proxy_mtx held
+static void event_fd_signal(clientproxy_internal *internal)
+{
+#if defined(__linux__)
+    if(internal->event_fd == -1) return;
+    uint64_t one = 1;
+    // EAGAIN means the counter is saturated, i e already readable; good enough
+    ssize_t written = write(internal->event_fd, &one, sizeof(one));
+    (void)written;
+#elif !defined(_WIN32)
+    if(internal->event_write_fd == -1) return;
+    // a full pipe is already readable, so a failed write is harmless
+    char one = 1;
+    ssize_t written = write(internal->event_write_fd, &one, 1);
+    (void)written;
+#else
+    (void)internal;
+#endif
+}
+
+// call with bridge_to_proxy_mtx held
+static void event_fd_clear(clientproxy_internal *internal)
+{
+#if defined(__linux__)
+    if(internal->event_fd == -1) return;
+    uint64_t count;
+    ssize_t nread = read(internal->event_fd, &count, sizeof(count));
+    (void)nread;
+#elif !defined(_WIN32)
+    if(internal->event_fd == -1) return;
+    char buf[64];
+    while(read(internal->event_fd, buf, sizeof(buf)) > 0) {}
+#else
+    (void)internal;
+#endif
+}
+
 static void enqueue_proxy_to_bridge(clientproxy_internal *internal, proxy_message *msg)
 {
     mtx_lock(&internal->proxy_to_bridge_mtx);
@@ -151,7 +252,10 @@ static void enqueue_bridge_to_proxy(clientproxy_internal *internal, proxy_messag
 {
     mtx_lock(&internal->bridge_to_proxy_mtx);
     STAILQ_INSERT_TAIL(&internal->bridge_to_proxy, msg, entries);
-    internal->bridge_to_proxy_len++;
+    if(internal->bridge_to_proxy_len++ == 0)
+    {
+        event_fd_signal(internal);
+    }
     mtx_unlock(&internal->bridge_to_proxy_mtx);
 }
 
@@ -161,11 +265,17 @@ static bool proxy_alloclient_connect(alloclient *proxyclient, const char *url, c
     msg->value.connect.url = strdup(url);
     msg->value.connect.identity = strdup(identity);
     msg->value.connect.avatar_desc = strdup(avatar_desc);
+    // only pass on unconverted planes if the app wants them; otherwise the bridge converts to RGBA for it
+    msg->value.connect.pictures = proxyclient->video_picture_callback != NULL;
     enqueue_proxy_to_bridge(_internal(proxyclient), msg);
     return true;
 }
 static void bridge_alloclient_connect(alloclient *bridgeclient, proxy_message *msg)
 {
+    if(msg->value.connect.pictures)
+    {
+        bridgeclient->video_picture_callback = bridge_video_picture_callback;
+    }
     bool success = alloclient_connect(bridgeclient, msg->value.connect.url, msg->value.connect.identity, msg->value.connect.avatar_desc);
     free(msg->value.connect.url);
     free(msg->value.connect.identity);
@@ -188,6 +298,7 @@ static void proxy_alloclient_disconnect(alloclient *proxyclient, int reason)
     thrd_join(_internal(proxyclient)->thr, NULL);
     mtx_destroy(&_internal(proxyclient)->bridge_to_proxy_mtx);
     mtx_destroy(&_internal(proxyclient)->proxy_to_bridge_mtx);
+    event_fd_destroy(_internal(proxyclient));
     free(proxyclient->_internal2);
     // TODO: clean out the message queues, goddammit.
     original_alloclient_disconnect(proxyclient, reason);
@@ -229,18 +340,24 @@ static void bridge_alloclient_set_intent(alloclient *bridgeclient, proxy_message
 
 static void proxy_alloclient_send_audio(alloclient *proxyclient, int32_t track_id, const int16_t *pcm, size_t sample_count)
 {
-    proxy_message *msg = proxy_message_create(msg_audio);
-    msg->value.audio.pcm = calloc(sizeof(int16_t), sample_count);
-    memcpy(msg->value.audio.pcm, pcm, sizeof(int16_t)*sample_count);
-    msg->value.audio.sample_count = sample_count;
-    msg->value.audio.track_id = track_id;
-    enqueue_proxy_to_bridge(_internal(proxyclient), msg);
+    // any length goes, so split it up into chunks that fit in pooled buffers
+    while(sample_count > 0)
+    {
+        size_t chunk = sample_count < ALLO_AUDIO_MAX_FRAME_SAMPLES ? sample_count : ALLO_AUDIO_MAX_FRAME_SAMPLES;
+        proxy_message *msg = proxy_message_create(msg_audio);
+        msg->value.audio.pcm = allo_pcm_buffer_get();
+        memcpy(msg->value.audio.pcm, pcm, sizeof(int16_t)*chunk);
+        msg->value.audio.sample_count = chunk;
+        msg->value.audio.track_id = track_id;
+        enqueue_proxy_to_bridge(_internal(proxyclient), msg);
+        pcm += chunk;
+        sample_count -= chunk;
+    }
 }
 static void bridge_alloclient_send_audio(alloclient *bridgeclient, proxy_message *msg)
 {
     alloclient_send_audio(bridgeclient, msg->value.audio.track_id, msg->value.audio.pcm, msg->value.audio.sample_count);
-    // in the best of worlds, we'd use a pool of buffers here to avoid malloc churn
-    free(msg->value.audio.pcm);
+    allo_pcm_buffer_return(msg->value.audio.pcm);
 }
 
 static void proxy_alloclient_send_video(alloclient *proxyclient, int32_t track_id, allopicture *picture)
@@ -285,6 +402,11 @@ static void proxy_alloclient_get_stats(alloclient *proxyclient, char *buffer, si
     );
 }
 
+static int proxy_alloclient_get_event_fd(alloclient *proxyclient)
+{
+    return _internal(proxyclient)->event_fd;
+}
+
 static void proxy_alloclient_asset_request(alloclient *proxyclient, const char *asset_id, const char *entity_id) {
     proxy_message *msg = proxy_message_create(msg_asset_request);
     msg->value.asset_request.asset_id = strdup(asset_id);
@@ -330,6 +452,16 @@ static void bridge_alloclient_asset_send_data(alloclient *bridgeclient, proxy_me
 }
 
 
+static void proxy_alloclient_set_asset_cache(alloclient *proxyclient, const char *path, size_t max_bytes) {
+    proxy_message *msg = proxy_message_create(msg_asset_cache);
+    msg->value.asset_cache.path = strdup(path);
+    msg->value.asset_cache.max_bytes = max_bytes;
+    enqueue_proxy_to_bridge(_internal(proxyclient), msg);
+}
+static void bridge_alloclient_set_asset_cache(alloclient *bridgeclient, proxy_message *msg) {
+    alloclient_set_asset_cache(bridgeclient, msg->value.asset_cache.path, msg->value.asset_cache.max_bytes);
+    free(msg->value.asset_cache.path);
+}
 
 static void(*bridge_message_lookup_table[])(alloclient*, proxy_message*) = {
     [msg_connect] = bridge_alloclient_connect,
@@ -341,6 +473,7 @@ static void(*bridge_message_lookup_table[])(alloclient*, proxy_message*) = {
     [msg_ack] = bridge_alloclient_ack,
     [msg_asset_request] = bridge_alloclient_asset_request,
     [msg_asset_send_data] = bridge_alloclient_asset_send_data,
+    [msg_asset_cache] = bridge_alloclient_set_asset_cache,
 };
 
 //////// Callbacks
@@ -465,28 +598,42 @@ static void proxy_audio_callback(alloclient *proxyclient, proxy_message *msg)
 {
     if(!proxyclient->audio_callback || proxyclient->audio_callback(proxyclient, msg->value.audio.track_id, msg->value.audio.pcm, msg->value.audio.sample_count))
     {
-        free(msg->value.audio.pcm);
+        allo_pcm_buffer_return(msg->value.audio.pcm);
     }
 }
 
 static bool bridge_video_callback(alloclient *bridgeclient, uint32_t track_id, allopixel pixels[], int32_t pixels_wide, int32_t pixels_high)
+{
+    return bridge_video_picture_callback(bridgeclient, track_id, allo_pixel_buffer_picture(pixels, pixels_wide, pixels_high));
+}
+static bool bridge_video_picture_callback(alloclient *bridgeclient, uint32_t track_id, allopicture *picture)
 {
     alloclient *proxyclient = bridgeclient->_backref;
     proxy_message *msg = proxy_message_create(msg_video);
     msg->value.video.track_id = track_id;
-    msg->value.video.picture = calloc(1, sizeof(allopicture));
-    msg->value.video.picture->planes[0].rgba = pixels;
-    msg->value.video.picture->width = pixels_wide;
-    msg->value.video.picture->height = pixels_high;
+    msg->value.video.picture = picture;
     enqueue_bridge_to_proxy(_internal(proxyclient), msg);
     return false;
 }
 static void proxy_video_callback(alloclient *proxyclient, proxy_message *msg)
 {
-    if(!proxyclient->video_callback || proxyclient->video_callback(proxyclient, msg->value.video.track_id, msg->value.video.picture->planes[0].rgba, msg->value.video.picture->width, msg->value.video.picture->height))
+    allopicture *picture = msg->value.video.picture;
+    if(proxyclient->video_picture_callback)
     {
-        free(msg->value.video.picture->planes[0].rgba);
-        free(msg->value.video.picture);
+        if(proxyclient->video_picture_callback(proxyclient, msg->value.video.track_id, picture))
+        {
+            allopicture_free(picture);
+        }
+    }
+    else if(!proxyclient->video_callback || picture->format != allopicture_format_rgba8888 ||
+        proxyclient->video_callback(proxyclient, msg->value.video.track_id, picture->planes[0].rgba, picture->width, picture->height))
+    {
+        allopicture_free(picture);
+    }
+    else
+    {
+        // the app kept the pixels
+        free(picture);
     }
 }
 
@@ -543,6 +690,7 @@ static bool proxy_alloclient_poll(alloclient *proxyclient, int timeout_ms)
 {
     (void)timeout_ms;
     mtx_lock(&_internal(proxyclient)->bridge_to_proxy_mtx);
+    event_fd_clear(_internal(proxyclient));
     proxy_message *msg = NULL;
     while((msg = STAILQ_FIRST(&_internal(proxyclient)->bridge_to_proxy))) {
         STAILQ_REMOVE_HEAD(&_internal(proxyclient)->bridge_to_proxy, entries);
@@ -557,6 +705,11 @@ static bool proxy_alloclient_poll(alloclient *proxyclient, int timeout_ms)
             break;
         }
     }
+    if(_internal(proxyclient)->bridge_to_proxy_len > 0)
+    {
+        // stopped early; stay readable so the host comes back for the rest
+        event_fd_signal(_internal(proxyclient));
+    }
     mtx_unlock(&_internal(proxyclient)->bridge_to_proxy_mtx);
     return true;
 }
@@ -619,6 +772,7 @@ alloclient *clientproxy_create(alloclient *target)
 
     STAILQ_INIT(&_internal(proxyclient)->proxy_to_bridge);
     STAILQ_INIT(&_internal(proxyclient)->bridge_to_proxy);
+    event_fd_create(_internal(proxyclient));
 
     original_alloclient_disconnect = proxyclient->alloclient_disconnect;
     original_alloclient_set_intent = proxyclient->alloclient_set_intent;
@@ -631,10 +785,12 @@ alloclient *clientproxy_create(alloclient *target)
     proxyclient->alloclient_send_video = proxy_alloclient_send_video;
     proxyclient->alloclient_get_time = proxy_alloclient_get_time;
     proxyclient->alloclient_get_stats = proxy_alloclient_get_stats;
+    proxyclient->alloclient_get_event_fd = proxy_alloclient_get_event_fd;
     
     
     proxyclient->alloclient_asset_request = proxy_alloclient_asset_request;
     proxyclient->alloclient_asset_send = proxy_alloclient_asset_send;
+    proxyclient->alloclient_set_asset_cache = proxy_alloclient_set_asset_cache;
 
     int success = thrd_create(&_internal(proxyclient)->thr, (thrd_start_t)_bridgethread, (void*)_internal(proxyclient)->bridgeclient);
     assert(success == thrd_success);
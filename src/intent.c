@@ -0,0 +1,293 @@
+#include <allonet/state.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include "util.h"
+
+/**
+ * Binary intent encoding. Layout, all integers big-endian:
+ *  u8  ALLO_INTENT_BINARY_MAGIC
+ *  u8  flags (bit 0: wants_stick_movement)
+ *  u16 mask of allo_intent_part included in this packet
+ *  u32 seq, increasing for every intent sent
+ *  u32 baseline_seq: the last seq the place acknowledged. Parts left out of the mask
+ *      have not changed since then. 0 = no baseline.
+ *  u64 ack_state_rev
+ *  f32 xmovement, zmovement, yaw, pitch
+ *  ...then each part in the mask, in bit order. Matrices are stored as one kind byte
+ *  followed by its payload:
+ *   - identity: nothing
+ *   - rigid: translation as 3 f32, then the 3x3 rotation as 9 int16 snorm (column major)
+ *   - full: 16 f32 (column major)
+ *  Grabs are a u8 entity id length (0 = not grabbing), the id, and a matrix.
+ */
+
+typedef enum {
+    matrix_kind_identity = 0,
+    matrix_kind_rigid = 1,
+    matrix_kind_full = 2,
+} matrix_kind;
+
+typedef struct {
+    uint8_t *data;
+    size_t length;
+    size_t offset;
+    bool ok;
+} intent_buffer;
+
+static void _write_bytes(intent_buffer *b, const void *bytes, size_t length)
+{
+    if(!b->ok || b->offset + length > b->length) { b->ok = false; return; }
+    if(length == 0) return;
+    memcpy(b->data + b->offset, bytes, length);
+    b->offset += length;
+}
+static void _write_u8(intent_buffer *b, uint8_t v) { _write_bytes(b, &v, 1); }
+static void _write_u16(intent_buffer *b, uint16_t v)
+{
+    uint8_t bytes[2] = {v >> 8, v};
+    _write_bytes(b, bytes, 2);
+}
+static void _write_u32(intent_buffer *b, uint32_t v)
+{
+    uint8_t bytes[4] = {v >> 24, v >> 16, v >> 8, v};
+    _write_bytes(b, bytes, 4);
+}
+static void _write_u64(intent_buffer *b, uint64_t v)
+{
+    _write_u32(b, v >> 32);
+    _write_u32(b, (uint32_t)v);
+}
+static void _write_f32(intent_buffer *b, double v)
+{
+    float f = (float)v;
+    uint32_t u; memcpy(&u, &f, 4);
+    _write_u32(b, u);
+}
+
+static void _read_bytes(intent_buffer *b, void *bytes, size_t length)
+{
+    if(!b->ok || b->offset + length > b->length) { b->ok = false; memset(bytes, 0, length); return; }
+    memcpy(bytes, b->data + b->offset, length);
+    b->offset += length;
+}
+static uint8_t _read_u8(intent_buffer *b) { uint8_t v; _read_bytes(b, &v, 1); return v; }
+static uint16_t _read_u16(intent_buffer *b)
+{
+    uint8_t bytes[2]; _read_bytes(b, bytes, 2);
+    return (uint16_t)(bytes[0] << 8 | bytes[1]);
+}
+static uint32_t _read_u32(intent_buffer *b)
+{
+    uint8_t bytes[4]; _read_bytes(b, bytes, 4);
+    return (uint32_t)bytes[0] << 24 | (uint32_t)bytes[1] << 16 | (uint32_t)bytes[2] << 8 | bytes[3];
+}
+static uint64_t _read_u64(intent_buffer *b)
+{
+    uint64_t hi = _read_u32(b);
+    return hi << 32 | _read_u32(b);
+}
+static double _read_f32(intent_buffer *b)
+{
+    uint32_t u = _read_u32(b);
+    float f; memcpy(&f, &u, 4);
+    return f;
+}
+
+static void _write_matrix(intent_buffer *b, allo_m4x4 m)
+{
+    if(allo_m4x4_is_identity(m))
+    {
+        _write_u8(b, matrix_kind_identity);
+        return;
+    }
+    bool rigid = m.c1r4 == 0 && m.c2r4 == 0 && m.c3r4 == 0 && m.c4r4 == 1;
+    for(int c = 0; c < 3 && rigid; c++)
+        for(int r = 0; r < 3 && rigid; r++)
+            rigid = fabs(m.v[c*4+r]) <= 1.0;
+
+    if(rigid)
+    {
+        _write_u8(b, matrix_kind_rigid);
+        _write_f32(b, m.c4r1); _write_f32(b, m.c4r2); _write_f32(b, m.c4r3);
+        for(int c = 0; c < 3; c++)
+            for(int r = 0; r < 3; r++)
+                _write_u16(b, (uint16_t)(int16_t)lround(m.v[c*4+r] * 32767.0));
+    }
+    else
+    {
+        _write_u8(b, matrix_kind_full);
+        for(int i = 0; i < 16; i++)
+            _write_f32(b, m.v[i]);
+    }
+}
+
+static allo_m4x4 _read_matrix(intent_buffer *b)
+{
+    allo_m4x4 m = allo_m4x4_identity();
+    switch(_read_u8(b))
+    {
+    case matrix_kind_identity:
+        break;
+    case matrix_kind_rigid:
+        m.c4r1 = _read_f32(b); m.c4r2 = _read_f32(b); m.c4r3 = _read_f32(b);
+        for(int c = 0; c < 3; c++)
+            for(int r = 0; r < 3; r++)
+                m.v[c*4+r] = (int16_t)_read_u16(b) / 32767.0;
+        break;
+    case matrix_kind_full:
+        for(int i = 0; i < 16; i++)
+            m.v[i] = _read_f32(b);
+        break;
+    default:
+        b->ok = false;
+    }
+    return m;
+}
+
+static void _write_skeleton(intent_buffer *b, const allo_m4x4 skeleton[ALLO_HAND_SKELETON_JOINT_COUNT])
+{
+    for(int i = 0; i < ALLO_HAND_SKELETON_JOINT_COUNT; i++)
+        _write_matrix(b, skeleton[i]);
+}
+
+static void _read_skeleton(intent_buffer *b, allo_m4x4 skeleton[ALLO_HAND_SKELETON_JOINT_COUNT])
+{
+    for(int i = 0; i < ALLO_HAND_SKELETON_JOINT_COUNT; i++)
+        skeleton[i] = _read_matrix(b);
+}
+
+static void _write_grab(intent_buffer *b, const allo_client_pose_grab *grab)
+{
+    size_t len = grab->entity ? strlen(grab->entity) : 0;
+    if(len > 255) { b->ok = false; return; }
+    _write_u8(b, (uint8_t)len);
+    _write_bytes(b, grab->entity, len);
+    _write_matrix(b, grab->grabber_from_entity_transform);
+}
+
+typedef struct {
+    char entity[256];
+    allo_m4x4 grabber_from_entity_transform;
+} decoded_grab;
+
+static void _read_grab(intent_buffer *b, decoded_grab *grab)
+{
+    uint8_t len = _read_u8(b);
+    _read_bytes(b, grab->entity, len);
+    grab->entity[len] = 0;
+    grab->grabber_from_entity_transform = _read_matrix(b);
+}
+
+static void _apply_grab(allo_client_pose_grab *grab, const decoded_grab *decoded)
+{
+    // only reallocate when the grabbed entity actually changes
+    if(decoded->entity[0] == 0)
+    {
+        free(grab->entity);
+        grab->entity = NULL;
+    }
+    else if(grab->entity == NULL || strcmp(grab->entity, decoded->entity) != 0)
+    {
+        free(grab->entity);
+        grab->entity = allo_strdup(decoded->entity);
+    }
+    grab->grabber_from_entity_transform = decoded->grabber_from_entity_transform;
+}
+
+static bool _grab_equal(const allo_client_pose_grab *a, const allo_client_pose_grab *b)
+{
+    if((a->entity == NULL) != (b->entity == NULL)) return false;
+    if(a->entity && strcmp(a->entity, b->entity) != 0) return false;
+    return memcmp(&a->grabber_from_entity_transform, &b->grabber_from_entity_transform, sizeof(allo_m4x4)) == 0;
+}
+
+uint16_t allo_client_intent_changed_parts(const allo_client_intent *a, const allo_client_intent *b)
+{
+    uint16_t changed = 0;
+    #define compare_part(part, field) if(memcmp(&a->poses.field, &b->poses.field, sizeof(a->poses.field)) != 0) changed |= part
+    compare_part(allo_intent_part_root, root.matrix);
+    compare_part(allo_intent_part_head, head.matrix);
+    compare_part(allo_intent_part_torso, torso.matrix);
+    compare_part(allo_intent_part_left_hand, left_hand.matrix);
+    compare_part(allo_intent_part_left_skeleton, left_hand.skeleton);
+    compare_part(allo_intent_part_right_hand, right_hand.matrix);
+    compare_part(allo_intent_part_right_skeleton, right_hand.skeleton);
+    #undef compare_part
+    if(!_grab_equal(&a->poses.left_hand.grab, &b->poses.left_hand.grab)) changed |= allo_intent_part_left_grab;
+    if(!_grab_equal(&a->poses.right_hand.grab, &b->poses.right_hand.grab)) changed |= allo_intent_part_right_grab;
+    return changed;
+}
+
+size_t allo_client_intent_encode_binary(const allo_client_intent *intent, uint16_t mask, uint32_t seq, uint32_t baseline_seq, uint8_t *buffer, size_t buffer_length)
+{
+    intent_buffer b = {buffer, buffer_length, 0, true};
+    _write_u8(&b, ALLO_INTENT_BINARY_MAGIC);
+    _write_u8(&b, intent->wants_stick_movement ? 1 : 0);
+    _write_u16(&b, mask & allo_intent_part_all);
+    _write_u32(&b, seq);
+    _write_u32(&b, baseline_seq);
+    _write_u64(&b, intent->ack_state_rev);
+    _write_f32(&b, intent->xmovement);
+    _write_f32(&b, intent->zmovement);
+    _write_f32(&b, intent->yaw);
+    _write_f32(&b, intent->pitch);
+
+    const allo_client_poses *poses = &intent->poses;
+    if(mask & allo_intent_part_root) _write_matrix(&b, poses->root.matrix);
+    if(mask & allo_intent_part_head) _write_matrix(&b, poses->head.matrix);
+    if(mask & allo_intent_part_torso) _write_matrix(&b, poses->torso.matrix);
+    if(mask & allo_intent_part_left_hand) _write_matrix(&b, poses->left_hand.matrix);
+    if(mask & allo_intent_part_left_skeleton) _write_skeleton(&b, poses->left_hand.skeleton);
+    if(mask & allo_intent_part_left_grab) _write_grab(&b, &poses->left_hand.grab);
+    if(mask & allo_intent_part_right_hand) _write_matrix(&b, poses->right_hand.matrix);
+    if(mask & allo_intent_part_right_skeleton) _write_skeleton(&b, poses->right_hand.skeleton);
+    if(mask & allo_intent_part_right_grab) _write_grab(&b, &poses->right_hand.grab);
+
+    return b.ok ? b.offset : 0;
+}
+
+bool allo_client_intent_decode_binary(allo_client_intent *intent, uint32_t *latest_seq, const uint8_t *data, size_t length)
+{
+    intent_buffer b = {(uint8_t*)data, length, 0, true};
+    if(_read_u8(&b) != ALLO_INTENT_BINARY_MAGIC) return false;
+    uint8_t flags = _read_u8(&b);
+    uint16_t mask = _read_u16(&b);
+    uint32_t seq = _read_u32(&b);
+    uint32_t baseline_seq = _read_u32(&b);
+    if(!b.ok) return false;
+    // old or reordered packet
+    if(seq <= *latest_seq) return false;
+    // parts missing from the mask are relative to something we never got
+    if(baseline_seq > *latest_seq) return false;
+
+    // decode into a scratch copy so that a truncated packet leaves `intent` untouched.
+    // grab entity strings are owned by `intent` and only replaced once all is read.
+    allo_client_intent decoded = *intent;
+    decoded.wants_stick_movement = flags & 1;
+    decoded.ack_state_rev = _read_u64(&b);
+    decoded.xmovement = _read_f32(&b);
+    decoded.zmovement = _read_f32(&b);
+    decoded.yaw = _read_f32(&b);
+    decoded.pitch = _read_f32(&b);
+
+    allo_client_poses *poses = &decoded.poses;
+    decoded_grab left_grab, right_grab;
+    if(mask & allo_intent_part_root) poses->root.matrix = _read_matrix(&b);
+    if(mask & allo_intent_part_head) poses->head.matrix = _read_matrix(&b);
+    if(mask & allo_intent_part_torso) poses->torso.matrix = _read_matrix(&b);
+    if(mask & allo_intent_part_left_hand) poses->left_hand.matrix = _read_matrix(&b);
+    if(mask & allo_intent_part_left_skeleton) _read_skeleton(&b, poses->left_hand.skeleton);
+    if(mask & allo_intent_part_left_grab) _read_grab(&b, &left_grab);
+    if(mask & allo_intent_part_right_hand) poses->right_hand.matrix = _read_matrix(&b);
+    if(mask & allo_intent_part_right_skeleton) _read_skeleton(&b, poses->right_hand.skeleton);
+    if(mask & allo_intent_part_right_grab) _read_grab(&b, &right_grab);
+    if(!b.ok) return false;
+
+    if(mask & allo_intent_part_left_grab) _apply_grab(&poses->left_hand.grab, &left_grab);
+    if(mask & allo_intent_part_right_grab) _apply_grab(&poses->right_hand.grab, &right_grab);
+
+    *intent = decoded;
+    *latest_seq = seq;
+    return true;
+}
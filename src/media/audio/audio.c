@@ -20,6 +20,12 @@ static bool audio_track_initialize(allo_media_track *track, const cJSON *compone
         fprintf(stderr, "Unknown audio format for track %d: %s\n", track->track_id, cJSON_GetStringValue(jformat));
         return false;
     }
+    const char *framing = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(component, "framing"));
+    track->info.audio.sequenced = framing && strcmp(framing, "sequenced") == 0;
+    if (track->info.audio.sequenced) {
+        track->info.audio.jitter = malloc(sizeof(allo_jitter_buffer));
+        allo_jitter_init(track->info.audio.jitter);
+    }
     if (DEBUG_AUDIO) {
         char name[255]; snprintf(name, 254, "track_%04d.pcm", track->track_id);
         track->info.audio.debug = fopen(name, "wb");
@@ -45,57 +51,133 @@ static void audio_track_destroy(allo_media_track *track)
     }
     opus_decoder_destroy(track->info.audio.decoder);
     track->info.audio.decoder = NULL;
+    free(track->info.audio.jitter);
+    track->info.audio.jitter = NULL;
+    arr_free(&track->info.audio.pending);
+    free(track->info.audio.send_pcm);
+    track->info.audio.send_pcm = NULL;
+    for (size_t i = 0; i < track->info.audio.decoded.length; i++) {
+        allo_pcm_buffer_return(track->info.audio.decoded.data[i].pcm);
+    }
+    arr_free(&track->info.audio.decoded);
 }
 
-static void parse_audio(alloclient *client, allo_media_track *track, unsigned char *mediadata, size_t length, mtx_t *unlock_me)
-{    
-    uint32_t track_id = track->track_id;
-    OpusDecoder *decoder = track->info.audio.decoder;
-    FILE *debugFile = track->info.audio.debug;
-    
-    const int maximumFrameCount = 5760; // 120ms as per documentation
-    int16_t *pcm = calloc(maximumFrameCount, sizeof(int16_t));
-    int samples_decoded = opus_decode(decoder, (unsigned char*)mediadata, length, pcm, maximumFrameCount, 0);
+// besides the network thread, which decodes too
+#define AUDIO_DECODE_THREADS 2
 
-    assert(samples_decoded >= 0);
-    if (debugFile) {
-        fwrite(pcm, sizeof(int16_t), samples_decoded, debugFile);
-        fflush(debugFile);
+static void parse_audio(alloclient *client, allo_media_track *track, unsigned char *mediadata, size_t length)
+{
+    (void)client;
+    // decoded along with everything else that arrived in the same poll, see _alloclient_decode_audio
+    if (length <= sizeof(((allo_audio_packet*)0)->data)) {
+        arr_reserve(&track->info.audio.pending, track->info.audio.pending.length + 1);
+        allo_audio_packet *packet = &track->info.audio.pending.data[track->info.audio.pending.length++];
+        packet->length = (uint16_t)length;
+        memcpy(packet->data, mediadata, length);
     }
+}
 
-    mtx_unlock(unlock_me);
-    
-    if(!client->audio_callback || client->audio_callback(client, track_id, pcm, samples_decoded)) {
-        free(pcm);
+/// Decode the pending packets of a single track, in order. Runs on a decode thread.
+static void decode_track(void *ctx, size_t index)
+{
+    allo_media_track *track = ((allo_media_track **)ctx)[index];
+    allo_jitter_frame frames[ALLO_JITTER_MAX_OUTPUT];
+    for (size_t p = 0; p < track->info.audio.pending.length; p++) {
+        allo_audio_packet *packet = &track->info.audio.pending.data[p];
+        int count = 0;
+        if (track->info.audio.sequenced) {
+            count = allo_jitter_push(track->info.audio.jitter, track->info.audio.decoder, packet->data, packet->length, frames);
+        } else {
+            int16_t *pcm = allo_pcm_buffer_get();
+            int samples_decoded = opus_decode(track->info.audio.decoder, packet->data, packet->length, pcm, ALLO_AUDIO_MAX_FRAME_SAMPLES, 0);
+            if (samples_decoded > 0) {
+                frames[count++] = (allo_jitter_frame){pcm, samples_decoded, 0};
+            } else {
+                allo_pcm_buffer_return(pcm);
+            }
+        }
+        if (count > 0) {
+            arr_append(&track->info.audio.decoded, frames, count);
+        }
+        if (track->info.audio.debug) {
+            for (int i = 0; i < count; i++) {
+                fwrite(frames[i].pcm, sizeof(int16_t), frames[i].sample_count, track->info.audio.debug);
+            }
+            fflush(track->info.audio.debug);
+        }
     }
+    track->info.audio.pending.length = 0;
 }
 
-void _alloclient_send_audio(alloclient *client, int32_t track_id, const int16_t *pcm, size_t frameCount)
+void _alloclient_decode_audio(alloclient *client)
 {
-    assert(frameCount == 480 || frameCount == 960);
-    
-    if (_internal(client)->peer == NULL) {
-        fprintf(stderr, "alloclient: Skipping send audio as we don't even have a peer\n");
-        return;
+    alloclient_internal *cl = _internal(client);
+    cl->decode_batch.length = 0;
+    const allo_media_track_table *table = _media_tracks_read_begin(cl->shared->media_tracks);
+    for (size_t i = 0; i < table->capacity; i++) {
+        allo_media_track *track = table->slots[i];
+        if (track && track->type == allo_media_type_audio && track->info.audio.pending.length > 0) {
+            arr_push(&cl->decode_batch, track);
+        }
     }
-    
-    if (_internal(client)->peer->state != ENET_PEER_STATE_CONNECTED) {
-        fprintf(stderr, "alloclient: Skipping send audio as peer is not connected\n");
-        return;
+    _media_tracks_read_end(cl->shared->media_tracks);
+    if (cl->decode_batch.length == 0) return;
+
+    // Tracks are only created and destroyed on this thread, so they stay put while we decode,
+    // and other threads never touch what we're decoding.
+    if (cl->decode_batch.length > 1 && !cl->audio_decoders) {
+        cl->audio_decoders = allo_workpool_create(AUDIO_DECODE_THREADS);
     }
+    if (cl->audio_decoders) {
+        allo_workpool_run(cl->audio_decoders, cl->decode_batch.length, decode_track, cl->decode_batch.data);
+    } else {
+        decode_track(cl->decode_batch.data, 0);
+    }
+
+    for (size_t t = 0; t < cl->decode_batch.length; t++) {
+        allo_media_track *track = cl->decode_batch.data[t];
+        for (size_t i = 0; i < track->info.audio.decoded.length; i++) {
+            allo_jitter_frame *frame = &track->info.audio.decoded.data[i];
+            if(!client->audio_callback || client->audio_callback(client, track->track_id, frame->pcm, frame->sample_count)) {
+                allo_pcm_buffer_return(frame->pcm);
+            }
+        }
+        track->info.audio.decoded.length = 0;
+    }
+}
+
+void alloclient_audio_buffer_return(int16_t *pcm)
+{
+    allo_pcm_buffer_return(pcm);
+}
+
+/// Encode and send a single frame. `track` must be in a read section, on the thread that sends on it.
+static void send_frame(alloclient *client, allo_media_track *track, const int16_t *pcm, size_t frameCount)
+{
+    bool sequenced = track->info.audio.sequenced;
+    OpusEncoder *encoder = _internal(client)->opus_encoder;
     
-    const int headerlen = sizeof(int32_t); // track id header
-    const int outlen = headerlen + frameCount*2 + 1; // theoretical max
-    ENetPacket *packet = enet_packet_create(NULL, outlen, ENET_PACKET_FLAG_RELIABLE);
+    const int headerlen = sizeof(int32_t) + (sequenced ? ALLO_AUDIO_SEQ_HEADER_SIZE : 0); // track id header, seq header
+    const int outlen = headerlen + ALLO_AUDIO_MAX_PACKET_SIZE;
+    // never reliable: a lost frame is better concealed than waited for. Sequenced tracks
+    // put frames back in order themselves, so let ENet deliver late ones too.
+    ENetPacket *packet = enet_packet_create(NULL, outlen, sequenced ? ENET_PACKET_FLAG_UNSEQUENCED : 0);
     assert(packet != NULL);
-    int32_t big_track_id = htonl(track_id);
-    memcpy(packet->data, &big_track_id, headerlen);
+    int32_t big_track_id = htonl(track->track_id);
+    memcpy(packet->data, &big_track_id, sizeof(int32_t));
+    if (sequenced) {
+        allo_audio_write_seq_header(packet->data + sizeof(int32_t), track->info.audio.send_seq, track->info.audio.send_timestamp, allo_audio_level(pcm, frameCount));
+    }
+    // timestamp advances even if we don't transmit, so the receiver knows how much it missed
+    track->info.audio.send_timestamp += frameCount;
 
+    double started = get_ts_monod();
     int len = opus_encode (
-        _internal(client)->opus_encoder, 
+        encoder, 
         pcm, frameCount,
         packet->data + headerlen, outlen - headerlen
     );
+    allo_audio_rate_encoded(_internal(client)->audio_rate, get_ts_monod() - started, (int)frameCount);
 
     if (len < 3) {  // error or DTX ("do not transmit")
         enet_packet_destroy(packet);
@@ -104,24 +186,84 @@ void _alloclient_send_audio(alloclient *client, int32_t track_id, const int16_t
         }
         return;
     }
+    track->info.audio.send_seq++;
 
     int ok = enet_packet_resize(packet, headerlen + len);
     assert(ok == 0); (void)ok;
+    size_t sentlen = packet->dataLength;
     ok = allo_enet_peer_send(_internal(client)->peer, CHANNEL_AUDIO, packet);
+    if (ok == 0) {
+        _media_track_count_sent(track, sentlen);
+    } else {
+        enet_packet_destroy(packet);
+    }
+}
+
+void _alloclient_send_audio(alloclient *client, int32_t track_id, const int16_t *pcm, size_t frameCount)
+{
+    if (_internal(client)->peer == NULL) {
+        fprintf(stderr, "alloclient: Skipping send audio as we don't even have a peer\n");
+        return;
+    }
     
-    alloclient_internal_shared *shared = _alloclient_internal_shared_begin(client);
-    allo_media_track *track = _media_track_find(&shared->media_tracks, track_id);
-    if (track) {
-        bitrate_increment_sent(&track->bitrates, packet->dataLength);
+    if (_internal(client)->peer->state != ENET_PEER_STATE_CONNECTED) {
+        fprintf(stderr, "alloclient: Skipping send audio as peer is not connected\n");
+        return;
     }
-    _alloclient_internal_shared_end(client);
     
-    assert(ok == 0);
+    // this is usually the audio capture thread, so only look up the track without locking. The
+    // track's send_ fields and the encoder are this thread's alone; see alloclient_send_audio.
+    allo_media_track_list *tracks = _internal(client)->shared->media_tracks;
+    allo_media_track *track = _media_track_table_find(_media_tracks_read_begin(tracks), track_id);
+    if (!track) {
+        // until our track is in the state, we don't know how the others expect it to be framed
+        _media_tracks_read_end(tracks);
+        return;
+    }
+
+    allo_audio_encoder_settings settings;
+    if (allo_audio_rate_settings(_internal(client)->audio_rate, &settings)) {
+        OpusEncoder *encoder = _internal(client)->opus_encoder;
+        opus_encoder_ctl(encoder, OPUS_SET_BITRATE(settings.bitrate));
+        opus_encoder_ctl(encoder, OPUS_SET_COMPLEXITY(settings.complexity));
+        opus_encoder_ctl(encoder, OPUS_SET_PACKET_LOSS_PERC(settings.loss_percent));
+    }
+    size_t frame_samples = settings.frame_samples;
+
+    // cut whatever the app gives us into frames of the duration the link currently wants
+    int16_t *pending = track->info.audio.send_pcm;
+    if (!pending) {
+        pending = track->info.audio.send_pcm = malloc(ALLO_AUDIO_MAX_FRAME_SAMPLES * sizeof(int16_t));
+    }
+    size_t pending_length = track->info.audio.send_pcm_length;
+    while (frameCount > 0 || pending_length >= frame_samples) {
+        if (pending_length == 0 && frameCount >= frame_samples) {
+            // no need to copy whole frames
+            send_frame(client, track, pcm, frame_samples);
+            pcm += frame_samples;
+            frameCount -= frame_samples;
+            continue;
+        }
+        if (pending_length >= frame_samples) {
+            send_frame(client, track, pending, frame_samples);
+            pending_length -= frame_samples;
+            memmove(pending, pending + frame_samples, pending_length * sizeof(int16_t));
+            continue;
+        }
+        size_t copied = frame_samples - pending_length;
+        if (copied > frameCount) copied = frameCount;
+        memcpy(pending + pending_length, pcm, copied * sizeof(int16_t));
+        pending_length += copied;
+        pcm += copied;
+        frameCount -= copied;
+    }
+    track->info.audio.send_pcm_length = pending_length;
+    _media_tracks_read_end(tracks);
 }
 
 void allo_media_audio_register(void)
 {
-    allo_media_subsystem *sys = malloc(sizeof(allo_media_subsystem));
+    allo_media_subsystem *sys = calloc(1, sizeof(allo_media_subsystem));
     sys->parse = parse_audio;
     sys->track_initialize = audio_track_initialize;
     sys->track_destroy = audio_track_destroy;
@@ -0,0 +1,41 @@
+#include "culling.h"
+#include "jitter.h"
+
+float allo_audio_level_db(uint8_t level)
+{
+    return (level & ALLO_AUDIO_LEVEL_VOICE) ? -(float)(level & ~ALLO_AUDIO_LEVEL_VOICE) : -ALLO_AUDIO_LEVEL_SILENT;
+}
+
+float allo_audio_loudness_at(float peak, double last_heard, double now, float decay)
+{
+    return peak - (float)((now - last_heard) * decay);
+}
+
+size_t allo_audio_select_audible(const allo_audio_source *sources, size_t count, allo_vector ears, double radius, int loudest, allo_audible_source *audible)
+{
+    size_t picked = 0;
+    for(size_t i = 0; i < count; i++)
+    {
+        if(!sources[i].hearable) continue;
+        double distance = allo_vector_length(allo_vector_subtract(sources[i].position, ears));
+        if(radius > 0 && distance > radius) continue;
+        audible[picked++] = (allo_audible_source){ i, distance };
+    }
+    if(loudest <= 0 || picked <= (size_t)loudest)
+    {
+        return picked;
+    }
+
+    // a place has tens of speakers, not thousands; insertion sort by loudness keeps equals in order
+    for(size_t i = 1; i < picked; i++)
+    {
+        allo_audible_source moving = audible[i];
+        size_t j = i;
+        for(; j > 0 && sources[audible[j-1].index].loudness < sources[moving.index].loudness; j--)
+        {
+            audible[j] = audible[j-1];
+        }
+        audible[j] = moving;
+    }
+    return (size_t)loudest;
+}
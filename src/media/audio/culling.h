@@ -0,0 +1,47 @@
+#ifndef ALLONET_AUDIO_CULLING_H
+#define ALLONET_AUDIO_CULLING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <allonet/math.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * In a busy place, each listener is only sent the audio it can hear: the tracks within an audible
+ * radius of it, and of those only the few loudest. Loudness comes from the level byte senders put
+ * in each sequenced audio packet (see ALLO_AUDIO_SEQ_HEADER_SIZE), held as a peak that fades slowly,
+ * so that speakers keep their place through the pauses between words.
+ */
+
+/// dBov from the level byte of a sequenced audio packet: -ALLO_AUDIO_LEVEL_SILENT unless it says there's voice in it
+float allo_audio_level_db(uint8_t level);
+/// How loud a speaker that peaked at `peak` dBov at `last_heard` is at `now`, fading by `decay` dB a second
+float allo_audio_loudness_at(float peak, double last_heard, double now, float decay);
+
+typedef struct allo_audio_source {
+    allo_vector position;
+    float loudness;  // dBov, as of now
+    bool hearable;   // the listener subscribed to it, and isn't the one sending it
+} allo_audio_source;
+
+typedef struct allo_audible_source {
+    size_t index;    // into the sources
+    double distance; // from the listener, in meters
+} allo_audible_source;
+
+/** Pick the sources that a listener at `ears` should hear: the hearable ones within `radius` meters,
+ *  if radius > 0, and of those only the `loudest` loudest, loudest first, if loudest > 0.
+ *  @param audible room for `count` of them
+ *  @return how many were picked
+ */
+size_t allo_audio_select_audible(const allo_audio_source *sources, size_t count, allo_vector ears, double radius, int loudest, allo_audible_source *audible);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
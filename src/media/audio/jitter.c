@@ -0,0 +1,235 @@
+#include "jitter.h"
+#include "pcm_pool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+
+// if the sender jumps further back than this, assume it restarted rather than that we got a very late packet
+#define RESTART_DISTANCE (4*ALLO_JITTER_SLOT_COUNT)
+// in-order frames before we try waiting a little less for missing packets
+#define DEPTH_DECAY_FRAMES 1000
+// longer gaps than this (e g while the place wasn't forwarding the track to us) are skipped, not concealed
+#define MAX_CONCEALED_FRAMES 5
+
+// quieter than this is background noise rather than someone talking
+#define VOICE_ACTIVITY_DBOV -45.0
+
+void allo_audio_write_seq_header(uint8_t *header, uint16_t seq, uint32_t timestamp, uint8_t level)
+{
+    header[0] = seq >> 8; header[1] = seq;
+    header[2] = timestamp >> 24; header[3] = timestamp >> 16; header[4] = timestamp >> 8; header[5] = timestamp;
+    header[6] = level;
+}
+
+uint8_t allo_audio_level(const int16_t *pcm, size_t count)
+{
+    double sum = 0;
+    for(size_t i = 0; i < count; i++)
+    {
+        double sample = pcm[i] / 32768.0;
+        sum += sample * sample;
+    }
+    double dbov = count && sum > 0 ? 10 * log10(sum / count) : -ALLO_AUDIO_LEVEL_SILENT;
+    if(dbov < -ALLO_AUDIO_LEVEL_SILENT) dbov = -ALLO_AUDIO_LEVEL_SILENT;
+    if(dbov > 0) dbov = 0;
+    return (uint8_t)(-dbov) | (dbov > VOICE_ACTIVITY_DBOV ? ALLO_AUDIO_LEVEL_VOICE : 0);
+}
+
+void allo_jitter_init(allo_jitter_buffer *jitter)
+{
+    memset(jitter, 0, sizeof(*jitter));
+    jitter->frame_size = 480;
+    jitter->depth = 1;
+}
+
+static void _reset(allo_jitter_buffer *jitter, uint16_t seq, uint32_t timestamp)
+{
+    for(int i = 0; i < ALLO_JITTER_SLOT_COUNT; i++)
+    {
+        jitter->slots[i].present = false;
+    }
+    jitter->started = true;
+    jitter->next_seq = seq;
+    jitter->next_timestamp = timestamp;
+}
+
+static bool _emit(allo_jitter_buffer *jitter, allo_jitter_frame *frame, int16_t *pcm, int samples)
+{
+    if(samples <= 0)
+    {
+        allo_pcm_buffer_return(pcm);
+        return false;
+    }
+    frame->pcm = pcm;
+    frame->sample_count = samples;
+    frame->timestamp = jitter->next_timestamp;
+    jitter->next_seq++;
+    jitter->next_timestamp += samples;
+    return true;
+}
+
+static bool _decode(allo_jitter_buffer *jitter, OpusDecoder *decoder, allo_jitter_packet *packet, allo_jitter_frame *frame)
+{
+    int16_t *pcm = allo_pcm_buffer_get();
+    int samples = opus_decode(decoder, packet->data, packet->length, pcm, ALLO_AUDIO_MAX_FRAME_SAMPLES, 0);
+    packet->present = false;
+    // stay on the sender's clock even if this frame couldn't be decoded
+    jitter->next_timestamp = packet->timestamp;
+    if(samples > 0)
+    {
+        jitter->frame_size = samples;
+        jitter->stats.decoded++;
+        if(++jitter->clean_frames >= DEPTH_DECAY_FRAMES && jitter->depth > 1)
+        {
+            jitter->depth--;
+            jitter->clean_frames = 0;
+        }
+    }
+    if(!_emit(jitter, frame, pcm, samples))
+    {
+        jitter->next_seq++;
+        jitter->next_timestamp += jitter->frame_size;
+        return false;
+    }
+    return true;
+}
+
+/// Give up on next_seq and make something up for it, from FEC in `following` if it's the packet right after.
+static bool _conceal(allo_jitter_buffer *jitter, OpusDecoder *decoder, const allo_jitter_packet *following, allo_jitter_frame *frame)
+{
+    int samples = jitter->frame_size;
+    bool adjacent = (uint16_t)(following->seq - jitter->next_seq) == 1;
+    uint32_t gap = following->timestamp - jitter->next_timestamp;
+    // opus frames are multiples of 2.5ms
+    if(adjacent && gap > 0 && gap <= ALLO_AUDIO_MAX_FRAME_SAMPLES && gap % 120 == 0)
+    {
+        samples = gap;
+    }
+
+    int16_t *pcm = allo_pcm_buffer_get();
+    int decoded = -1;
+    if(adjacent)
+    {
+        decoded = opus_decode(decoder, following->data, following->length, pcm, samples, 1);
+        if(decoded > 0) jitter->stats.recovered++;
+    }
+    if(decoded <= 0)
+    {
+        decoded = opus_decode(decoder, NULL, 0, pcm, samples, 0);
+        jitter->stats.concealed++;
+    }
+    if(!_emit(jitter, frame, pcm, decoded))
+    {
+        jitter->next_seq++;
+        jitter->next_timestamp += samples;
+        return false;
+    }
+    return true;
+}
+
+int allo_jitter_push(allo_jitter_buffer *jitter, OpusDecoder *decoder, const uint8_t *data, size_t length, allo_jitter_frame *frames)
+{
+    if(length <= ALLO_AUDIO_SEQ_HEADER_SIZE || length - ALLO_AUDIO_SEQ_HEADER_SIZE > ALLO_AUDIO_MAX_PACKET_SIZE)
+    {
+        return 0;
+    }
+    uint16_t seq = ((uint16_t)data[0] << 8) | data[1];
+    uint32_t timestamp = ((uint32_t)data[2] << 24) | ((uint32_t)data[3] << 16) | ((uint32_t)data[4] << 8) | data[5];
+
+    if(!jitter->started)
+    {
+        _reset(jitter, seq, timestamp);
+    }
+
+    int count = 0;
+    int16_t distance = (int16_t)(seq - jitter->next_seq);
+    if(distance < -RESTART_DISTANCE)
+    {
+        _reset(jitter, seq, timestamp);
+        distance = 0;
+    }
+    else if(distance < 0)
+    {
+        // we already played something else in its place. Wait a bit longer next time.
+        jitter->stats.late++;
+        if(jitter->depth < ALLO_JITTER_SLOT_COUNT-1) jitter->depth++;
+        jitter->clean_frames = 0;
+        return 0;
+    }
+    else if(distance >= ALLO_JITTER_SLOT_COUNT)
+    {
+        // too long a gap to conceal; play what we have and continue from here
+        uint16_t first = jitter->next_seq;
+        for(uint16_t i = 0; i < ALLO_JITTER_SLOT_COUNT && count < ALLO_JITTER_MAX_OUTPUT; i++)
+        {
+            uint16_t s = first + i;
+            allo_jitter_packet *packet = &jitter->slots[s % ALLO_JITTER_SLOT_COUNT];
+            if(packet->present && packet->seq == s)
+            {
+                jitter->next_seq = s;
+                if(_decode(jitter, decoder, packet, &frames[count])) count++;
+            }
+        }
+        _reset(jitter, seq, timestamp);
+        distance = 0;
+    }
+
+    allo_jitter_packet *slot = &jitter->slots[seq % ALLO_JITTER_SLOT_COUNT];
+    if(slot->present)
+    {
+        jitter->stats.duplicate++;
+        return count;
+    }
+    slot->present = true;
+    slot->seq = seq;
+    slot->timestamp = timestamp;
+    slot->length = length - ALLO_AUDIO_SEQ_HEADER_SIZE;
+    memcpy(slot->data, data + ALLO_AUDIO_SEQ_HEADER_SIZE, slot->length);
+    jitter->stats.received++;
+
+    while(count < ALLO_JITTER_MAX_OUTPUT)
+    {
+        allo_jitter_packet *next = &jitter->slots[jitter->next_seq % ALLO_JITTER_SLOT_COUNT];
+        if(next->present)
+        {
+            if(_decode(jitter, decoder, next, &frames[count])) count++;
+            continue;
+        }
+
+        // next is missing. Has enough arrived after it that we should stop waiting?
+        int ahead = 0;
+        int closest_distance = INT_MAX;
+        const allo_jitter_packet *closest = NULL;
+        for(int i = 0; i < ALLO_JITTER_SLOT_COUNT; i++)
+        {
+            const allo_jitter_packet *packet = &jitter->slots[i];
+            if(!packet->present) continue;
+            ahead++;
+            int d = (uint16_t)(packet->seq - jitter->next_seq);
+            if(d < closest_distance)
+            {
+                closest_distance = d;
+                closest = packet;
+            }
+        }
+        if(ahead == 0 || ahead < jitter->depth)
+        {
+            break;
+        }
+        if(closest_distance > MAX_CONCEALED_FRAMES)
+        {
+            jitter->next_seq = closest->seq;
+            jitter->next_timestamp = closest->timestamp;
+            continue;
+        }
+        if(_conceal(jitter, decoder, closest, &frames[count])) count++;
+    }
+    return count;
+}
+
+double allo_jitter_loss_percent(const allo_jitter_stats *stats)
+{
+    uint64_t total = stats->decoded + stats->recovered + stats->concealed;
+    return total ? 100.0 * (stats->recovered + stats->concealed) / total : 0.0;
+}
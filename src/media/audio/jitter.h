@@ -0,0 +1,92 @@
+#ifndef ALLONET_AUDIO_JITTER_H
+#define ALLONET_AUDIO_JITTER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <opus.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Sequenced audio packets have this after the track id: big-endian u16 seq, u32 timestamp (in 48kHz samples),
+/// and a u8 audio level like RFC 6464: voice activity flag in the top bit, and -dBov (0-127) in the rest.
+#define ALLO_AUDIO_SEQ_HEADER_SIZE 7
+#define ALLO_AUDIO_LEVEL_VOICE 0x80
+#define ALLO_AUDIO_LEVEL_SILENT 127
+/// Largest Opus packet for a single frame
+#define ALLO_AUDIO_MAX_PACKET_SIZE 1275
+/// 120ms, the longest Opus frame
+#define ALLO_AUDIO_MAX_FRAME_SAMPLES 5760
+/// How many packets we can hold while waiting for a missing one
+#define ALLO_JITTER_SLOT_COUNT 16
+/// Most frames that a single allo_jitter_push can produce
+#define ALLO_JITTER_MAX_OUTPUT (2*ALLO_JITTER_SLOT_COUNT)
+
+typedef struct allo_jitter_packet {
+    bool present;
+    uint16_t seq;
+    uint32_t timestamp;
+    uint16_t length;
+    uint8_t data[ALLO_AUDIO_MAX_PACKET_SIZE];
+} allo_jitter_packet;
+
+/// A received audio packet, seq header included if sequenced
+typedef struct allo_audio_packet {
+    uint16_t length;
+    uint8_t data[ALLO_AUDIO_SEQ_HEADER_SIZE + ALLO_AUDIO_MAX_PACKET_SIZE];
+} allo_audio_packet;
+
+typedef struct allo_jitter_stats {
+    uint64_t received;   // packets that arrived in time
+    uint64_t decoded;    // frames decoded from their own packet
+    uint64_t recovered;  // lost frames rebuilt from FEC in the next packet
+    uint64_t concealed;  // lost frames replaced by opus packet loss concealment
+    uint64_t late;       // packets that arrived after we had given up on them
+    uint64_t duplicate;
+} allo_jitter_stats;
+
+typedef struct allo_jitter_frame {
+    int16_t *pcm; // from allo_pcm_buffer_get, owned by whoever gets the frame
+    int sample_count;
+    uint32_t timestamp; // sender's timestamp of the first sample
+} allo_jitter_frame;
+
+/**
+ * Reorders sequenced audio packets from an unreliable channel and hands out decoded
+ * frames in order. Frames are passed straight through while nothing is missing. When
+ * a packet is missing, we wait until `depth` newer packets have arrived before giving
+ * up on it, and then rebuild it from the in-band FEC of the next packet, or conceal it.
+ * `depth` grows every time a packet shows up after we gave up on it, and slowly shrinks
+ * back while the stream is clean, so we only add the delay that the network needs.
+ */
+typedef struct allo_jitter_buffer {
+    allo_jitter_packet slots[ALLO_JITTER_SLOT_COUNT];
+    bool started;
+    uint16_t next_seq;
+    uint32_t next_timestamp;
+    int frame_size; // samples in the latest frame, used to conceal frames we know nothing about
+    int depth;
+    int clean_frames; // in-order frames since depth last changed
+    allo_jitter_stats stats;
+} allo_jitter_buffer;
+
+void allo_audio_write_seq_header(uint8_t *header, uint16_t seq, uint32_t timestamp, uint8_t level);
+/// Level byte for a frame of audio, with the voice activity flag set if it's loud enough to be someone talking
+uint8_t allo_audio_level(const int16_t *pcm, size_t count);
+
+void allo_jitter_init(allo_jitter_buffer *jitter);
+/** Add a packet (starting with the seq header) and decode everything that is now due.
+ * @param frames  receives up to ALLO_JITTER_MAX_OUTPUT decoded frames, in order
+ * @return number of frames written to `frames`
+ */
+int allo_jitter_push(allo_jitter_buffer *jitter, OpusDecoder *decoder, const uint8_t *data, size_t length, allo_jitter_frame *frames);
+/// Percentage of frames that had to be rebuilt or concealed
+double allo_jitter_loss_percent(const allo_jitter_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
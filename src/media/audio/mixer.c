@@ -0,0 +1,515 @@
+#include "mixer.h"
+#include "jitter.h"
+#include "pcm_pool.h"
+#include "../../workpool.h"
+#include "../../threading.h"
+#include "../../util.h"
+#include <allonet/arr.h>
+#include <opus.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define MIX_INTERVAL (ALLO_MIX_FRAME_SAMPLES / 48000.0)
+// room for the most a source can be buffered, with its longest possible frames
+#define FIFO_SAMPLES (ALLO_AUDIO_MAX_FRAME_SAMPLES * 3)
+// never fall further behind a source than this beyond its prebuffer
+#define MAX_EXTRA_BUFFERED_SAMPLES (ALLO_MIX_FRAME_SAMPLES * 4)
+// if the mixer can't keep up, drop audio rather than queueing it
+#define MAX_INCOMING_PACKETS 50
+
+typedef struct mix_blob {
+    size_t length;
+    uint8_t data[];
+} mix_blob;
+
+typedef arr_t(mix_blob*) mix_blob_list;
+
+typedef struct mix_source {
+    uint32_t track_id;
+    bool sequenced;
+    bool removed;
+    OpusDecoder *decoder;
+    allo_jitter_buffer *jitter;
+    mix_blob_list incoming; // guarded by the mixer lock
+    mix_blob_list decoding; // only touched while mixing
+
+    int16_t fifo[FIFO_SAMPLES];
+    size_t fifo_start, fifo_length;
+    size_t max_frame_samples; // longest frame decoded from it so far
+    bool playing;
+    bool has_frame;
+    int16_t frame[ALLO_MIX_FRAME_SAMPLES];
+} mix_source;
+
+typedef struct mix_gain {
+    uint32_t track_id;
+    float gain;
+} mix_gain;
+
+typedef struct mix_listener {
+    void *listener;
+    bool removed;
+    OpusEncoder *encoder;
+    uint16_t seq;
+    uint32_t timestamp;
+    arr_t(mix_gain) gains; // guarded by the mixer lock
+    arr_t(mix_gain) mixing_gains; // only touched while mixing
+    ENetPacket *mixed;
+} mix_listener;
+
+typedef struct mix_output {
+    void *listener;
+    ENetPacket *packet;
+} mix_output;
+
+struct allo_audio_mixer {
+    mtx_t lock;
+    arr_t(mix_source*) sources;
+    arr_t(mix_listener*) listeners;
+    arr_t(mix_output) outbox;
+    bool stopping;
+
+    allo_workpool *pool;
+    bool clocked;
+    thrd_t clock_thread;
+    // what's being mixed right now
+    arr_t(mix_source*) mixing_sources;
+    arr_t(mix_listener*) mixing_listeners;
+};
+
+static void _blobs_free(mix_blob_list *list)
+{
+    for(size_t i = 0; i < list->length; i++) free(list->data[i]);
+    arr_free(list);
+}
+
+static void _source_free(mix_source *source)
+{
+    opus_decoder_destroy(source->decoder);
+    free(source->jitter);
+    _blobs_free(&source->incoming);
+    _blobs_free(&source->decoding);
+    free(source);
+}
+
+static void _listener_free(mix_listener *listener)
+{
+    opus_encoder_destroy(listener->encoder);
+    arr_free(&listener->gains);
+    arr_free(&listener->mixing_gains);
+    if(listener->mixed) enet_packet_destroy(listener->mixed);
+    free(listener);
+}
+
+static mix_source *_source_find(allo_audio_mixer *mixer, uint32_t track_id)
+{
+    for(size_t i = 0; i < mixer->sources.length; i++)
+    {
+        mix_source *source = mixer->sources.data[i];
+        if(source->track_id == track_id && !source->removed) return source;
+    }
+    return NULL;
+}
+
+static mix_listener *_listener_find_or_create(allo_audio_mixer *mixer, void *client)
+{
+    for(size_t i = 0; i < mixer->listeners.length; i++)
+    {
+        mix_listener *listener = mixer->listeners.data[i];
+        if(listener->listener == client && !listener->removed) return listener;
+    }
+    int err;
+    mix_listener *listener = calloc(1, sizeof(mix_listener));
+    listener->listener = client;
+    listener->encoder = opus_encoder_create(48000, 1, OPUS_APPLICATION_VOIP, &err);
+    assert(listener->encoder);
+    opus_encoder_ctl(listener->encoder, OPUS_SET_INBAND_FEC(1));
+    opus_encoder_ctl(listener->encoder, OPUS_SET_PACKET_LOSS_PERC(10));
+    arr_init(&listener->gains);
+    arr_init(&listener->mixing_gains);
+    arr_push(&mixer->listeners, listener);
+    return listener;
+}
+
+static void _fifo_write(mix_source *source, const int16_t *pcm, size_t count)
+{
+    if(count > source->max_frame_samples) source->max_frame_samples = count;
+    for(size_t i = 0; i < count; i++)
+    {
+        if(source->fifo_length == FIFO_SAMPLES)
+        {
+            source->fifo_start = (source->fifo_start + 1) % FIFO_SAMPLES;
+            source->fifo_length--;
+        }
+        source->fifo[(source->fifo_start + source->fifo_length++) % FIFO_SAMPLES] = pcm[i];
+    }
+}
+
+static void _fifo_skip(mix_source *source, size_t count)
+{
+    source->fifo_start = (source->fifo_start + count) % FIFO_SAMPLES;
+    source->fifo_length -= count;
+}
+
+/// Wait for this much audio before starting to mix in a source, to ride out network jitter: a
+/// whole frame of the longest the source sends (it may use 40 or 60ms ones), and a mix frame more.
+static size_t _prebuffer_samples(const mix_source *source)
+{
+    size_t frame = source->max_frame_samples > ALLO_MIX_FRAME_SAMPLES ? source->max_frame_samples : ALLO_MIX_FRAME_SAMPLES;
+    return frame + ALLO_MIX_FRAME_SAMPLES;
+}
+
+static void _decode_source(void *ctx, size_t index)
+{
+    allo_audio_mixer *mixer = ctx;
+    mix_source *source = mixer->mixing_sources.data[index];
+
+    for(size_t i = 0; i < source->decoding.length; i++)
+    {
+        mix_blob *blob = source->decoding.data[i];
+        if(source->sequenced)
+        {
+            allo_jitter_frame frames[ALLO_JITTER_MAX_OUTPUT];
+            int count = allo_jitter_push(source->jitter, source->decoder, blob->data, blob->length, frames);
+            for(int f = 0; f < count; f++)
+            {
+                _fifo_write(source, frames[f].pcm, frames[f].sample_count);
+                allo_pcm_buffer_return(frames[f].pcm);
+            }
+        }
+        else
+        {
+            int16_t pcm[ALLO_AUDIO_MAX_FRAME_SAMPLES];
+            int samples = opus_decode(source->decoder, blob->data, blob->length, pcm, ALLO_AUDIO_MAX_FRAME_SAMPLES, 0);
+            if(samples > 0) _fifo_write(source, pcm, samples);
+        }
+        free(blob);
+    }
+    arr_clear(&source->decoding);
+
+    size_t prebuffer = _prebuffer_samples(source);
+    if(!source->playing && source->fifo_length >= prebuffer)
+    {
+        source->playing = true;
+    }
+    if(source->fifo_length > prebuffer + MAX_EXTRA_BUFFERED_SAMPLES)
+    {
+        _fifo_skip(source, source->fifo_length - prebuffer);
+    }
+    source->has_frame = source->playing;
+    if(!source->playing) return;
+
+    size_t available = source->fifo_length < ALLO_MIX_FRAME_SAMPLES ? source->fifo_length : ALLO_MIX_FRAME_SAMPLES;
+    for(size_t i = 0; i < available; i++)
+    {
+        source->frame[i] = source->fifo[(source->fifo_start + i) % FIFO_SAMPLES];
+    }
+    memset(source->frame + available, 0, (ALLO_MIX_FRAME_SAMPLES - available) * sizeof(int16_t));
+    _fifo_skip(source, available);
+    if(available < ALLO_MIX_FRAME_SAMPLES)
+    {
+        // ran dry; buffer up again before continuing
+        source->playing = false;
+    }
+}
+
+static void _mix_listener(void *ctx, size_t index)
+{
+    allo_audio_mixer *mixer = ctx;
+    mix_listener *listener = mixer->mixing_listeners.data[index];
+    uint32_t timestamp = listener->timestamp;
+    listener->timestamp += ALLO_MIX_FRAME_SAMPLES;
+    listener->mixed = NULL;
+
+    float mix[ALLO_MIX_FRAME_SAMPLES] = {0};
+    bool audible = false;
+    for(size_t g = 0; g < listener->mixing_gains.length; g++)
+    {
+        mix_gain gain = listener->mixing_gains.data[g];
+        for(size_t s = 0; s < mixer->mixing_sources.length; s++)
+        {
+            mix_source *source = mixer->mixing_sources.data[s];
+            if(source->track_id != gain.track_id || !source->has_frame) continue;
+            allo_audio_mix_add(mix, source->frame, ALLO_MIX_FRAME_SAMPLES, gain.gain);
+            audible = true;
+            break;
+        }
+    }
+    if(!audible)
+    {
+        // nothing to say; the timestamp still moves on so the listener knows it's a pause
+        return;
+    }
+
+    int16_t pcm[ALLO_MIX_FRAME_SAMPLES];
+    allo_audio_mix_to_pcm(mix, pcm, ALLO_MIX_FRAME_SAMPLES);
+
+    const size_t headerlen = sizeof(uint32_t) + ALLO_AUDIO_SEQ_HEADER_SIZE;
+    ENetPacket *packet = enet_packet_create(NULL, headerlen + ALLO_AUDIO_MAX_PACKET_SIZE, ENET_PACKET_FLAG_UNSEQUENCED);
+    uint32_t big_track_id = htonl(ALLO_MIX_TRACK_ID);
+    memcpy(packet->data, &big_track_id, sizeof(big_track_id));
+    allo_audio_write_seq_header(packet->data + sizeof(uint32_t), listener->seq, timestamp, allo_audio_level(pcm, ALLO_MIX_FRAME_SAMPLES));
+    int len = opus_encode(listener->encoder, pcm, ALLO_MIX_FRAME_SAMPLES, packet->data + headerlen, ALLO_AUDIO_MAX_PACKET_SIZE);
+    if(len < 3) // error or DTX
+    {
+        enet_packet_destroy(packet);
+        return;
+    }
+    enet_packet_resize(packet, headerlen + len);
+    listener->seq++;
+    listener->mixed = packet;
+}
+
+static void _mix(allo_audio_mixer *mixer)
+{
+    mtx_lock(&mixer->lock);
+    // nobody else can be using removed ones at this point
+    for(size_t i = 0; i < mixer->sources.length; i++)
+    {
+        if(!mixer->sources.data[i]->removed) continue;
+        _source_free(mixer->sources.data[i]);
+        arr_splice(&mixer->sources, i, 1);
+        i--;
+    }
+    for(size_t i = 0; i < mixer->listeners.length; i++)
+    {
+        if(!mixer->listeners.data[i]->removed) continue;
+        _listener_free(mixer->listeners.data[i]);
+        arr_splice(&mixer->listeners, i, 1);
+        i--;
+    }
+
+    arr_clear(&mixer->mixing_sources);
+    for(size_t i = 0; i < mixer->sources.length; i++)
+    {
+        mix_source *source = mixer->sources.data[i];
+        mix_blob_list incoming = source->incoming;
+        source->incoming = source->decoding;
+        source->decoding = incoming;
+        arr_push(&mixer->mixing_sources, source);
+    }
+    arr_clear(&mixer->mixing_listeners);
+    for(size_t i = 0; i < mixer->listeners.length; i++)
+    {
+        mix_listener *listener = mixer->listeners.data[i];
+        arr_clear(&listener->mixing_gains);
+        if(listener->gains.length > 0)
+        {
+            arr_append(&listener->mixing_gains, listener->gains.data, listener->gains.length);
+        }
+        arr_push(&mixer->mixing_listeners, listener);
+    }
+    mtx_unlock(&mixer->lock);
+
+    allo_workpool_run(mixer->pool, mixer->mixing_sources.length, _decode_source, mixer);
+    allo_workpool_run(mixer->pool, mixer->mixing_listeners.length, _mix_listener, mixer);
+
+    mtx_lock(&mixer->lock);
+    for(size_t i = 0; i < mixer->mixing_listeners.length; i++)
+    {
+        mix_listener *listener = mixer->mixing_listeners.data[i];
+        if(!listener->mixed) continue;
+        if(listener->removed)
+        {
+            enet_packet_destroy(listener->mixed);
+        }
+        else
+        {
+            mix_output output = { listener->listener, listener->mixed };
+            arr_push(&mixer->outbox, output);
+        }
+        listener->mixed = NULL;
+    }
+    mtx_unlock(&mixer->lock);
+}
+
+static bool _stopping(allo_audio_mixer *mixer)
+{
+    mtx_lock(&mixer->lock);
+    bool stopping = mixer->stopping;
+    mtx_unlock(&mixer->lock);
+    return stopping;
+}
+
+static int _clock_thread(void *arg)
+{
+    allo_audio_mixer *mixer = arg;
+    double next = get_ts_monod();
+    while(!_stopping(mixer))
+    {
+        _mix(mixer);
+        next += MIX_INTERVAL;
+        double wait = next - get_ts_monod();
+        if(wait > 0)
+        {
+            struct timespec duration = { 0, (long)(wait * 1e9) };
+            thrd_sleep(&duration, NULL);
+        }
+        else if(wait < -10 * MIX_INTERVAL)
+        {
+            // way behind; skip ahead rather than mixing in a hurry to catch up
+            next = get_ts_monod();
+        }
+    }
+    return 0;
+}
+
+allo_audio_mixer *allo_audio_mixer_create_unclocked(int worker_threads)
+{
+    allo_audio_mixer *mixer = calloc(1, sizeof(allo_audio_mixer));
+    mtx_init(&mixer->lock, mtx_plain);
+    arr_init(&mixer->sources);
+    arr_init(&mixer->listeners);
+    arr_init(&mixer->outbox);
+    arr_init(&mixer->mixing_sources);
+    arr_init(&mixer->mixing_listeners);
+    mixer->pool = allo_workpool_create(worker_threads);
+    return mixer;
+}
+
+allo_audio_mixer *allo_audio_mixer_create(int worker_threads)
+{
+    allo_audio_mixer *mixer = allo_audio_mixer_create_unclocked(worker_threads);
+    mixer->clocked = true;
+    int success = thrd_create(&mixer->clock_thread, _clock_thread, mixer);
+    assert(success == thrd_success); (void)success;
+    return mixer;
+}
+
+void allo_audio_mixer_tick(allo_audio_mixer *mixer)
+{
+    assert(!mixer->clocked);
+    _mix(mixer);
+}
+
+void allo_audio_mixer_destroy(allo_audio_mixer *mixer)
+{
+    if(!mixer) return;
+    mtx_lock(&mixer->lock);
+    mixer->stopping = true;
+    mtx_unlock(&mixer->lock);
+    if(mixer->clocked) thrd_join(mixer->clock_thread, NULL);
+    allo_workpool_destroy(mixer->pool);
+
+    for(size_t i = 0; i < mixer->sources.length; i++) _source_free(mixer->sources.data[i]);
+    for(size_t i = 0; i < mixer->listeners.length; i++) _listener_free(mixer->listeners.data[i]);
+    for(size_t i = 0; i < mixer->outbox.length; i++) enet_packet_destroy(mixer->outbox.data[i].packet);
+    arr_free(&mixer->sources);
+    arr_free(&mixer->listeners);
+    arr_free(&mixer->outbox);
+    arr_free(&mixer->mixing_sources);
+    arr_free(&mixer->mixing_listeners);
+    mtx_destroy(&mixer->lock);
+    free(mixer);
+}
+
+void allo_audio_mixer_push(allo_audio_mixer *mixer, uint32_t track_id, bool sequenced, const uint8_t *data, size_t length)
+{
+    mix_blob *blob = malloc(sizeof(mix_blob) + length);
+    blob->length = length;
+    memcpy(blob->data, data, length);
+
+    mtx_lock(&mixer->lock);
+    mix_source *source = _source_find(mixer, track_id);
+    if(!source)
+    {
+        int err;
+        source = calloc(1, sizeof(mix_source));
+        source->track_id = track_id;
+        source->sequenced = sequenced;
+        source->decoder = opus_decoder_create(48000, 1, &err);
+        assert(source->decoder);
+        if(sequenced)
+        {
+            source->jitter = malloc(sizeof(allo_jitter_buffer));
+            allo_jitter_init(source->jitter);
+        }
+        arr_init(&source->incoming);
+        arr_init(&source->decoding);
+        arr_push(&mixer->sources, source);
+    }
+    if(source->incoming.length < MAX_INCOMING_PACKETS)
+    {
+        arr_push(&source->incoming, blob);
+        blob = NULL;
+    }
+    mtx_unlock(&mixer->lock);
+    free(blob);
+}
+
+void allo_audio_mixer_set_gains(allo_audio_mixer *mixer, const allo_audio_mix_gain *gains, size_t count)
+{
+    mtx_lock(&mixer->lock);
+    for(size_t i = 0; i < mixer->listeners.length; i++)
+    {
+        arr_clear(&mixer->listeners.data[i]->gains);
+    }
+    for(size_t i = 0; i < count; i++)
+    {
+        mix_listener *listener = _listener_find_or_create(mixer, gains[i].listener);
+        mix_gain gain = { gains[i].track_id, gains[i].gain };
+        arr_push(&listener->gains, gain);
+    }
+    mtx_unlock(&mixer->lock);
+}
+
+void allo_audio_mixer_remove_source(allo_audio_mixer *mixer, uint32_t track_id)
+{
+    mtx_lock(&mixer->lock);
+    mix_source *source = _source_find(mixer, track_id);
+    if(source) source->removed = true;
+    mtx_unlock(&mixer->lock);
+}
+
+void allo_audio_mixer_remove_listener(allo_audio_mixer *mixer, void *client)
+{
+    mtx_lock(&mixer->lock);
+    for(size_t i = 0; i < mixer->listeners.length; i++)
+    {
+        if(mixer->listeners.data[i]->listener == client) mixer->listeners.data[i]->removed = true;
+    }
+    for(size_t i = 0; i < mixer->outbox.length; i++)
+    {
+        if(mixer->outbox.data[i].listener != client) continue;
+        enet_packet_destroy(mixer->outbox.data[i].packet);
+        arr_splice(&mixer->outbox, i, 1);
+        i--;
+    }
+    mtx_unlock(&mixer->lock);
+}
+
+void allo_audio_mixer_send_pending(allo_audio_mixer *mixer, allo_audio_mixer_send_func send_func, void *ctx)
+{
+    mtx_lock(&mixer->lock);
+    for(size_t i = 0; i < mixer->outbox.length; i++)
+    {
+        send_func(ctx, mixer->outbox.data[i].listener, mixer->outbox.data[i].packet);
+    }
+    arr_clear(&mixer->outbox);
+    mtx_unlock(&mixer->lock);
+}
+
+void allo_audio_mix_add(float *mix, const int16_t *pcm, size_t count, float gain)
+{
+    for(size_t i = 0; i < count; i++)
+    {
+        mix[i] += pcm[i] * gain;
+    }
+}
+
+void allo_audio_mix_to_pcm(const float *mix, int16_t *pcm, size_t count)
+{
+    for(size_t i = 0; i < count; i++)
+    {
+        float v = mix[i];
+        pcm[i] = v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : (int16_t)v;
+    }
+}
+
+float allo_audio_mix_distance_gain(double distance)
+{
+    if(distance > ALLO_MIX_MAX_DISTANCE) return 0.0f;
+    if(distance <= 1.0) return 1.0f;
+    return (float)(1.0 / distance);
+}
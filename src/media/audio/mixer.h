@@ -0,0 +1,68 @@
+#ifndef ALLONET_AUDIO_MIXER_H
+#define ALLONET_AUDIO_MIXER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <enet/enet.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Track id that every listener gets its own mix on. Allocated tracks start at 1.
+#define ALLO_MIX_TRACK_ID 0
+/// 20ms at 48kHz
+#define ALLO_MIX_FRAME_SAMPLES 960
+/// Sources further away than this are left out of the mix
+#define ALLO_MIX_MAX_DISTANCE 50.0
+
+/**
+ * Place-side audio mixer, for rooms where forwarding every talker to every listener
+ * costs too much bandwidth. Decodes incoming audio tracks, and every 20ms mixes and
+ * encodes one sequenced Opus stream per listener on ALLO_MIX_TRACK_ID, using
+ * the gains from allo_audio_mixer_set_gains.
+ * Decoding and encoding happen on the mixer's own threads. All functions are
+ * meant to be called from the network thread.
+ */
+typedef struct allo_audio_mixer allo_audio_mixer;
+
+typedef struct allo_audio_mix_gain {
+    void *listener;
+    uint32_t track_id;
+    float gain;
+} allo_audio_mix_gain;
+
+/// @param worker_threads threads to decode and encode on, besides the mixer's clock thread
+allo_audio_mixer *allo_audio_mixer_create(int worker_threads);
+/// A mixer without a clock thread, that only mixes when allo_audio_mixer_tick is called. For tests.
+allo_audio_mixer *allo_audio_mixer_create_unclocked(int worker_threads);
+/// Mix one frame now, as the clock thread would every 20ms
+void allo_audio_mixer_tick(allo_audio_mixer *mixer);
+void allo_audio_mixer_destroy(allo_audio_mixer *mixer);
+
+/// Queue an audio packet (after its track id) from track_id for mixing.
+/// @param sequenced whether it has a seq header (see ALLO_AUDIO_SEQ_HEADER_SIZE)
+void allo_audio_mixer_push(allo_audio_mixer *mixer, uint32_t track_id, bool sequenced, const uint8_t *data, size_t length);
+/// Replace who hears what. Listeners that aren't mentioned get nothing.
+void allo_audio_mixer_set_gains(allo_audio_mixer *mixer, const allo_audio_mix_gain *gains, size_t count);
+void allo_audio_mixer_remove_source(allo_audio_mixer *mixer, uint32_t track_id);
+/// Forget a listener, including any mixes for it that haven't been sent yet.
+void allo_audio_mixer_remove_listener(allo_audio_mixer *mixer, void *listener);
+
+typedef void (*allo_audio_mixer_send_func)(void *ctx, void *listener, ENetPacket *packet);
+/// Hand all mixes finished so far to `send_func`, which takes ownership of the packets.
+void allo_audio_mixer_send_pending(allo_audio_mixer *mixer, allo_audio_mixer_send_func send_func, void *ctx);
+
+/// Add `count` samples of `pcm` into `mix`, at `gain`
+void allo_audio_mix_add(float *mix, const int16_t *pcm, size_t count, float gain);
+/// Round a mix to 16 bit samples, clipping anything too loud
+void allo_audio_mix_to_pcm(const float *mix, int16_t *pcm, size_t count);
+/// Inverse distance falloff, full volume within a meter, and silence beyond ALLO_MIX_MAX_DISTANCE.
+float allo_audio_mix_distance_gain(double distance);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,44 @@
+#include "pcm_pool.h"
+#include "jitter.h"
+#include "../../threading.h"
+#include <stdlib.h>
+
+// enough for a few hundred ms of audio from a room full of people, waiting to be played
+#define MAX_POOLED_BUFFERS 256
+
+static once_flag pool_once = ONCE_FLAG_INIT;
+static mtx_t pool_lock;
+static int16_t *pool[MAX_POOLED_BUFFERS];
+static int pool_count;
+
+static void pool_init(void)
+{
+    mtx_init(&pool_lock, mtx_plain);
+}
+
+int16_t *allo_pcm_buffer_get(void)
+{
+    call_once(&pool_once, pool_init);
+    int16_t *pcm = NULL;
+    mtx_lock(&pool_lock);
+    if(pool_count > 0)
+    {
+        pcm = pool[--pool_count];
+    }
+    mtx_unlock(&pool_lock);
+    return pcm ? pcm : malloc(ALLO_AUDIO_MAX_FRAME_SAMPLES * sizeof(int16_t));
+}
+
+void allo_pcm_buffer_return(int16_t *pcm)
+{
+    if(!pcm) return;
+    call_once(&pool_once, pool_init);
+    mtx_lock(&pool_lock);
+    if(pool_count < MAX_POOLED_BUFFERS)
+    {
+        pool[pool_count++] = pcm;
+        pcm = NULL;
+    }
+    mtx_unlock(&pool_lock);
+    free(pcm);
+}
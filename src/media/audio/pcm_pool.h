@@ -0,0 +1,23 @@
+#ifndef ALLONET_AUDIO_PCM_POOL_H
+#define ALLONET_AUDIO_PCM_POOL_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Recycles the buffers that decoded audio is handed to the app in, so that receiving
+ * audio doesn't allocate for every frame. Every buffer holds ALLO_AUDIO_MAX_FRAME_SAMPLES
+ * samples and comes from malloc, so it's fine to free() one instead of returning it;
+ * it just won't be reused. Thread safe.
+ */
+int16_t *allo_pcm_buffer_get(void);
+void allo_pcm_buffer_return(int16_t *pcm);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
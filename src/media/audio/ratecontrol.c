@@ -0,0 +1,133 @@
+#include "ratecontrol.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include "../../atomics.h"
+
+#define MIN_BITRATE 8000
+#define MAX_BITRATE 40000
+#define START_BITRATE 24000
+// taken off on every congested update, and added on every clean one
+#define BACKOFF_FACTOR 0.75
+#define RECOVERY_STEP 2000
+// RTT this much above the lowest we've seen means packets are queueing up somewhere
+#define QUEUEING_RTT 0.05
+#define MIN_LOSS_PERCENT 2
+#define MAX_LOSS_PERCENT 40
+
+#define START_COMPLEXITY 9
+#define MIN_COMPLEXITY 2
+#define MAX_COMPLEXITY 10
+// fraction of real time spent encoding, above which we lower complexity and below which we raise it
+#define MAX_ENCODE_LOAD 0.10
+#define MIN_ENCODE_LOAD 0.02
+// frames to wait after changing complexity before judging the new one
+#define COMPLEXITY_SETTLE_FRAMES 100
+
+struct allo_audio_rate_controller {
+    // network thread
+    double bitrate;
+    double loss;
+    double base_rtt;
+
+    // bitrate, loss percent and frame duration in ms, packed by _pack
+    allo_atomic_u64 network_settings;
+
+    // encoding thread
+    uint64_t applied; // network_settings last handed out
+    int complexity;
+    bool complexity_changed;
+    double encode_load;
+    int frames_since_complexity_change;
+};
+
+static uint64_t _pack(int bitrate, int loss_percent, int frame_ms)
+{
+    return (uint64_t)bitrate | (uint64_t)loss_percent << 32 | (uint64_t)frame_ms << 40;
+}
+
+static int _frame_ms_for(double bitrate)
+{
+    // every packet costs ~40 bytes of IP, UDP and ENet headers, which matters more the fewer bits we have
+    return bitrate < 12000 ? 60 : bitrate < 16000 ? 40 : 20;
+}
+
+allo_audio_rate_controller *allo_audio_rate_controller_create(void)
+{
+    allo_audio_rate_controller *ctl = calloc(1, sizeof(allo_audio_rate_controller));
+    ctl->bitrate = START_BITRATE;
+    ctl->complexity = START_COMPLEXITY;
+    allo_atomic_u64_store(&ctl->network_settings, _pack(START_BITRATE, 10, _frame_ms_for(START_BITRATE)));
+    return ctl;
+}
+
+void allo_audio_rate_controller_destroy(allo_audio_rate_controller *ctl)
+{
+    free(ctl);
+}
+
+void allo_audio_rate_update(allo_audio_rate_controller *ctl, const allo_audio_link_stats *stats)
+{
+    ctl->loss = 0.7 * ctl->loss + 0.3 * stats->loss;
+    if(ctl->base_rtt == 0 || stats->rtt < ctl->base_rtt)
+    {
+        ctl->base_rtt = stats->rtt;
+    }
+    else
+    {
+        // follow route changes, slowly
+        ctl->base_rtt += (stats->rtt - ctl->base_rtt) * 0.01;
+    }
+
+    bool congested = stats->throttle < 0.9 || stats->loss > 0.1 || stats->rtt > ctl->base_rtt + QUEUEING_RTT;
+    if(congested)
+    {
+        ctl->bitrate *= BACKOFF_FACTOR;
+    }
+    else if(stats->loss < 0.02)
+    {
+        ctl->bitrate += RECOVERY_STEP;
+    }
+    if(ctl->bitrate < MIN_BITRATE) ctl->bitrate = MIN_BITRATE;
+    if(ctl->bitrate > MAX_BITRATE) ctl->bitrate = MAX_BITRATE;
+
+    // a bit more FEC than the loss we've seen, since loss comes in bursts
+    int loss_percent = (int)ceil(ctl->loss * 150);
+    if(loss_percent < MIN_LOSS_PERCENT) loss_percent = MIN_LOSS_PERCENT;
+    if(loss_percent > MAX_LOSS_PERCENT) loss_percent = MAX_LOSS_PERCENT;
+
+    allo_atomic_u64_store(&ctl->network_settings, _pack((int)ctl->bitrate, loss_percent, _frame_ms_for(ctl->bitrate)));
+}
+
+bool allo_audio_rate_settings(allo_audio_rate_controller *ctl, allo_audio_encoder_settings *settings)
+{
+    uint64_t network = allo_atomic_u64_load(&ctl->network_settings);
+    settings->bitrate = (int)(network & 0xffffffff);
+    settings->loss_percent = (int)((network >> 32) & 0xff);
+    settings->frame_samples = (int)(network >> 40) * 48;
+    settings->complexity = ctl->complexity;
+
+    bool changed = network != ctl->applied || ctl->complexity_changed;
+    ctl->applied = network;
+    ctl->complexity_changed = false;
+    return changed;
+}
+
+void allo_audio_rate_encoded(allo_audio_rate_controller *ctl, double seconds, int frame_samples)
+{
+    double load = seconds / (frame_samples / 48000.0);
+    ctl->encode_load = ctl->frames_since_complexity_change == 0 ? load : 0.9 * ctl->encode_load + 0.1 * load;
+    if(++ctl->frames_since_complexity_change < COMPLEXITY_SETTLE_FRAMES)
+    {
+        return;
+    }
+    int complexity = ctl->complexity;
+    if(ctl->encode_load > MAX_ENCODE_LOAD && complexity > MIN_COMPLEXITY) complexity--;
+    else if(ctl->encode_load < MIN_ENCODE_LOAD && complexity < MAX_COMPLEXITY) complexity++;
+    if(complexity != ctl->complexity)
+    {
+        ctl->complexity = complexity;
+        ctl->complexity_changed = true;
+        ctl->frames_since_complexity_change = 0;
+    }
+}
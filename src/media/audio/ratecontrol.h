@@ -0,0 +1,51 @@
+#ifndef ALLONET_AUDIO_RATECONTROL_H
+#define ALLONET_AUDIO_RATECONTROL_H
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Decides how to encode outgoing audio from how the link to the place is doing, and
+ * from how long encoding takes on this machine. Backs off bitrate quickly when ENet
+ * starts throttling, losing packets or queueing (RTT going up), and creeps back up
+ * while the link is clean. At low bitrates it sends longer frames, so less of the
+ * bandwidth goes to packet headers, and it puts in as much FEC as the loss calls for.
+ *
+ * allo_audio_rate_update is called from the network thread, and the rest from whatever
+ * thread encodes audio; the two only share the latest settings, through an atomic.
+ */
+typedef struct allo_audio_rate_controller allo_audio_rate_controller;
+
+typedef struct allo_audio_link_stats {
+    double loss;     // fraction of packets lost lately, 0-1
+    double rtt;      // round trip time, in seconds
+    double throttle; // fraction of unreliable packets that ENet lets through, 0-1
+} allo_audio_link_stats;
+
+typedef struct allo_audio_encoder_settings {
+    int bitrate;       // bits per second
+    int complexity;    // 0-10
+    int loss_percent;  // packet loss that in-band FEC should be able to cover
+    int frame_samples; // 480, 960, 1920 or 2880 (10, 20, 40 or 60ms at 48kHz)
+} allo_audio_encoder_settings;
+
+allo_audio_rate_controller *allo_audio_rate_controller_create(void);
+void allo_audio_rate_controller_destroy(allo_audio_rate_controller *ctl);
+
+/// Feed it fresh link statistics, a couple of times per second
+void allo_audio_rate_update(allo_audio_rate_controller *ctl, const allo_audio_link_stats *stats);
+/** What to encode the next frame with.
+ * @return whether anything changed since the last call, so the encoder needs to be reconfigured
+ */
+bool allo_audio_rate_settings(allo_audio_rate_controller *ctl, allo_audio_encoder_settings *settings);
+/// Tell it how long encoding a frame took, so it can lower the complexity on slow machines
+void allo_audio_rate_encoded(allo_audio_rate_controller *ctl, double seconds, int frame_samples);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -5,8 +5,11 @@
 #include <string.h>
 #include "../util.h"
 #include "video/mjpeg.h"
+#include "video/tiled.h"
 #include "audio/audio.h"
+#include "video/fragment.h"
 #include <libavcodec/avcodec.h>
+#include "../atomics.h"
 
 #define DEBUG_AUDIO 0
 
@@ -22,26 +25,146 @@ static inline char* formatTrackId(allo_media_track *track) {
     if(trackId)free(trackId); \
 } while(false)
 
-allo_media_track *_media_track_find(allo_media_track_list *tracklist, uint32_t track_id) {
-    for(size_t i = 0; i < tracklist->length; i++) {
-        allo_media_track *track = &tracklist->data[i];
-        if (track->track_id == track_id) {
-            return track;
+struct allo_media_track_list {
+    allo_atomic_ptr table; // allo_media_track_table *
+    allo_atomic_int readers;
+    mtx_t write_lock;
+    // unpublished, but maybe still in use by readers
+    arr_t(allo_media_track_table *) retired_tables;
+    arr_t(allo_media_track *) retired_tracks;
+};
+
+static inline size_t _track_slot(uint32_t track_id, size_t capacity) {
+    return (track_id * 2654435761u) & (capacity - 1);
+}
+
+static allo_media_track_table *_table_create(size_t count) {
+    // keep it at most half full so probes stay short
+    size_t capacity = 8;
+    while (capacity < count * 2) capacity *= 2;
+    allo_media_track_table *table = malloc(sizeof(allo_media_track_table) + capacity * sizeof(allo_media_track *));
+    table->capacity = capacity;
+    table->count = 0;
+    table->slots = (allo_media_track **)(table + 1);
+    memset(table->slots, 0, capacity * sizeof(allo_media_track *));
+    return table;
+}
+
+static void _table_insert(allo_media_track_table *table, allo_media_track *track) {
+    size_t i = _track_slot(track->track_id, table->capacity);
+    while (table->slots[i]) i = (i + 1) & (table->capacity - 1);
+    table->slots[i] = track;
+    table->count++;
+}
+
+/// Publish a copy of the current table with `added` added and `removed` left out. Call with write_lock held.
+static void _table_replace(allo_media_track_list *tracklist, allo_media_track *added, allo_media_track *removed) {
+    allo_media_track_table *old = (allo_media_track_table *)allo_atomic_ptr_load(&tracklist->table);
+    allo_media_track_table *table = _table_create(old->count + 1);
+    for (size_t i = 0; i < old->capacity; i++) {
+        if (old->slots[i] && old->slots[i] != removed) _table_insert(table, old->slots[i]);
+    }
+    if (added) _table_insert(table, added);
+    allo_atomic_ptr_store(&tracklist->table, table);
+    arr_push(&tracklist->retired_tables, old);
+}
+
+static void _track_free(allo_media_track *track) {
+    if (track->subsystem) {
+        track->subsystem->track_destroy(track);
+    }
+    arr_free(&track->recipients);
+    mtx_destroy(&track->bitrates_lock);
+    if (track->type == allo_media_type_audio) {
+        arr_free(&track->info.audio.forward_to);
+    } else if (track->type == allo_media_type_video) {
+        _media_video_track_free(track);
+    }
+    free(track);
+}
+
+allo_media_track_list *_media_tracks_create(void) {
+    allo_media_track_list *tracklist = calloc(1, sizeof(allo_media_track_list));
+    allo_atomic_ptr_store(&tracklist->table, _table_create(0));
+    allo_atomic_int_store(&tracklist->readers, 0);
+    mtx_init(&tracklist->write_lock, mtx_plain);
+    return tracklist;
+}
+
+void _media_tracks_destroy(allo_media_track_list *tracklist) {
+    if (!tracklist) return;
+    assert(allo_atomic_int_load(&tracklist->readers) == 0);
+    allo_media_track_table *table = (allo_media_track_table *)allo_atomic_ptr_load(&tracklist->table);
+    for (size_t i = 0; i < table->capacity; i++) {
+        if (table->slots[i]) _track_free(table->slots[i]);
+    }
+    free(table);
+    _media_tracks_reclaim(tracklist);
+    arr_free(&tracklist->retired_tables);
+    arr_free(&tracklist->retired_tracks);
+    mtx_destroy(&tracklist->write_lock);
+    free(tracklist);
+}
+
+const allo_media_track_table *_media_tracks_read_begin(allo_media_track_list *tracklist) {
+    allo_atomic_int_fetch_add(&tracklist->readers, 1);
+    return (allo_media_track_table *)allo_atomic_ptr_load(&tracklist->table);
+}
+
+void _media_tracks_read_end(allo_media_track_list *tracklist) {
+    allo_atomic_int_fetch_add(&tracklist->readers, -1);
+}
+
+void _media_tracks_reclaim(allo_media_track_list *tracklist) {
+    mtx_lock(&tracklist->write_lock);
+    // anyone who got hold of a retired table or track is still inside their read section
+    if (allo_atomic_int_load(&tracklist->readers) == 0) {
+        for (size_t i = 0; i < tracklist->retired_tracks.length; i++) {
+            _track_free(tracklist->retired_tracks.data[i]);
+        }
+        for (size_t i = 0; i < tracklist->retired_tables.length; i++) {
+            free(tracklist->retired_tables.data[i]);
+        }
+        arr_clear(&tracklist->retired_tracks);
+        arr_clear(&tracklist->retired_tables);
+    }
+    mtx_unlock(&tracklist->write_lock);
+}
+
+allo_media_track *_media_track_table_find(const allo_media_track_table *table, uint32_t track_id) {
+    for (size_t i = _track_slot(track_id, table->capacity); table->slots[i]; i = (i + 1) & (table->capacity - 1)) {
+        if (table->slots[i]->track_id == track_id) {
+            return table->slots[i];
         }
     }
     return NULL;
 }
 
-allo_media_track *_media_track_create(allo_media_track_list *tracklist, uint32_t track_id, allo_media_track_type type) {
-    // reserve 1 extra and use that as our track data
-    arr_reserve(tracklist, tracklist->length + 1);
-    allo_media_track *track = &tracklist->data[tracklist->length++];
-    memset(track, 0, sizeof(allo_media_track));
+allo_media_track *_media_track_find(allo_media_track_list *tracklist, uint32_t track_id) {
+    return _media_track_table_find((allo_media_track_table *)allo_atomic_ptr_load(&tracklist->table), track_id);
+}
+
+static allo_media_track *_track_alloc(uint32_t track_id, allo_media_track_type type) {
+    allo_media_track *track = calloc(1, sizeof(allo_media_track));
     track->track_id = track_id;
     track->type = type;
     arr_init(&track->recipients);
-    
+    mtx_init(&track->bitrates_lock, mtx_plain);
+    return track;
+}
+
+/// Make a fully set up track visible to readers
+static void _track_publish(allo_media_track_list *tracklist, allo_media_track *track) {
+    mtx_lock(&tracklist->write_lock);
+    _table_replace(tracklist, track, NULL);
+    mtx_unlock(&tracklist->write_lock);
+    _media_tracks_reclaim(tracklist);
     media_log(ALLO_LOG_DEBUG, track, "Track was created");
+}
+
+allo_media_track *_media_track_create(allo_media_track_list *tracklist, uint32_t track_id, allo_media_track_type type) {
+    allo_media_track *track = _track_alloc(track_id, type);
+    _track_publish(tracklist, track);
     return track;
 }
 
@@ -58,19 +181,25 @@ void _media_track_destroy(allo_media_track_list *tracklist, allo_media_track *tr
     if (!track) return;
     
     media_log(ALLO_LOG_DEBUG, track, "Destroying");
-    if(track->subsystem) {
-        track->subsystem->track_destroy(track);
-    } else {
-        media_log(ALLO_LOG_ERROR, track, "Destruction failed; subsystem was not set");
-    }
     
-    // remove from the list
-    for (size_t i = 0; i < tracklist->length; i++) {
-        if (track == &tracklist->data[i]) {
-            arr_splice(tracklist, i, 1);
-            break;
-        }
-    }
+    // remove from the table now, but only free it once nobody can be using it
+    mtx_lock(&tracklist->write_lock);
+    _table_replace(tracklist, NULL, track);
+    arr_push(&tracklist->retired_tracks, track);
+    mtx_unlock(&tracklist->write_lock);
+    _media_tracks_reclaim(tracklist);
+}
+
+void _media_track_count_sent(allo_media_track *track, size_t bytes) {
+    mtx_lock(&track->bitrates_lock);
+    bitrate_increment_sent(&track->bitrates, bytes);
+    mtx_unlock(&track->bitrates_lock);
+}
+
+void _media_track_count_received(allo_media_track *track, size_t bytes) {
+    mtx_lock(&track->bitrates_lock);
+    bitrate_increment_received(&track->bitrates, bytes);
+    mtx_unlock(&track->bitrates_lock);
 }
 
 allo_media_track_type _media_track_type_from_string(const char *string) {
@@ -86,13 +215,14 @@ allo_media_track_type _media_track_type_from_string(const char *string) {
 }
 
 void _alloclient_media_track_find_or_create(alloclient *client, uint32_t track_id, allo_media_track_type type, const cJSON *comp) {
-    alloclient_internal_shared *shared = _alloclient_internal_shared_begin(client);
+    allo_media_track_list *tracks = _internal(client)->shared->media_tracks;
     
-    allo_media_track *track = _media_track_find(&shared->media_tracks, track_id);
+    allo_media_track *track = _media_track_find(tracks, track_id);
     if (track) {
         assert(track->type == type);
     } else {
-        allo_media_track *track = _media_track_create(&shared->media_tracks, track_id, type);
+        // set it up before it's published, so that other threads never see it half done
+        track = _track_alloc(track_id, type);
         int i = 0;
         allo_media_subsystem *subsystem;
         while((subsystem = allo_media_subsystems[i++])) {
@@ -105,27 +235,31 @@ void _alloclient_media_track_find_or_create(alloclient *client, uint32_t track_i
             const char *type = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(comp, "type"));
             const char *fmt = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(comp, "format"));
             media_log(ALLO_LOG_ERROR, track, "Unknown media format %s.%s, skipping.", type, fmt);
-            _media_track_destroy(&shared->media_tracks, track);
+            _track_free(track);
+            return;
         }
+        if (type == allo_media_type_video) {
+            _alloclient_video_track_initialize(track, comp);
+        }
+        _track_publish(tracks, track);
     }
-    
-    _alloclient_internal_shared_end(client);
 }
 
 
 void _alloclient_media_track_destroy(alloclient *client, uint32_t track_id)
 {
-    alloclient_internal_shared *shared = _alloclient_internal_shared_begin(client);
+    allo_media_track_list *tracks = _internal(client)->shared->media_tracks;
     
-    allo_media_track *track = _media_track_find(&shared->media_tracks, track_id);
+    allo_media_track *track = _media_track_find(tracks, track_id);
     
     if (track) {
-        _media_track_destroy(&shared->media_tracks, track);
+        if (_internal(client)->video_decoders) {
+            allo_video_decode_queue_forget(_internal(client)->video_decoders, track_id);
+        }
+        _media_track_destroy(tracks, track);
     } else {
         media_log(ALLO_LOG_ERROR, NULL, "Was asked to destroy track %d but it was not found", track_id);
     }
-    
-    _alloclient_internal_shared_end(client);
 }
 
 static void _alloclient_media_add_track_from_comp(alloclient *client, const cJSON *cdata)
@@ -183,7 +317,6 @@ void _alloclient_media_handle_statediff(alloclient *client, allo_state_diff *dif
 
 void _alloclient_parse_media(alloclient *client, unsigned char *data, size_t length)
 {
-    alloclient_internal_shared *shared = _alloclient_internal_shared_begin(client);
     size_t datalength = length;
     // get the track_id from the top of data
     uint32_t track_id;
@@ -194,15 +327,19 @@ void _alloclient_parse_media(alloclient *client, unsigned char *data, size_t len
     length -= sizeof(track_id);
     
     // see if we have allocated a media object for this
-    allo_media_track *track = _media_track_find(&shared->media_tracks, track_id);
+    // tracks are only created and destroyed on this thread, so no need for a read section
+    allo_media_track *track = _media_track_find(_internal(client)->shared->media_tracks, track_id);
     if (!track) {
         // it is possible to receive data before the track exists in components
-        _alloclient_internal_shared_end(client);
         return;
     }
-    bitrate_increment_received(&track->bitrates, datalength);
+    _media_track_count_received(track, datalength);
 
-    track->subsystem->parse(client, track, data, length, &shared->lock);
+    if (track->type == allo_media_type_video) {
+        _alloclient_receive_video(client, track, data, length);
+    } else {
+        track->subsystem->parse(client, track, data, length);
+    }
 }
 
 allo_media_subsystem *allo_media_subsystems[255];
@@ -222,14 +359,19 @@ void _allo_media_initialize(void)
 {
     allo_media_audio_register();
     allo_media_mjpeg_register();
+    allo_media_tiled_register();
 }
 
 
 void allo_media_get_stats(allo_media_track_list *media_tracks, char *buffer, size_t buffersize) {
     double time = get_ts_monod();
-    for(size_t i = 0; i < media_tracks->length; i++) {
-        allo_media_track *track = &media_tracks->data[i];
+    const allo_media_track_table *table = _media_tracks_read_begin(media_tracks);
+    for(size_t i = 0; i < table->capacity; i++) {
+        allo_media_track *track = table->slots[i];
+        if (!track) continue;
+        mtx_lock(&track->bitrates_lock);
         struct bitrate_deltas_t deltas = bitrate_deltas(&track->bitrates, time);
+        mtx_unlock(&track->bitrates_lock);
         
         int len = strlen(buffer);
         buffersize -= len;
@@ -242,5 +384,18 @@ void allo_media_get_stats(allo_media_track_list *media_tracks, char *buffer, siz
                  deltas.sent_bytes/1024.0,
                  deltas.received_bytes/1024.0
                  );
+        if (track->type == allo_media_type_audio && track->info.audio.jitter) {
+            allo_jitter_stats *stats = &track->info.audio.jitter->stats;
+            len = strlen(buffer);
+            snprintf(buffer + len, buffersize - len,
+                     "\tconcealed %.1f%% (%llu fec, %llu plc, %llu late), waiting for %d\n",
+                     allo_jitter_loss_percent(stats),
+                     (unsigned long long)stats->recovered,
+                     (unsigned long long)stats->concealed,
+                     (unsigned long long)stats->late,
+                     track->info.audio.jitter->depth
+                     );
+        }
     }
+    _media_tracks_read_end(media_tracks);
 }
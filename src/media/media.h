@@ -8,6 +8,11 @@
 #include <libavcodec/avcodec.h>
 #include "../threading.h"
 #include "../util.h"
+#include "audio/jitter.h"
+#include "audio/pcm_pool.h"
+#include "audio/ratecontrol.h"
+#include "video/fragment.h"
+#include "video/simulcast.h"
 #include <allonet/client.h>
 
 #ifdef __cplusplus
@@ -32,23 +37,42 @@ typedef enum allo_audio_format {
 typedef enum allo_video_format {
     allo_video_format_invalid = -1,
     allo_video_format_mjpeg,
-    allo_video_format_h264
+    allo_video_format_h264,
+    allo_video_format_tiled
 } allo_video_format;
 
 struct SwsContext;
 
-typedef struct {
+typedef struct allo_media_track {
     uint32_t track_id;
     allo_media_track_type type;
     void *origin; // client that allocated the track
     arr_t(void *) recipients; // clients that want the track
     allo_media_subsystem *subsystem; // subsystem managing this track
+    // packets are counted as they're sent on the app's threads and received on the network thread,
+    // and read by whoever asks for stats, so only touch bitrates with bitrates_lock held
     struct bitrate_t bitrates;
+    mtx_t bitrates_lock;
     union {
         struct {
             OpusDecoder *decoder;
             FILE *debug;
             allo_audio_format format;
+            bool sequenced; // packets have an ALLO_AUDIO_SEQ_HEADER_SIZE header and are sent unsequenced
+            allo_jitter_buffer *jitter; // only if sequenced
+            // sending client: belongs to the one thread that sends on the track (see alloclient_send_audio),
+            // and nothing else touches it, so it isn't locked. Freed with the track, after any read section.
+            uint16_t send_seq;
+            uint32_t send_timestamp;
+            int16_t *send_pcm; // audio from the app that doesn't make up a whole frame yet
+            size_t send_pcm_length;
+            // client only: packets received since the last decode, and frames decoded from them but not yet delivered
+            arr_t(allo_audio_packet) pending;
+            arr_t(allo_jitter_frame) decoded;
+            // place only: peak level in dBov as of last_heard, and who to forward to if culling audio
+            float loudness;
+            double last_heard;
+            arr_t(void *) forward_to;
         } audio;
         struct {
             allo_video_format format;
@@ -57,6 +81,14 @@ typedef struct {
                 AVCodecContext *context;
                 AVPacket *packet;
                 struct SwsContext *scale_context;
+                // frames to convert pictures into, reused once the encoder is done with them
+                arr_t(AVFrame *) frames;
+                size_t next_frame;
+                // created on the first frame sent on an mjpeg track
+                struct allo_mjpeg_encoder *mjpeg;
+                // created on the first frame sent on a tiled track
+                struct allo_tiled_encoder *tiled;
+                double last_keyframe;
             } encoder;
             struct {
                 AVCodec *codec;
@@ -64,24 +96,65 @@ typedef struct {
                 struct SwsContext *scale_context;
                 AVPacket *packet;
                 AVFrame *frame;
+                // the framebuffer of a tiled track, owned by the client's decode queue
+                struct allo_tiled_decoder *tiled;
             } decoder;
             int width, height;
             int framenr;
+            // whether create_video_packet's latest packet can be decoded without the ones before it
+            bool keyframe;
+            // frames are sent in fragments with an ALLO_VIDEO_FRAGMENT_HEADER_SIZE header; see fragment.h
+            bool fragmented;
+            uint16_t next_frame_id;
+            // receiving client; and place, to send whole frames of the base layer to recipients without fragmented_video
+            struct allo_video_reassembler *reassembler;
+            // sending client: a receiver asked for a keyframe. Receiving client and place: when we last asked for or passed one on, by layer.
+            bool keyframe_requested;
+            double last_keyframe_request[ALLO_VIDEO_MAX_LAYERS];
+            // receiving client: the subsystem can't show the whole picture until it gets a keyframe
+            bool keyframe_needed;
+            // simulcast, if more than 1; see simulcast.h
+            int layer_count;
+            // sending client: a track of its own for each layer after the first, to keep its encoder and frame ids in
+            struct allo_media_track *layers[ALLO_VIDEO_MAX_LAYERS - 1];
+            int layer; // of such a layer track
+            // receiving client: the layer the place is sending us
+            int receiving_layer;
+            // place: which layer each recipient gets
+            arr_t(allo_video_subscriber) subscribers;
         } video;
     } info;
 } allo_media_track;
 
-typedef arr_t(allo_media_track) allo_media_track_list;
+/**
+ * Tracks by track_id. Tracks stay at the same address for as long as they exist.
+ * Lookups never lock: the table of tracks is replaced as a whole whenever a track is
+ * created or destroyed, and readers just look in whichever table is current.
+ * Only one thread (the network thread) creates and destroys tracks. It can use the tracks
+ * it finds freely. Any other thread must only touch tracks (and tables) between
+ * _media_tracks_read_begin and _media_tracks_read_end, and destroyed tracks and old
+ * tables are only freed by _media_tracks_reclaim once no such read section is open.
+ */
+typedef struct allo_media_track_list allo_media_track_list;
+
+typedef struct allo_media_track_table {
+    size_t capacity; // power of two
+    size_t count;
+    allo_media_track **slots; // open addressing by track_id; NULL where empty
+} allo_media_track_table;
+
 typedef struct alloclient alloclient;
 
 typedef struct allo_media_subsystem {
     /// each subsystem is tested to see if it wants to manage this track. return true if successful.
     bool (*track_initialize)(allo_media_track *track, const cJSON *component);
     void (*track_destroy)(allo_media_track *track);
-    void (*parse)(alloclient *client, allo_media_track *track, unsigned char *data, size_t length, mtx_t *unlock_me);
+    void (*parse)(alloclient *client, allo_media_track *track, unsigned char *data, size_t length);
 
     // only one of these should be set for a subsystem
     ENetPacket* (*create_video_packet)(allo_media_track *track, allopicture *picture);
+    /// optional: encoded frames that came out of the encoder later than the picture they're from, one per call
+    ENetPacket* (*drain_video_packet)(allo_media_track *track);
     ENetPacket* (*create_audio_packet)(allo_media_track *track, const int16_t *pcm, size_t frameCount);
 } allo_media_subsystem;
 extern allo_media_subsystem *allo_media_subsystems[];
@@ -89,16 +162,33 @@ extern void allo_media_subsystem_register(allo_media_subsystem *subsystem);
 
 allo_media_track_type _media_track_type_from_string(const char *string);
 
+allo_media_track_list *_media_tracks_create(void);
+/// Free the list and every track in it
+void _media_tracks_destroy(allo_media_track_list *tracklist);
+
+/// Start reading from another thread than the one that creates and destroys tracks
+const allo_media_track_table *_media_tracks_read_begin(allo_media_track_list *tracklist);
+void _media_tracks_read_end(allo_media_track_list *tracklist);
+/// Free destroyed tracks, unless someone might still be using them. Call every now and then from the network thread.
+void _media_tracks_reclaim(allo_media_track_list *tracklist);
+
+/// Count a packet sent or received on `track`, from any thread
+void _media_track_count_sent(allo_media_track *track, size_t bytes);
+void _media_track_count_received(allo_media_track *track, size_t bytes);
+
 /// Find a track with track_id in tracklist
 allo_media_track *_media_track_find(allo_media_track_list *tracklist, uint32_t track_id);
+allo_media_track *_media_track_table_find(const allo_media_track_table *table, uint32_t track_id);
 
 /// Create a new track in tracklist
 allo_media_track *_media_track_create(allo_media_track_list *tracklist, uint32_t track_id, allo_media_track_type type);
 
 allo_media_track *_media_track_find_or_create(allo_media_track_list *tracklist, uint32_t track_id, allo_media_track_type type);
 
-/// Remove a track from tracklist
+/// Remove a track from tracklist. It's torn down and freed later, by _media_tracks_reclaim.
 void _media_track_destroy(allo_media_track_list *tracklist, allo_media_track *track);
+/// Free what's common to all video tracks, after the subsystem has torn down the rest
+void _media_video_track_free(allo_media_track *track);
 
 void allo_media_get_stats(allo_media_track_list *media_tracks, char *buffer, size_t buffersize);
 
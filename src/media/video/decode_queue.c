@@ -0,0 +1,334 @@
+#include "decode_queue.h"
+#include "pixel_pool.h"
+#include "../../threading.h"
+#include <allonet/arr.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+// frames a track with its own decoder can fall behind by before the oldest are dropped, and it
+// needs a keyframe to catch up
+#define MAX_BACKLOG 32
+
+typedef struct decode_slot {
+    uint32_t track_id;
+    // from allo_video_decode_queue_set_decoder, if the track has its own
+    allo_video_stateful_decode_func decode;
+    void *state;
+    void (*free_state)(void *state);
+    // the newest frame, until a thread picks it up; or every frame since, for a track with its
+    // own decoder, as its frames build on each other. Each one after its length as a uint32_t.
+    uint8_t *pending;
+    size_t pending_length, pending_capacity;
+    int pending_count;
+    bool has_pending;
+    // the frames being decoded; swapped with pending when a thread picks them up
+    uint8_t *decoding;
+    size_t decoding_capacity;
+    bool busy;
+    // the track went away while busy; the decoding thread frees the slot
+    bool forgotten;
+    allo_decoded_video_frame decoded;
+    bool has_decoded;
+} decode_slot;
+
+struct allo_video_decode_queue {
+    allo_video_decode_func decode;
+    mtx_t lock;
+    cnd_t wake;
+    bool stopping;
+    arr_t(decode_slot *) slots;
+    size_t next_slot; // where to start looking for work, so that every track gets its turn
+    arr_t(thrd_t) threads;
+    allo_video_decode_stats stats;
+};
+
+static void _frame_return(allo_decoded_video_frame *frame)
+{
+    allo_pixel_buffer_return(frame->pixels, (size_t)frame->wide * frame->high);
+    frame->pixels = NULL;
+}
+
+static void _slot_free(decode_slot *slot)
+{
+    if(slot->has_decoded) _frame_return(&slot->decoded);
+    if(slot->free_state) slot->free_state(slot->state);
+    free(slot->pending);
+    free(slot->decoding);
+    free(slot);
+}
+
+static void _slot_remove(allo_video_decode_queue *queue, decode_slot *slot)
+{
+    for(size_t i = 0; i < queue->slots.length; i++)
+    {
+        if(queue->slots.data[i] == slot)
+        {
+            arr_splice(&queue->slots, i, 1);
+            break;
+        }
+    }
+    _slot_free(slot);
+}
+
+static decode_slot *_slot_find(allo_video_decode_queue *queue, uint32_t track_id)
+{
+    for(size_t i = 0; i < queue->slots.length; i++)
+    {
+        decode_slot *slot = queue->slots.data[i];
+        if(slot->track_id == track_id && !slot->forgotten) return slot;
+    }
+    return NULL;
+}
+
+static decode_slot *_slot_get(allo_video_decode_queue *queue, uint32_t track_id)
+{
+    decode_slot *slot = _slot_find(queue, track_id);
+    if(!slot)
+    {
+        slot = calloc(1, sizeof(decode_slot));
+        slot->track_id = track_id;
+        arr_push(&queue->slots, slot);
+    }
+    return slot;
+}
+
+static decode_slot *_next_job(allo_video_decode_queue *queue)
+{
+    size_t count = queue->slots.length;
+    for(size_t i = 0; i < count; i++)
+    {
+        size_t index = (queue->next_slot + i) % count;
+        decode_slot *slot = queue->slots.data[index];
+        if(slot->has_pending && !slot->busy)
+        {
+            queue->next_slot = index + 1;
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+static int _decode_thread(void *ctx)
+{
+    allo_video_decode_queue *queue = (allo_video_decode_queue *)ctx;
+    mtx_lock(&queue->lock);
+    while(true)
+    {
+        decode_slot *slot = NULL;
+        while(!queue->stopping && !(slot = _next_job(queue)))
+        {
+            cnd_wait(&queue->wake, &queue->lock);
+        }
+        if(queue->stopping) break;
+
+        // take the frames, and leave the other buffer for whatever arrives while we decode
+        uint8_t *data = slot->pending;
+        size_t length = slot->pending_length, capacity = slot->pending_capacity;
+        int count = slot->pending_count;
+        slot->pending = slot->decoding;
+        slot->pending_capacity = slot->decoding_capacity;
+        slot->pending_length = 0;
+        slot->pending_count = 0;
+        slot->decoding = data;
+        slot->decoding_capacity = capacity;
+        slot->has_pending = false;
+        slot->busy = true;
+        allo_video_stateful_decode_func decode = slot->decode;
+        void *state = slot->state;
+        mtx_unlock(&queue->lock);
+
+        // all of them in order, but only the last one's picture is worth handing on
+        allo_decoded_video_frame frame = { slot->track_id, NULL, 0, 0, false };
+        bool ok = false;
+        int failed = 0, replaced = 0;
+        for(size_t offset = 0; offset < length; )
+        {
+            uint32_t frame_length;
+            memcpy(&frame_length, data + offset, sizeof(frame_length));
+            offset += sizeof(frame_length);
+            allo_decoded_video_frame next = { slot->track_id, NULL, 0, 0, false };
+            bool next_ok = decode ? decode(state, data + offset, frame_length, &next) : queue->decode(data + offset, frame_length, &next);
+            offset += frame_length;
+            if(next_ok)
+            {
+                if(ok)
+                {
+                    _frame_return(&frame);
+                    replaced++;
+                }
+                frame = next;
+                ok = true;
+            }
+            else
+            {
+                failed++;
+                // a frame that didn't decode can still tell us the decoder has fallen out of step
+                frame.needs_keyframe = next.needs_keyframe;
+            }
+        }
+        assert(failed + replaced + ok == count); (void)count;
+
+        mtx_lock(&queue->lock);
+        slot->busy = false;
+        queue->stats.failed += failed;
+        queue->stats.dropped += replaced;
+        if(!ok)
+        {
+            // nothing to show, but the track still needs to hear that it should ask for a keyframe
+            if(frame.needs_keyframe && !slot->forgotten)
+            {
+                if(!slot->has_decoded)
+                {
+                    slot->decoded = frame;
+                    slot->has_decoded = true;
+                }
+                slot->decoded.needs_keyframe = true;
+            }
+        }
+        else if(slot->forgotten)
+        {
+            _frame_return(&frame);
+            queue->stats.dropped++;
+        }
+        else
+        {
+            if(slot->has_decoded && slot->decoded.pixels)
+            {
+                _frame_return(&slot->decoded);
+                queue->stats.dropped++;
+            }
+            slot->decoded = frame;
+            slot->has_decoded = true;
+            queue->stats.decoded++;
+        }
+        if(slot->forgotten)
+        {
+            _slot_remove(queue, slot);
+        }
+    }
+    mtx_unlock(&queue->lock);
+    return 0;
+}
+
+allo_video_decode_queue *allo_video_decode_queue_create(int thread_count, allo_video_decode_func decode)
+{
+    assert(thread_count > 0);
+    allo_video_decode_queue *queue = calloc(1, sizeof(allo_video_decode_queue));
+    queue->decode = decode;
+    mtx_init(&queue->lock, mtx_plain);
+    cnd_init(&queue->wake);
+    for(int i = 0; i < thread_count; i++)
+    {
+        thrd_t thread;
+        int success = thrd_create(&thread, _decode_thread, queue);
+        assert(success == thrd_success); (void)success;
+        arr_push(&queue->threads, thread);
+    }
+    return queue;
+}
+
+void allo_video_decode_queue_destroy(allo_video_decode_queue *queue)
+{
+    if(!queue) return;
+    mtx_lock(&queue->lock);
+    queue->stopping = true;
+    cnd_broadcast(&queue->wake);
+    mtx_unlock(&queue->lock);
+    for(size_t i = 0; i < queue->threads.length; i++)
+    {
+        thrd_join(queue->threads.data[i], NULL);
+    }
+    arr_free(&queue->threads);
+    for(size_t i = 0; i < queue->slots.length; i++)
+    {
+        _slot_free(queue->slots.data[i]);
+    }
+    arr_free(&queue->slots);
+    cnd_destroy(&queue->wake);
+    mtx_destroy(&queue->lock);
+    free(queue);
+}
+
+void allo_video_decode_queue_set_decoder(allo_video_decode_queue *queue, uint32_t track_id, allo_video_stateful_decode_func decode, void *state, void (*free_state)(void *state))
+{
+    mtx_lock(&queue->lock);
+    decode_slot *slot = _slot_get(queue, track_id);
+    // nothing decodes with the old state: the decoder is set before the track's first frame
+    assert(!slot->busy);
+    if(slot->free_state) slot->free_state(slot->state);
+    slot->decode = decode;
+    slot->state = state;
+    slot->free_state = free_state;
+    mtx_unlock(&queue->lock);
+}
+
+void allo_video_decode_queue_push(allo_video_decode_queue *queue, uint32_t track_id, const uint8_t *data, size_t length)
+{
+    mtx_lock(&queue->lock);
+    decode_slot *slot = _slot_get(queue, track_id);
+    // a track with its own decoder can't skip any of its frames, so they pile up
+    if(slot->has_pending && (!slot->decode || slot->pending_count >= MAX_BACKLOG))
+    {
+        queue->stats.dropped += slot->pending_count;
+        slot->pending_length = 0;
+        slot->pending_count = 0;
+    }
+    uint32_t frame_length = (uint32_t)length;
+    size_t needed = slot->pending_length + sizeof(frame_length) + length;
+    if(slot->pending_capacity < needed)
+    {
+        slot->pending_capacity = needed > slot->pending_capacity * 2 ? needed : slot->pending_capacity * 2;
+        slot->pending = realloc(slot->pending, slot->pending_capacity);
+    }
+    memcpy(slot->pending + slot->pending_length, &frame_length, sizeof(frame_length));
+    memcpy(slot->pending + slot->pending_length + sizeof(frame_length), data, length);
+    slot->pending_length = needed;
+    slot->pending_count++;
+    slot->has_pending = true;
+    queue->stats.queued++;
+    cnd_signal(&queue->wake);
+    mtx_unlock(&queue->lock);
+}
+
+bool allo_video_decode_queue_pop(allo_video_decode_queue *queue, allo_decoded_video_frame *frame)
+{
+    bool found = false;
+    mtx_lock(&queue->lock);
+    for(size_t i = 0; i < queue->slots.length && !found; i++)
+    {
+        decode_slot *slot = queue->slots.data[i];
+        if(slot->has_decoded)
+        {
+            *frame = slot->decoded;
+            slot->has_decoded = false;
+            found = true;
+        }
+    }
+    mtx_unlock(&queue->lock);
+    return found;
+}
+
+void allo_video_decode_queue_forget(allo_video_decode_queue *queue, uint32_t track_id)
+{
+    mtx_lock(&queue->lock);
+    decode_slot *slot = _slot_find(queue, track_id);
+    if(slot)
+    {
+        slot->forgotten = true;
+        queue->stats.dropped += slot->pending_count;
+        slot->pending_count = 0;
+        slot->pending_length = 0;
+        slot->has_pending = false;
+        if(!slot->busy) _slot_remove(queue, slot);
+    }
+    mtx_unlock(&queue->lock);
+}
+
+allo_video_decode_stats allo_video_decode_queue_stats(allo_video_decode_queue *queue)
+{
+    mtx_lock(&queue->lock);
+    allo_video_decode_stats stats = queue->stats;
+    mtx_unlock(&queue->lock);
+    return stats;
+}
@@ -0,0 +1,70 @@
+#ifndef ALLONET_VIDEO_DECODE_QUEUE_H
+#define ALLONET_VIDEO_DECODE_QUEUE_H
+
+#include <allonet/client.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Decodes compressed video frames on a few threads of its own, so that whoever receives them
+ * only has to copy them in. Only the newest frame of each track matters: a frame that
+ * hasn't been picked up for decoding when a newer one arrives is dropped, and so is a
+ * decoded frame that hasn't been taken when a newer one is decoded. Tracks with decoders of
+ * their own are the exception, as their frames build on each other: every one is decoded.
+ * A track's frames are decoded one at a time, in order; different tracks in parallel.
+ * Thread safe.
+ */
+typedef struct allo_video_decode_queue allo_video_decode_queue;
+
+typedef struct allo_decoded_video_frame {
+    uint32_t track_id;
+    // from allo_pixel_buffer_get
+    allopixel *pixels;
+    int32_t wide, high;
+    // the decoder missed frames that this one builds on, and is incomplete until the next keyframe
+    bool needs_keyframe;
+} allo_decoded_video_frame;
+
+/// Decode `data` into frame->pixels, wide and high. Runs on a decode thread.
+typedef bool (*allo_video_decode_func)(const uint8_t *data, size_t length, allo_decoded_video_frame *frame);
+/// Like allo_video_decode_func, for formats whose frames build on the ones before them.
+/// `state` is the track's own, as given to allo_video_decode_queue_set_decoder.
+typedef bool (*allo_video_stateful_decode_func)(void *state, const uint8_t *data, size_t length, allo_decoded_video_frame *frame);
+
+typedef struct allo_video_decode_stats {
+    uint64_t queued;
+    uint64_t decoded;
+    // replaced by a newer frame before or after decoding, or forgotten
+    uint64_t dropped;
+    uint64_t failed;
+} allo_video_decode_stats;
+
+allo_video_decode_queue *allo_video_decode_queue_create(int thread_count, allo_video_decode_func decode);
+/// Stops the threads once they're done with what they're decoding, and drops everything else.
+void allo_video_decode_queue_destroy(allo_video_decode_queue *queue);
+
+/// Decode a track's frames with `decode` and `state` rather than the queue's own decode function.
+/// None of them are skipped for newer ones, unless the track falls far behind.
+/// As a track's frames decode one at a time, `state` needs no locking. The queue frees it with
+/// `free_state` once the track is forgotten, or the queue destroyed.
+void allo_video_decode_queue_set_decoder(allo_video_decode_queue *queue, uint32_t track_id, allo_video_stateful_decode_func decode, void *state, void (*free_state)(void *state));
+/// Copy a compressed frame in to be decoded.
+void allo_video_decode_queue_push(allo_video_decode_queue *queue, uint32_t track_id, const uint8_t *data, size_t length);
+/// Take a decoded frame, if there is one. The caller owns frame->pixels afterwards. pixels is NULL
+/// for a track whose frames failed to decode, if its decoder said it needs a keyframe.
+bool allo_video_decode_queue_pop(allo_video_decode_queue *queue, allo_decoded_video_frame *frame);
+/// Drop everything queued or decoded for a track that has gone away.
+void allo_video_decode_queue_forget(allo_video_decode_queue *queue, uint32_t track_id);
+
+allo_video_decode_stats allo_video_decode_queue_stats(allo_video_decode_queue *queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,216 @@
+#include "fragment.h"
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct partial_frame {
+    bool active;
+    uint16_t frame_id;
+    uint16_t count, received;
+    bool keyframe;
+    double first_arrival;
+    size_t length; // of the whole frame, once its last fragment is in
+    uint8_t *data;
+    size_t capacity;
+    uint8_t *have; // per fragment: whether it has arrived
+    size_t have_capacity;
+} partial_frame;
+
+struct allo_video_reassembler {
+    double deadline;
+    partial_frame partials[ALLO_VIDEO_PARTIAL_FRAMES];
+    bool started;
+    uint16_t last_frame_id; // newest frame delivered
+    bool needs_keyframe;
+    allo_video_reassembly_stats stats;
+};
+
+void allo_video_write_fragment_header(uint8_t *out, const allo_video_fragment_header *header)
+{
+    out[0] = header->flags;
+    out[1] = header->frame_id >> 8; out[2] = (uint8_t)header->frame_id;
+    out[3] = header->index >> 8; out[4] = (uint8_t)header->index;
+    out[5] = header->count >> 8; out[6] = (uint8_t)header->count;
+}
+
+bool allo_video_read_fragment_header(const uint8_t *data, size_t length, allo_video_fragment_header *header)
+{
+    if(length < ALLO_VIDEO_FRAGMENT_HEADER_SIZE) return false;
+    header->flags = data[0];
+    header->frame_id = ((uint16_t)data[1] << 8) | data[2];
+    header->index = ((uint16_t)data[3] << 8) | data[4];
+    header->count = ((uint16_t)data[5] << 8) | data[6];
+    return true;
+}
+
+int allo_video_fragment_count(size_t length)
+{
+    return length == 0 ? 1 : (int)((length + ALLO_VIDEO_FRAGMENT_PAYLOAD - 1) / ALLO_VIDEO_FRAGMENT_PAYLOAD);
+}
+
+allo_video_reassembler *allo_video_reassembler_create(double deadline)
+{
+    allo_video_reassembler *reassembler = calloc(1, sizeof(allo_video_reassembler));
+    reassembler->deadline = deadline;
+    return reassembler;
+}
+
+void allo_video_reassembler_destroy(allo_video_reassembler *reassembler)
+{
+    if(!reassembler) return;
+    for(int i = 0; i < ALLO_VIDEO_PARTIAL_FRAMES; i++)
+    {
+        free(reassembler->partials[i].data);
+        free(reassembler->partials[i].have);
+    }
+    free(reassembler);
+}
+
+static bool _newer(uint16_t a, uint16_t b)
+{
+    return (int16_t)(a - b) > 0;
+}
+
+static void _drop(allo_video_reassembler *reassembler, partial_frame *partial)
+{
+    partial->active = false;
+    reassembler->stats.incomplete++;
+    reassembler->needs_keyframe = true;
+}
+
+/// Somewhere to put fragments of a frame we haven't seen before, or NULL if it's too old to bother with
+static partial_frame *_partial_start(allo_video_reassembler *reassembler, const allo_video_fragment_header *header, double now)
+{
+    partial_frame *partial = NULL;
+    for(int i = 0; i < ALLO_VIDEO_PARTIAL_FRAMES && !partial; i++)
+    {
+        if(!reassembler->partials[i].active) partial = &reassembler->partials[i];
+    }
+    if(!partial)
+    {
+        // all busy; make room by giving up on the oldest, unless this is older still
+        partial = &reassembler->partials[0];
+        for(int i = 1; i < ALLO_VIDEO_PARTIAL_FRAMES; i++)
+        {
+            if(_newer(partial->frame_id, reassembler->partials[i].frame_id)) partial = &reassembler->partials[i];
+        }
+        if(_newer(partial->frame_id, header->frame_id)) return NULL;
+        _drop(reassembler, partial);
+    }
+
+    size_t capacity = (size_t)header->count * ALLO_VIDEO_FRAGMENT_PAYLOAD;
+    if(partial->capacity < capacity)
+    {
+        free(partial->data);
+        partial->data = malloc(capacity);
+        partial->capacity = capacity;
+    }
+    if(partial->have_capacity < header->count)
+    {
+        free(partial->have);
+        partial->have = malloc(header->count);
+        partial->have_capacity = header->count;
+    }
+    memset(partial->have, 0, header->count);
+    partial->active = true;
+    partial->frame_id = header->frame_id;
+    partial->count = header->count;
+    partial->received = 0;
+    partial->keyframe = header->flags & ALLO_VIDEO_FRAGMENT_KEYFRAME;
+    partial->first_arrival = now;
+    partial->length = 0;
+    return partial;
+}
+
+bool allo_video_reassembler_push(allo_video_reassembler *reassembler, const allo_video_fragment_header *header, const uint8_t *payload, size_t length, double now, const uint8_t **frame, size_t *frame_length)
+{
+    reassembler->stats.fragments++;
+    if(header->count == 0 || header->count > ALLO_VIDEO_MAX_FRAGMENTS || header->index >= header->count ||
+        length > ALLO_VIDEO_FRAGMENT_PAYLOAD || (header->index + 1 < header->count && length != ALLO_VIDEO_FRAGMENT_PAYLOAD))
+    {
+        reassembler->stats.invalid++;
+        return false;
+    }
+    if(reassembler->started && !_newer(header->frame_id, reassembler->last_frame_id))
+    {
+        reassembler->stats.stale++;
+        return false;
+    }
+
+    partial_frame *partial = NULL;
+    for(int i = 0; i < ALLO_VIDEO_PARTIAL_FRAMES; i++)
+    {
+        partial_frame *p = &reassembler->partials[i];
+        if(!p->active) continue;
+        if(p->frame_id == header->frame_id)
+        {
+            partial = p;
+        }
+        else if(now - p->first_arrival > reassembler->deadline)
+        {
+            _drop(reassembler, p);
+        }
+    }
+    if(partial && partial->count != header->count)
+    {
+        reassembler->stats.invalid++;
+        return false;
+    }
+    if(!partial && !(partial = _partial_start(reassembler, header, now)))
+    {
+        reassembler->stats.stale++;
+        return false;
+    }
+    if(partial->have[header->index])
+    {
+        return false;
+    }
+    memcpy(partial->data + (size_t)header->index * ALLO_VIDEO_FRAGMENT_PAYLOAD, payload, length);
+    partial->have[header->index] = 1;
+    partial->received++;
+    if(header->index + 1 == header->count)
+    {
+        partial->length = (size_t)header->index * ALLO_VIDEO_FRAGMENT_PAYLOAD + length;
+    }
+    if(partial->received < partial->count)
+    {
+        return false;
+    }
+
+    // complete! Anything older can't be shown anymore.
+    for(int i = 0; i < ALLO_VIDEO_PARTIAL_FRAMES; i++)
+    {
+        partial_frame *p = &reassembler->partials[i];
+        if(p->active && p != partial && _newer(header->frame_id, p->frame_id)) _drop(reassembler, p);
+    }
+    if(reassembler->started && (uint16_t)(header->frame_id - reassembler->last_frame_id) != 1)
+    {
+        // whole frames went missing in between
+        reassembler->needs_keyframe = true;
+    }
+    if(partial->keyframe)
+    {
+        reassembler->needs_keyframe = false;
+    }
+    else if(!reassembler->started)
+    {
+        // joined in the middle of a group of pictures
+        reassembler->needs_keyframe = true;
+    }
+    reassembler->started = true;
+    reassembler->last_frame_id = header->frame_id;
+    reassembler->stats.frames++;
+    partial->active = false;
+    *frame = partial->data;
+    *frame_length = partial->length;
+    return true;
+}
+
+bool allo_video_reassembler_needs_keyframe(const allo_video_reassembler *reassembler)
+{
+    return reassembler->needs_keyframe;
+}
+
+allo_video_reassembly_stats allo_video_reassembler_stats(const allo_video_reassembler *reassembler)
+{
+    return reassembler->stats;
+}
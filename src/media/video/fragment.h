@@ -0,0 +1,89 @@
+#ifndef ALLONET_VIDEO_FRAGMENT_H
+#define ALLONET_VIDEO_FRAGMENT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Fragmented video packets have this after the track id: u8 flags, then big-endian u16 frame id,
+/// u16 fragment index and u16 fragment count.
+#define ALLO_VIDEO_FRAGMENT_HEADER_SIZE 7
+/// Every fragment but the last of a frame carries exactly this much. Small enough that a fragment
+/// and all the headers in front of it fit in one UDP datagram on a typical 1400 byte path MTU.
+#define ALLO_VIDEO_FRAGMENT_PAYLOAD 1200
+/// 1.2MB, far more than a frame of the video we send
+#define ALLO_VIDEO_MAX_FRAGMENTS 1024
+/// Frames being reassembled at once. A few, since fragments of consecutive frames can interleave.
+#define ALLO_VIDEO_PARTIAL_FRAMES 4
+
+enum {
+    /// the frame can be decoded without any of the frames before it
+    ALLO_VIDEO_FRAGMENT_KEYFRAME = 1 << 0,
+    /// not a fragment, but a receiver asking the sender for a keyframe. Frame id, index and count are 0.
+    ALLO_VIDEO_FRAGMENT_KEYFRAME_REQUEST = 1 << 1,
+    /// which simulcast layer the frame or keyframe request is for; see simulcast.h
+    ALLO_VIDEO_FRAGMENT_LAYER = 3 << 2,
+};
+#define ALLO_VIDEO_FRAGMENT_LAYER_SHIFT 2
+/// simulcast layers a video track can have, counting the full size one
+#define ALLO_VIDEO_MAX_LAYERS 3
+
+static inline int allo_video_fragment_layer(uint8_t flags)
+{
+    return (flags & ALLO_VIDEO_FRAGMENT_LAYER) >> ALLO_VIDEO_FRAGMENT_LAYER_SHIFT;
+}
+
+typedef struct allo_video_fragment_header {
+    uint8_t flags;
+    uint16_t frame_id;
+    uint16_t index;
+    uint16_t count;
+} allo_video_fragment_header;
+
+void allo_video_write_fragment_header(uint8_t *out, const allo_video_fragment_header *header);
+/// @return false if `length` is too short to hold a header
+bool allo_video_read_fragment_header(const uint8_t *data, size_t length, allo_video_fragment_header *header);
+/// How many fragments a frame of `length` bytes is sent in
+int allo_video_fragment_count(size_t length);
+
+typedef struct allo_video_reassembly_stats {
+    uint64_t fragments;          // fragments received
+    uint64_t frames;             // whole frames put back together
+    uint64_t incomplete;         // frames dropped because fragments of them didn't arrive in time
+    uint64_t stale;              // fragments of frames older than one already delivered
+    uint64_t invalid;            // fragments that didn't make sense
+} allo_video_reassembly_stats;
+
+/**
+ * Puts fragmented video frames back together. Fragments can arrive in any order, and several
+ * frames can be in flight at once. Only ever moves forward: once a frame is complete, anything
+ * older than it is dropped, and a frame that isn't complete within `deadline` seconds of its
+ * first fragment arriving is dropped too.
+ * Keeps track of whether a frame has been lost since the last keyframe, in which case the
+ * sender should be asked for a new keyframe.
+ */
+typedef struct allo_video_reassembler allo_video_reassembler;
+
+allo_video_reassembler *allo_video_reassembler_create(double deadline);
+void allo_video_reassembler_destroy(allo_video_reassembler *reassembler);
+
+/** Add a fragment.
+ *  @param payload what came after the fragment header
+ *  @param now seconds, on any monotonic clock
+ *  @param frame, frame_length set to the whole frame if this fragment completed one. It stays valid until the next push.
+ *  @return whether a frame was completed
+ */
+bool allo_video_reassembler_push(allo_video_reassembler *reassembler, const allo_video_fragment_header *header, const uint8_t *payload, size_t length, double now, const uint8_t **frame, size_t *frame_length);
+/// Whether a frame has been lost since the last complete keyframe
+bool allo_video_reassembler_needs_keyframe(const allo_video_reassembler *reassembler);
+allo_video_reassembly_stats allo_video_reassembler_stats(const allo_video_reassembler *reassembler);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,6 +1,7 @@
 #include "../media.h"
 #include "../../client/_client.h"
 #include "../../util.h"
+#include "pixel_pool.h"
 #include <string.h>
 #include <assert.h>
 #include <libswscale/swscale.h>
@@ -18,66 +19,137 @@ static inline char* formatTrackId(allo_media_track *track) {
     if(trackId)free(trackId); \
 } while(false)
 
-static ENetPacket *allo_video_write_h264(allo_media_track *track, allopicture *picture)
+// see alloclient_set_video_encoder_threads
+static int encoder_thread_count = 0;
+static allo_video_threading encoder_threading = allo_video_threading_slice;
+
+void alloclient_set_video_encoder_threads(int thread_count, allo_video_threading threading)
 {
+    encoder_thread_count = thread_count < 0 ? 0 : thread_count;
+    encoder_threading = threading;
+}
 
+static bool open_encoder(allo_media_track *track)
+{
+    track->info.video.encoder.codec = avcodec_find_encoder(AV_CODEC_ID_H264);
     if (track->info.video.encoder.codec == NULL) {
-        track->info.video.encoder.codec = avcodec_find_encoder(AV_CODEC_ID_H264);
-        if (track->info.video.encoder.codec == NULL) {
-            libav_log(ALLO_LOG_ERROR, track, "No encoder", NULL);
-            return NULL;
-        }
-        track->info.video.encoder.context = avcodec_alloc_context3(track->info.video.encoder.codec);
-        
-        track->info.video.encoder.context->width = track->info.video.width;
-        track->info.video.encoder.context->height = track->info.video.height;
+        libav_log(ALLO_LOG_ERROR, track, "No encoder", NULL);
+        return false;
+    }
+    track->info.video.encoder.context = avcodec_alloc_context3(track->info.video.encoder.codec);
+    
+    // 4:2:0 needs even dimensions
+    track->info.video.encoder.context->width = track->info.video.width & ~1;
+    track->info.video.encoder.context->height = track->info.video.height & ~1;
 //        track->info.video.encoder.context->time_base = av_d2q(1.0, 10);
-        track->info.video.encoder.context->time_base = (AVRational){9000, 1};
-        track->info.video.encoder.context->pix_fmt = AV_PIX_FMT_YUV422P;
-        track->info.video.encoder.context->bit_rate = 10 * 1000 * 1000;
-        track->info.video.encoder.context->gop_size = 15;
-        track->info.video.encoder.context->max_b_frames = 0;
+    track->info.video.encoder.context->time_base = (AVRational){9000, 1};
+    track->info.video.encoder.context->pix_fmt = AV_PIX_FMT_YUV420P;
+    track->info.video.encoder.context->bit_rate = 10 * 1000 * 1000;
+    track->info.video.encoder.context->gop_size = 15;
+    track->info.video.encoder.context->max_b_frames = 0;
 //        track->info.video.encoder.context->rc_buffer_size = 0;
 //        track->info.video.encoder.context->rc_max_rate = 0;
 //        track->info.video.encoder.context->me_cmp = 1;
 //        track->info.video.encoder.context->me_range = 0;
-        track->info.video.encoder.context->thread_count = 1;
-        track->info.video.encoder.context->codec_type = AVMEDIA_TYPE_VIDEO;
+    track->info.video.encoder.context->thread_count = encoder_thread_count;
+    track->info.video.encoder.context->thread_type = encoder_threading == allo_video_threading_frame ? FF_THREAD_FRAME : FF_THREAD_SLICE;
+    track->info.video.encoder.context->codec_type = AVMEDIA_TYPE_VIDEO;
 //        track->info.video.encoder.context->qmin = 10;
 //        track->info.video.encoder.context->qmin = 50; // these affects quality a lot
-        track->info.video.encoder.context->flags |= AV_CODEC_FLAG_LOOP_FILTER;
+    track->info.video.encoder.context->flags |= AV_CODEC_FLAG_LOOP_FILTER;
 //        track->info.video.encoder.context->qcompress = 0.6;
 //        track->info.video.encoder.context->i_quant_factor = 0.71; // no notable change
 //        track->info.video.encoder.context->me_subpel_quality = 5; // no notable change
-        track->info.video.encoder.context->refs = 3;
-        track->info.video.encoder.context->trellis = 0;
-        
-        track->info.video.encoder.packet = av_packet_alloc();
-        
-        track->info.video.encoder.scale_context = NULL;
-        
-        av_opt_set(track->info.video.encoder.context->priv_data, "preset", "ultrafast", 0);
-        av_opt_set(track->info.video.encoder.context->priv_data, "tune", "zerolatency", 0);
-        av_opt_set(track->info.video.encoder.context->priv_data, "g", "30", 0);
-                   
-        int ret = avcodec_open2(track->info.video.encoder.context, track->info.video.encoder.codec, NULL);
-        if (ret != 0) {
-            libav_log(ALLO_LOG_ERROR, track, "avcodec_open2 return %d when opening encoder", ret);
-            return NULL;
+    track->info.video.encoder.context->refs = 3;
+    track->info.video.encoder.context->trellis = 0;
+    
+    track->info.video.encoder.packet = av_packet_alloc();
+    
+    track->info.video.encoder.scale_context = NULL;
+    
+    av_opt_set(track->info.video.encoder.context->priv_data, "preset", "ultrafast", 0);
+    av_opt_set(track->info.video.encoder.context->priv_data, "tune", "zerolatency", 0);
+    av_opt_set(track->info.video.encoder.context->priv_data, "g", "30", 0);
+    // so that keyframes forced for receivers that lost a frame reset their decoders
+    av_opt_set(track->info.video.encoder.context->priv_data, "forced-idr", "1", 0);
+               
+    int ret = avcodec_open2(track->info.video.encoder.context, track->info.video.encoder.codec, NULL);
+    if (ret != 0) {
+        libav_log(ALLO_LOG_ERROR, track, "avcodec_open2 return %d when opening encoder", ret);
+        avcodec_free_context(&track->info.video.encoder.context);
+        // the next frame tries again from scratch
+        av_packet_free(&track->info.video.encoder.packet);
+        return false;
+    }
+    return true;
+}
+
+/// A frame to convert the next picture into. The encoder holds on to the frames it's been
+/// given until it's done with them, so reuse whichever it has let go of. That's at most
+/// one per frame thread, plus the one being filled in.
+static AVFrame *encoder_frame(allo_media_track *track)
+{
+    AVCodecContext *context = track->info.video.encoder.context;
+    for (size_t i = 0; i < track->info.video.encoder.frames.length; i++) {
+        AVFrame *frame = track->info.video.encoder.frames.data[i];
+        if (av_frame_is_writable(frame)) {
+            return frame;
         }
     }
     
-    int ret = 0;
+    int needed = (context->active_thread_type & FF_THREAD_FRAME ? context->thread_count : 1) + 1;
+    if (track->info.video.encoder.frames.length < (size_t)needed) {
+        AVFrame *frame = av_frame_alloc();
+        frame->format = context->pix_fmt;
+        frame->width = context->width;
+        frame->height = context->height;
+        int ret = av_frame_get_buffer(frame, 0);
+        assert(ret == 0); (void)ret;
+        arr_push(&track->info.video.encoder.frames, frame);
+        return frame;
+    }
     
-    /// encoder may hold on to frame data pointer so no cheating
-    AVFrame *frame = av_frame_alloc();
-    frame->format = track->info.video.encoder.context->pix_fmt;
-    frame->width = track->info.video.encoder.context->width;
-    frame->height = track->info.video.encoder.context->height;
-    frame->pts = track->info.video.framenr += 1;
+    // the encoder still has them all; give one a buffer of its own again
+    AVFrame *frame = track->info.video.encoder.frames.data[track->info.video.encoder.next_frame++ % track->info.video.encoder.frames.length];
+    int ret = av_frame_make_writable(frame);
+    assert(ret == 0); (void)ret;
+    return frame;
+}
+
+/// The next encoded frame, if the encoder has one ready
+static ENetPacket *receive_packet(allo_media_track *track)
+{
+    AVPacket *avpacket = track->info.video.encoder.packet;
+    int ret = avcodec_receive_packet(track->info.video.encoder.context, avpacket);
+    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+        return NULL;
+    } else if (ret < 0) {
+        libav_log(ALLO_LOG_ERROR, track, "Something went wrong in the h264 encoding: %d", ret);
+        return NULL;
+    }
+    
+    ENetPacket *packet = enet_packet_create(NULL, avpacket->size + 4, 0);
+    memcpy(packet->data + 4, avpacket->data, avpacket->size);
+    track->info.video.keyframe = (avpacket->flags & AV_PKT_FLAG_KEY) != 0;
+    av_packet_unref(avpacket);
+    return packet;
+}
+
+static ENetPacket *allo_video_write_h264(allo_media_track *track, allopicture *picture)
+{
+    ENetPacket *packet = NULL;
+    if (track->info.video.encoder.context == NULL && !open_encoder(track)) {
+        goto end;
+    }
     
-    ret = av_frame_get_buffer(frame, 0);
-    assert(ret == 0);
+    AVFrame *frame = encoder_frame(track);
+    frame->pts = track->info.video.framenr += 1;
+    frame->pict_type = AV_PICTURE_TYPE_NONE;
+    if (track->info.video.keyframe_requested) {
+        // a receiver lost a frame it needed
+        frame->pict_type = AV_PICTURE_TYPE_I;
+        track->info.video.keyframe_requested = false;
+    }
 
     enum AVPixelFormat sourceFormat = AV_PIX_FMT_RGBA;
     switch(picture->format)
@@ -92,6 +164,10 @@ static ENetPacket *allo_video_write_h264(allo_media_track *track, allopicture *p
             sourceFormat = AV_PIX_FMT_BGRA; break;
         case allopicture_format_xrgb8888:
             sourceFormat = AV_PIX_FMT_0RGB; break;
+        case allopicture_format_yuv420p:
+            sourceFormat = AV_PIX_FMT_YUV420P; break;
+        case allopicture_format_nv12:
+            sourceFormat = AV_PIX_FMT_NV12; break;
     }
     
     // Convert from pixels RGBA into frame->data YUV
@@ -109,37 +185,29 @@ static ENetPacket *allo_video_write_h264(allo_media_track *track, allopicture *p
     track->info.video.encoder.scale_context = sws_ctx;
     uint8_t **srcData = (uint8_t **)picture->planes;
     int *srcStrides = picture->plane_strides;
-    int height = sws_scale(sws_ctx, (const uint8_t *const*)srcData, srcStrides, 0, picture->height, frame->data, frame->linesize);
-    
-    ret = avcodec_send_frame(track->info.video.encoder.context, frame);
-    assert(ret == 0);
+    sws_scale(sws_ctx, (const uint8_t *const*)srcData, srcStrides, 0, picture->height, frame->data, frame->linesize);
     
-    AVPacket *avpacket = track->info.video.encoder.packet;
-    // TODO: Might need to loop and receive multiple packets (because encoded frames can come out of order)
-    ret = avcodec_receive_packet(track->info.video.encoder.context, avpacket);
-    
-    ENetPacket *packet = NULL;
-    if (ret >= 0) {
-        packet = enet_packet_create(NULL, avpacket->size + 4, 0);
-        memcpy(packet->data + 4, avpacket->data, avpacket->size);
-    } else {
-        libav_log(ALLO_LOG_ERROR, track, "Something went wrong in the h264 encoding: %d", ret);
+    int ret = avcodec_send_frame(track->info.video.encoder.context, frame);
+    if (ret < 0) {
+        libav_log(ALLO_LOG_ERROR, track, "avcodec_send_frame return %d", ret);
+        goto end;
     }
-    av_packet_unref(avpacket);
-    av_frame_unref(frame);
     
-    
-    av_frame_free(&frame);
+    // with frame threading this is often nothing yet; the rest comes out of drain_video_packet
+    packet = receive_packet(track);
+end:
     allopicture_free(picture);
-    
     return packet;
 }
 
-static allopixel *allo_video_parse_h264(alloclient *client, allo_media_track *track, unsigned char *data, size_t length, int32_t *pixels_wide, int32_t *pixels_high)
+static ENetPacket *allo_video_drain_h264(allo_media_track *track)
+{
+    return track->info.video.encoder.context ? receive_packet(track) : NULL;
+}
+
+/// Decode a frame into track->info.video.decoder.frame, if the decoder has one ready
+static AVFrame *decode_h264(allo_media_track *track, unsigned char *data, size_t length)
 {
-    assert(pixels_high != NULL);
-    assert(pixels_wide != NULL);
-    
     if (track->info.video.decoder.codec == NULL) {
         track->info.video.decoder.codec = avcodec_find_decoder(AV_CODEC_ID_H264);
         if (track->info.video.decoder.codec == NULL) {
@@ -165,23 +233,39 @@ static allopixel *allo_video_parse_h264(alloclient *client, allo_media_track *tr
     avpacket->size = length;
     avpacket->data = data;
     int ret = avcodec_send_packet(track->info.video.decoder.context, avpacket);
-    
+    av_packet_unref(avpacket);
     if (ret != 0) {
         libav_log(ALLO_LOG_ERROR, track, "avcodec_send_packet return %d", ret);
-        
         return NULL;
     }
     
     AVFrame *frame = track->info.video.decoder.frame;
     ret = avcodec_receive_frame(track->info.video.decoder.context, frame);
-    if (ret != 0) {
+    if (ret == AVERROR(EAGAIN)) {
+        return NULL;
+    } else if (ret != 0) {
         libav_log(ALLO_LOG_ERROR, track, "avcodec_receive_frame return %d", ret);
         return NULL;
     }
-    
+    return frame;
+}
+
+// see alloclient_set_video_scaler
+static allo_video_scaler decoder_scaler = allo_video_scaler_bilinear;
+
+void alloclient_set_video_scaler(allo_video_scaler scaler)
+{
+    decoder_scaler = scaler;
+}
+
+static allopixel *convert_to_rgba(allo_media_track *track, AVFrame *frame, int32_t *pixels_wide, int32_t *pixels_high)
+{
     if (*pixels_wide == 0) *pixels_wide = frame->width;
     if (*pixels_high == 0) *pixels_high = frame->height;
     
+    int flags = decoder_scaler == allo_video_scaler_fast_bilinear ? SWS_FAST_BILINEAR :
+                decoder_scaler == allo_video_scaler_bicubic ? SWS_BICUBIC :
+                SWS_BILINEAR;
     // Convert from frame->data YUV into pixels RGBA
     struct SwsContext *sws_ctx = track->info.video.decoder.scale_context;
     sws_ctx = sws_getCachedContext(
@@ -192,22 +276,59 @@ static allopixel *allo_video_parse_h264(alloclient *client, allo_media_track *tr
         *pixels_wide,
         *pixels_high,
         AV_PIX_FMT_RGBA,
-        SWS_BICUBIC, NULL, NULL, NULL
+        flags, NULL, NULL, NULL
     );
     track->info.video.decoder.scale_context = sws_ctx;
     
     // Convert pixel formats
-    allopixel *pixels = (allopixel*)malloc((*pixels_wide) * (*pixels_high) * sizeof(allopixel));
+    allopixel *pixels = allo_pixel_buffer_get((size_t)(*pixels_wide) * (*pixels_high));
     uint8_t *dstData[4] = { (uint8_t*)pixels, NULL, NULL, NULL };
     int dstStrides[4] = { (*pixels_wide) * sizeof(allopixel), 0, 0, 0 };
-    int height = sws_scale(sws_ctx, (const uint8_t *const*)frame->data, frame->linesize, 0, frame->height, dstData, dstStrides);
-
-    av_frame_unref(frame);
-    av_packet_unref(avpacket);
+    sws_scale(sws_ctx, (const uint8_t *const*)frame->data, frame->linesize, 0, frame->height, dstData, dstStrides);
     return pixels;
 }
 
+static void free_frame_picture(allopicture *picture)
+{
+    AVFrame *frame = picture->userdata;
+    av_frame_free(&frame);
+    free(picture);
+}
 
+/// Hand the decoded planes over as they are. The picture takes the decoder's reference to
+/// them, so the decoder will decode the next frame into other buffers from its pool.
+/// NULL if the app wouldn't know what to do with the frame's format.
+static allopicture *frame_picture(AVFrame *decoded)
+{
+    allopicture_format format;
+    int plane_count;
+    switch (decoded->format) {
+        case AV_PIX_FMT_YUV420P:
+        case AV_PIX_FMT_YUVJ420P:
+            format = allopicture_format_yuv420p; plane_count = 3; break;
+        case AV_PIX_FMT_NV12:
+            format = allopicture_format_nv12; plane_count = 2; break;
+        default:
+            return NULL;
+    }
+    
+    AVFrame *frame = av_frame_alloc();
+    av_frame_move_ref(frame, decoded);
+    allopicture *picture = calloc(1, sizeof(allopicture));
+    picture->format = format;
+    picture->width = frame->width;
+    picture->height = frame->height;
+    picture->plane_count = plane_count;
+    for (int i = 0; i < plane_count; i++) {
+        int rows = i == 0 ? frame->height : (frame->height + 1) / 2;
+        picture->planes[i].monochrome = frame->data[i];
+        picture->plane_strides[i] = frame->linesize[i];
+        picture->plane_byte_lengths[i] = frame->linesize[i] * rows;
+    }
+    picture->free = free_frame_picture;
+    picture->userdata = frame;
+    return picture;
+}
 
 
 static bool video_track_initialize(allo_media_track *track, const cJSON *comp)
@@ -236,6 +357,11 @@ static void video_track_destroy(allo_media_track *track)
     if (track->info.video.format == allo_video_format_h264) {
         // cleanup encoder
         if (track->info.video.encoder.context) {
+            // flush out whatever the encoder's threads are still working on, so it lets go of its frames
+            avcodec_send_frame(track->info.video.encoder.context, NULL);
+            while (avcodec_receive_packet(track->info.video.encoder.context, track->info.video.encoder.packet) == 0) {
+                av_packet_unref(track->info.video.encoder.packet);
+            }
             avcodec_close(track->info.video.encoder.context);
             avcodec_free_context(&track->info.video.encoder.context);
         }
@@ -244,6 +370,11 @@ static void video_track_destroy(allo_media_track *track)
             av_packet_free(&track->info.video.encoder.packet);
         }
         
+        for (size_t i = 0; i < track->info.video.encoder.frames.length; i++) {
+            av_frame_free(&track->info.video.encoder.frames.data[i]);
+        }
+        arr_free(&track->info.video.encoder.frames);
+        
         if (track->info.video.encoder.scale_context) {
             sws_freeContext(track->info.video.encoder.scale_context);
             track->info.video.encoder.scale_context = NULL;
@@ -270,31 +401,48 @@ static void video_track_destroy(allo_media_track *track)
     }
 }
 
-static void parse_video(alloclient *client, allo_media_track *track, unsigned char *mediadata, size_t length, mtx_t *unlock_me)
+static void parse_video(alloclient *client, allo_media_track *track, unsigned char *mediadata, size_t length)
 {
     uint32_t track_id = track->track_id;
     int32_t wide = track->info.video.width, high = track->info.video.height;
-    if (!client->video_callback) {
-        mtx_unlock(unlock_me);
+    if (!client->video_callback && !client->video_picture_callback) {
         return;
     }
 
-    allopixel *pixels = allo_video_parse_h264(client, track, mediadata, length, &wide, &high);
-    
-    mtx_unlock(unlock_me);
+    AVFrame *frame = decode_h264(track, mediadata, length);
+    if (!frame) {
+        return;
+    }
     
-    if (pixels && client->video_callback(client, track_id, pixels, wide, high)) {
-        free(pixels);
+    if (client->video_picture_callback) {
+        allopicture *picture = frame_picture(frame);
+        if (!picture) {
+            // e g 4:4:4 from a high profile encoder
+            allopixel *pixels = convert_to_rgba(track, frame, &wide, &high);
+            picture = allo_pixel_buffer_picture(pixels, wide, high);
+        }
+        av_frame_unref(frame);
+        if (client->video_picture_callback(client, track_id, picture)) {
+            allopicture_free(picture);
+        }
+        return;
+    }
+
+    allopixel *pixels = convert_to_rgba(track, frame, &wide, &high);
+    av_frame_unref(frame);
+    if (client->video_callback(client, track_id, pixels, wide, high)) {
+        allo_pixel_buffer_return(pixels, (size_t)wide * high);
     }
 }
 
 void allo_libav_initialize(void)
 {
-    allo_media_subsystem *sys = malloc(sizeof(allo_media_subsystem));
+    allo_media_subsystem *sys = calloc(1, sizeof(allo_media_subsystem));
     sys->parse = parse_video;
     sys->track_initialize = video_track_initialize;
     sys->track_destroy = video_track_destroy;
     sys->create_video_packet = allo_video_write_h264;
+    sys->drain_video_packet = allo_video_drain_h264;
     allo_media_subsystem_register(sys);
     libav_log(ALLO_LOG_INFO, NULL, "initialized libav media subsystem", NULL);
 }
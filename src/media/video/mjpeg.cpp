@@ -2,24 +2,18 @@ extern "C" {
 #include "../../client/_client.h"
 #include "../../util.h"
 #include "mjpeg.h"
+#include "mjpeg_encoder.h"
+#include "decode_queue.h"
+#include "pixel_pool.h"
 #include <string.h>
 #include <assert.h>
 }
-#include <tinyjpeg/tiny_jpeg.h>
 #include <richgel9999-jpegcompressor/jpgd.h>
-#include <richgel9999-jpegcompressor/jpge.h>
 
-static void create_packet(ENetPacket **packet, void* encoded, int size)
-{
-    if (*packet) {
-        size_t acc = (*packet)->dataLength;
-        enet_packet_resize(*packet, acc + size);
-        memcpy((*packet)->data + acc, encoded, size);
-    } else {
-        *packet = enet_packet_create(NULL, size + 4, 0 /* unreliable */);
-        memcpy((*packet)->data + 4, encoded, size);
-    }
-}
+#define MJPEG_QUALITY 60
+// besides the thread sending the frame
+#define MJPEG_ENCODER_THREADS 3
+#define MJPEG_DECODER_THREADS 2
 
 static ENetPacket* allo_mjpeg_encode(allo_media_track *track, allopicture *picture)
 {
@@ -31,15 +25,23 @@ static ENetPacket* allo_mjpeg_encode(allo_media_track *track, allopicture *pictu
         goto end;
     }
 
-    (void)track;
-    tje_encode_with_func((tje_write_func*)create_packet, &packet, 1, picture->width, picture->height, 4, (const unsigned char*)picture->planes[0].rgba);
+    if(!track->info.video.encoder.mjpeg)
+    {
+        track->info.video.encoder.mjpeg = allo_mjpeg_encoder_create(MJPEG_QUALITY, MJPEG_ENCODER_THREADS);
+    }
+    {
+        int stride = picture->plane_strides[0] ? picture->plane_strides[0] : picture->width * 4;
+        // leave room for the track id
+        packet = allo_mjpeg_encoder_encode(track->info.video.encoder.mjpeg, (const uint8_t*)picture->planes[0].rgba, picture->width, picture->height, stride, 4);
+        track->info.video.keyframe = true;
+    }
 
 end:
     allopicture_free(picture);
     return packet;
 }
 
-static allopixel *allo_mjpeg_decode(uint8_t *jpegdata, size_t jpegdata_size, int32_t *pixels_wide, int32_t *pixels_high)
+extern "C" allopixel *allo_mjpeg_decode(uint8_t *jpegdata, size_t jpegdata_size, int32_t *pixels_wide, int32_t *pixels_high)
 {
     int components;
     allopixel *pixels = (allopixel*)jpgd::decompress_jpeg_image_from_memory(jpegdata, jpegdata_size, (int*)pixels_wide, (int*)pixels_high, &components, 4, 0);
@@ -49,6 +51,40 @@ static allopixel *allo_mjpeg_decode(uint8_t *jpegdata, size_t jpegdata_size, int
 
 
 
+/// Decode into a pooled buffer. Runs on a decode thread.
+static bool decode_frame(const uint8_t *data, size_t length, allo_decoded_video_frame *frame)
+{
+    jpgd::jpeg_decoder_mem_stream stream(data, (jpgd::uint)length);
+    jpgd::jpeg_decoder decoder(&stream);
+    if (decoder.get_error_code() != jpgd::JPGD_SUCCESS || decoder.begin_decoding() != jpgd::JPGD_SUCCESS) {
+        return false;
+    }
+    int wide = decoder.get_width(), high = decoder.get_height();
+    bool gray = decoder.get_num_components() == 1;
+    allopixel *pixels = allo_pixel_buffer_get((size_t)wide * high);
+    for (int y = 0; y < high; y++) {
+        const uint8_t *line;
+        jpgd::uint line_length;
+        if (decoder.decode((const void**)&line, &line_length) != jpgd::JPGD_SUCCESS) {
+            allo_pixel_buffer_return(pixels, (size_t)wide * high);
+            return false;
+        }
+        allopixel *row = pixels + (size_t)y * wide;
+        if (gray) {
+            for (int x = 0; x < wide; x++) {
+                row[x].r = row[x].g = row[x].b = line[x];
+                row[x].a = 255;
+            }
+        } else {
+            memcpy(row, line, wide * sizeof(allopixel));
+        }
+    }
+    frame->pixels = pixels;
+    frame->wide = wide;
+    frame->high = high;
+    return true;
+}
+
 static bool video_track_initialize(allo_media_track *track, const cJSON *comp)
 {
     if(track->type != allo_media_type_video) return false;
@@ -62,31 +98,32 @@ static bool video_track_initialize(allo_media_track *track, const cJSON *comp)
 
 static void video_track_destroy(allo_media_track *track)
 {
-    (void)track;
+    allo_mjpeg_encoder_destroy(track->info.video.encoder.mjpeg);
+    track->info.video.encoder.mjpeg = NULL;
 }
 
-static void parse_video(alloclient *client, allo_media_track *track, unsigned char *mediadata, size_t length, mtx_t *unlock_me)
+static void parse_video(alloclient *client, allo_media_track *track, unsigned char *mediadata, size_t length)
 {
-    uint32_t track_id = track->track_id;
-    int32_t wide = track->info.video.width, high = track->info.video.height;
-    if (!client->video_callback) {
-        mtx_unlock(unlock_me);
+    if (!client->video_callback && !client->video_picture_callback) {
         return;
     }
+    // decoded on other threads, and handed to video_callback from alloclient_poll; see _alloclient_deliver_video
+    allo_video_decode_queue_push(allo_mjpeg_decode_queue(client), track->track_id, mediadata, length);
+}
 
-    allopixel *pixels = allo_mjpeg_decode(mediadata, length, &wide, &high);
-    
-    mtx_unlock(unlock_me);
-    
-    if (pixels && client->video_callback(client, track_id, pixels, wide, high)) {
-        free(pixels);
+extern "C" allo_video_decode_queue *allo_mjpeg_decode_queue(alloclient *client)
+{
+    alloclient_internal *cl = _internal(client);
+    if (!cl->video_decoders) {
+        cl->video_decoders = allo_video_decode_queue_create(MJPEG_DECODER_THREADS, decode_frame);
     }
+    return cl->video_decoders;
 }
 
 
 extern "C" void allo_media_mjpeg_register(void)
 {
-    allo_media_subsystem *sys = (allo_media_subsystem*)malloc(sizeof(allo_media_subsystem));
+    allo_media_subsystem *sys = (allo_media_subsystem*)calloc(1, sizeof(allo_media_subsystem));
     sys->parse = parse_video;
     sys->track_initialize = video_track_initialize;
     sys->track_destroy = video_track_destroy;
@@ -1,10 +1,16 @@
 #include <allonet/client.h>
+#include "decode_queue.h"
 
 #ifdef __cplusplus
  extern "C" { 
 #endif
 
 void allo_media_mjpeg_register(void);
+/// Decode a JPEG into RGBA pixels that the caller free()s, or NULL if it isn't one.
+allopixel *allo_mjpeg_decode(uint8_t *jpegdata, size_t jpegdata_size, int32_t *pixels_wide, int32_t *pixels_high);
+/// The client's video decode queue, created on first use. It decodes frames as JPEGs unless
+/// their track has a decoder of its own.
+allo_video_decode_queue *allo_mjpeg_decode_queue(alloclient *client);
 
 #ifdef __cplusplus
 } // extern "C"
@@ -0,0 +1,557 @@
+#include "mjpeg_encoder.h"
+#include "../../workpool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MJPEG_SSE2 1
+#endif
+
+// 16x16 pixels: four luma blocks, and one block each of Cb and Cr
+#define MCU_SIZE 16
+#define BLOCKS_PER_MCU 6
+// enough to keep every thread busy even if some slices are quicker than others
+#define SLICES_PER_THREAD 2
+
+//////// 8 lanes of float, so that the math below works on 8 pixels or 8 columns at a time
+
+#ifdef MJPEG_SSE2
+typedef struct { __m128 lo, hi; } v8;
+static inline v8 v8_load(const float *p) { v8 r; r.lo = _mm_loadu_ps(p); r.hi = _mm_loadu_ps(p + 4); return r; }
+static inline void v8_store(float *p, v8 a) { _mm_storeu_ps(p, a.lo); _mm_storeu_ps(p + 4, a.hi); }
+static inline v8 v8_add(v8 a, v8 b) { v8 r; r.lo = _mm_add_ps(a.lo, b.lo); r.hi = _mm_add_ps(a.hi, b.hi); return r; }
+static inline v8 v8_sub(v8 a, v8 b) { v8 r; r.lo = _mm_sub_ps(a.lo, b.lo); r.hi = _mm_sub_ps(a.hi, b.hi); return r; }
+static inline v8 v8_mul(v8 a, v8 b) { v8 r; r.lo = _mm_mul_ps(a.lo, b.lo); r.hi = _mm_mul_ps(a.hi, b.hi); return r; }
+static inline v8 v8_scale(v8 a, float k) { __m128 kk = _mm_set1_ps(k); v8 r; r.lo = _mm_mul_ps(a.lo, kk); r.hi = _mm_mul_ps(a.hi, kk); return r; }
+static inline v8 v8_fill(float k) { v8 r; r.lo = r.hi = _mm_set1_ps(k); return r; }
+
+static void v8_transpose(v8 *m)
+{
+    // as four 4x4 transposes, swapping the top right and bottom left quadrants
+    __m128 a0 = m[0].lo, a1 = m[1].lo, a2 = m[2].lo, a3 = m[3].lo;
+    __m128 b0 = m[0].hi, b1 = m[1].hi, b2 = m[2].hi, b3 = m[3].hi;
+    __m128 c0 = m[4].lo, c1 = m[5].lo, c2 = m[6].lo, c3 = m[7].lo;
+    __m128 d0 = m[4].hi, d1 = m[5].hi, d2 = m[6].hi, d3 = m[7].hi;
+    _MM_TRANSPOSE4_PS(a0, a1, a2, a3);
+    _MM_TRANSPOSE4_PS(b0, b1, b2, b3);
+    _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+    _MM_TRANSPOSE4_PS(d0, d1, d2, d3);
+    m[0].lo = a0; m[1].lo = a1; m[2].lo = a2; m[3].lo = a3;
+    m[0].hi = c0; m[1].hi = c1; m[2].hi = c2; m[3].hi = c3;
+    m[4].lo = b0; m[5].lo = b1; m[6].lo = b2; m[7].lo = b3;
+    m[4].hi = d0; m[5].hi = d1; m[6].hi = d2; m[7].hi = d3;
+}
+#else
+// written so that compilers can vectorize it for whatever they're targeting
+typedef struct { float v[8]; } v8;
+static inline v8 v8_load(const float *p) { v8 r; memcpy(r.v, p, sizeof(r.v)); return r; }
+static inline void v8_store(float *p, v8 a) { memcpy(p, a.v, sizeof(a.v)); }
+static inline v8 v8_add(v8 a, v8 b) { for(int i = 0; i < 8; i++) a.v[i] += b.v[i]; return a; }
+static inline v8 v8_sub(v8 a, v8 b) { for(int i = 0; i < 8; i++) a.v[i] -= b.v[i]; return a; }
+static inline v8 v8_mul(v8 a, v8 b) { for(int i = 0; i < 8; i++) a.v[i] *= b.v[i]; return a; }
+static inline v8 v8_scale(v8 a, float k) { for(int i = 0; i < 8; i++) a.v[i] *= k; return a; }
+static inline v8 v8_fill(float k) { v8 r; for(int i = 0; i < 8; i++) r.v[i] = k; return r; }
+
+static void v8_transpose(v8 *m)
+{
+    for(int i = 0; i < 8; i++)
+    {
+        for(int j = i + 1; j < 8; j++)
+        {
+            float t = m[i].v[j]; m[i].v[j] = m[j].v[i]; m[j].v[i] = t;
+        }
+    }
+}
+#endif
+
+//////// Tables from the JPEG spec, annex K
+
+static const uint8_t zigzag[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+static const uint8_t luma_quant[64] = {
+    16, 11, 10, 16,  24,  40,  51,  61,
+    12, 12, 14, 19,  26,  58,  60,  55,
+    14, 13, 16, 24,  40,  57,  69,  56,
+    14, 17, 22, 29,  51,  87,  80,  62,
+    18, 22, 37, 56,  68, 109, 103,  77,
+    24, 35, 55, 64,  81, 104, 113,  92,
+    49, 64, 78, 87, 103, 121, 120, 101,
+    72, 92, 95, 98, 112, 100, 103,  99,
+};
+
+static const uint8_t chroma_quant[64] = {
+    17, 18, 24, 47, 99, 99, 99, 99,
+    18, 21, 26, 66, 99, 99, 99, 99,
+    24, 26, 56, 99, 99, 99, 99, 99,
+    47, 66, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+};
+
+static const uint8_t luma_dc_counts[16] = { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+static const uint8_t chroma_dc_counts[16] = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+static const uint8_t dc_values[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+
+static const uint8_t luma_ac_counts[16] = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+static const uint8_t luma_ac_values[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+    0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+    0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa,
+};
+
+static const uint8_t chroma_ac_counts[16] = { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+static const uint8_t chroma_ac_values[162] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+    0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+    0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa,
+};
+
+// the float AAN DCT leaves each coefficient scaled by these, in both directions
+static const float aan_scale[8] = {
+    1.0f, 1.387039845f, 1.306562965f, 1.175875602f, 1.0f, 0.785694958f, 0.541196100f, 0.275899379f
+};
+
+typedef struct huffman_table {
+    uint16_t codes[256];
+    uint8_t sizes[256];
+} huffman_table;
+
+typedef struct component {
+    uint8_t quant[64]; // natural order
+    // undoes the DCT's scaling and quantizes in one multiply, in zigzag order
+    float scale[64];
+    huffman_table dc, ac;
+    size_t block_bound; // most bytes a block can take, byte stuffing included
+} component;
+
+typedef struct slice {
+    uint8_t *data;
+    size_t capacity;
+    size_t length;
+    int first_row, row_count; // in MCUs
+} slice;
+
+struct allo_mjpeg_encoder {
+    allo_workpool *pool;
+    int threads;
+    component luma, chroma;
+
+    int width, height;
+    int mcus_wide, mcus_high;
+    int rows_per_slice;
+    slice *slices;
+    int slice_count;
+    uint8_t header[1024];
+    size_t header_length;
+
+    // the picture being encoded
+    const uint8_t *rgba;
+    int stride;
+};
+
+static void build_huffman(huffman_table *table, const uint8_t *counts, const uint8_t *values)
+{
+    int code = 0, k = 0;
+    for(int length = 1; length <= 16; length++)
+    {
+        for(int i = 0; i < counts[length - 1]; i++, k++)
+        {
+            table->codes[values[k]] = (uint16_t)code++;
+            table->sizes[values[k]] = (uint8_t)length;
+        }
+        code <<= 1;
+    }
+}
+
+static int bit_length(unsigned v)
+{
+#if defined(__GNUC__)
+    return v ? 32 - __builtin_clz(v) : 0;
+#else
+    int n = 0;
+    while(v) { n++; v >>= 1; }
+    return n;
+#endif
+}
+
+static void component_init(component *c, const uint8_t *base_quant, int quality, const uint8_t *dc_counts, const uint8_t *ac_counts, const uint8_t *ac_values)
+{
+    // libjpeg's quality scaling
+    int percent = quality < 50 ? 5000 / quality : 200 - 2 * quality;
+    size_t bits = 0;
+    for(int i = 0; i < 64; i++)
+    {
+        int q = (base_quant[i] * percent + 50) / 100;
+        c->quant[i] = (uint8_t)(q < 1 ? 1 : q > 255 ? 255 : q);
+    }
+    for(int z = 0; z < 64; z++)
+    {
+        int n = zigzag[z], row = n / 8, column = n % 8;
+        c->scale[z] = 1.0f / (c->quant[n] * aan_scale[row] * aan_scale[column] * 8.0f);
+        // longest huffman code, and the most magnitude bits this coefficient can have after quantization;
+        // DC is coded as a difference from the previous block, so it can be twice as big
+        unsigned largest = 1024 / c->quant[n] + 1;
+        bits += 16 + bit_length(z == 0 ? 2 * largest : largest);
+    }
+    bits += 16; // end of block
+    // worst case, every byte is 0xff and gets a 0 stuffed after it
+    c->block_bound = 2 * ((bits + 7) / 8);
+    build_huffman(&c->dc, dc_counts, dc_values);
+    build_huffman(&c->ac, ac_counts, ac_values);
+}
+
+allo_mjpeg_encoder *allo_mjpeg_encoder_create(int quality, int worker_threads)
+{
+    if(quality < 1) quality = 1;
+    if(quality > 100) quality = 100;
+    allo_mjpeg_encoder *encoder = calloc(1, sizeof(allo_mjpeg_encoder));
+    encoder->pool = allo_workpool_create(worker_threads);
+    encoder->threads = worker_threads + 1;
+    component_init(&encoder->luma, luma_quant, quality, luma_dc_counts, luma_ac_counts, luma_ac_values);
+    component_init(&encoder->chroma, chroma_quant, quality, chroma_dc_counts, chroma_ac_counts, chroma_ac_values);
+    return encoder;
+}
+
+void allo_mjpeg_encoder_destroy(allo_mjpeg_encoder *encoder)
+{
+    if(!encoder) return;
+    allo_workpool_destroy(encoder->pool);
+    for(int i = 0; i < encoder->slice_count; i++)
+    {
+        free(encoder->slices[i].data);
+    }
+    free(encoder->slices);
+    free(encoder);
+}
+
+//////// Headers
+
+static uint8_t *put16(uint8_t *p, int v)
+{
+    *p++ = (uint8_t)(v >> 8);
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+static uint8_t *put_huffman(uint8_t *p, int id, const uint8_t *counts, const uint8_t *values)
+{
+    int total = 0;
+    *p++ = (uint8_t)id;
+    for(int i = 0; i < 16; i++) total += counts[i];
+    memcpy(p, counts, 16); p += 16;
+    memcpy(p, values, total); p += total;
+    return p;
+}
+
+static void write_header(allo_mjpeg_encoder *encoder)
+{
+    static const uint8_t jfif[] = { 0xff, 0xe0, 0, 16, 'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0 };
+    uint8_t *p = encoder->header;
+    *p++ = 0xff; *p++ = 0xd8; // start of image
+    memcpy(p, jfif, sizeof(jfif)); p += sizeof(jfif);
+
+    const component *components[2] = { &encoder->luma, &encoder->chroma };
+    for(int t = 0; t < 2; t++)
+    {
+        *p++ = 0xff; *p++ = 0xdb; p = put16(p, 2 + 65);
+        *p++ = (uint8_t)t;
+        for(int z = 0; z < 64; z++) *p++ = components[t]->quant[zigzag[z]];
+    }
+
+    *p++ = 0xff; *p++ = 0xc0; p = put16(p, 17);
+    *p++ = 8;
+    p = put16(p, encoder->height);
+    p = put16(p, encoder->width);
+    *p++ = 3;
+    *p++ = 1; *p++ = 0x22; *p++ = 0; // Y, 2x2 sampled, quant table 0
+    *p++ = 2; *p++ = 0x11; *p++ = 1; // Cb
+    *p++ = 3; *p++ = 0x11; *p++ = 1; // Cr
+
+    *p++ = 0xff; *p++ = 0xc4; p = put16(p, 2 + 4 * 17 + 2 * 12 + 2 * 162);
+    p = put_huffman(p, 0x00, luma_dc_counts, dc_values);
+    p = put_huffman(p, 0x10, luma_ac_counts, luma_ac_values);
+    p = put_huffman(p, 0x01, chroma_dc_counts, dc_values);
+    p = put_huffman(p, 0x11, chroma_ac_counts, chroma_ac_values);
+
+    *p++ = 0xff; *p++ = 0xdd; p = put16(p, 4);
+    p = put16(p, encoder->rows_per_slice * encoder->mcus_wide);
+
+    *p++ = 0xff; *p++ = 0xda; p = put16(p, 12);
+    *p++ = 3;
+    *p++ = 1; *p++ = 0x00;
+    *p++ = 2; *p++ = 0x11;
+    *p++ = 3; *p++ = 0x11;
+    *p++ = 0; *p++ = 63; *p++ = 0;
+
+    encoder->header_length = p - encoder->header;
+    assert(encoder->header_length <= sizeof(encoder->header));
+}
+
+/// Cut the picture into slices, and make sure each has room for the worst case.
+static void prepare(allo_mjpeg_encoder *encoder, int width, int height, int threads)
+{
+    if(width == encoder->width && height == encoder->height) return;
+
+    for(int i = 0; i < encoder->slice_count; i++) free(encoder->slices[i].data);
+    free(encoder->slices);
+
+    encoder->width = width;
+    encoder->height = height;
+    encoder->mcus_wide = (width + MCU_SIZE - 1) / MCU_SIZE;
+    encoder->mcus_high = (height + MCU_SIZE - 1) / MCU_SIZE;
+    int wanted = threads * SLICES_PER_THREAD;
+    int rows = (encoder->mcus_high + wanted - 1) / wanted;
+    // the restart interval is 16 bits
+    while(rows > 1 && rows * encoder->mcus_wide > 0xffff) rows--;
+    encoder->rows_per_slice = rows;
+    encoder->slice_count = (encoder->mcus_high + rows - 1) / rows;
+    encoder->slices = calloc(encoder->slice_count, sizeof(slice));
+    size_t mcu_bound = 4 * encoder->luma.block_bound + 2 * encoder->chroma.block_bound;
+    for(int i = 0; i < encoder->slice_count; i++)
+    {
+        slice *s = &encoder->slices[i];
+        s->first_row = i * rows;
+        s->row_count = s->first_row + rows > encoder->mcus_high ? encoder->mcus_high - s->first_row : rows;
+        s->capacity = (size_t)s->row_count * encoder->mcus_wide * mcu_bound + 8;
+        s->data = malloc(s->capacity);
+    }
+    write_header(encoder);
+}
+
+//////// Encoding
+
+typedef struct bit_writer {
+    uint8_t *out;
+    size_t length;
+    uint64_t bits;
+    int count;
+} bit_writer;
+
+static inline void put_bits(bit_writer *w, uint32_t code, int size)
+{
+    w->bits = (w->bits << size) | code;
+    w->count += size;
+    while(w->count >= 8)
+    {
+        w->count -= 8;
+        uint8_t byte = (uint8_t)(w->bits >> w->count);
+        w->out[w->length++] = byte;
+        if(byte == 0xff) w->out[w->length++] = 0;
+    }
+}
+
+static inline void put_value(bit_writer *w, const huffman_table *table, int symbol_high, int value)
+{
+    int magnitude = value < 0 ? -value : value;
+    int size = bit_length((unsigned)magnitude);
+    int symbol = symbol_high | size;
+    put_bits(w, table->codes[symbol], table->sizes[symbol]);
+    if(size)
+    {
+        // negative values are sent as their one's complement
+        put_bits(w, (uint32_t)(value < 0 ? value - 1 : value) & ((1u << size) - 1), size);
+    }
+}
+
+/// 2D DCT of 8 rows of 8 samples, in place: down all 8 columns at once, transpose, and again.
+static void fdct8x8(float *block)
+{
+    v8 d[8];
+    for(int i = 0; i < 8; i++) d[i] = v8_load(block + 8 * i);
+    for(int pass = 0; pass < 2; pass++)
+    {
+        // Arai, Agui and Nakajima's DCT, as in libjpeg's jfdctflt.c
+        v8 tmp0 = v8_add(d[0], d[7]), tmp7 = v8_sub(d[0], d[7]);
+        v8 tmp1 = v8_add(d[1], d[6]), tmp6 = v8_sub(d[1], d[6]);
+        v8 tmp2 = v8_add(d[2], d[5]), tmp5 = v8_sub(d[2], d[5]);
+        v8 tmp3 = v8_add(d[3], d[4]), tmp4 = v8_sub(d[3], d[4]);
+
+        v8 tmp10 = v8_add(tmp0, tmp3), tmp13 = v8_sub(tmp0, tmp3);
+        v8 tmp11 = v8_add(tmp1, tmp2), tmp12 = v8_sub(tmp1, tmp2);
+        d[0] = v8_add(tmp10, tmp11);
+        d[4] = v8_sub(tmp10, tmp11);
+        v8 z1 = v8_scale(v8_add(tmp12, tmp13), 0.707106781f);
+        d[2] = v8_add(tmp13, z1);
+        d[6] = v8_sub(tmp13, z1);
+
+        tmp10 = v8_add(tmp4, tmp5);
+        tmp11 = v8_add(tmp5, tmp6);
+        tmp12 = v8_add(tmp6, tmp7);
+        v8 z5 = v8_scale(v8_sub(tmp10, tmp12), 0.382683433f);
+        v8 z2 = v8_add(v8_scale(tmp10, 0.541196100f), z5);
+        v8 z4 = v8_add(v8_scale(tmp12, 1.306562965f), z5);
+        v8 z3 = v8_scale(tmp11, 0.707106781f);
+        v8 z11 = v8_add(tmp7, z3), z13 = v8_sub(tmp7, z3);
+        d[5] = v8_add(z13, z2);
+        d[3] = v8_sub(z13, z2);
+        d[1] = v8_add(z11, z4);
+        d[7] = v8_sub(z11, z4);
+
+        v8_transpose(d);
+    }
+    for(int i = 0; i < 8; i++) v8_store(block + 8 * i, d[i]);
+}
+
+static void encode_block(bit_writer *w, float *block, const component *c, int *dc_prediction)
+{
+    fdct8x8(block);
+    int16_t coefficients[64];
+    for(int z = 0; z < 64; z++)
+    {
+        float v = block[zigzag[z]] * c->scale[z];
+        int q = (int)(v < 0 ? v - 0.5f : v + 0.5f);
+        coefficients[z] = (int16_t)(q < -1023 ? -1023 : q > 1023 ? 1023 : q);
+    }
+
+    put_value(w, &c->dc, 0, coefficients[0] - *dc_prediction);
+    *dc_prediction = coefficients[0];
+
+    int run = 0;
+    for(int z = 1; z < 64; z++)
+    {
+        if(coefficients[z] == 0)
+        {
+            run++;
+            continue;
+        }
+        while(run > 15)
+        {
+            put_bits(w, c->ac.codes[0xf0], c->ac.sizes[0xf0]); // sixteen zeros
+            run -= 16;
+        }
+        put_value(w, &c->ac, run << 4, coefficients[z]);
+        run = 0;
+    }
+    if(run > 0)
+    {
+        put_bits(w, c->ac.codes[0x00], c->ac.sizes[0x00]); // end of block
+    }
+}
+
+static void encode_slice(void *ctx, size_t index)
+{
+    allo_mjpeg_encoder *encoder = (allo_mjpeg_encoder *)ctx;
+    slice *s = &encoder->slices[index];
+    bit_writer w = { s->data, 0, 0, 0 };
+    int dc_prediction[3] = { 0, 0, 0 };
+    const uint8_t *rows[MCU_SIZE];
+    int columns[MCU_SIZE];
+    float y[4][64], cb[64], cr[64];
+
+    for(int my = s->first_row; my < s->first_row + s->row_count; my++)
+    {
+        // repeat the last row and column to fill out MCUs along the edges
+        for(int i = 0; i < MCU_SIZE; i++)
+        {
+            int py = my * MCU_SIZE + i;
+            if(py >= encoder->height) py = encoder->height - 1;
+            rows[i] = encoder->rgba + (size_t)py * encoder->stride;
+        }
+        for(int mx = 0; mx < encoder->mcus_wide; mx++)
+        {
+            for(int i = 0; i < MCU_SIZE; i++)
+            {
+                int px = mx * MCU_SIZE + i;
+                columns[i] = 4 * (px >= encoder->width ? encoder->width - 1 : px);
+            }
+
+            for(int row = 0; row < MCU_SIZE; row++)
+            {
+                for(int half = 0; half < 2; half++)
+                {
+                    float r[8], g[8], b[8];
+                    for(int i = 0; i < 8; i++)
+                    {
+                        const uint8_t *pixel = rows[row] + columns[half * 8 + i];
+                        r[i] = pixel[0]; g[i] = pixel[1]; b[i] = pixel[2];
+                    }
+                    v8 luma = v8_add(v8_add(v8_scale(v8_load(r), 0.299f), v8_scale(v8_load(g), 0.587f)), v8_add(v8_scale(v8_load(b), 0.114f), v8_fill(-128.0f)));
+                    v8_store(&y[(row / 8) * 2 + half][(row % 8) * 8], luma);
+                }
+            }
+            for(int row = 0; row < 8; row++)
+            {
+                // 4:2:0, so average 2x2 pixels first. Color conversion is linear so it comes out the same.
+                float r[8], g[8], b[8];
+                for(int i = 0; i < 8; i++)
+                {
+                    const uint8_t *p00 = rows[2 * row] + columns[2 * i], *p01 = rows[2 * row] + columns[2 * i + 1];
+                    const uint8_t *p10 = rows[2 * row + 1] + columns[2 * i], *p11 = rows[2 * row + 1] + columns[2 * i + 1];
+                    r[i] = (p00[0] + p01[0] + p10[0] + p11[0]) * 0.25f;
+                    g[i] = (p00[1] + p01[1] + p10[1] + p11[1]) * 0.25f;
+                    b[i] = (p00[2] + p01[2] + p10[2] + p11[2]) * 0.25f;
+                }
+                v8 vr = v8_load(r), vg = v8_load(g), vb = v8_load(b);
+                v8_store(&cb[row * 8], v8_add(v8_add(v8_scale(vr, -0.168736f), v8_scale(vg, -0.331264f)), v8_scale(vb, 0.5f)));
+                v8_store(&cr[row * 8], v8_add(v8_add(v8_scale(vr, 0.5f), v8_scale(vg, -0.418688f)), v8_scale(vb, -0.081312f)));
+            }
+
+            for(int i = 0; i < 4; i++) encode_block(&w, y[i], &encoder->luma, &dc_prediction[0]);
+            encode_block(&w, cb, &encoder->chroma, &dc_prediction[1]);
+            encode_block(&w, cr, &encoder->chroma, &dc_prediction[2]);
+        }
+    }
+    // pad the last byte with ones
+    if(w.count > 0) put_bits(&w, (1u << (8 - w.count)) - 1, 8 - w.count);
+    assert(w.length <= s->capacity);
+    s->length = w.length;
+}
+
+ENetPacket *allo_mjpeg_encoder_encode(allo_mjpeg_encoder *encoder, const uint8_t *rgba, int width, int height, int stride, size_t reserve)
+{
+    if(width <= 0 || height <= 0 || width > 0xffff || height > 0xffff) return NULL;
+    prepare(encoder, width, height, encoder->threads);
+    encoder->rgba = rgba;
+    encoder->stride = stride;
+    allo_workpool_run(encoder->pool, encoder->slice_count, encode_slice, encoder);
+
+    size_t length = reserve + encoder->header_length + 2;
+    for(int i = 0; i < encoder->slice_count; i++)
+    {
+        length += encoder->slices[i].length + (i + 1 < encoder->slice_count ? 2 : 0);
+    }
+    ENetPacket *packet = enet_packet_create(NULL, length, 0 /* unreliable */);
+    if(!packet) return NULL;
+    uint8_t *p = packet->data + reserve;
+    memcpy(p, encoder->header, encoder->header_length);
+    p += encoder->header_length;
+    for(int i = 0; i < encoder->slice_count; i++)
+    {
+        memcpy(p, encoder->slices[i].data, encoder->slices[i].length);
+        p += encoder->slices[i].length;
+        if(i + 1 < encoder->slice_count)
+        {
+            *p++ = 0xff; *p++ = (uint8_t)(0xd0 + i % 8); // restart marker
+        }
+    }
+    *p++ = 0xff; *p++ = 0xd9; // end of image
+    assert(p == packet->data + length);
+    encoder->rgba = NULL;
+    return packet;
+}
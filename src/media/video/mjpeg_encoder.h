@@ -0,0 +1,38 @@
+#ifndef ALLONET_MJPEG_ENCODER_H
+#define ALLONET_MJPEG_ENCODER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <enet/enet.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Baseline JPEG encoder for streaming RGBA video. Frames are 4:2:0, cut into horizontal
+ * slices separated by restart markers, and the slices are encoded in parallel on the
+ * encoder's own threads. Color conversion and DCT work on 8 samples at a time (SSE2
+ * where available). Each slice encodes into a buffer that is allocated once, from a
+ * bound on how big a slice can get at the chosen quality, so a frame costs exactly one
+ * allocation: the packet it ends up in.
+ * Not thread safe; use one encoder per video track.
+ */
+typedef struct allo_mjpeg_encoder allo_mjpeg_encoder;
+
+/// @param quality 1-100, as in libjpeg
+/// @param worker_threads threads to encode slices on, besides the calling thread
+allo_mjpeg_encoder *allo_mjpeg_encoder_create(int quality, int worker_threads);
+void allo_mjpeg_encoder_destroy(allo_mjpeg_encoder *encoder);
+
+/** Encode an RGBA8888 picture into a new unreliable packet.
+ * @param stride bytes per row in `rgba`
+ * @param reserve bytes to leave free at the start of the packet, e g for a track id
+ */
+ENetPacket *allo_mjpeg_encoder_encode(allo_mjpeg_encoder *encoder, const uint8_t *rgba, int width, int height, int stride, size_t reserve);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
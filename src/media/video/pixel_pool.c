@@ -0,0 +1,78 @@
+#include "pixel_pool.h"
+#include "../../threading.h"
+#include <stdlib.h>
+
+// a couple of frames in flight per track, for a handful of tracks
+#define MAX_POOLED_BUFFERS 16
+
+typedef struct pooled_buffer {
+    allopixel *pixels;
+    size_t pixel_count;
+} pooled_buffer;
+
+static once_flag pool_once = ONCE_FLAG_INIT;
+static mtx_t pool_lock;
+static pooled_buffer pool[MAX_POOLED_BUFFERS];
+static int pool_count;
+
+static void pool_init(void)
+{
+    mtx_init(&pool_lock, mtx_plain);
+}
+
+allopixel *allo_pixel_buffer_get(size_t pixel_count)
+{
+    call_once(&pool_once, pool_init);
+    allopixel *pixels = NULL;
+    mtx_lock(&pool_lock);
+    // the smallest that fits, so that small tracks don't use up the big buffers
+    int best = -1;
+    for(int i = 0; i < pool_count; i++)
+    {
+        if(pool[i].pixel_count >= pixel_count && (best == -1 || pool[i].pixel_count < pool[best].pixel_count))
+        {
+            best = i;
+        }
+    }
+    if(best != -1)
+    {
+        pixels = pool[best].pixels;
+        pool[best] = pool[--pool_count];
+    }
+    mtx_unlock(&pool_lock);
+    return pixels ? pixels : malloc(pixel_count * sizeof(allopixel));
+}
+
+void allo_pixel_buffer_return(allopixel *pixels, size_t pixel_count)
+{
+    if(!pixels) return;
+    call_once(&pool_once, pool_init);
+    mtx_lock(&pool_lock);
+    if(pool_count < MAX_POOLED_BUFFERS)
+    {
+        pool[pool_count++] = (pooled_buffer){pixels, pixel_count};
+        pixels = NULL;
+    }
+    mtx_unlock(&pool_lock);
+    free(pixels);
+}
+
+static void return_picture(allopicture *picture)
+{
+    allo_pixel_buffer_return(picture->planes[0].rgba, (size_t)picture->width * picture->height);
+    free(picture);
+}
+
+allopicture *allo_pixel_buffer_picture(allopixel *pixels, int32_t wide, int32_t high)
+{
+    allopicture *picture = calloc(1, sizeof(allopicture));
+    picture->format = allopicture_format_rgba8888;
+    picture->width = wide;
+    picture->height = high;
+    picture->plane_count = 1;
+    picture->planes[0].rgba = pixels;
+    picture->plane_strides[0] = wide * sizeof(allopixel);
+    picture->plane_byte_lengths[0] = wide * high * sizeof(allopixel);
+    picture->free = return_picture;
+    return picture;
+}
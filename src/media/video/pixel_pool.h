@@ -0,0 +1,28 @@
+#ifndef ALLONET_VIDEO_PIXEL_POOL_H
+#define ALLONET_VIDEO_PIXEL_POOL_H
+
+#include <allonet/client.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Recycles the buffers that decoded video is handed to the app in, so that receiving
+ * video doesn't allocate a whole picture for every frame. Buffers come from malloc,
+ * so it's fine to free() one instead of returning it; it just won't be reused.
+ * Thread safe.
+ */
+/// A buffer with room for at least pixel_count pixels.
+allopixel *allo_pixel_buffer_get(size_t pixel_count);
+/// @param pixel_count how many pixels `pixels` has room for (at least)
+void allo_pixel_buffer_return(allopixel *pixels, size_t pixel_count);
+/// Wrap pooled RGBA pixels in a picture that gives them back to the pool when it's freed.
+allopicture *allo_pixel_buffer_picture(allopixel *pixels, int32_t wide, int32_t high);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
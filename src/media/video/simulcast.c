@@ -0,0 +1,48 @@
+#include "simulcast.h"
+#include "fragment.h"
+#include <stddef.h>
+
+// from about this far away, a layer of half the size looks as sharp in a headset as the one before it
+static const double layer_distances[ALLO_VIDEO_MAX_LAYERS] = { 0, 3, 8 };
+// only move up to a bigger layer once this far inside its range
+#define UPGRADE_MARGIN 0.8
+
+bool allo_video_subscriber_forward(allo_video_subscriber *subscriber, int layer, bool keyframe)
+{
+    if(keyframe && layer == subscriber->target && layer != subscriber->current)
+    {
+        subscriber->current = layer;
+    }
+    return layer == subscriber->current;
+}
+
+int allo_video_auto_layer(int layer_count, int current, double distance, allo_video_link link)
+{
+    int layer = 0;
+    for(int i = 1; i < layer_count && i < ALLO_VIDEO_MAX_LAYERS; i++)
+    {
+        double threshold = layer_distances[i];
+        if(current >= i) threshold *= UPGRADE_MARGIN;
+        if(distance >= threshold) layer = i;
+    }
+    // a congested link gets less, however close it is
+    if(link.loss > 0.15 || link.throttle < 0.5) layer += 2;
+    else if(link.loss > 0.05 || link.throttle < 0.8) layer += 1;
+    return layer < layer_count ? layer : layer_count - 1;
+}
+
+void allo_video_halve(const uint8_t *src, int width, int height, int stride, uint8_t *dst)
+{
+    int wide = width / 2, high = height / 2;
+    for(int y = 0; y < high; y++)
+    {
+        const uint8_t *top = src + (size_t)2 * y * stride;
+        const uint8_t *bottom = top + stride;
+        uint8_t *out = dst + (size_t)y * wide * 4;
+        for(int x = 0; x < wide * 4; x++)
+        {
+            int i = (x / 4) * 8 + x % 4;
+            out[x] = (top[i] + top[i + 4] + bottom[i] + bottom[i + 4] + 2) >> 2;
+        }
+    }
+}
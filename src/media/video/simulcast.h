@@ -0,0 +1,51 @@
+#ifndef ALLONET_VIDEO_SIMULCAST_H
+#define ALLONET_VIDEO_SIMULCAST_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Simulcast video tracks are sent in up to ALLO_VIDEO_MAX_LAYERS layers at once: layer 0 at full
+ * size, and every layer after it half the width and height of the one before. The place forwards
+ * each subscriber one layer, and only ever switches a subscriber to another layer at a keyframe
+ * of that layer, so that its decoder never sees a frame it can't decode.
+ * The layer is in the ALLO_VIDEO_FRAGMENT_LAYER bits of each fragment's flags; see fragment.h.
+ */
+
+/// a subscriber that lets the place pick a layer for it
+#define ALLO_VIDEO_LAYER_AUTO -1
+
+typedef struct allo_video_subscriber {
+    void *client;
+    int8_t requested; // what the subscriber asked for, or ALLO_VIDEO_LAYER_AUTO
+    int8_t target;    // the layer it should be getting
+    int8_t current;   // the layer it's getting; -1 until the first keyframe of `target`
+} allo_video_subscriber;
+
+/// Whether to forward a fragment of a frame in `layer` to `subscriber`. Moves it over to its
+/// target layer if this is a keyframe of it.
+bool allo_video_subscriber_forward(allo_video_subscriber *subscriber, int layer, bool keyframe);
+
+typedef struct allo_video_link {
+    double loss;     // fraction of packets lost lately, 0-1
+    double throttle; // fraction of unreliable packets that ENet lets through, 0-1
+} allo_video_link;
+
+/// The layer worth sending to a subscriber `distance` meters from the video, over `link`:
+/// smaller the further away it is, and smaller still if the link can't keep up.
+/// `current` is the layer it's on now, so that it doesn't flip back and forth at the edges.
+int allo_video_auto_layer(int layer_count, int current, double distance, allo_video_link link);
+
+/// Scale 4-byte pixels (RGBA or similar) down to half the width and height, averaging each 2x2 block.
+/// `dst` is tightly packed, (width/2) * 4 bytes per row.
+void allo_video_halve(const uint8_t *src, int width, int height, int stride, uint8_t *dst);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,354 @@
+#include "tiled.h"
+#include "mjpeg.h"
+#include "mjpeg_encoder.h"
+#include "pixel_pool.h"
+#include "../media.h"
+#include "../../client/_client.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define TILE ALLO_TILED_TILE_SIZE
+
+// UI is mostly text and sharp edges, which smear at the quality mjpeg tracks use
+#define TILED_QUALITY 85
+// besides the thread sending the frame
+#define TILED_ENCODER_THREADS 3
+// tracks whose receivers can't ask for keyframes get one this often, so lost frames don't leave stale tiles forever
+#define TILED_REFRESH_INTERVAL 2.0
+
+static inline int min_int(int a, int b) { return a < b ? a : b; }
+
+//////// Encoder
+
+struct allo_tiled_encoder {
+    allo_mjpeg_encoder *jpeg;
+    // the last picture sent, width * 4 bytes per row
+    uint8_t *previous;
+    int width, height;
+    uint16_t next_seq;
+    // which tiles go into the frame being encoded
+    int *tiles;
+    // the changed tiles side by side
+    uint8_t *atlas;
+    size_t atlas_capacity;
+};
+
+allo_tiled_encoder *allo_tiled_encoder_create(int quality, int worker_threads)
+{
+    allo_tiled_encoder *encoder = calloc(1, sizeof(allo_tiled_encoder));
+    encoder->jpeg = allo_mjpeg_encoder_create(quality, worker_threads);
+    return encoder;
+}
+
+void allo_tiled_encoder_destroy(allo_tiled_encoder *encoder)
+{
+    if(!encoder) return;
+    allo_mjpeg_encoder_destroy(encoder->jpeg);
+    free(encoder->previous);
+    free(encoder->tiles);
+    free(encoder->atlas);
+    free(encoder);
+}
+
+/// memcmp is vectorized and bails at the first difference, so unchanged tiles cost about a memory read
+static bool tile_changed(const uint8_t *a, size_t a_stride, const uint8_t *b, size_t b_stride, size_t row_bytes, int rows)
+{
+    for(int y = 0; y < rows; y++)
+    {
+        if(memcmp(a + y * a_stride, b + y * b_stride, row_bytes) != 0) return true;
+    }
+    return false;
+}
+
+/// Copy a tile into its slot in the atlas, repeating its last row and column out to a full tile
+/// at the picture's edges so the JPEG doesn't spend bits on a hard edge nobody will see
+static void copy_to_atlas(uint8_t *slot, size_t atlas_stride, const uint8_t *src, size_t stride, int tile_wide, int tile_high)
+{
+    for(int y = 0; y < TILE; y++)
+    {
+        uint8_t *row = slot + y * atlas_stride;
+        memcpy(row, src + min_int(y, tile_high - 1) * stride, tile_wide * 4);
+        for(int x = tile_wide; x < TILE; x++)
+        {
+            memcpy(row + x * 4, row + (tile_wide - 1) * 4, 4);
+        }
+    }
+}
+
+ENetPacket *allo_tiled_encoder_encode(allo_tiled_encoder *encoder, const uint8_t *rgba, int width, int height, int stride, bool keyframe, size_t reserve)
+{
+    if(width <= 0 || height <= 0 || width > 0xffff || height > 0xffff) return NULL;
+    int columns = (width + TILE - 1) / TILE;
+    int rows = (height + TILE - 1) / TILE;
+    int total = columns * rows;
+    if(total > ALLO_TILED_MAX_TILES) return NULL;
+
+    size_t previous_stride = (size_t)width * 4;
+    if(width != encoder->width || height != encoder->height)
+    {
+        free(encoder->previous);
+        free(encoder->tiles);
+        encoder->previous = malloc(previous_stride * height);
+        encoder->tiles = malloc(total * sizeof(int));
+        encoder->width = width;
+        encoder->height = height;
+        keyframe = true;
+    }
+
+    int count = 0;
+    for(int i = 0; i < total; i++)
+    {
+        int x = (i % columns) * TILE, y = (i / columns) * TILE;
+        int tile_wide = min_int(TILE, width - x), tile_high = min_int(TILE, height - y);
+        const uint8_t *src = rgba + (size_t)y * stride + (size_t)x * 4;
+        uint8_t *previous = encoder->previous + (size_t)y * previous_stride + (size_t)x * 4;
+        if(!keyframe && !tile_changed(src, stride, previous, previous_stride, tile_wide * 4, tile_high)) continue;
+        for(int row = 0; row < tile_high; row++)
+        {
+            memcpy(previous + row * previous_stride, src + (size_t)row * stride, tile_wide * 4);
+        }
+        encoder->tiles[count++] = i;
+    }
+    if(count == 0) return NULL;
+
+    int atlas_columns = min_int(count, ALLO_TILED_ATLAS_COLUMNS);
+    int atlas_rows = (count + atlas_columns - 1) / atlas_columns;
+    size_t atlas_stride = (size_t)atlas_columns * TILE * 4;
+    size_t atlas_size = atlas_stride * atlas_rows * TILE;
+    if(atlas_size > encoder->atlas_capacity)
+    {
+        free(encoder->atlas);
+        encoder->atlas = malloc(atlas_size);
+        encoder->atlas_capacity = atlas_size;
+    }
+    for(int slot = 0; slot < atlas_rows * atlas_columns; slot++)
+    {
+        uint8_t *dst = encoder->atlas + (slot / atlas_columns) * TILE * atlas_stride + (slot % atlas_columns) * TILE * 4;
+        if(slot >= count)
+        {
+            for(int y = 0; y < TILE; y++) memset(dst + y * atlas_stride, 0, TILE * 4);
+            continue;
+        }
+        int i = encoder->tiles[slot];
+        int x = (i % columns) * TILE, y = (i / columns) * TILE;
+        copy_to_atlas(dst, atlas_stride, rgba + (size_t)y * stride + (size_t)x * 4, stride, min_int(TILE, width - x), min_int(TILE, height - y));
+    }
+
+    size_t bitmap_length = (total + 7) / 8;
+    size_t header_length = ALLO_TILED_HEADER_SIZE + bitmap_length;
+    ENetPacket *packet = allo_mjpeg_encoder_encode(encoder->jpeg, encoder->atlas, atlas_columns * TILE, atlas_rows * TILE, (int)atlas_stride, reserve + header_length);
+    if(!packet)
+    {
+        // `previous` already has these tiles, so start over with a keyframe
+        encoder->width = encoder->height = 0;
+        return NULL;
+    }
+
+    uint8_t *header = packet->data + reserve;
+    uint16_t seq = encoder->next_seq++;
+    header[0] = keyframe ? ALLO_TILED_KEYFRAME : 0;
+    header[1] = seq >> 8; header[2] = seq;
+    header[3] = width >> 8; header[4] = width;
+    header[5] = height >> 8; header[6] = height;
+    uint8_t *bitmap = header + ALLO_TILED_HEADER_SIZE;
+    memset(bitmap, 0, bitmap_length);
+    for(int t = 0; t < count; t++)
+    {
+        bitmap[encoder->tiles[t] / 8] |= 1 << (encoder->tiles[t] % 8);
+    }
+    return packet;
+}
+
+//////// Decoder
+
+allo_tiled_decoder *allo_tiled_decoder_create(void)
+{
+    return calloc(1, sizeof(allo_tiled_decoder));
+}
+
+void allo_tiled_decoder_destroy(allo_tiled_decoder *decoder)
+{
+    if(!decoder) return;
+    free(decoder->framebuffer);
+    free(decoder);
+}
+
+bool allo_tiled_decoder_apply(allo_tiled_decoder *decoder, const uint8_t *data, size_t length)
+{
+    if(length < ALLO_TILED_HEADER_SIZE) return false;
+    bool keyframe = data[0] & ALLO_TILED_KEYFRAME;
+    uint16_t seq = ((uint16_t)data[1] << 8) | data[2];
+    int width = (data[3] << 8) | data[4];
+    int height = (data[5] << 8) | data[6];
+    if(width == 0 || height == 0) return false;
+    int columns = (width + TILE - 1) / TILE;
+    int rows = (height + TILE - 1) / TILE;
+    int total = columns * rows;
+    if(total > ALLO_TILED_MAX_TILES) return false;
+    size_t bitmap_length = (total + 7) / 8;
+    if(length <= ALLO_TILED_HEADER_SIZE + bitmap_length) return false;
+    const uint8_t *bitmap = data + ALLO_TILED_HEADER_SIZE;
+    int count = 0;
+    for(int i = 0; i < total; i++)
+    {
+        if(bitmap[i / 8] & (1 << (i % 8))) count++;
+    }
+    if(count == 0) return false;
+
+    size_t jpeg_offset = ALLO_TILED_HEADER_SIZE + bitmap_length;
+    int32_t atlas_wide = 0, atlas_high = 0;
+    allopixel *atlas = allo_mjpeg_decode((uint8_t*)data + jpeg_offset, length - jpeg_offset, &atlas_wide, &atlas_high);
+    if(!atlas) return false;
+    int atlas_columns = min_int(count, ALLO_TILED_ATLAS_COLUMNS);
+    int atlas_rows = (count + atlas_columns - 1) / atlas_columns;
+    if(atlas_wide != atlas_columns * TILE || atlas_high != atlas_rows * TILE)
+    {
+        free(atlas);
+        return false;
+    }
+
+    if(width != decoder->width || height != decoder->height)
+    {
+        // also when joining halfway: show what we get, and fill in the rest from the next keyframe
+        free(decoder->framebuffer);
+        decoder->framebuffer = calloc((size_t)width * height, sizeof(allopixel));
+        decoder->width = width;
+        decoder->height = height;
+        decoder->needs_keyframe = true;
+    }
+    else if(seq != decoder->next_seq)
+    {
+        decoder->needs_keyframe = true;
+    }
+    if(keyframe)
+    {
+        decoder->needs_keyframe = false;
+    }
+    decoder->next_seq = seq + 1;
+
+    int slot = 0;
+    for(int i = 0; i < total; i++)
+    {
+        if(!(bitmap[i / 8] & (1 << (i % 8)))) continue;
+        int x = (i % columns) * TILE, y = (i / columns) * TILE;
+        int tile_wide = min_int(TILE, width - x), tile_high = min_int(TILE, height - y);
+        const allopixel *src = atlas + (size_t)(slot / atlas_columns) * TILE * atlas_wide + (slot % atlas_columns) * TILE;
+        allopixel *dst = decoder->framebuffer + (size_t)y * width + x;
+        for(int row = 0; row < tile_high; row++)
+        {
+            memcpy(dst + (size_t)row * width, src + (size_t)row * atlas_wide, tile_wide * sizeof(allopixel));
+        }
+        slot++;
+    }
+    free(atlas);
+    return true;
+}
+
+//////// Media subsystem
+
+static ENetPacket *tiled_encode(allo_media_track *track, allopicture *picture)
+{
+    ENetPacket *packet = NULL;
+    if(picture->format != allopicture_format_rgba8888)
+    {
+        fprintf(stderr, "allonet/tiled: dropping frame: picture is format %d, only rgba supported\n", picture->format);
+        goto end;
+    }
+    if(!track->info.video.encoder.tiled)
+    {
+        track->info.video.encoder.tiled = allo_tiled_encoder_create(TILED_QUALITY, TILED_ENCODER_THREADS);
+    }
+
+    double now = get_ts_monod();
+    bool keyframe = track->info.video.keyframe_requested ||
+        (!track->info.video.fragmented && now - track->info.video.encoder.last_keyframe >= TILED_REFRESH_INTERVAL);
+    int stride = picture->plane_strides[0] ? picture->plane_strides[0] : picture->width * 4;
+    // leave room for the track id
+    packet = allo_tiled_encoder_encode(track->info.video.encoder.tiled, (const uint8_t*)picture->planes[0].rgba, picture->width, picture->height, stride, keyframe, 4);
+    if(packet)
+    {
+        track->info.video.keyframe = packet->data[4] & ALLO_TILED_KEYFRAME;
+        if(track->info.video.keyframe)
+        {
+            track->info.video.keyframe_requested = false;
+            track->info.video.encoder.last_keyframe = now;
+        }
+    }
+
+end:
+    allopicture_free(picture);
+    return packet;
+}
+
+bool allo_tiled_decoder_decode(void *state, const uint8_t *data, size_t length, allo_decoded_video_frame *frame)
+{
+    allo_tiled_decoder *decoder = state;
+    if(!allo_tiled_decoder_apply(decoder, data, length))
+    {
+        // whatever tiles it had are lost, so the framebuffer is only whole again after a keyframe
+        decoder->needs_keyframe = true;
+        frame->needs_keyframe = true;
+        return false;
+    }
+    frame->needs_keyframe = decoder->needs_keyframe;
+    // the framebuffer stays ours to patch
+    size_t pixel_count = (size_t)decoder->width * decoder->height;
+    frame->pixels = allo_pixel_buffer_get(pixel_count);
+    memcpy(frame->pixels, decoder->framebuffer, pixel_count * sizeof(allopixel));
+    frame->wide = decoder->width;
+    frame->high = decoder->height;
+    return true;
+}
+
+static void tiled_decoder_free(void *state)
+{
+    allo_tiled_decoder_destroy(state);
+}
+
+static void tiled_parse(alloclient *client, allo_media_track *track, unsigned char *data, size_t length)
+{
+    if(!client->video_callback && !client->video_picture_callback)
+    {
+        return;
+    }
+    // decoded on other threads like mjpeg, and handed to video_callback from alloclient_poll
+    allo_video_decode_queue *queue = allo_mjpeg_decode_queue(client);
+    if(!track->info.video.decoder.tiled)
+    {
+        // the queue owns it from here on, so it outlives a decode that's still running when the track goes away
+        track->info.video.decoder.tiled = allo_tiled_decoder_create();
+        allo_video_decode_queue_set_decoder(queue, track->track_id, allo_tiled_decoder_decode, track->info.video.decoder.tiled, tiled_decoder_free);
+    }
+    allo_video_decode_queue_push(queue, track->track_id, data, length);
+}
+
+static bool tiled_track_initialize(allo_media_track *track, const cJSON *comp)
+{
+    if(track->type != allo_media_type_video) return false;
+    const char *format = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(comp, "format"));
+    if(format && strcmp(format, "tiled") == 0)
+    {
+        track->info.video.format = allo_video_format_tiled;
+        return true;
+    }
+    return false;
+}
+
+static void tiled_track_destroy(allo_media_track *track)
+{
+    allo_tiled_encoder_destroy(track->info.video.encoder.tiled);
+    track->info.video.encoder.tiled = NULL;
+    // the decode queue frees the decoder once the track is forgotten
+    track->info.video.decoder.tiled = NULL;
+}
+
+void allo_media_tiled_register(void)
+{
+    allo_media_subsystem *sys = calloc(1, sizeof(allo_media_subsystem));
+    sys->parse = tiled_parse;
+    sys->track_initialize = tiled_track_initialize;
+    sys->track_destroy = tiled_track_destroy;
+    sys->create_video_packet = tiled_encode;
+    allo_media_subsystem_register(sys);
+}
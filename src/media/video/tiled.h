@@ -0,0 +1,79 @@
+#ifndef ALLONET_VIDEO_TILED_H
+#define ALLONET_VIDEO_TILED_H
+
+#include <allonet/client.h>
+#include <enet/enet.h>
+#include "decode_queue.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Video for mostly static pictures, like 2D UI. The picture is cut into ALLO_TILED_TILE_SIZE
+ * square tiles, and only the tiles that changed since the previous frame are sent. They're
+ * packed side by side into one small picture and sent as a single JPEG, so both the bandwidth
+ * and the encoding work follow the damaged area rather than the resolution.
+ *
+ * A frame is: u8 flags, big-endian u16 sequence number, u16 width, u16 height, a bitmap with
+ * one bit per tile in row-major order (least significant bit first) saying which tiles are in
+ * the frame, and then a JPEG of those tiles in the same order, ALLO_TILED_ATLAS_COLUMNS to a row.
+ */
+#define ALLO_TILED_TILE_SIZE 64
+#define ALLO_TILED_ATLAS_COLUMNS 8
+#define ALLO_TILED_HEADER_SIZE 7
+/// A JPEG can be at most 65535 pixels high
+#define ALLO_TILED_MAX_TILES (ALLO_TILED_ATLAS_COLUMNS * (0xffff / ALLO_TILED_TILE_SIZE))
+
+enum {
+    /// every tile is in the frame, so it doesn't depend on the frames before it
+    ALLO_TILED_KEYFRAME = 1 << 0,
+};
+
+/// Not thread safe; use one encoder per video track.
+typedef struct allo_tiled_encoder allo_tiled_encoder;
+
+/// @param quality 1-100, as in libjpeg
+/// @param worker_threads threads to encode on, besides the calling thread
+allo_tiled_encoder *allo_tiled_encoder_create(int quality, int worker_threads);
+void allo_tiled_encoder_destroy(allo_tiled_encoder *encoder);
+
+/** Encode the tiles of an RGBA8888 picture that changed since the last one into a new
+ * unreliable packet, or all of them if `keyframe` or the picture changed size.
+ * @param stride bytes per row in `rgba`
+ * @param reserve bytes to leave free at the start of the packet, e g for a track id
+ * @return NULL if nothing changed
+ */
+ENetPacket *allo_tiled_encoder_encode(allo_tiled_encoder *encoder, const uint8_t *rgba, int width, int height, int stride, bool keyframe, size_t reserve);
+
+typedef struct allo_tiled_decoder {
+    /// everything received so far, width * height pixels
+    allopixel *framebuffer;
+    int width, height;
+    uint16_t next_seq;
+    /// frames were lost or the stream was joined halfway, so the framebuffer is missing
+    /// tiles until the next keyframe
+    bool needs_keyframe;
+} allo_tiled_decoder;
+
+allo_tiled_decoder *allo_tiled_decoder_create(void);
+void allo_tiled_decoder_destroy(allo_tiled_decoder *decoder);
+
+/// Patch a frame into the framebuffer.
+/// @return false if nothing changed, because the frame was invalid or can't be applied without a keyframe first
+bool allo_tiled_decoder_apply(allo_tiled_decoder *decoder, const uint8_t *data, size_t length);
+
+/// Patch a frame into `state`, an allo_tiled_decoder, and copy the framebuffer into frame->pixels.
+/// An allo_video_stateful_decode_func, for decoding on an allo_video_decode_queue.
+bool allo_tiled_decoder_decode(void *state, const uint8_t *data, size_t length, allo_decoded_video_frame *frame);
+
+void allo_media_tiled_register(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
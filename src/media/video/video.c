@@ -1,9 +1,224 @@
 #include "../../client/_client.h"
 #include "../../util.h"
 #include "../media.h"
+#include "pixel_pool.h"
+#include "fragment.h"
+#include "simulcast.h"
 #include <string.h>
 #include <assert.h>
 
+// a few frame times: fragments of a frame normally arrive within a millisecond or two of each other
+#define REASSEMBLY_DEADLINE 0.2
+// don't ask again before a keyframe we asked for could have arrived
+#define KEYFRAME_REQUEST_INTERVAL 0.5
+
+void _alloclient_video_track_initialize(allo_media_track *track, const cJSON *comp)
+{
+    const char *framing = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(comp, "framing"));
+    track->info.video.fragmented = framing && strcmp(framing, "fragmented") == 0;
+    if (track->info.video.fragmented) {
+        track->info.video.reassembler = allo_video_reassembler_create(REASSEMBLY_DEADLINE);
+    }
+    cJSON *jlayers = cJSON_GetObjectItemCaseSensitive(comp, "layers");
+    int layer_count = cJSON_IsNumber(jlayers) ? jlayers->valueint : 1;
+    if (layer_count > ALLO_VIDEO_MAX_LAYERS) layer_count = ALLO_VIDEO_MAX_LAYERS;
+    if (track->subsystem && track->info.video.fragmented && layer_count > 1) {
+        track->info.video.layer_count = layer_count;
+        for (int layer = 1; layer < layer_count; layer++) {
+            // only encoders are ever created on these, once we send on the track
+            allo_media_track *layer_track = calloc(1, sizeof(allo_media_track));
+            layer_track->track_id = track->track_id;
+            layer_track->type = track->type;
+            layer_track->subsystem = track->subsystem;
+            mtx_init(&layer_track->bitrates_lock, mtx_plain);
+            track->subsystem->track_initialize(layer_track, comp);
+            layer_track->info.video.width = track->info.video.width >> layer;
+            layer_track->info.video.height = track->info.video.height >> layer;
+            layer_track->info.video.fragmented = true;
+            layer_track->info.video.layer = layer;
+            track->info.video.layers[layer - 1] = layer_track;
+        }
+    }
+}
+
+void _media_video_track_free(allo_media_track *track)
+{
+    allo_video_reassembler_destroy(track->info.video.reassembler);
+    for (int i = 0; i < ALLO_VIDEO_MAX_LAYERS - 1; i++) {
+        allo_media_track *layer_track = track->info.video.layers[i];
+        if (!layer_track) continue;
+        layer_track->subsystem->track_destroy(layer_track);
+        mtx_destroy(&layer_track->bitrates_lock);
+        free(layer_track);
+    }
+    arr_free(&track->info.video.subscribers);
+}
+
+/// Send a whole frame from create_video_packet as fragments small enough not to need IP fragmentation,
+/// so that losing one packet costs one fragment rather than the whole frame having to be resent.
+static void send_fragments(alloclient *client, allo_media_track *track, ENetPacket *packet)
+{
+    const int headerlen = sizeof(int32_t); // track id header
+    int32_t big_track_id = htonl(track->track_id);
+    const uint8_t *frame = packet->data + headerlen;
+    size_t length = packet->dataLength - headerlen;
+    allo_video_fragment_header header = {
+        (uint8_t)((track->info.video.keyframe ? ALLO_VIDEO_FRAGMENT_KEYFRAME : 0) | track->info.video.layer << ALLO_VIDEO_FRAGMENT_LAYER_SHIFT),
+        track->info.video.next_frame_id++,
+        0,
+        (uint16_t)allo_video_fragment_count(length)
+    };
+    if (header.count > ALLO_VIDEO_MAX_FRAGMENTS) {
+        fprintf(stderr, "alloclient: Skipping send video as the frame is too big (%zu bytes)\n", length);
+        return;
+    }
+    for (; header.index < header.count; header.index++) {
+        size_t offset = (size_t)header.index * ALLO_VIDEO_FRAGMENT_PAYLOAD;
+        size_t chunk = length - offset < ALLO_VIDEO_FRAGMENT_PAYLOAD ? length - offset : ALLO_VIDEO_FRAGMENT_PAYLOAD;
+        // fragments are reassembled in any order, so don't let enet drop the ones that overtake each other
+        ENetPacket *fragment = enet_packet_create(NULL, headerlen + ALLO_VIDEO_FRAGMENT_HEADER_SIZE + chunk, ENET_PACKET_FLAG_UNSEQUENCED);
+        memcpy(fragment->data, &big_track_id, headerlen);
+        allo_video_write_fragment_header(fragment->data + headerlen, &header);
+        memcpy(fragment->data + headerlen + ALLO_VIDEO_FRAGMENT_HEADER_SIZE, frame + offset, chunk);
+        size_t sentlen = fragment->dataLength;
+        if (allo_enet_peer_send(_internal(client)->peer, CHANNEL_VIDEO, fragment) == 0) {
+            _media_track_count_sent(track, sentlen);
+        } else {
+            enet_packet_destroy(fragment);
+        }
+    }
+}
+
+static void request_keyframe(alloclient *client, allo_media_track *track, int layer)
+{
+    const int headerlen = sizeof(int32_t); // track id header
+    int32_t big_track_id = htonl(track->track_id);
+    allo_video_fragment_header header = { (uint8_t)(ALLO_VIDEO_FRAGMENT_KEYFRAME_REQUEST | layer << ALLO_VIDEO_FRAGMENT_LAYER_SHIFT), 0, 0, 0 };
+    ENetPacket *packet = enet_packet_create(NULL, headerlen + ALLO_VIDEO_FRAGMENT_HEADER_SIZE, ENET_PACKET_FLAG_UNSEQUENCED);
+    memcpy(packet->data, &big_track_id, headerlen);
+    allo_video_write_fragment_header(packet->data + headerlen, &header);
+    if (allo_enet_peer_send(_internal(client)->peer, CHANNEL_VIDEO, packet) != 0) {
+        enet_packet_destroy(packet);
+    }
+}
+
+void _alloclient_receive_video(alloclient *client, allo_media_track *track, unsigned char *data, size_t length)
+{
+    if (!track->info.video.fragmented) {
+        track->subsystem->parse(client, track, data, length);
+        return;
+    }
+    allo_video_fragment_header header;
+    if (!allo_video_read_fragment_header(data, length, &header)) {
+        return;
+    }
+    int layer = allo_video_fragment_layer(header.flags);
+    if (layer >= ALLO_VIDEO_MAX_LAYERS || (track->info.video.layer_count > 1 && layer >= track->info.video.layer_count)) {
+        // a layer this track doesn't have
+        return;
+    }
+    if (header.flags & ALLO_VIDEO_FRAGMENT_KEYFRAME_REQUEST) {
+        // for our own track; the next frame we send in that layer will be a keyframe
+        allo_media_track *layer_track = layer == 0 ? track : layer < track->info.video.layer_count ? track->info.video.layers[layer - 1] : NULL;
+        if (layer_track) layer_track->info.video.keyframe_requested = true;
+        return;
+    }
+    if (layer != track->info.video.receiving_layer) {
+        if (!(header.flags & ALLO_VIDEO_FRAGMENT_KEYFRAME)) {
+            // stragglers from the layer the place just moved us off
+            return;
+        }
+        // the place moved us to another layer of a simulcast track; its frame ids have nothing to do with the old one's
+        allo_video_reassembler_destroy(track->info.video.reassembler);
+        track->info.video.reassembler = allo_video_reassembler_create(REASSEMBLY_DEADLINE);
+        track->info.video.receiving_layer = layer;
+    }
+    allo_video_reassembler *reassembler = track->info.video.reassembler;
+    const uint8_t *frame;
+    size_t frame_length;
+    double now = get_ts_monod();
+    if (allo_video_reassembler_push(reassembler, &header, data + ALLO_VIDEO_FRAGMENT_HEADER_SIZE, length - ALLO_VIDEO_FRAGMENT_HEADER_SIZE, now, &frame, &frame_length)) {
+        track->subsystem->parse(client, track, (unsigned char*)frame, frame_length);
+    }
+    // every mjpeg frame is a keyframe, so it never needs to ask
+    bool needs_keyframe = allo_video_reassembler_needs_keyframe(reassembler) || track->info.video.keyframe_needed;
+    if (track->info.video.format != allo_video_format_mjpeg && needs_keyframe &&
+        now - track->info.video.last_keyframe_request[layer] >= KEYFRAME_REQUEST_INTERVAL) {
+        track->info.video.last_keyframe_request[layer] = now;
+        request_keyframe(client, track, layer);
+    }
+}
+
+/// Send and take ownership of an encoded frame from the track's subsystem
+static void send_packet(alloclient *client, allo_media_track *track, ENetPacket *packet)
+{
+    if(packet && track->info.video.fragmented) {
+        send_fragments(client, track, packet);
+        enet_packet_destroy(packet);
+    } else if(packet) {
+        const int headerlen = sizeof(int32_t); // track id header
+        int32_t big_track_id = htonl(track->track_id);
+        memcpy(packet->data, &big_track_id, headerlen);
+
+        size_t sentlen = packet->dataLength;
+        if (allo_enet_peer_send(_internal(client)->peer, CHANNEL_VIDEO, packet) == 0) {
+            _media_track_count_sent(track, sentlen);
+        } else {
+            enet_packet_destroy(packet);
+        }
+    }
+}
+
+static void encode_and_send(alloclient *client, allo_media_track *track, allopicture *picture)
+{
+    ENetPacket *packet = track->subsystem->create_video_packet(track, picture);
+    send_packet(client, track, packet);
+    // anything else the encoder has finished by now, so that nothing sits in it waiting for the next picture
+    while (track->subsystem->drain_video_packet && (packet = track->subsystem->drain_video_packet(track))) {
+        send_packet(client, track, packet);
+    }
+}
+
+static void free_borrowed_picture(allopicture *picture)
+{
+    free(picture);
+}
+
+/// `picture` for subsystems to free as usual, while it's still needed for the other layers
+static allopicture *borrow_picture(const allopicture *picture)
+{
+    allopicture *borrowed = malloc(sizeof(allopicture));
+    *borrowed = *picture;
+    borrowed->free = free_borrowed_picture;
+    borrowed->userdata = NULL;
+    return borrowed;
+}
+
+/// Encode and send every layer of a simulcast track, each from the one before scaled down by half
+static void send_layers(alloclient *client, allo_media_track *track, allopicture *picture)
+{
+    allopicture *layers[ALLO_VIDEO_MAX_LAYERS] = { borrow_picture(picture) };
+    int layer_count = track->info.video.layer_count;
+    for (int layer = 1; layer < layer_count; layer++) {
+        const allopicture *bigger = layers[layer - 1];
+        int wide = bigger->width / 2, high = bigger->height / 2;
+        if (allopicture_bpp(bigger->format) != 4 || wide == 0 || high == 0) {
+            // the h264 encoder scales anything it can encode by itself
+            layers[layer] = borrow_picture(bigger);
+            continue;
+        }
+        allopixel *pixels = allo_pixel_buffer_get((size_t)wide * high);
+        int stride = bigger->plane_strides[0] ? bigger->plane_strides[0] : bigger->width * 4;
+        allo_video_halve((const uint8_t*)bigger->planes[0].rgba, bigger->width, bigger->height, stride, (uint8_t*)pixels);
+        layers[layer] = allo_pixel_buffer_picture(pixels, wide, high);
+        layers[layer]->format = bigger->format;
+    }
+    for (int layer = 0; layer < layer_count; layer++) {
+        encode_and_send(client, layer == 0 ? track : track->info.video.layers[layer - 1], layers[layer]);
+    }
+    allopicture_free(picture);
+}
+
 void _alloclient_send_video(alloclient *client, int32_t track_id, allopicture *picture)
 {
     if (_internal(client)->peer == NULL) {
@@ -16,8 +231,8 @@ void _alloclient_send_video(alloclient *client, int32_t track_id, allopicture *p
         return;
     }
     
-    alloclient_internal_shared *shared = _alloclient_internal_shared_begin(client);
-    allo_media_track *track = _media_track_find(&shared->media_tracks, track_id);
+    allo_media_track_list *tracks = _internal(client)->shared->media_tracks;
+    allo_media_track *track = _media_track_table_find(_media_tracks_read_begin(tracks), track_id);
     
     if (track == NULL) {
         fprintf(stderr, "alloclient: Skipping send video as track is not allocated\n");
@@ -29,17 +244,47 @@ void _alloclient_send_video(alloclient *client, int32_t track_id, allopicture *p
         goto end;
     }
     
-    ENetPacket *packet = track->subsystem->create_video_packet(track, picture);
-    
-    if(packet) {
-        const int headerlen = sizeof(int32_t); // track id header
-        int32_t big_track_id = htonl(track_id);
-        memcpy(packet->data, &big_track_id, headerlen);
-
-        int ok = allo_enet_peer_send(_internal(client)->peer, CHANNEL_VIDEO, packet); (void)ok;
-        bitrate_increment_sent(&track->bitrates, packet->dataLength);
-        assert(ok == 0);
+    if (track->info.video.layer_count > 1) {
+        send_layers(client, track, picture);
+    } else {
+        encode_and_send(client, track, picture);
     }
 end:
-    _alloclient_internal_shared_end(client);
+    _media_tracks_read_end(tracks);
+}
+
+void _alloclient_video_deliver(alloclient *client, uint32_t track_id, allopixel *pixels, int32_t wide, int32_t high)
+{
+    if (client->video_picture_callback) {
+        allopicture *picture = allo_pixel_buffer_picture(pixels, wide, high);
+        if (client->video_picture_callback(client, track_id, picture)) {
+            allopicture_free(picture);
+        }
+    } else if (!client->video_callback || client->video_callback(client, track_id, pixels, wide, high)) {
+        allo_pixel_buffer_return(pixels, (size_t)wide * high);
+    }
+}
+
+void _alloclient_deliver_video(alloclient *client)
+{
+    allo_video_decode_queue *decoders = _internal(client)->video_decoders;
+    if (!decoders) return;
+    allo_media_track_list *tracks = _internal(client)->shared->media_tracks;
+    allo_decoded_video_frame frame;
+    while (allo_video_decode_queue_pop(decoders, &frame)) {
+        // the track might have gone away while the frame was decoding
+        allo_media_track *track = _media_track_find(tracks, frame.track_id);
+        if (track == NULL) {
+            allo_pixel_buffer_return(frame.pixels, (size_t)frame.wide * frame.high);
+            continue;
+        }
+        track->info.video.keyframe_needed = frame.needs_keyframe;
+        if (frame.pixels == NULL) continue;
+        _alloclient_video_deliver(client, frame.track_id, frame.pixels, frame.wide, frame.high);
+    }
+}
+
+void alloclient_video_buffer_return(allopixel *pixels, int32_t pixels_wide, int32_t pixels_high)
+{
+    allo_pixel_buffer_return(pixels, (size_t)pixels_wide * pixels_high);
 }
@@ -36,16 +36,28 @@ typedef arr_t(ENetPeer *) PeerList;
 typedef struct wanted_asset {
     char *id; // asset id
     arr_t(ENetPeer *) recipients;  // The peers that wants the asset
-    ENetPeer *source;// the peer we have choosen to download the asset from
-    arr_t(ENetPeer *) remaining_potential_sources;
+    arr_t(ENetPeer *) remaining_potential_sources; // the peers we're downloading it from, or might
+
 } wanted_asset;
 
+// How many recently sent asset chunks to keep packed, for others that ask for the same chunk
+#define SERVED_CHUNKS_MAX 16
+typedef struct served_chunk {
+    char *asset_id;
+    size_t offset, length; // as requested
+    asset_packed_message *message;
+    double last_used;
+} served_chunk;
+
 typedef struct {
     ENetHost *enet;
     /// map from asset_id to list of client peers
     arr_t(wanted_asset*) wanted_assets;
     assetstore assetstore;
-    allo_media_track_list media_tracks;
+    bool asset_cache; // assetstore is an asset_diskstore
+    asset_transfers asset_transfers; // wanted assets being downloaded into assetstore
+    arr_t(served_chunk) served_chunks; // complete assets' chunks, as recently sent
+    double next_stall_check;
 } alloserv_internal;
 
 typedef struct {
@@ -118,27 +130,33 @@ typedef struct asset_user {
 
 
 /// @param user must be an asset_user
-static void _asset_send_func_broadcast(asset_mid mid, const cJSON *header, const uint8_t *data, size_t data_length, void *user) {
-    // Build packet and send to everyone except the client in user
+static void _asset_send_func_potential_sources(asset_mid mid, const cJSON *header, const uint8_t *data, size_t data_length, void *user) {
+    // Build packet and send to everyone that might have the asset in the header
     
     alloserver *server = ((asset_user *)user)->server;
-    alloserver_client *client = ((asset_user *)user)->client;
+    wanted_asset *wanted = _asset_is_wanted(cJSON_GetStringValue(cJSON_GetObjectItem(header, "id")), server);
+    if (wanted == NULL || wanted->remaining_potential_sources.length == 0) {
+        return;
+    }
     
     ENetPacket *packet = asset_build_enet_packet(mid, header, data, data_length);
-    
-    alloserver_client *other;
-    LIST_FOREACH(other, &server->clients, pointers) {
-        if (other == client) continue;
-        ENetPeer *peer = _clientinternal(other)->peer;
-        
-        allo_enet_peer_send(peer, CHANNEL_ASSETS, packet);
+    for (size_t i = 0; i < wanted->remaining_potential_sources.length; i++) {
+        if (allo_enet_peer_send(wanted->remaining_potential_sources.data[i], CHANNEL_ASSETS, packet) != 0) {
+            LOG_ASSET_D(NULL, "%s Failed to ask source %p", wanted->id, wanted->remaining_potential_sources.data[i]);
+        }
+    }
+    // shared by every peer it went out to, and freed by ENet once they've sent it
+    if (packet->referenceCount == 0) {
+        enet_packet_destroy(packet);
     }
 }
 void _asset_send_func_peer(asset_mid mid, const cJSON *header, const uint8_t *data, size_t data_length, void *user) {
     ENetPeer *peer = ((asset_user *)user)->peer;
     
     ENetPacket *packet = asset_build_enet_packet(mid, header, data, data_length);
-    allo_enet_peer_send(peer, CHANNEL_ASSETS, packet);
+    if (allo_enet_peer_send(peer, CHANNEL_ASSETS, packet) != 0) {
+        enet_packet_destroy(packet);
+    }
 }
 void _asset_send_func(asset_mid mid, const cJSON *header, const uint8_t *data, size_t data_length, void *user) {
     // Extract peer if one is not already set.
@@ -154,22 +172,81 @@ void _asset_send_func(asset_mid mid, const cJSON *header, const uint8_t *data, s
     _asset_send_func_peer(mid, header, data, data_length, &usr);
 }
 
-static void _asset_request_bytes_func(const char *asset_id, size_t offset, size_t length, void *user) {
-    alloserver *server = ((asset_user *)user)->server;
-    alloserver_client *client = ((asset_user *)user)->client;
-    
-    uint8_t *buffer = malloc(length);
-    assert(buffer);
+static void _clear_served_chunks(alloserv_internal *sv)
+{
+    for (size_t i = 0; i < sv->served_chunks.length; i++) {
+        free(sv->served_chunks.data[i].asset_id);
+        asset_packed_message_release(sv->served_chunks.data[i].message);
+    }
+    arr_clear(&sv->served_chunks);
+}
+
+/// Reads a chunk from the store straight into a packed message. Chunks of complete assets are kept for
+/// a while, so that when many clients ask for the same asset, like when they join, it's only read once.
+/// @return The message, with a reference for the caller, or NULL if the store doesn't have the chunk
+static asset_packed_message *_served_chunk(alloserv_internal *sv, const char *asset_id, size_t offset, size_t length)
+{
+    double now = get_ts_monod();
+    for (size_t i = 0; i < sv->served_chunks.length; i++) {
+        served_chunk *chunk = &sv->served_chunks.data[i];
+        if (chunk->offset == offset && chunk->length == length && strcmp(chunk->asset_id, asset_id) == 0) {
+            chunk->last_used = now;
+            asset_packed_message_retain(chunk->message);
+            return chunk->message;
+        }
+    }
     
+    int complete = 0;
     size_t total_size = 0;
-    int read_length = assetstore_read(&(_servinternal(server)->assetstore), asset_id, offset, buffer, length, &total_size);
+    assetstore_get_state(&sv->assetstore, asset_id, NULL, &complete, NULL, &total_size);
+    if (offset >= total_size) {
+        return NULL;
+    }
+    size_t read_length = length < total_size - offset ? length : total_size - offset;
+    asset_packed_message *message = asset_pack_bytes(asset_id, offset, read_length, total_size);
+    if (assetstore_read(&sv->assetstore, asset_id, offset, asset_packed_message_data(message), read_length, &total_size) != (int)read_length) {
+        asset_packed_message_release(message);
+        return NULL;
+    }
+    if (!complete) {
+        return message;
+    }
     
-    if (read_length > 0) {
-        asset_deliver_bytes(asset_id, buffer, offset, read_length, total_size, _asset_send_func, user);
+    served_chunk chunk = { strdup(asset_id), offset, length, message, now };
+    if (sv->served_chunks.length == SERVED_CHUNKS_MAX) {
+        size_t oldest = 0;
+        for (size_t i = 1; i < sv->served_chunks.length; i++) {
+            if (sv->served_chunks.data[i].last_used < sv->served_chunks.data[oldest].last_used) oldest = i;
+        }
+        free(sv->served_chunks.data[oldest].asset_id);
+        asset_packed_message_release(sv->served_chunks.data[oldest].message);
+        sv->served_chunks.data[oldest] = chunk;
     } else {
+        arr_push(&sv->served_chunks, chunk);
+    }
+    asset_packed_message_retain(message);
+    return message;
+}
+
+static void _asset_request_bytes_func(const char *asset_id, size_t offset, size_t length, void *user) {
+    alloserver *server = ((asset_user *)user)->server;
+    alloserver_client *client = ((asset_user *)user)->client;
+    
+    asset_packed_message *message = _served_chunk(_servinternal(server), asset_id, offset, length);
+    if (message == NULL) {
         _request_missing_asset(server, client, asset_id);
+        return;
+    }
+    // as _asset_send_func, but every peer's packet refers to the same bytes
+    ENetPeer *peer = ((asset_user *)user)->peer;
+    if (peer == NULL) {
+        peer = _clientinternal(client)->peer;
     }
-    free(buffer);
+    ENetPacket *packet = asset_packed_message_enet_packet(message);
+    if (allo_enet_peer_send(peer, CHANNEL_ASSETS, packet) != 0) {
+        enet_packet_destroy(packet);
+    }
+    asset_packed_message_release(message);
 }
 
 // we have acquired asset data from 'sender_peer' and want to store it.
@@ -178,9 +255,12 @@ static int _asset_write_func(const char *asset_id, const uint8_t *buffer, size_t
     alloserver_client *sender = ((asset_user *)user)->client;
     ENetPeer *sender_peer = _clientinternal(sender)->peer;
     wanted_asset *wanted = _asset_is_wanted(asset_id, server);
+    bool is_source = false;
+    for (size_t i = 0; wanted && i < wanted->remaining_potential_sources.length; i++) {
+        is_source |= wanted->remaining_potential_sources.data[i] == sender_peer;
+    }
     
-    if (wanted && (wanted->source == NULL || wanted->source == sender_peer)) {
-        wanted->source = sender_peer;
+    if (is_source) {
         LOG_ASSET_D(sender, "%s Received %d+%d=%d of %d bytes from %p", asset_id, offset, length, offset+length, total_size, sender_peer);
         return assetstore_write(&(_servinternal(server)->assetstore), asset_id, offset, buffer, length, total_size);
     } else {
@@ -214,7 +294,7 @@ static void _asset_state_callback_func(const char *asset_id, asset_state state,
                 break;
             }
         }
-        // TODO: Add a timeout for if a client just never responds to the asset request?
+        // sources that never respond are caught by _check_asset_stalls
         if(wanted->remaining_potential_sources.length == 0)
         {
             _forward_wanted_asset_failure(asset_id, server, client, wanted);
@@ -227,7 +307,7 @@ static void _asset_state_callback_func(const char *asset_id, asset_state state,
 static void handle_assets(const uint8_t *data, size_t data_length, alloserver *server, alloserver_client *client) {
     
     asset_user usr = { .server = server, .client = client };
-    asset_handle(data, data_length, _asset_request_bytes_func, _asset_write_func, _asset_send_func, _asset_state_callback_func, (void*)&usr);
+    asset_handle(data, data_length, &_servinternal(server)->asset_transfers, _clientinternal(client)->peer, _asset_request_bytes_func, _asset_write_func, _asset_send_func, _asset_state_callback_func, (void*)&usr);
 }
 
 static void handle_incoming_data(alloserver *serv, alloserver_client *client, allochannel channel, ENetPacket *packet)
@@ -241,7 +321,11 @@ static void handle_incoming_data(alloserver *serv, alloserver_client *client, al
         handle_assets(packet->data, packet->dataLength, serv, client);
         return;
     }
-    
+
+    if (serv->media_packet_callback && (channel == CHANNEL_AUDIO || channel == CHANNEL_VIDEO)) {
+        serv->media_packet_callback(serv, client, channel, packet);
+        return;
+    }
     
     if(serv->raw_indata_callback && channel != CHANNEL_ASSETS)
     {
@@ -273,8 +357,11 @@ static void handle_lost_connection(alloserver *serv, alloserver_client *client)
     alloserv_client_free(client);
 }
 
+static void _check_asset_stalls(alloserver *server);
+
 static bool allo_poll(alloserver *serv, int timeout)
 {
+    _check_asset_stalls(serv);
     ENetEvent event;
     enet_host_service (_servinternal(serv)->enet, &event, timeout);
     alloserver_client *client = event.peer ? (alloserver_client*)event.peer->data : NULL;
@@ -286,12 +373,13 @@ static bool allo_poll(alloserver *serv, int timeout)
             break;
     
         case ENET_EVENT_TYPE_RECEIVE:
-            if (client == NULL) {
-                // old data from disconnected client?!
-                break;
+            if (client != NULL) {
+                handle_incoming_data(serv, client, event.channelID, event.packet);
+            } // else old data from disconnected client?!
+            // if the packet was forwarded to other peers, ENet frees it once they've all sent it
+            if (event.packet->referenceCount == 0) {
+                enet_packet_destroy (event.packet);
             }
-            handle_incoming_data(serv, client, event.channelID, event.packet);
-            enet_packet_destroy (event.packet);
             break;
     
         case ENET_EVENT_TYPE_DISCONNECT:
@@ -316,13 +404,22 @@ void allo_send(alloserver *serv, alloserver_client *client, allochannel channel,
             0
     );
     memcpy(packet->data, buf, len);
-    allo_enet_peer_send(_clientinternal(client)->peer, channel, packet);
+    if (allo_enet_peer_send(_clientinternal(client)->peer, channel, packet) != 0) {
+        enet_packet_destroy(packet);
+    }
 }
 
-void alloserv_send_enet(alloserver *serv, alloserver_client *client, allochannel channel, ENetPacket *packet)
+int alloserv_send_enet(alloserver *serv, alloserver_client *client, allochannel channel, ENetPacket *packet)
 {
     (void)serv;
-    allo_enet_peer_send(_clientinternal(client)->peer, channel, packet);
+    return allo_enet_peer_send(_clientinternal(client)->peer, channel, packet);
+}
+
+static void _use_memory_for_assets(alloserv_internal *sv)
+{
+    asset_memstore_init(&sv->assetstore, NULL);
+    // the store frees it
+    asset_memstore_register_asset_nocopy(&sv->assetstore, "hello", (uint8_t*)strdup("Hello World!"), 13);
 }
 
 alloserver *allo_listen(int listenhost, int port)
@@ -330,11 +427,10 @@ alloserver *allo_listen(int listenhost, int port)
     alloserver *serv = (alloserver*)calloc(1, sizeof(alloserver));
     serv->_internal = (alloserv_internal*)calloc(1, sizeof(alloserv_internal));
     arr_init(&_servinternal(serv)->wanted_assets);
-    arr_init(&_servinternal(serv)->media_tracks);
+    arr_init(&_servinternal(serv)->served_chunks);
     
-    assetstore *assetstore = &(_servinternal(serv)->assetstore);
-    asset_memstore_init(assetstore);
-    asset_memstore_register_asset_nocopy(assetstore, "hello", (uint8_t*)"Hello World!", 13);
+    _use_memory_for_assets(_servinternal(serv));
+    asset_transfers_init(&_servinternal(serv)->asset_transfers, &_servinternal(serv)->assetstore);
 
     ENetAddress address;
     address.host = listenhost;
@@ -371,9 +467,43 @@ void alloserv_disconnect(alloserver *serv, alloserver_client *client, int reason
     enet_peer_disconnect_later(_clientinternal(client)->peer, reason_code);
 }
 
+bool alloserv_set_asset_cache(alloserver *serv, const char *path, size_t max_bytes)
+{
+    alloserv_internal *sv = _servinternal(serv);
+    _clear_served_chunks(sv);
+    if (sv->asset_cache) {
+        asset_diskstore_deinit(&sv->assetstore);
+    } else {
+        asset_memstore_deinit(&sv->assetstore);
+    }
+    // anything half-downloaded was going into the old store
+    asset_transfers_deinit(&sv->asset_transfers);
+    asset_transfers_init(&sv->asset_transfers, &sv->assetstore);
+    
+    sv->asset_cache = asset_diskstore_init(&sv->assetstore, path, max_bytes) == 0;
+    if (!sv->asset_cache) {
+        server_log(ALLO_LOG_ERROR, NULL, "Can't keep assets in %s; keeping them in memory", path);
+        _use_memory_for_assets(sv);
+        return false;
+    }
+    const uint8_t hello[] = "Hello World!";
+    char *hello_id = asset_generate_identifier(hello, 13);
+    assetstore_write(&sv->assetstore, hello_id, 0, hello, 13, 13);
+    free(hello_id);
+    return true;
+}
+
 void alloserv_stop(alloserver* serv)
 {
   enet_host_destroy(_servinternal(serv)->enet);
+  _clear_served_chunks(_servinternal(serv));
+  arr_free(&_servinternal(serv)->served_chunks);
+  asset_transfers_deinit(&_servinternal(serv)->asset_transfers);
+  if (_servinternal(serv)->asset_cache) {
+    asset_diskstore_deinit(&_servinternal(serv)->assetstore);
+  } else {
+    asset_memstore_deinit(&_servinternal(serv)->assetstore);
+  }
   free(_servinternal(serv));
   free(serv);
 }
@@ -415,6 +545,18 @@ size_t alloserv_get_client_stats(alloserver* serv, alloserver_client *client, ch
     return slen;
 }
 
+alloserver_link_stats alloserv_get_client_link(alloserver *serv, alloserver_client *client)
+{
+    (void)serv;
+    ENetPeer *peer = _clientinternal(client)->peer;
+    alloserver_link_stats link = {
+        peer->packetLoss / (double)ENET_PEER_PACKET_LOSS_SCALE,
+        peer->roundTripTime / 1000.0,
+        peer->packetThrottle / (double)ENET_PEER_PACKET_THROTTLE_SCALE
+    };
+    return link;
+}
+
 void alloserv_get_stats(alloserver* server, char *buffer, size_t bufferlen)
 {
     int offset = snprintf(buffer, bufferlen,
@@ -462,7 +604,6 @@ void _request_missing_asset(alloserver *server, alloserver_client *client, const
     {
         wanted = malloc(sizeof(wanted_asset));
         wanted->id = strdup(asset_id);
-        wanted->source = NULL;
         arr_init(&wanted->recipients);
         arr_init(&wanted->remaining_potential_sources);
         arr_push(&_servinternal(server)->wanted_assets, wanted);
@@ -481,7 +622,7 @@ void _request_missing_asset(alloserver *server, alloserver_client *client, const
         LOG_ASSET_D(client, "... and we queued %d potential sources to get it", wanted->remaining_potential_sources.length);
         
         asset_user usr = { .server = server, .client = client };
-        asset_request(asset_id, NULL, _asset_send_func_broadcast, &usr);
+        asset_request(asset_id, NULL, &_servinternal(server)->asset_transfers, _asset_send_func_potential_sources, &usr);
     }
 }
 
@@ -496,6 +637,7 @@ static void free_wanted(wanted_asset *wanted)
 void _forward_wanted_asset_failure(const char *asset_id, alloserver *server, alloserver_client *client, wanted_asset *wanted) {
     alloserv_internal *sv = _servinternal(server);
     LOG_ASSET_D(client, "%s telling %d recipients that asset doesn't exist. potentials %d should be 0", asset_id, wanted->recipients.length, wanted->remaining_potential_sources.length);
+    asset_transfers_cancel(&sv->asset_transfers, asset_id);
 
     for(size_t recipient_index = 0; recipient_index < wanted->recipients.length; recipient_index++)
     {
@@ -544,6 +686,7 @@ void _remove_client_from_wanted(alloserver *server, alloserver_client *client) {
     ENetPeer *lost_peer = _clientinternal(client)->peer;
     
     LOG_ASSET_D(client, "Lost peer %p", lost_peer);
+    asset_transfers_remove_source(&sv->asset_transfers, lost_peer);
 
     for (size_t i = 0; i < sv->wanted_assets.length; i++) {
         wanted_asset *wanted = sv->wanted_assets.data[i];
@@ -558,6 +701,7 @@ void _remove_client_from_wanted(alloserver *server, alloserver_client *client) {
                 break;
             }
         }
+        bool was_source = false;
         for(size_t source_index = 0; source_index < wanted->remaining_potential_sources.length; source_index++)
         {
             ENetPeer *source = wanted->remaining_potential_sources.data[source_index];
@@ -565,6 +709,7 @@ void _remove_client_from_wanted(alloserver *server, alloserver_client *client) {
             {
                 LOG_ASSET_D(client, "... which was a potential source");
                 arr_splice(&wanted->remaining_potential_sources, source_index, 1);
+                was_source = true;
                 break;
             }
         }
@@ -573,8 +718,49 @@ void _remove_client_from_wanted(alloserver *server, alloserver_client *client) {
             _forward_wanted_asset_failure(wanted->id, server, client, wanted);
             // ^ will arr_splice wanted_assets, so need to decrease i
             --i;
+        } else if (was_source) {
+            // ask the others for whatever it was sending
+            asset_user usr = { .server = server, .client = client };
+            asset_request(wanted->id, NULL, &sv->asset_transfers, _asset_send_func_potential_sources, &usr);
+        }
+    }
+}
+
+static void _asset_stalled_func(const char *asset_id, const void *source, void *user) {
+    alloserver *server = (alloserver *)user;
+    wanted_asset *wanted = _asset_is_wanted(asset_id, server);
+    if (wanted == NULL) {
+        asset_transfers_cancel(&_servinternal(server)->asset_transfers, asset_id);
+        return;
+    }
+    if (source == NULL) {
+        // nobody answered at all
+        wanted->remaining_potential_sources.length = 0;
+    }
+    for (size_t i = 0; i < wanted->remaining_potential_sources.length; i++) {
+        if (wanted->remaining_potential_sources.data[i] == source) {
+            arr_splice(&wanted->remaining_potential_sources, i, 1);
+            break;
         }
     }
+    LOG_ASSET_D(NULL, "%s stalled from source %p, %d remaining", asset_id, source, wanted->remaining_potential_sources.length);
+    if (wanted->remaining_potential_sources.length == 0) {
+        _forward_wanted_asset_failure(asset_id, server, NULL, wanted);
+    } else {
+        asset_user usr = { .server = server };
+        asset_request(asset_id, NULL, &_servinternal(server)->asset_transfers, _asset_send_func_potential_sources, &usr);
+    }
+}
+
+/// Give up on sources that have stopped sending wanted assets, at most once a second
+static void _check_asset_stalls(alloserver *server) {
+    alloserv_internal *sv = _servinternal(server);
+    double now = get_ts_monod();
+    if (now < sv->next_stall_check) {
+        return;
+    }
+    sv->next_stall_check = now + 1.0;
+    asset_transfers_check_stalls(&sv->asset_transfers, _asset_stalled_func, server);
 }
 
 const char *alloserv_describe_client(alloserver_client *client)
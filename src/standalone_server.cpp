@@ -7,9 +7,14 @@
 
 #include <string>
 #include <vector>
+#include <algorithm>
 
 #include <allonet/allonet.h>
 #include "media/media.h"
+#include "media/audio/mixer.h"
+#include "media/audio/culling.h"
+#include "media/video/fragment.h"
+#include "media/video/simulcast.h"
 #include "util.h"
 #include "delta.h"
 #include "uri.h"
@@ -19,7 +24,16 @@ static allo_entity* place;
 static double last_simulate_at = 0;
 static char *g_placename;
 static char *g_public_hostname;
-static allo_media_track_list mediatracks;
+static allo_media_track_list *mediatracks;
+static allo_audio_mixer *mixer; // set if mixing audio rather than forwarding it
+static double audible_radius = 0; // if set, don't send audio further than this many meters
+static int loudest_speakers = 0; // if set, only send the this many loudest audio tracks to each listener
+// a sender only needs one keyframe request per this many seconds, however many receivers lost a frame
+static const double keyframe_request_interval = 0.25;
+// how long the place waits for the rest of a frame it's putting back together for an older client
+static const double reassembly_deadline = 0.2;
+// how fast a speaker's loudness fades in the ranking after they stop talking
+static const float loudness_decay_db_per_second = 20;
 
 typedef struct {
     std::string avatarToken;
@@ -30,10 +44,11 @@ static void handle_app_launched(alloserver* serv, std::string avatarToken, allo_
 
 // local helpers
 
-static void send_interaction_to_client(alloserver* serv, alloserver_client* client, allo_interaction *interaction)
+// takes ownership of body, and prints it straight into the outgoing command without a text round-trip
+static void send_interaction_to_client(alloserver* serv, alloserver_client* client, const char *type, const char *sender_entity_id, const char *receiver_entity_id, const char *request_id, cJSON *body)
 {
-  cJSON* cmdrep = allo_interaction_to_cjson(interaction);
-  const char* json = cJSON_Print(cmdrep);
+  cJSON* cmdrep = allo_interaction_create_cjson(type, sender_entity_id, receiver_entity_id, request_id, body);
+  const char* json = cJSON_PrintUnformatted(cmdrep);
   cJSON_Delete(cmdrep);
 
   serv->send(serv, client, CHANNEL_COMMANDS, (const uint8_t*)json, strlen(json));
@@ -76,6 +91,16 @@ static alloserver_client *find_agent_by_id(alloserver *serv, const char *by_id)
 }
 
 // callbacks
+static void remove_video_subscriber(allo_media_track *track, alloserver_client *client)
+{
+    for (size_t i = 0; i < track->info.video.subscribers.length; i++) {
+        if (track->info.video.subscribers.data[i].client == client) {
+            arr_splice(&track->info.video.subscribers, i, 1);
+            break;
+        }
+    }
+}
+
 static void clients_changed(alloserver* serv, alloserver_client* added, alloserver_client* removed)
 {
     (void)added;
@@ -90,43 +115,77 @@ static void clients_changed(alloserver* serv, alloserver_client* added, alloserv
             }
         }
         
-        for (size_t i = 0; i < mediatracks.length; i++) {
+        const allo_media_track_table *tracks = _media_tracks_read_begin(mediatracks);
+        for (size_t i = 0; i < tracks->capacity; i++) {
+            allo_media_track *track = tracks->slots[i];
+            if (!track) continue;
             /// Remove the client from any track recipient lists
-            allo_media_track *track = &mediatracks.data[i];
             for (size_t j = 0; j < track->recipients.length; j++) {
                 if (track->recipients.data[j] == removed) {
                     arr_splice(&track->recipients, j, 1);
                     break;
                 }
             }
+            if (track->type == allo_media_type_video) {
+                remove_video_subscriber(track, removed);
+            }
+            if (track->type == allo_media_type_audio) {
+                for (size_t j = 0; j < track->info.audio.forward_to.length; j++) {
+                    if (track->info.audio.forward_to.data[j] == removed) {
+                        arr_splice(&track->info.audio.forward_to, j, 1);
+                        break;
+                    }
+                }
+            }
             // Remove tracks where client is the origin
             if (track->origin == removed) {
-                arr_splice(&mediatracks, i, 1);
-                --i;
+                if (mixer) allo_audio_mixer_remove_source(mixer, track->track_id);
+                _media_track_destroy(mediatracks, track);
             }
         }
+        _media_tracks_read_end(mediatracks);
+        _media_tracks_reclaim(mediatracks);
+        if (mixer) allo_audio_mixer_remove_listener(mixer, removed);
     }
 }
 
-static void handle_intent(alloserver* serv, alloserver_client* client, allo_client_intent *intent)
+// a client's intent only ever drives its own avatar, whatever entity it names
+static void claim_own_avatar(alloserver_client* client)
+{
+  const char *avatar = client->avatar_entity_id;
+  char *named = client->intent->entity_id;
+  if(avatar && named && strcmp(named, avatar) == 0)
+    return;
+  free(named);
+  client->intent->entity_id = avatar ? allo_strdup(avatar) : NULL;
+}
+
+static void handle_intent(alloserver* serv, alloserver_client* client, const cJSON *ntvintent)
+{
+  (void)serv;
+  if(ntvintent == NULL)
+    return;
+  // parse straight into the client's intent, so we don't churn allocations at 20hz per client
+  allo_client_intent_parse_cjson_into(client->intent, ntvintent);
+  claim_own_avatar(client);
+}
+
+static void handle_binary_intent(alloserver* serv, alloserver_client* client, const uint8_t *data, size_t data_length)
 {
   (void)serv;
-  allo_client_intent_clone(intent, client->intent);
-  free(client->intent->entity_id);
-  client->intent->entity_id = allo_strdup(client->avatar_entity_id);
+  // decodes straight into the client's intent; stale, reordered or corrupt packets are just dropped
+  allo_client_intent_decode_binary(client->intent, &client->intent_seq, data, data_length);
+  claim_own_avatar(client);
 }
 
 // interactions
-static void send_place_interaction_response(alloserver *serv,  alloserver_client* client, allo_interaction* request, cJSON *respbody)
+// takes ownership of respbody
+static void send_place_interaction_response(alloserver *serv,  alloserver_client* client, allo_interaction_parsed* request, cJSON *respbody)
 {
-    char* respbodys = cJSON_Print(respbody);
-    allo_interaction* response = allo_interaction_create("response", "place", "", request->request_id, respbodys);
-    free(respbodys);
-    send_interaction_to_client(serv, client, response);
-    allo_interaction_free(response);
+    send_interaction_to_client(serv, client, "response", "place", "", request->request_id, respbody);
 }
 
-static void handle_invalid_place_interaction(alloserver* serv, alloserver_client* client, allo_interaction* interaction, cJSON *body)
+static void handle_invalid_place_interaction(alloserver* serv, alloserver_client* client, allo_interaction_parsed* interaction, cJSON *body)
 {
     if(strcmp(interaction->type, "request") != 0){
         return; // just ignore non-requests
@@ -135,10 +194,9 @@ static void handle_invalid_place_interaction(alloserver* serv, alloserver_client
     cJSON *cmd = cJSON_GetArrayItem(body, 0);
     cJSON *respbody = cjson_create_list(cJSON_CreateString(cJSON_GetStringValue(cmd)), cJSON_CreateString("error"), cJSON_CreateString("invalid request"), NULL);
     send_place_interaction_response(serv, client, interaction, respbody);
-    cJSON_Delete(respbody);
 }
 
-static void handle_place_announce_interaction(alloserver* serv, alloserver_client* client, allo_interaction* interaction, cJSON *body)
+static void handle_place_announce_interaction(alloserver* serv, alloserver_client* client, allo_interaction_parsed* interaction, cJSON *body)
 {
   const int version = cJSON_GetArrayItem(body, 2)->valueint;
   cJSON* identity = cJSON_GetArrayItem(body, 4);
@@ -152,6 +210,9 @@ static void handle_place_announce_interaction(alloserver* serv, alloserver_clien
   allo_entity *ava = allo_state_add_entity_from_spec(&serv->state, client->agent_id, avatar, NULL);// takes avatar
   client->avatar_entity_id = allo_strdup(ava->id);
   client->identity = cJSON_Duplicate(identity, true);
+  cJSON* features = cJSON_GetArrayItem(body, 8);
+  client->sequenced_audio = cJSON_IsArray(features) && cjson_find_in_array(features, "audio.sequenced") != -1;
+  client->fragmented_video = cJSON_IsArray(features) && cjson_find_in_array(features, "video.fragmented") != -1;
 
   if(avatarTokenj) {
     handle_app_launched(serv, avatarToken, ava);
@@ -165,44 +226,34 @@ static void handle_place_announce_interaction(alloserver* serv, alloserver_clien
       cJSON_CreateString("announce"), cJSON_CreateString("error"), 
       cJSON_CreateNumber(alloerror_outdated_version), cJSON_CreateString("Please update your app. Outdated network protocol."), NULL
     );
-    char* respbodys = cJSON_Print(respbody);
-    allo_interaction* response = allo_interaction_create("response", "place", "", interaction->request_id, respbodys);
-    free(respbodys);
-    cJSON_Delete(respbody);
-    send_interaction_to_client(serv, client, response);
-    allo_interaction_free(response);
+    send_place_interaction_response(serv, client, interaction, respbody);
     alloserv_disconnect(serv, client, alloerror_outdated_version);
   }
   else
   {
     fprintf(stderr, "Client announced: %s version %d\n", alloserv_describe_client(client), version);
-    cJSON* respbody = cjson_create_list(cJSON_CreateString("announce"), cJSON_CreateString(ava->id), cJSON_CreateString(g_placename), NULL);
-    char* respbodys = cJSON_Print(respbody);
-    allo_interaction* response = allo_interaction_create("response", "place", "", interaction->request_id, respbodys);
-    free(respbodys);
-    cJSON_Delete(respbody);
-    send_interaction_to_client(serv, client, response);
-    allo_interaction_free(response);
+    cJSON* respbody = cjson_create_list(
+      cJSON_CreateString("announce"), cJSON_CreateString(ava->id), cJSON_CreateString(g_placename),
+      // optional protocol features this place supports
+      cjson_create_list(cJSON_CreateString("intent.binary"), NULL),
+      NULL
+    );
+    send_place_interaction_response(serv, client, interaction, respbody);
   }
 }
 
 
-static void handle_place_spawn_entity_interaction(alloserver* serv, alloserver_client* client, allo_interaction* interaction, cJSON *body)
+static void handle_place_spawn_entity_interaction(alloserver* serv, alloserver_client* client, allo_interaction_parsed* interaction, cJSON *body)
 {
   cJSON* edesc = cJSON_DetachItemFromArray(body, 1);
 
   allo_entity *entity = allo_state_add_entity_from_spec(&serv->state, client->agent_id, edesc, NULL); // takes edesc
 
   cJSON* respbody = cjson_create_list(cJSON_CreateString("spawn_entity"), cJSON_CreateString(entity->id), NULL);
-  char* respbodys = cJSON_Print(respbody);
-  cJSON_Delete(respbody);
-  allo_interaction* response = allo_interaction_create("response", "place", "", interaction->request_id, respbodys);
-  free(respbodys);
-  send_interaction_to_client(serv, client, response);
-  allo_interaction_free(response);
+  send_place_interaction_response(serv, client, interaction, respbody);
 }
 
-static void handle_place_remove_entity_interaction(alloserver* serv, alloserver_client* client, allo_interaction* interaction, cJSON *body)
+static void handle_place_remove_entity_interaction(alloserver* serv, alloserver_client* client, allo_interaction_parsed* interaction, cJSON *body)
 {
   cJSON *jeid = cJSON_DetachItemFromArray(body, 1);
   cJSON *jmodes = cJSON_DetachItemFromArray(body, 2);
@@ -218,16 +269,10 @@ static void handle_place_remove_entity_interaction(alloserver* serv, alloserver_
   cJSON_Delete(jmodes);
 
   cJSON* respbody = cjson_create_list(cJSON_CreateString("remove_entity"), cJSON_CreateString(ok?"ok":"failed"), NULL);
-  char* respbodys = cJSON_Print(respbody);
-  cJSON_Delete(respbody);
-  allo_interaction* response = allo_interaction_create("response", "place", "", interaction->request_id, respbodys);
-  free(respbodys);
-  
-  send_interaction_to_client(serv, client, response);
-  allo_interaction_free(response);
+  send_place_interaction_response(serv, client, interaction, respbody);
 }
 
-static void handle_place_change_components_interaction(alloserver* serv, alloserver_client* client, allo_interaction* interaction, cJSON *body)
+static void handle_place_change_components_interaction(alloserver* serv, alloserver_client* client, allo_interaction_parsed* interaction, cJSON *body)
 {
   cJSON* entity_id = cJSON_GetArrayItem(body, 1);
   cJSON* comps = cJSON_DetachItemFromArray(body, 3);
@@ -262,17 +307,12 @@ static void handle_place_change_components_interaction(alloserver* serv, alloser
 
   respbody = cjson_create_list(cJSON_CreateString("change_components"), cJSON_CreateString("ok"), NULL);
 end:;
-  char* respbodys = cJSON_Print(respbody);
-  cJSON_Delete(respbody);
-  allo_interaction* response = allo_interaction_create("response", "place", "", interaction->request_id, respbodys);
-  free(respbodys);
-  send_interaction_to_client(serv, client, response);
-  allo_interaction_free(response);
+  send_place_interaction_response(serv, client, interaction, respbody);
 }
 
 static int next_free_track_id = 1;
 
-static void handle_place_allocate_track_interaction(alloserver* serv, alloserver_client* client, allo_interaction* interaction, cJSON *body)
+static void handle_place_allocate_track_interaction(alloserver* serv, alloserver_client* client, allo_interaction_parsed* interaction, cJSON *body)
 {
     allo_entity* entity = state_get_entity(&serv->state, interaction->sender_entity_id);
     cJSON *existing_comp = entity ? cJSON_GetObjectItem(entity->components, "live_media") : NULL;
@@ -281,12 +321,7 @@ static void handle_place_allocate_track_interaction(alloserver* serv, alloserver
     {
       fprintf(stderr, "Disallowed creating allocating track for %s: entity already has track\n", interaction->sender_entity_id);
       cJSON* respbody = cjson_create_list(cJSON_CreateString("allocate_track"), cJSON_CreateString("failed"), cJSON_CreateString("only one track allowed per entity"), NULL);
-      char* respbodys = cJSON_Print(respbody);
-      cJSON_Delete(respbody);
-      allo_interaction* response = allo_interaction_create("response", "place", "", interaction->request_id, respbodys);
-      free(respbodys);
-      send_interaction_to_client(serv, client, response);
-      allo_interaction_free(response);
+      send_place_interaction_response(serv, client, interaction, respbody);
       return;
     }
 
@@ -302,6 +337,22 @@ static void handle_place_allocate_track_interaction(alloserver* serv, alloserver
         "metadata", cJSON_Duplicate(media_metadata, true),
         NULL
     );
+    if (client->sequenced_audio && _media_track_type_from_string(cJSON_GetStringValue(media_type)) == allo_media_type_audio) {
+        // tells everyone how to parse this track's packets. Clients that can't are sent them without
+        // the sequence header; see handle_media.
+        cJSON_AddStringToObject(mediacomp, "framing", "sequenced");
+    }
+    int layer_count = 1;
+    if (client->fragmented_video && _media_track_type_from_string(cJSON_GetStringValue(media_type)) == allo_media_type_video) {
+        // clients that can't reassemble frames get them whole from the place; see forward_whole_frames
+        cJSON_AddStringToObject(mediacomp, "framing", "fragmented");
+        // simulcast needs the layer bits in the fragment headers
+        cJSON *jlayers = cJSON_GetObjectItemCaseSensitive(media_metadata, "layers");
+        if (cJSON_IsNumber(jlayers) && jlayers->valueint > 1) {
+            layer_count = std::min(jlayers->valueint, ALLO_VIDEO_MAX_LAYERS);
+            cJSON_AddNumberToObject(mediacomp, "layers", layer_count);
+        }
+    }
 
     fprintf(stderr, "Allocated track %d (%s.%s) for %s/%s.\n", 
       track_id, cJSON_GetStringValue(media_type), cJSON_GetStringValue(media_format),
@@ -309,27 +360,84 @@ static void handle_place_allocate_track_interaction(alloserver* serv, alloserver
     );
 
     
-    allo_media_track *track = _media_track_find_or_create(&mediatracks, track_id, _media_track_type_from_string(media_type->valuestring));
+    allo_media_track *track = _media_track_find_or_create(mediatracks, track_id, _media_track_type_from_string(media_type->valuestring));
     track->origin = client;
+    if (track->type == allo_media_type_audio) {
+        track->info.audio.sequenced = client->sequenced_audio;
+        track->info.audio.loudness = -ALLO_AUDIO_LEVEL_SILENT;
+        track->info.audio.last_heard = get_ts_monod();
+        arr_init(&track->info.audio.forward_to);
+    } else if (track->type == allo_media_type_video) {
+        track->info.video.fragmented = client->fragmented_video;
+        track->info.video.layer_count = layer_count;
+        arr_init(&track->info.video.subscribers);
+    }
 
     cJSON_AddItemToObject(entity->components, "live_media", mediacomp);
 
     cJSON* respbody = cjson_create_list(cJSON_CreateString("allocate_track"), cJSON_CreateString("ok"), cJSON_CreateNumber(track_id), NULL);
-    char* respbodys = cJSON_Print(respbody);
-    cJSON_Delete(respbody);
-    allo_interaction* response = allo_interaction_create("response", "place", "", interaction->request_id, respbodys);
-    free(respbodys);
-    send_interaction_to_client(serv, client, response);
-    allo_interaction_free(response);
+    send_place_interaction_response(serv, client, interaction, respbody);
 }
 
-static void handle_place_media_track_interaction(alloserver* serv, alloserver_client* client, allo_interaction* interaction, cJSON *body) {
+/// Ask the sender of a simulcast track for a keyframe in `layer`, so that subscribers can switch to it
+static void request_layer_keyframe(alloserver *serv, allo_media_track *track, int layer)
+{
+    double now = get_ts_monod();
+    if (!track->origin || now - track->info.video.last_keyframe_request[layer] < keyframe_request_interval) {
+        return;
+    }
+    track->info.video.last_keyframe_request[layer] = now;
+
+    uint32_t big_track_id = htonl(track->track_id);
+    allo_video_fragment_header header = { (uint8_t)(ALLO_VIDEO_FRAGMENT_KEYFRAME_REQUEST | layer << ALLO_VIDEO_FRAGMENT_LAYER_SHIFT), 0, 0, 0 };
+    ENetPacket *packet = enet_packet_create(NULL, sizeof(big_track_id) + ALLO_VIDEO_FRAGMENT_HEADER_SIZE, ENET_PACKET_FLAG_UNSEQUENCED);
+    memcpy(packet->data, &big_track_id, sizeof(big_track_id));
+    allo_video_write_fragment_header(packet->data + sizeof(big_track_id), &header);
+    if (alloserv_send_enet(serv, (alloserver_client*)track->origin, CHANNEL_VIDEO, packet) != 0) {
+        enet_packet_destroy(packet);
+    }
+}
+
+/// Start sending `client` the layer it asked for in `options` ({"layer": n} or {"layer": "auto"}),
+/// from its next keyframe. Without options it gets the biggest layer.
+static void subscribe_video_layer(alloserver *serv, allo_media_track *track, alloserver_client *client, cJSON *options)
+{
+    cJSON *jlayer = cJSON_GetObjectItemCaseSensitive(options, "layer");
+    int requested = 0;
+    if (cJSON_IsNumber(jlayer)) {
+        requested = std::max(0, std::min(jlayer->valueint, track->info.video.layer_count - 1));
+    } else if (cJSON_IsString(jlayer) && strcmp(jlayer->valuestring, "auto") == 0) {
+        requested = ALLO_VIDEO_LAYER_AUTO;
+    }
+
+    allo_video_subscriber *subscriber = NULL;
+    for (size_t i = 0; i < track->info.video.subscribers.length; i++) {
+        if (track->info.video.subscribers.data[i].client == client) {
+            subscriber = &track->info.video.subscribers.data[i];
+        }
+    }
+    if (!subscriber) {
+        allo_video_subscriber added = { client, 0, 0, -1 };
+        arr_push(&track->info.video.subscribers, added);
+        subscriber = &track->info.video.subscribers.data[track->info.video.subscribers.length - 1];
+    }
+    subscriber->requested = (int8_t)requested;
+    // auto starts small; update_video_layers moves it up once it knows where the subscriber is
+    int target = requested == ALLO_VIDEO_LAYER_AUTO ? track->info.video.layer_count - 1 : requested;
+    if (target != subscriber->target || subscriber->current == -1) {
+        subscriber->target = (int8_t)target;
+        request_layer_keyframe(serv, track, target);
+    }
+}
+
+static void handle_place_media_track_interaction(alloserver* serv, alloserver_client* client, allo_interaction_parsed* interaction, cJSON *body) {
     cJSON *jTrackId = cJSON_GetArrayItem(body, 1);
     cJSON *jsub = cJSON_GetArrayItem(body, 2);
+    cJSON *joptions = cJSON_GetArrayItem(body, 3);
     cJSON* respbody;
-    char* respbodys;
     uint32_t track_id;
     allo_media_track *track;
+    bool subscribed;
 
     if (!cJSON_IsNumber(jTrackId) || !cJSON_IsString(jsub)) {
       respbody = cjson_create_list(cJSON_CreateString("media_track"), cJSON_CreateString("failed"), cJSON_CreateString("missing id or verb"), NULL);
@@ -340,7 +448,7 @@ static void handle_place_media_track_interaction(alloserver* serv, alloserver_cl
     track_id = jTrackId->valueint;
     
     // find the track and add or remove client to list of recipients
-    track = _media_track_find(&mediatracks, track_id);
+    track = _media_track_find(mediatracks, track_id);
     if(!track) {
       respbody = cjson_create_list(cJSON_CreateString("media_track"), cJSON_CreateString("failed"), cJSON_CreateString("invalid track id"), NULL);
       fprintf(stderr, "media_track interaction: %s/%s requested unavailable track id %d\n", interaction->sender_entity_id, alloserv_describe_client(client), track_id);
@@ -348,7 +456,20 @@ static void handle_place_media_track_interaction(alloserver* serv, alloserver_cl
     }
     if (strcmp(jsub->valuestring, "subscribe") == 0) {
         fprintf(stderr, "media_track interaction: %s/%s subscribed to track %d\n", interaction->sender_entity_id, alloserv_describe_client(client), track_id);
-        arr_push(&track->recipients, client);
+        // subscribing again just changes the options
+        subscribed = false;
+        for (size_t i = 0; i < track->recipients.length && !subscribed; i++) {
+            subscribed = track->recipients.data[i] == client;
+        }
+        if (!subscribed) {
+            arr_push(&track->recipients, client);
+        }
+        if (track->type == allo_media_type_video && track->info.video.fragmented && !client->fragmented_video) {
+            // gets whole frames of the base layer, put back together by the place; see forward_whole_frames
+            request_layer_keyframe(serv, track, 0);
+        } else if (track->type == allo_media_type_video && track->info.video.layer_count > 1) {
+            subscribe_video_layer(serv, track, client, joptions);
+        }
     } else if (strcmp(jsub->valuestring, "unsubscribe") == 0) {
         fprintf(stderr, "media_track interaction: %s/%s UNsubscribed to track %d\n", interaction->sender_entity_id, alloserv_describe_client(client), track_id);
         for (size_t i = 0; i < track->recipients.length; i++) {
@@ -357,6 +478,9 @@ static void handle_place_media_track_interaction(alloserver* serv, alloserver_cl
                 break;
             }
         }
+        if (track->type == allo_media_type_video) {
+            remove_video_subscriber(track, client);
+        }
     } else {
       respbody = cjson_create_list(cJSON_CreateString("media_track"), cJSON_CreateString("failed"), cJSON_CreateString("incorrect verb"), NULL);
       fprintf(stderr, "media_track: neither sub nor unsub");
@@ -365,15 +489,10 @@ static void handle_place_media_track_interaction(alloserver* serv, alloserver_cl
     respbody = cjson_create_list(cJSON_CreateString("media_track"), cJSON_CreateString("ok"), cJSON_CreateNumber(track_id), NULL);
   
 done:;
-    respbodys = cJSON_Print(respbody);
-    cJSON_Delete(respbody);
-    allo_interaction* response = allo_interaction_create("response", "place", "", interaction->request_id, respbodys);
-    free(respbodys);
-    send_interaction_to_client(serv, client, response);
-    allo_interaction_free(response);
+    send_place_interaction_response(serv, client, interaction, respbody);
 }
 
-static void handle_place_add_property_animation_interaction(alloserver* serv, alloserver_client* client, allo_interaction* interaction, cJSON *body)
+static void handle_place_add_property_animation_interaction(alloserver* serv, alloserver_client* client, allo_interaction_parsed* interaction, cJSON *body)
 {
     allo_entity* entity = state_get_entity(&serv->state, interaction->sender_entity_id);
     cJSON *animation_spec = cJSON_DetachItemFromArray(body, 1);
@@ -399,15 +518,10 @@ static void handle_place_add_property_animation_interaction(alloserver* serv, al
     }
 
     
-    char* respbodys = cJSON_Print(respbody);
-    cJSON_Delete(respbody);
-    allo_interaction* response = allo_interaction_create("response", "place", "", interaction->request_id, respbodys);
-    free(respbodys);
-    send_interaction_to_client(serv, client, response);
-    allo_interaction_free(response);
+    send_place_interaction_response(serv, client, interaction, respbody);
 }
 
-static void handle_place_remove_property_animation_interaction(alloserver* serv, alloserver_client* client, allo_interaction* interaction, cJSON *body)
+static void handle_place_remove_property_animation_interaction(alloserver* serv, alloserver_client* client, allo_interaction_parsed* interaction, cJSON *body)
 {
     allo_entity* entity = state_get_entity(&serv->state, interaction->sender_entity_id);
     const char *animation_id = cJSON_GetStringValue(cJSON_GetArrayItem(body, 1));
@@ -431,15 +545,10 @@ static void handle_place_remove_property_animation_interaction(alloserver* serv,
         respbody = cjson_create_list(cJSON_CreateString("remove_property_animation"), cJSON_CreateString("failed"), cJSON_CreateString(errstr), NULL);
     }
     
-    char* respbodys = cJSON_Print(respbody);
-    cJSON_Delete(respbody);
-    allo_interaction* response = allo_interaction_create("response", "place", "", interaction->request_id, respbodys);
-    free(respbodys);
-    send_interaction_to_client(serv, client, response);
-    allo_interaction_free(response);
+    send_place_interaction_response(serv, client, interaction, respbody);
 }
 
-static void handle_place_list_agents_interaction(alloserver* serv, alloserver_client* client, allo_interaction* interaction, cJSON *body)
+static void handle_place_list_agents_interaction(alloserver* serv, alloserver_client* client, allo_interaction_parsed* interaction, cJSON *body)
 {
     (void)body;
     cJSON *agentlist = cJSON_CreateArray();
@@ -463,15 +572,10 @@ static void handle_place_list_agents_interaction(alloserver* serv, alloserver_cl
     }
     
     cJSON *respbody = cjson_create_list(cJSON_CreateString("list_agents"), cJSON_CreateString("ok"), agentlist, NULL);
-    char* respbodys = cJSON_Print(respbody);
-    cJSON_Delete(respbody);
-    allo_interaction* response = allo_interaction_create("response", "place", "", interaction->request_id, respbodys);
-    free(respbodys);
-    send_interaction_to_client(serv, client, response);
-    allo_interaction_free(response);
+    send_place_interaction_response(serv, client, interaction, respbody);
 }
 
-static void handle_place_kick_agent_interaction(alloserver* serv, alloserver_client* client, allo_interaction* interaction, cJSON *body)
+static void handle_place_kick_agent_interaction(alloserver* serv, alloserver_client* client, allo_interaction_parsed* interaction, cJSON *body)
 {
     const char *agent_id = cJSON_GetStringValue(cJSON_GetArrayItem(body, 1));
     if(!agent_id) 
@@ -492,16 +596,11 @@ static void handle_place_kick_agent_interaction(alloserver* serv, alloserver_cli
         respbody = cjson_create_list(cJSON_CreateString("list_agents"), cJSON_CreateString("error"), cJSON_CreateString("agent not found"), NULL);
     }
         
-    char* respbodys = cJSON_Print(respbody);
-    cJSON_Delete(respbody);
-    allo_interaction* response = allo_interaction_create("response", "place", "", interaction->request_id, respbodys);
-    free(respbodys);
-    send_interaction_to_client(serv, client, response);
-    allo_interaction_free(response);
+    send_place_interaction_response(serv, client, interaction, respbody);
 }
 
 // {"launch_app", "alloapp:http://host:port/{appid or path}", args}
-static void handle_place_launch_app_interaction(alloserver* serv, alloserver_client* client, allo_interaction* interaction, cJSON *body)
+static void handle_place_launch_app_interaction(alloserver* serv, alloserver_client* client, allo_interaction_parsed* interaction, cJSON *body)
 {
     std::string app_url = cJSON_GetStringValue(cJSON_GetArrayItem(body, 1));
     cJSON *launch_args = cJSON_DetachItemFromArray(body, 2); // can be NULL/missing
@@ -557,7 +656,7 @@ static void handle_place_launch_app_interaction(alloserver* serv, alloserver_cli
     // todo: don't block thread :S
 
     // save it so we can respond when we get a connection from the gateway.
-    OutstandingAppLaunchRequest req = {avatar_token, allo_interaction_clone(interaction)};
+    OutstandingAppLaunchRequest req = {avatar_token, allo_interaction_parsed_to_interaction(interaction)};
     outstanding_app_launch_requests.push_back(req);
     cJSON_Delete(launch_args);
 }
@@ -588,20 +687,19 @@ static void handle_app_launched(alloserver* serv, std::string avatarToken, allo_
     }
 
     cJSON *respbody = cjson_create_list(cJSON_CreateString("launch_app"), cJSON_CreateString("ok"), cJSON_CreateString(ava->id), NULL);
-    char* respbodys = cJSON_Print(respbody);
-    cJSON_Delete(respbody);
-
-    allo_interaction* response = allo_interaction_create("response", "place", req.inter->sender_entity_id, req.inter->request_id, respbodys);
-    free(respbodys);
-    send_interaction_to_client(serv, client, response);
-    allo_interaction_free(response);
+    send_interaction_to_client(serv, client, "response", "place", req.inter->sender_entity_id, req.inter->request_id, respbody);
     allo_interaction_free(req.inter);
 }
 
-static void handle_place_interaction(alloserver* serv, alloserver_client* client, allo_interaction* interaction)
+static void handle_place_interaction(alloserver* serv, alloserver_client* client, allo_interaction_parsed* interaction)
 {
-    cJSON* body = cJSON_Parse(interaction->body);
-    const char *name = cJSON_GetArrayItem(body, 0)->valuestring;
+    // handlers may detach and keep parts of the body; it's ours to take since it belongs to this packet
+    cJSON* body = interaction->body;
+    const char *name = cJSON_GetStringValue(cJSON_GetArrayItem(body, 0));
+    if (name == NULL) {
+        handle_invalid_place_interaction(serv, client, interaction, body);
+        return;
+    }
     if (strcmp(name, "announce") == 0) {
         handle_place_announce_interaction(serv, client, interaction, body);
     } else if (strcmp(name, "change_components") == 0) {
@@ -630,11 +728,10 @@ static void handle_place_interaction(alloserver* serv, alloserver_client* client
 
   // force sending delta, since the above was likely an important change
   last_simulate_at = 0;
-
-  cJSON_Delete(body);
 }
 
-static void handle_interaction(alloserver* serv, alloserver_client* client, allo_interaction *interaction)
+/// @param data the raw interaction command, so it can be forwarded as-is
+static void handle_interaction(alloserver* serv, alloserver_client* client, allo_interaction_parsed *interaction, const uint8_t *data, size_t data_length)
 {
     if (strcmp(interaction->receiver_entity_id, "place") == 0)
     {
@@ -648,13 +745,12 @@ static void handle_interaction(alloserver* serv, alloserver_client* client, allo
             alloserver_client* client2 = find_agent_by_id(serv, entity->owner_agent_id);
             if(client2)
             {
-                send_interaction_to_client(serv, client2, interaction);
+                // nothing to change, so forward the original bytes rather than re-serializing
+                serv->send(serv, client2, CHANNEL_COMMANDS, data, data_length);
                 return;
             }
         }
-        cJSON *body = cJSON_Parse(interaction->body);
-        handle_invalid_place_interaction(serv, client, interaction, body);
-        cJSON_Delete(body);
+        handle_invalid_place_interaction(serv, client, interaction, interaction->body);
     }
 }
 
@@ -670,55 +766,349 @@ static void handle_clock(alloserver *serv, alloserver_client *client, cJSON *cmd
   free((void*)json);
 }
 
-static void handle_media(alloserver *serv, alloserver_client *client, const uint8_t *data, size_t length, int channel)
+static bool audio_culling()
+{
+    return audible_radius > 0 || loudest_speakers > 0;
+}
+
+static float current_loudness(allo_media_track *track, double now)
+{
+    return allo_audio_loudness_at(track->info.audio.loudness, track->info.audio.last_heard, now, loudness_decay_db_per_second);
+}
+
+/// Keep track of how loud each audio track is, from the level its sender put in each packet
+static void note_audio_level(allo_media_track *track, const uint8_t *data, size_t length)
+{
+    // tracks without a level are counted as someone talking quietly
+    float level = -60;
+    if (track->info.audio.sequenced) {
+        if (length <= ALLO_AUDIO_SEQ_HEADER_SIZE) return;
+        level = allo_audio_level_db(data[ALLO_AUDIO_SEQ_HEADER_SIZE - 1]);
+    }
+    double now = get_ts_monod();
+    track->info.audio.loudness = std::max(level, current_loudness(track, now));
+    track->info.audio.last_heard = now;
+}
+
+/// A copy of sequenced audio `packet` without its sequence header, for recipients from before
+/// sequenced audio, who would take the header for the start of the Opus packet.
+static ENetPacket *strip_audio_seq_header(ENetPacket *packet)
+{
+    const size_t headers = sizeof(uint32_t) + ALLO_AUDIO_SEQ_HEADER_SIZE;
+    if (packet->dataLength <= headers) {
+        // nothing but the header: no Opus in it for them
+        return NULL;
+    }
+    ENetPacket *stripped = enet_packet_create(NULL, packet->dataLength - ALLO_AUDIO_SEQ_HEADER_SIZE, packet->flags);
+    memcpy(stripped->data, packet->data, sizeof(uint32_t));
+    memcpy(stripped->data + sizeof(uint32_t), packet->data + headers, packet->dataLength - headers);
+    return stripped;
+}
+
+/// Put the base layer of fragmented video `track` back together, and send each whole frame to the
+/// recipients that joined without fragmented_video, as they'd otherwise take every fragment for a frame.
+/// They can't ask for keyframes or layers themselves, so the place asks the sender for them.
+static void forward_whole_frames(alloserver *serv, allo_media_track *track, allochannel channel, const allo_video_fragment_header *fragment, ENetPacket *packet)
+{
+    bool anyone = false;
+    for (size_t i = 0; i < track->recipients.length && !anyone; i++) {
+        anyone = !((alloserver_client*)track->recipients.data[i])->fragmented_video;
+    }
+    if (!anyone || allo_video_fragment_layer(fragment->flags) != 0) {
+        return;
+    }
+    if (!track->info.video.reassembler) {
+        track->info.video.reassembler = allo_video_reassembler_create(reassembly_deadline);
+    }
+
+    const size_t headers = sizeof(uint32_t) + ALLO_VIDEO_FRAGMENT_HEADER_SIZE;
+    const uint8_t *frame;
+    size_t frame_length;
+    bool complete = allo_video_reassembler_push(track->info.video.reassembler, fragment, packet->data + headers, packet->dataLength - headers, get_ts_monod(), &frame, &frame_length);
+    if (allo_video_reassembler_needs_keyframe(track->info.video.reassembler)) {
+        request_layer_keyframe(serv, track, 0);
+    }
+    if (!complete) {
+        return;
+    }
+
+    ENetPacket *whole = enet_packet_create(NULL, sizeof(uint32_t) + frame_length, 0);
+    memcpy(whole->data, packet->data, sizeof(uint32_t));
+    memcpy(whole->data + sizeof(uint32_t), frame, frame_length);
+    for (size_t i = 0; i < track->recipients.length; i++) {
+        alloserver_client *recipient = (alloserver_client*)track->recipients.data[i];
+        if (!recipient->fragmented_video) {
+            alloserv_send_enet(serv, recipient, channel, whole);
+        }
+    }
+    if (whole->referenceCount == 0) {
+        enet_packet_destroy(whole);
+    }
+}
+
+static void handle_media(alloserver *serv, alloserver_client *client, allochannel channel, ENetPacket *packet)
 {
     // get the track_id from the top of data
     uint32_t track_id;
-    assert(length >= sizeof(track_id) + 3);
-    memcpy(&track_id, data, sizeof(track_id));
+    if (packet->dataLength < sizeof(track_id) + 3) {
+        return;
+    }
+    memcpy(&track_id, packet->data, sizeof(track_id));
     track_id = ntohl(track_id);
     
     // check agains list of open tracks
-    allo_media_track *track = _media_track_find(&mediatracks, track_id);
+    allo_media_track *track = _media_track_find(mediatracks, track_id);
     
     // ignore this data if track was never allocated
     if (track == NULL) {
         return;
     }
     
+    allo_video_fragment_header fragment;
+    if (track->type == allo_media_type_video && track->info.video.fragmented &&
+        allo_video_read_fragment_header(packet->data + sizeof(track_id), packet->dataLength - sizeof(track_id), &fragment) &&
+        (fragment.flags & ALLO_VIDEO_FRAGMENT_KEYFRAME_REQUEST)) {
+        // pass it on to the sender, if it's from someone who gets this track
+        bool subscribed = false;
+        for (size_t i = 0; i < track->recipients.length && !subscribed; i++) {
+            subscribed = track->recipients.data[i] == client;
+        }
+        int layer = allo_video_fragment_layer(fragment.flags);
+        double now = get_ts_monod();
+        if (subscribed && track->origin && layer < ALLO_VIDEO_MAX_LAYERS &&
+            now - track->info.video.last_keyframe_request[layer] >= keyframe_request_interval &&
+            alloserv_send_enet(serv, (alloserver_client*)track->origin, channel, packet) == 0) {
+            // if the send failed, allo_poll frees the packet and the next request is let through
+            track->info.video.last_keyframe_request[layer] = now;
+        }
+        return;
+    }
+
     // ignore if the sender is not client that allocated the track
     if (track->origin != client) {
         return;
     }
     
-    // pass information on to all peers in track recipient list
-    for (size_t i = 0; i < track->recipients.length; i++) {
-        ENetPacket *packet = enet_packet_create(data, length, 0);
-        alloserv_send_enet(serv, (alloserver_client*)track->recipients.data[i], (allochannel)channel, packet);
+    void **recipients = track->recipients.data;
+    size_t recipient_count = track->recipients.length;
+    bool mixing = mixer && track->type == allo_media_type_audio;
+    if (track->type == allo_media_type_audio) {
+        note_audio_level(track, packet->data + sizeof(track_id), packet->dataLength - sizeof(track_id));
+        if (audio_culling()) {
+            recipients = track->info.audio.forward_to.data;
+            recipient_count = track->info.audio.forward_to.length;
+        }
+    }
+    if (mixing) {
+        allo_audio_mixer_push(mixer, track_id, track->info.audio.sequenced, packet->data + sizeof(track_id), packet->dataLength - sizeof(track_id));
+    }
+
+    // pass the very same packet on to all peers in track recipient list. Media is always
+    // forwarded unreliably, whatever the sender asked for.
+    packet->flags &= ~ENET_PACKET_FLAG_RELIABLE;
+    bool fragmented = track->type == allo_media_type_video && track->info.video.fragmented;
+    if (fragmented) {
+        if (!allo_video_read_fragment_header(packet->data + sizeof(track_id), packet->dataLength - sizeof(track_id), &fragment)) {
+            return;
+        }
+        forward_whole_frames(serv, track, channel, &fragment, packet);
+    }
+    if (track->type == allo_media_type_video && track->info.video.layer_count > 1) {
+        // simulcast: each subscriber only gets its layer
+        int layer = allo_video_fragment_layer(fragment.flags);
+        bool keyframe = fragment.flags & ALLO_VIDEO_FRAGMENT_KEYFRAME;
+        for (size_t i = 0; i < track->info.video.subscribers.length; i++) {
+            allo_video_subscriber *subscriber = &track->info.video.subscribers.data[i];
+            if (allo_video_subscriber_forward(subscriber, layer, keyframe)) {
+                alloserv_send_enet(serv, (alloserver_client*)subscriber->client, channel, packet);
+            }
+        }
+        return;
+    }
+    bool sequenced = track->type == allo_media_type_audio && track->info.audio.sequenced;
+    ENetPacket *stripped = NULL; // made the first time an older recipient needs it, then shared
+    bool stripped_made = false;
+    for (size_t i = 0; i < recipient_count; i++) {
+        alloserver_client *recipient = (alloserver_client*)recipients[i];
+        if (mixing && recipient->sequenced_audio) {
+            // gets it in its mix instead
+            continue;
+        }
+        if (fragmented && !recipient->fragmented_video) {
+            // gets whole frames instead
+            continue;
+        }
+        if (sequenced && !recipient->sequenced_audio) {
+            if (!stripped_made) {
+                stripped = strip_audio_seq_header(packet);
+                stripped_made = true;
+            }
+            if (stripped) {
+                alloserv_send_enet(serv, recipient, channel, stripped);
+            }
+            continue;
+        }
+        alloserv_send_enet(serv, recipient, channel, packet);
+    }
+    if (stripped && stripped->referenceCount == 0) {
+        enet_packet_destroy(stripped);
+    }
+}
+
+static void send_mixed_audio(void *ctx, void *listener, ENetPacket *packet)
+{
+    if (alloserv_send_enet((alloserver*)ctx, (alloserver_client*)listener, CHANNEL_AUDIO, packet) != 0) {
+        enet_packet_destroy(packet);
+    }
+}
+
+struct audio_source {
+    allo_media_track *track;
+    allo_vector position;
+    float loudness;
+};
+
+struct audible_source {
+    const audio_source *source;
+    double distance;
+};
+
+/// Every audio track in the place, and where it's coming from
+static std::vector<audio_source> collect_audio_sources(alloserver* serv)
+{
+    std::vector<audio_source> sources;
+    double now = get_ts_monod();
+    allo_entity *entity;
+    LIST_FOREACH(entity, &serv->state.entities, pointers) {
+        cJSON *jtrack_id = cJSON_GetObjectItemCaseSensitive(cJSON_GetObjectItemCaseSensitive(entity->components, "live_media"), "track_id");
+        if (!cJSON_IsNumber(jtrack_id)) continue;
+        allo_media_track *track = _media_track_find(mediatracks, jtrack_id->valueint);
+        if (!track || track->type != allo_media_type_audio) continue;
+        allo_vector position = allo_m4x4_get_position(entity_get_transform_in_coordinate_space(&serv->state, entity, NULL));
+        sources.push_back({track, position, current_loudness(track, now)});
+    }
+    return sources;
+}
+
+/// The sources that `listener` has subscribed to and should hear: those within audible_radius, and
+/// of those only the loudest_speakers loudest.
+static std::vector<audible_source> select_audible_sources(alloserver_client *listener, allo_vector ears, const std::vector<audio_source> &sources)
+{
+    std::vector<allo_audio_source> candidates;
+    for (const audio_source &source : sources) {
+        bool subscribed = false;
+        for (size_t i = 0; i < source.track->recipients.length && !subscribed; i++) {
+            subscribed = source.track->recipients.data[i] == listener;
+        }
+        candidates.push_back({source.position, source.loudness, subscribed && source.track->origin != listener});
+    }
+    std::vector<allo_audible_source> picked(candidates.size());
+    picked.resize(allo_audio_select_audible(candidates.data(), candidates.size(), ears, audible_radius, loudest_speakers, picked.data()));
+
+    std::vector<audible_source> audible;
+    for (const allo_audible_source &pick : picked) {
+        audible.push_back({&sources[pick.index], pick.distance});
+    }
+    return audible;
+}
+
+static allo_entity *get_avatar(alloserver* serv, alloserver_client *client)
+{
+    return client->avatar_entity_id ? state_get_entity(&serv->state, client->avatar_entity_id) : NULL;
+}
+
+/// Tell the mixer how loud each subscribed audio track should be for each listener, from where they are.
+static void update_mix_gains(alloserver* serv, const std::vector<audio_source> &sources)
+{
+    std::vector<allo_audio_mix_gain> gains;
+    alloserver_client* listener;
+    LIST_FOREACH(listener, &serv->clients, pointers) {
+        allo_entity *avatar = get_avatar(serv, listener);
+        if (!listener->sequenced_audio || !avatar) continue;
+        allo_vector ears = allo_m4x4_get_position(entity_get_transform_in_coordinate_space(&serv->state, avatar, NULL));
+        for (const audible_source &audible : select_audible_sources(listener, ears, sources)) {
+            float gain = allo_audio_mix_distance_gain(audible.distance);
+            if (gain > 0) {
+                gains.push_back({listener, audible.source->track->track_id, gain});
+            }
+        }
+    }
+    allo_audio_mixer_set_gains(mixer, gains.data(), gains.size());
+}
+
+/// Pick a layer of each simulcast video track for the subscribers that let the place choose,
+/// from how far away they are and how well their connection keeps up.
+static void update_video_layers(alloserver* serv)
+{
+    allo_entity *entity;
+    LIST_FOREACH(entity, &serv->state.entities, pointers) {
+        cJSON *jtrack_id = cJSON_GetObjectItemCaseSensitive(cJSON_GetObjectItemCaseSensitive(entity->components, "live_media"), "track_id");
+        if (!cJSON_IsNumber(jtrack_id)) continue;
+        allo_media_track *track = _media_track_find(mediatracks, jtrack_id->valueint);
+        if (!track || track->type != allo_media_type_video || track->info.video.layer_count < 2) continue;
+        allo_vector position = allo_m4x4_get_position(entity_get_transform_in_coordinate_space(&serv->state, entity, NULL));
+        for (size_t i = 0; i < track->info.video.subscribers.length; i++) {
+            allo_video_subscriber *subscriber = &track->info.video.subscribers.data[i];
+            alloserver_client *viewer = (alloserver_client*)subscriber->client;
+            allo_entity *avatar = get_avatar(serv, viewer);
+            if (subscriber->requested != ALLO_VIDEO_LAYER_AUTO || !avatar) continue;
+            allo_vector eyes = allo_m4x4_get_position(entity_get_transform_in_coordinate_space(&serv->state, avatar, NULL));
+            double distance = allo_vector_length(allo_vector_subtract(position, eyes));
+            alloserver_link_stats stats = alloserv_get_client_link(serv, viewer);
+            allo_video_link link = { stats.loss, stats.throttle };
+            int target = allo_video_auto_layer(track->info.video.layer_count, subscriber->current < 0 ? subscriber->target : subscriber->current, distance, link);
+            if (target != subscriber->target) {
+                subscriber->target = (int8_t)target;
+                request_layer_keyframe(serv, track, target);
+            }
+        }
+    }
+}
+
+/// Decide who gets each audio track forwarded to them, when culling audio
+static void update_audio_forwarding(alloserver* serv, const std::vector<audio_source> &sources)
+{
+    const allo_media_track_table *tracks = _media_tracks_read_begin(mediatracks);
+    for (size_t i = 0; i < tracks->capacity; i++) {
+        if (tracks->slots[i] && tracks->slots[i]->type == allo_media_type_audio) {
+            arr_clear(&tracks->slots[i]->info.audio.forward_to);
+        }
+    }
+    _media_tracks_read_end(mediatracks);
+    alloserver_client* listener;
+    LIST_FOREACH(listener, &serv->clients, pointers) {
+        allo_entity *avatar = get_avatar(serv, listener);
+        if (!avatar || (mixer && listener->sequenced_audio)) continue;
+        allo_vector ears = allo_m4x4_get_position(entity_get_transform_in_coordinate_space(&serv->state, avatar, NULL));
+        for (const audible_source &audible : select_audible_sources(listener, ears, sources)) {
+            arr_push(&audible.source->track->info.audio.forward_to, (void*)listener);
+        }
     }
 }
 
 static void received_from_client(alloserver* serv, alloserver_client* client, allochannel channel, const uint8_t* data, size_t data_length)
 {
-    if (channel == CHANNEL_STATEDIFFS) {
+    if (channel == CHANNEL_STATEDIFFS && data_length > 0 && data[0] == ALLO_INTENT_BINARY_MAGIC) {
+        handle_binary_intent(serv, client, data, data_length);
+    } else if (channel == CHANNEL_STATEDIFFS) {
         cJSON* cmd = cJSON_ParseWithLength((const char*)data, data_length);
         const cJSON* ntvintent = cJSON_GetObjectItemCaseSensitive(cmd, "intent");
-        allo_client_intent *intent = allo_client_intent_parse_cjson(ntvintent);
-        handle_intent(serv, client, intent);
-        allo_client_intent_free(intent);
+        handle_intent(serv, client, ntvintent);
         cJSON_Delete(cmd);
     } else if (channel == CHANNEL_COMMANDS) {
         cJSON* cmd = cJSON_ParseWithLength((const char*)data, data_length);
-        allo_interaction* interaction = allo_interaction_parse_cjson(cmd);
-        handle_interaction(serv, client, interaction);
-        allo_interaction_free(interaction);
+        allo_interaction_parsed interaction;
+        if (allo_interaction_parsed_init(&interaction, cmd)) {
+            handle_interaction(serv, client, &interaction, data, data_length);
+            allo_interaction_parsed_deinit(&interaction);
+        } else {
+            fprintf(stderr, "Malformed interaction from %s\n", alloserv_describe_client(client));
+        }
         cJSON_Delete(cmd);
     } else if (channel == CHANNEL_CLOCK) {
         cJSON* cmd = cJSON_ParseWithLength((const char*)data, data_length);
         handle_clock(serv, client, cmd);
         cJSON_Delete(cmd);
-    } else if (channel == CHANNEL_VIDEO || channel == CHANNEL_AUDIO) {
-        handle_media(serv, client, data, data_length, channel);
     }
 }
 
@@ -738,13 +1128,28 @@ static void broadcast_server_state(alloserver* serv)
     /// Note: The returned json is managed by allo_delta_compute
     char *json = allo_delta_compute(&hist, client->intent->ack_state_rev);
     int jsonlength = strlen(json);
-    serv->send(serv, client, CHANNEL_STATEDIFFS, (const uint8_t*)json, jsonlength);
+    if(client->intent_seq == 0) {
+      serv->send(serv, client, CHANNEL_STATEDIFFS, (const uint8_t*)json, jsonlength);
+      continue;
+    }
+    // binary intent clients need to know which intent we have, so they can skip unchanged parts
+    ENetPacket *packet = enet_packet_create(NULL, 5 + jsonlength, 0);
+    packet->data[0] = ALLO_INTENT_ACK_MAGIC;
+    uint32_t ack = htonl(client->intent_seq);
+    memcpy(packet->data + 1, &ack, sizeof(ack));
+    memcpy(packet->data + 5, json, jsonlength);
+    if (alloserv_send_enet(serv, client, CHANNEL_STATEDIFFS, packet) != 0) {
+        enet_packet_destroy(packet);
+    }
   }
 }
 
 static void step(double goalDt)
 {
   while (serv->interbeat(serv, 1)) {}
+  if (mixer) {
+    allo_audio_mixer_send_pending(mixer, send_mixed_audio, serv);
+  }
 
   double now = get_ts_monod();
 
@@ -761,6 +1166,12 @@ static void step(double goalDt)
     if (count == 32) break;
   }
   allo_simulate(&serv->state, (const allo_client_intent**)intents, count, now, NULL);
+  if (mixer || audio_culling()) {
+    std::vector<audio_source> sources = collect_audio_sources(serv);
+    if (mixer) update_mix_gains(serv, sources);
+    if (audio_culling()) update_audio_forwarding(serv, sources);
+  }
+  update_video_layers(serv);
   broadcast_server_state(serv);
 }
 
@@ -787,7 +1198,6 @@ static allo_entity* add_place(alloserver *serv)
 extern "C" bool alloserv_run_standalone(const char *public_hostname, int host, int port, const char *placename)
 {
     alloserver *serv = alloserv_start_standalone(public_hostname, host, port, placename);
-    arr_init(&mediatracks);
   
     if (serv == NULL)
     {
@@ -820,6 +1230,7 @@ alloserver *alloserv_start_standalone(const char *public_hostname, int listenhos
 
   g_public_hostname = strdup(public_hostname);
   g_placename = strdup(placename);
+  mediatracks = _media_tracks_create();
 
   int retries = 3;
   while (!serv)
@@ -845,6 +1256,7 @@ alloserver *alloserv_start_standalone(const char *public_hostname, int listenhos
   }
   serv->clients_callback = clients_changed;
   serv->raw_indata_callback = received_from_client;
+  serv->media_packet_callback = handle_media;
   allo_state_init(&serv->state);
 
   fprintf(stderr, "alloserv_run_standalone open on port %d\n", serv->_port);
@@ -861,7 +1273,8 @@ bool alloserv_poll_standalone(int allosocket)
 
   int hz = 5;
   double dt = 1.0/hz;
-  int dtmillis = dt*1000;
+  // mixes are finished on another thread; don't sit on them for long
+  int dtmillis = mixer ? 5 : dt*1000;
 
   int selectr = enet_socketset_select(allosocket, &set, NULL, dtmillis);
   if (selectr < 0 && errno != EINTR) {
@@ -875,9 +1288,38 @@ bool alloserv_poll_standalone(int allosocket)
   return true;
 }
 
+void alloserv_enable_audio_mixing_standalone(int worker_threads)
+{
+  assert(serv && place && "start the place first");
+  if (mixer) return;
+  mixer = allo_audio_mixer_create(worker_threads);
+
+  // every listener gets its own mix on this track
+  cJSON *mixcomp = cjson_create_object(
+    "track_id", cJSON_CreateNumber(ALLO_MIX_TRACK_ID),
+    "type", cJSON_CreateString("audio"),
+    "format", cJSON_CreateString("opus"),
+    "framing", cJSON_CreateString("sequenced"),
+    "metadata", cjson_create_object("mixed", cJSON_CreateTrue(), NULL),
+    NULL
+  );
+  cJSON_AddItemToObject(place->components, "live_media", mixcomp);
+  fprintf(stderr, "Mixing audio on the place with %d worker threads\n", worker_threads);
+}
+
+void alloserv_set_audio_culling_standalone(double radius, int speakers)
+{
+  audible_radius = radius;
+  loudest_speakers = speakers;
+}
+
 void alloserv_stop_standalone()
 {
+  allo_audio_mixer_destroy(mixer);
+  mixer = NULL;
   if(serv) alloserv_stop(serv);
   place = NULL;
   serv = NULL;
+  _media_tracks_destroy(mediatracks);
+  mediatracks = NULL;
 }
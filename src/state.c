@@ -71,6 +71,11 @@ static void cjson_to_skeleton(allo_m4x4 skeleton[26], cJSON *list)
 {
   if(list == NULL || list->child == NULL)
   {
+    // see skeleton_to_cjson: empty means all identity
+    for(int i = 0; i < ALLO_HAND_SKELETON_JOINT_COUNT; i++)
+    {
+      skeleton[i] = allo_m4x4_identity();
+    }
     return;
   }
   
@@ -78,7 +83,7 @@ static void cjson_to_skeleton(allo_m4x4 skeleton[26], cJSON *list)
   int i = 0;
   while(node && i < ALLO_HAND_SKELETON_JOINT_COUNT)
   {
-    skeleton[i] = cjson2m(node);
+    skeleton[i++] = cjson2m(node);
     node = node->next;
   }
 }
@@ -97,12 +102,19 @@ static cJSON* grab_to_cjson(allo_client_pose_grab grab)
   );
 }
 
-static allo_client_pose_grab grab_parse_cjson(cJSON* cjson)
+// replace *str with a copy of value, reusing the existing allocation if it's already equal
+static void replace_string(char **str, const char *value)
 {
-  return (allo_client_pose_grab) {
-    .entity = allo_strdup(cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(cjson, "entity"))),
-    .grabber_from_entity_transform = cjson2m(cJSON_GetObjectItemCaseSensitive(cjson, "grabber_from_entity_transform"))
-  };
+  if(*str && value && strcmp(*str, value) == 0)
+    return;
+  free(*str);
+  *str = allo_strdup(value);
+}
+
+static void grab_parse_cjson_into(allo_client_pose_grab *grab, cJSON* cjson)
+{
+  replace_string(&grab->entity, cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(cjson, "entity")));
+  grab->grabber_from_entity_transform = cjson2m(cJSON_GetObjectItemCaseSensitive(cjson, "grabber_from_entity_transform"));
 }
 
 cJSON* allo_client_intent_to_cjson(const allo_client_intent* intent)
@@ -148,8 +160,18 @@ cJSON* allo_client_intent_to_cjson(const allo_client_intent* intent)
 allo_client_intent *allo_client_intent_parse_cjson(const cJSON* from)
 {
   allo_client_intent* intent = allo_client_intent_create();
+  allo_client_intent_parse_cjson_into(intent, from);
+  return intent;
+}
+
+void allo_client_intent_parse_cjson_into(allo_client_intent *intent, const cJSON* from)
+{
   cJSON* poses = cJSON_GetObjectItemCaseSensitive(from, "poses");
-  intent->entity_id = allo_strdup(cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(from, "entity_id")));
+  cJSON *entity_id = cJSON_GetObjectItemCaseSensitive(from, "entity_id");
+  if(entity_id)
+  {
+    replace_string(&intent->entity_id, cJSON_GetStringValue(entity_id));
+  }
   cJSON *wants = cJSON_GetObjectItemCaseSensitive(from, "wants_stick_movement");
   intent->wants_stick_movement = wants ? wants->valueint : true;
   intent->zmovement = cJSON_GetObjectItemCaseSensitive(from, "zmovement")->valuedouble;
@@ -158,30 +180,17 @@ allo_client_intent *allo_client_intent_parse_cjson(const cJSON* from)
   intent->pitch = cJSON_GetObjectItemCaseSensitive(from, "pitch")->valuedouble;
   cJSON *hand_left = cJSON_GetObjectItemCaseSensitive(poses, "hand/left");
   cJSON *hand_right = cJSON_GetObjectItemCaseSensitive(poses, "hand/right");
-  intent->poses = (allo_client_poses){
-    .root = (allo_client_plain_pose){
-      .matrix = cjson2m(cJSON_GetObjectItemCaseSensitive(cJSON_GetObjectItemCaseSensitive(poses, "root"), "matrix")),
-    },
-    .head = (allo_client_plain_pose){
-      .matrix = cjson2m(cJSON_GetObjectItemCaseSensitive(cJSON_GetObjectItemCaseSensitive(poses, "head"), "matrix")),
-    },
-    .torso = (allo_client_plain_pose){
-      .matrix = cjson2m(cJSON_GetObjectItemCaseSensitive(cJSON_GetObjectItemCaseSensitive(poses, "torso"), "matrix")),
-    },
-    .left_hand = (allo_client_hand_pose){
-      .matrix = cjson2m(cJSON_GetObjectItemCaseSensitive(hand_left, "matrix")),
-      .grab = grab_parse_cjson(cJSON_GetObjectItemCaseSensitive(hand_left, "grab"))
-    },
-    .right_hand = (allo_client_hand_pose){
-      .matrix = cjson2m(cJSON_GetObjectItemCaseSensitive(hand_right, "matrix")),
-      .grab = grab_parse_cjson(cJSON_GetObjectItemCaseSensitive(hand_right, "grab"))
-    },
-  };
+  intent->poses.root.matrix = cjson2m(cJSON_GetObjectItemCaseSensitive(cJSON_GetObjectItemCaseSensitive(poses, "root"), "matrix"));
+  intent->poses.head.matrix = cjson2m(cJSON_GetObjectItemCaseSensitive(cJSON_GetObjectItemCaseSensitive(poses, "head"), "matrix"));
+  intent->poses.torso.matrix = cjson2m(cJSON_GetObjectItemCaseSensitive(cJSON_GetObjectItemCaseSensitive(poses, "torso"), "matrix"));
+  intent->poses.left_hand.matrix = cjson2m(cJSON_GetObjectItemCaseSensitive(hand_left, "matrix"));
+  grab_parse_cjson_into(&intent->poses.left_hand.grab, cJSON_GetObjectItemCaseSensitive(hand_left, "grab"));
+  intent->poses.right_hand.matrix = cjson2m(cJSON_GetObjectItemCaseSensitive(hand_right, "matrix"));
+  grab_parse_cjson_into(&intent->poses.right_hand.grab, cJSON_GetObjectItemCaseSensitive(hand_right, "grab"));
   cjson_to_skeleton(intent->poses.left_hand.skeleton, cJSON_GetObjectItemCaseSensitive(hand_left, "skeleton"));
   cjson_to_skeleton(intent->poses.right_hand.skeleton, cJSON_GetObjectItemCaseSensitive(hand_right, "skeleton"));
 
   intent->ack_state_rev = cjson_get_int64_value(cJSON_GetObjectItemCaseSensitive(from, "ack_state_rev"));
-  return intent;
 }
 
 
@@ -575,6 +584,51 @@ cJSON* allo_interaction_to_cjson(const allo_interaction* interaction)
     NULL
   );
 }
+cJSON *allo_interaction_create_cjson(const char *type, const char *sender_entity_id, const char *receiver_entity_id, const char *request_id, cJSON *body)
+{
+  return cjson_create_list(
+    cJSON_CreateString("interaction"),
+    cJSON_CreateString(type),
+    cJSON_CreateString(sender_entity_id),
+    cJSON_CreateString(receiver_entity_id),
+    cJSON_CreateString(request_id),
+    body,
+    NULL
+  );
+}
+
+bool allo_interaction_parsed_init(allo_interaction_parsed *interaction, const cJSON *from)
+{
+  memset(interaction, 0, sizeof(*interaction));
+  interaction->type = cJSON_GetStringValue(cJSON_GetArrayItem(from, 1));
+  interaction->sender_entity_id = cJSON_GetStringValue(cJSON_GetArrayItem(from, 2));
+  interaction->receiver_entity_id = cJSON_GetStringValue(cJSON_GetArrayItem(from, 3));
+  interaction->request_id = cJSON_GetStringValue(cJSON_GetArrayItem(from, 4));
+  interaction->body = cJSON_GetArrayItem(from, 5);
+  return interaction->type && interaction->sender_entity_id && interaction->receiver_entity_id &&
+    interaction->request_id && interaction->body;
+}
+
+void allo_interaction_parsed_deinit(allo_interaction_parsed *interaction)
+{
+  free(interaction->_body_text);
+  interaction->_body_text = NULL;
+}
+
+const char *allo_interaction_parsed_get_body(allo_interaction_parsed *interaction)
+{
+  if(interaction->_body_text == NULL)
+  {
+    interaction->_body_text = cJSON_Print(interaction->body);
+  }
+  return interaction->_body_text;
+}
+
+allo_interaction *allo_interaction_parsed_to_interaction(allo_interaction_parsed *interaction)
+{
+  return allo_interaction_create(interaction->type, interaction->sender_entity_id, interaction->receiver_entity_id, interaction->request_id, allo_interaction_parsed_get_body(interaction));
+}
+
 allo_interaction *allo_interaction_parse_cjson(const cJSON* inter_json)
 {
   const char* type = cJSON_GetArrayItem(inter_json, 1)->valuestring;
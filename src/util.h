@@ -105,13 +105,13 @@ static inline struct bitrate_deltas_t bitrate_deltas(struct bitrate_t *br, doubl
     return delta;
 }
 
+/// enet_peer_send, counting what's sent. If it fails the packet is still the caller's to destroy,
+/// unless another peer already has it queued.
 static inline int allo_enet_peer_send(ENetPeer * peer, enet_uint8 channelID, ENetPacket * packet) {
     int result = enet_peer_send(peer, channelID, packet);
     if (result == 0) {
         bitrate_increment_sent(&allo_statistics.channel_rates[channelID], packet->dataLength);
         bitrate_increment_sent(&allo_statistics.channel_rates[CHANNEL_COUNT], packet->dataLength);
-    } else {
-        enet_packet_destroy(packet);
     }
     return result;
 }
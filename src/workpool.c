@@ -0,0 +1,117 @@
+#include "workpool.h"
+#include "threading.h"
+#include <allonet/arr.h>
+#include <stdlib.h>
+#include <assert.h>
+
+struct allo_workpool {
+    mtx_t lock;
+    cnd_t work_available;
+    cnd_t work_done;
+    arr_t(thrd_t) threads;
+    bool stopping;
+
+    // current batch
+    allo_workpool_func work;
+    void *ctx;
+    size_t count;
+    size_t next;
+    size_t remaining;
+};
+
+/// Run items of the current batch until there are none left to take. Call with lock held.
+static void _work_locked(allo_workpool *pool)
+{
+    while(pool->next < pool->count)
+    {
+        size_t index = pool->next++;
+        mtx_unlock(&pool->lock);
+        pool->work(pool->ctx, index);
+        mtx_lock(&pool->lock);
+        if(--pool->remaining == 0)
+        {
+            cnd_broadcast(&pool->work_done);
+        }
+    }
+}
+
+static int _workpool_thread(void *arg)
+{
+    allo_workpool *pool = arg;
+    mtx_lock(&pool->lock);
+    while(!pool->stopping)
+    {
+        if(pool->next < pool->count)
+        {
+            _work_locked(pool);
+        }
+        else
+        {
+            cnd_wait(&pool->work_available, &pool->lock);
+        }
+    }
+    mtx_unlock(&pool->lock);
+    return 0;
+}
+
+allo_workpool *allo_workpool_create(int thread_count)
+{
+    allo_workpool *pool = calloc(1, sizeof(allo_workpool));
+    mtx_init(&pool->lock, mtx_plain);
+    cnd_init(&pool->work_available);
+    cnd_init(&pool->work_done);
+    arr_init(&pool->threads);
+    for(int i = 0; i < thread_count; i++)
+    {
+        thrd_t thread;
+        int success = thrd_create(&thread, _workpool_thread, pool);
+        assert(success == thrd_success); (void)success;
+        arr_push(&pool->threads, thread);
+    }
+    return pool;
+}
+
+void allo_workpool_destroy(allo_workpool *pool)
+{
+    if(!pool) return;
+    mtx_lock(&pool->lock);
+    pool->stopping = true;
+    cnd_broadcast(&pool->work_available);
+    mtx_unlock(&pool->lock);
+    for(size_t i = 0; i < pool->threads.length; i++)
+    {
+        thrd_join(pool->threads.data[i], NULL);
+    }
+    arr_free(&pool->threads);
+    cnd_destroy(&pool->work_available);
+    cnd_destroy(&pool->work_done);
+    mtx_destroy(&pool->lock);
+    free(pool);
+}
+
+void allo_workpool_run(allo_workpool *pool, size_t count, allo_workpool_func work, void *ctx)
+{
+    if(count == 0) return;
+    if(pool->threads.length == 0 || count == 1)
+    {
+        for(size_t i = 0; i < count; i++) work(ctx, i);
+        return;
+    }
+
+    mtx_lock(&pool->lock);
+    pool->work = work;
+    pool->ctx = ctx;
+    pool->count = count;
+    pool->next = 0;
+    pool->remaining = count;
+    cnd_broadcast(&pool->work_available);
+    _work_locked(pool);
+    while(pool->remaining > 0)
+    {
+        cnd_wait(&pool->work_done, &pool->lock);
+    }
+    pool->count = pool->next = 0;
+    pool->work = NULL;
+    pool->ctx = NULL;
+    mtx_unlock(&pool->lock);
+}
@@ -0,0 +1,30 @@
+#ifndef ALLONET_WORKPOOL_H
+#define ALLONET_WORKPOOL_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A fixed set of threads for fork-join style parallel loops: split a batch of
+ * independent items over the threads (and the caller), and wait for all of them.
+ * One batch runs at a time; only call allo_workpool_run from one thread at a time.
+ */
+typedef struct allo_workpool allo_workpool;
+
+typedef void (*allo_workpool_func)(void *ctx, size_t index);
+
+/// @param thread_count extra threads to start. With 0, batches run on the calling thread.
+allo_workpool *allo_workpool_create(int thread_count);
+void allo_workpool_destroy(allo_workpool *pool);
+/// Call work(ctx, i) for every i in [0, count), and return when all calls have returned.
+void allo_workpool_run(allo_workpool *pool, size_t count, allo_workpool_func work, void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,395 @@
+#include <unity.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <enet/enet.h>
+#include <cJSON/cJSON.h>
+#include <allonet/assetstore.h>
+#include "../src/asset.h"
+
+// Downloads an asset from one or more peers over simulated links with latency and limited bandwidth,
+// with virtual time so that a long transfer takes no time at all, and measures how the throughput
+// depends on how many range requests are kept outstanding and on how many peers it comes from.
+
+#define ASSET_SIZE (24*1024*1024)
+#define LINK_LATENCY 0.05            // one way; 100ms round trip
+#define LINK_BANDWIDTH (25*1024*1024) // bytes per second each way, unless the peer says otherwise
+#define MAX_SENDERS 3
+
+typedef struct peer peer;
+
+typedef struct message {
+    double arrives_at;
+    peer *from;
+    peer *to;
+    ENetPacket *packet;
+} message;
+
+struct peer {
+    assetstore store;
+    asset_transfers transfers;
+    double bandwidth;    // bytes per second sent
+    double link_free_at; // when the link from this peer is done sending what it has queued
+    double stops_at;     // stops answering requests after this, if set
+    size_t sent;         // asset bytes sent
+    bool gone;           // the receiver has given up on it
+    bool available;
+    bool unavailable;
+};
+
+/// Who to send to: `to`, or every sender if NULL
+typedef struct connection {
+    peer *from;
+    peer *to;
+} connection;
+
+static arr_t(message) in_flight;
+static double now;
+static peer senders[MAX_SENDERS], receiver;
+static int sender_count;
+#define sender senders[0]
+static uint8_t *asset;
+static char *asset_id;
+
+static double virtual_clock(void) {
+    return now;
+}
+
+static void send_packet(peer *from, peer *to, ENetPacket *packet) {
+    double sent_at = (from->link_free_at > now ? from->link_free_at : now) + packet->dataLength / from->bandwidth;
+    from->link_free_at = sent_at;
+    message m = { sent_at + LINK_LATENCY, from, to, packet };
+    arr_push(&in_flight, m);
+}
+
+static void send_func(asset_mid mid, const cJSON *header, const uint8_t *data, size_t data_length, void *user) {
+    connection *c = (connection*)user;
+    if (c->to) {
+        send_packet(c->from, c->to, asset_build_enet_packet(mid, header, data, data_length));
+        return;
+    }
+    for (int i = 0; i < sender_count; i++) {
+        if (!senders[i].gone) {
+            send_packet(c->from, &senders[i], asset_build_enet_packet(mid, header, data, data_length));
+        }
+    }
+}
+
+static void request_func(const char *asset_id, size_t offset, size_t length, void *user) {
+    peer *self = ((connection*)user)->from;
+    if (self->stops_at > 0 && now > self->stops_at) {
+        return;
+    }
+    uint8_t *buffer = malloc(length);
+    size_t total_size = 0;
+    int read = assetstore_read(&self->store, asset_id, offset, buffer, length, &total_size);
+    self->sent += read > 0 ? read : 0;
+    asset_deliver_bytes(asset_id, read > 0 ? buffer : NULL, offset, read > 0 ? read : 0, total_size, send_func, user);
+    free(buffer);
+}
+
+static int write_func(const char *asset_id, const uint8_t *buffer, size_t offset, size_t length, size_t total_size, void *user) {
+    connection *c = (connection*)user;
+    if (c->to->gone) {
+        return 0;
+    }
+    return assetstore_write(&c->from->store, asset_id, offset, buffer, length, total_size);
+}
+
+static bool anyone_left(void) {
+    for (int i = 0; i < sender_count; i++) {
+        if (!senders[i].gone) return true;
+    }
+    return false;
+}
+
+/// Like the server: forget a source that failed or stalled, and ask the rest, or give up
+static void give_up_on(const char *asset_id, peer *source) {
+    if (source) {
+        source->gone = true;
+    } else {
+        for (int i = 0; i < sender_count; i++) senders[i].gone = true;
+    }
+    if (!anyone_left()) {
+        asset_transfers_cancel(&receiver.transfers, asset_id);
+        receiver.unavailable = true;
+        return;
+    }
+    connection everyone = { &receiver, NULL };
+    asset_request(asset_id, NULL, &receiver.transfers, send_func, &everyone);
+}
+
+static void state_func(const char *asset_id, asset_state state, void *user) {
+    connection *c = (connection*)user;
+    if (state == asset_state_now_available) {
+        c->from->available = true;
+    } else if (state == asset_state_now_unavailable) {
+        c->to->gone = true;
+        if (!anyone_left()) {
+            asset_transfers_cancel(&c->from->transfers, asset_id);
+            c->from->unavailable = true;
+        }
+    }
+}
+
+static void stalled_func(const char *asset_id, const void *source, void *user) {
+    give_up_on(asset_id, (peer*)source);
+}
+
+/// Deliver messages in the order they arrive until there are none left, looking for stalls once a second
+static void run(void) {
+    double next_check = now + 1;
+    while (in_flight.length > 0 || receiver.transfers.active.length > 0) {
+        TEST_ASSERT_TRUE(now < 600);
+        size_t next = 0;
+        for (size_t i = 1; i < in_flight.length; i++) {
+            if (in_flight.data[i].arrives_at < in_flight.data[next].arrives_at) next = i;
+        }
+        if (in_flight.length == 0 || in_flight.data[next].arrives_at > next_check) {
+            now = next_check;
+            next_check += 1;
+            asset_transfers_check_stalls(&receiver.transfers, stalled_func, NULL);
+            continue;
+        }
+        message m = in_flight.data[next];
+        arr_splice(&in_flight, next, 1);
+        now = m.arrives_at;
+        connection c = { m.to, m.from };
+        asset_handle(m.packet->data, m.packet->dataLength, &m.to->transfers, m.from, request_func, write_func, send_func, state_func, &c);
+        enet_packet_destroy(m.packet);
+    }
+}
+
+static void peer_init(peer *p) {
+    memset(p, 0, sizeof(*p));
+    p->bandwidth = LINK_BANDWIDTH;
+    asset_memstore_init(&p->store, NULL);
+    asset_transfers_init(&p->transfers, &p->store);
+    p->transfers.clock = virtual_clock;
+}
+
+static void peer_deinit(peer *p) {
+    asset_transfers_deinit(&p->transfers);
+    asset_memstore_deinit(&p->store);
+}
+
+void setUp(void) {
+    now = 0;
+    arr_init(&in_flight);
+    peer_init(&receiver);
+    for (int i = 0; i < MAX_SENDERS; i++) {
+        peer_init(&senders[i]);
+    }
+    sender_count = 1;
+
+    asset = malloc(ASSET_SIZE);
+    srand(1);
+    for (size_t i = 0; i < ASSET_SIZE; i++) asset[i] = rand();
+    asset_id = asset_generate_identifier(asset, ASSET_SIZE);
+    // the first store owns it from here
+    asset_memstore_register_asset_nocopy(&senders[0].store, asset_id, asset, ASSET_SIZE);
+    for (int i = 1; i < MAX_SENDERS; i++) {
+        uint8_t *copy = malloc(ASSET_SIZE);
+        memcpy(copy, asset, ASSET_SIZE);
+        asset_memstore_register_asset_nocopy(&senders[i].store, asset_id, copy, ASSET_SIZE);
+    }
+}
+
+void tearDown(void) {
+    peer_deinit(&receiver);
+    for (int i = 0; i < MAX_SENDERS; i++) {
+        peer_deinit(&senders[i]);
+    }
+    for (size_t i = 0; i < in_flight.length; i++) {
+        enet_packet_destroy(in_flight.data[i].packet);
+    }
+    arr_free(&in_flight);
+    free(asset_id);
+}
+
+/// @return bytes per second
+static double download(int window, size_t chunk_size) {
+    receiver.transfers.window = window;
+    receiver.transfers.chunk_size = chunk_size;
+    connection everyone = { &receiver, NULL };
+    asset_request(asset_id, NULL, &receiver.transfers, send_func, &everyone);
+    run();
+
+    TEST_ASSERT_TRUE(receiver.available);
+    TEST_ASSERT_EQUAL_INT(0, receiver.transfers.active.length);
+    uint8_t *received = asset_memstore_get_data_pointer(&receiver.store, asset_id);
+    TEST_ASSERT_NOT_NULL(received);
+    TEST_ASSERT_EQUAL_MEMORY(asset, received, ASSET_SIZE);
+    return ASSET_SIZE / now;
+}
+
+void test_stop_and_wait_is_bound_by_round_trips(void) {
+    double throughput = download(1, ASSET_CHUNK_SIZE);
+    // a chunk per round trip plus the time to send it
+    double expected = ASSET_CHUNK_SIZE / (2 * LINK_LATENCY + ASSET_CHUNK_SIZE / (double)LINK_BANDWIDTH);
+    TEST_ASSERT_DOUBLE_WITHIN(expected * 0.1, expected, throughput);
+}
+
+void test_throughput_by_window(void) {
+    const int windows[] = {1, 2, 4, 8, 16};
+    double throughputs[5];
+    for (int i = 0; i < 5; i++) {
+        if (i > 0) { tearDown(); setUp(); }
+        throughputs[i] = download(windows[i], ASSET_CHUNK_SIZE);
+        printf("window %2d x %d KiB over %.0fms RTT: %.1f MiB/s\n", windows[i], ASSET_CHUNK_SIZE / 1024, LINK_LATENCY * 2000, throughputs[i] / (1024*1024));
+    }
+    for (int i = 1; i < 5; i++) {
+        TEST_ASSERT_TRUE(throughputs[i] >= throughputs[i-1] * 0.99);
+    }
+    // the default window fills the link, after a round trip to learn the size and one to ask for the rest
+    double filled = ASSET_SIZE / (4 * LINK_LATENCY + ASSET_SIZE / (double)LINK_BANDWIDTH);
+    TEST_ASSERT_TRUE(throughputs[3] > filled * 0.95);
+    TEST_ASSERT_TRUE(throughputs[3] > throughputs[0] * 2.5);
+}
+
+void test_small_chunks_need_a_bigger_window(void) {
+    double small = download(ASSET_WINDOW_SIZE, 64*1024);
+    tearDown(); setUp();
+    double bigger_window = download(64, 64*1024);
+    printf("64 KiB chunks: %.1f MiB/s with a window of %d, %.1f MiB/s with 64\n", small / (1024*1024), ASSET_WINDOW_SIZE, bigger_window / (1024*1024));
+    TEST_ASSERT_TRUE(bigger_window > small * 3);
+}
+
+void test_tiny_asset_completes_with_first_chunk(void) {
+    char *hello = strdup("Hello World!");
+    char *id = asset_generate_identifier((const uint8_t*)hello, 13);
+    asset_memstore_register_asset_nocopy(&sender.store, id, (const uint8_t*)hello, 13);
+    connection everyone = { &receiver, NULL };
+    asset_request(id, NULL, &receiver.transfers, send_func, &everyone);
+    run();
+    TEST_ASSERT_TRUE(receiver.available);
+    TEST_ASSERT_DOUBLE_WITHIN(0.001, 2 * LINK_LATENCY, now);
+    TEST_ASSERT_EQUAL_STRING(hello, (char*)asset_memstore_get_data_pointer(&receiver.store, id));
+    free(id);
+}
+
+void test_missing_asset_is_unavailable(void) {
+    sender_count = MAX_SENDERS;
+    connection everyone = { &receiver, NULL };
+    asset_request("asset:sha256:nope", NULL, &receiver.transfers, send_func, &everyone);
+    run();
+    TEST_ASSERT_TRUE(receiver.unavailable);
+    TEST_ASSERT_EQUAL_INT(0, receiver.transfers.active.length);
+}
+
+void test_several_sources_are_faster_than_one(void) {
+    senders[0].bandwidth = 8*1024*1024;
+    double one = download(ASSET_WINDOW_SIZE, ASSET_CHUNK_SIZE);
+    tearDown(); setUp();
+    sender_count = 3;
+    senders[0].bandwidth = senders[1].bandwidth = 8*1024*1024;
+    senders[2].bandwidth = 2*1024*1024;
+    double three = download(ASSET_WINDOW_SIZE, ASSET_CHUNK_SIZE);
+    printf("from one 8 MiB/s source: %.1f MiB/s, adding another one and a 2 MiB/s one: %.1f MiB/s\n", one / (1024*1024), three / (1024*1024));
+    // most of what the three links can carry, less the first chunk that everyone sends
+    TEST_ASSERT_TRUE(three > one * 1.8);
+}
+
+void test_slower_sources_are_asked_for_less(void) {
+    sender_count = 3;
+    senders[0].bandwidth = senders[1].bandwidth = 8*1024*1024;
+    senders[2].bandwidth = 2*1024*1024;
+    download(ASSET_WINDOW_SIZE, ASSET_CHUNK_SIZE);
+    printf("sent %zu, %zu and %zu KiB\n", senders[0].sent / 1024, senders[1].sent / 1024, senders[2].sent / 1024);
+    TEST_ASSERT_TRUE(senders[2].sent > 0);
+    TEST_ASSERT_TRUE(senders[0].sent > senders[2].sent * 2);
+    TEST_ASSERT_TRUE(senders[1].sent > senders[2].sent * 2);
+    // nothing is sent by more than one source, except the first chunk
+    size_t total = senders[0].sent + senders[1].sent + senders[2].sent;
+    TEST_ASSERT_TRUE(total <= ASSET_SIZE + 2 * ASSET_CHUNK_SIZE);
+}
+
+void test_stalled_source_is_replaced(void) {
+    sender_count = 2;
+    senders[0].bandwidth = senders[1].bandwidth = 8*1024*1024;
+    senders[1].stops_at = 0.5;
+    download(ASSET_WINDOW_SIZE, ASSET_CHUNK_SIZE);
+    printf("with a source that stops after %.1fs: done after %.1fs\n", senders[1].stops_at, now);
+    TEST_ASSERT_TRUE(senders[1].gone);
+    TEST_ASSERT_FALSE(senders[0].gone);
+    TEST_ASSERT_TRUE(senders[1].sent > 0);
+    // it finishes about a stall timeout later than it would have from the one source alone
+    double alone = ASSET_SIZE / senders[0].bandwidth;
+    TEST_ASSERT_TRUE(now < alone + ASSET_STALL_TIMEOUT + 2);
+}
+
+void test_nobody_answering_is_unavailable(void) {
+    sender_count = 2;
+    senders[0].stops_at = senders[1].stops_at = 0.001;
+    now = 0.01;
+    connection everyone = { &receiver, NULL };
+    asset_request(asset_id, NULL, &receiver.transfers, send_func, &everyone);
+    run();
+    TEST_ASSERT_TRUE(receiver.unavailable);
+    TEST_ASSERT_FALSE(receiver.available);
+    TEST_ASSERT_EQUAL_INT(0, receiver.transfers.active.length);
+    TEST_ASSERT_TRUE(now > ASSET_STALL_TIMEOUT);
+}
+
+static ENetPacket *delivered;
+static void keep_packet(asset_mid mid, const cJSON *header, const uint8_t *data, size_t data_length, void *user) {
+    (void)user;
+    delivered = asset_build_enet_packet(mid, header, data, data_length);
+}
+
+void test_packed_chunk_is_what_deliver_sends(void) {
+    const uint8_t data[] = "some bytes of an asset";
+    asset_deliver_bytes(asset_id, data, 100, sizeof(data), 1000, keep_packet, NULL);
+    
+    asset_packed_message *message = asset_pack_bytes(asset_id, 100, sizeof(data), 1000);
+    memcpy(asset_packed_message_data(message), data, sizeof(data));
+    // one per peer, and neither copies the bytes
+    ENetPacket *first = asset_packed_message_enet_packet(message);
+    ENetPacket *second = asset_packed_message_enet_packet(message);
+    asset_packed_message_release(message);
+    TEST_ASSERT_EQUAL_PTR(first->data, second->data);
+    
+    TEST_ASSERT_EQUAL_INT(delivered->dataLength, first->dataLength);
+    TEST_ASSERT_EQUAL_MEMORY(delivered->data, first->data, first->dataLength);
+    enet_packet_destroy(first);
+    enet_packet_destroy(second);
+    enet_packet_destroy(delivered);
+}
+
+static void *store_asked_with;
+
+/// As if the app kept this asset's bytes itself, so the store can't tell which are missing
+static assetstore *no_store(const char *asset_id, void *user) {
+    store_asked_with = user;
+    return NULL;
+}
+
+void test_each_transfer_can_have_a_store_of_its_own(void) {
+    receiver.transfers.store_for = no_store;
+    connection everyone = { &receiver, NULL };
+    asset_request(asset_id, NULL, &receiver.transfers, send_func, &everyone);
+    TEST_ASSERT_EQUAL_PTR(&everyone, store_asked_with);
+    run();
+    // done once every byte has arrived, as there's no store to ask
+    TEST_ASSERT_TRUE(receiver.available);
+    TEST_ASSERT_EQUAL_INT(ASSET_SIZE, receiver.store.cache_size);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_stop_and_wait_is_bound_by_round_trips);
+    RUN_TEST(test_throughput_by_window);
+    RUN_TEST(test_small_chunks_need_a_bigger_window);
+    RUN_TEST(test_tiny_asset_completes_with_first_chunk);
+    RUN_TEST(test_missing_asset_is_unavailable);
+    RUN_TEST(test_several_sources_are_faster_than_one);
+    RUN_TEST(test_slower_sources_are_asked_for_less);
+    RUN_TEST(test_stalled_source_is_replaced);
+    RUN_TEST(test_nobody_answering_is_unavailable);
+    RUN_TEST(test_packed_chunk_is_what_deliver_sends);
+    RUN_TEST(test_each_transfer_can_have_a_store_of_its_own);
+
+    return UNITY_END();
+}
@@ -0,0 +1,90 @@
+#include <unity.h>
+#include <allonet/assetstore.h>
+#include "../src/util.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// Measures how many small assets per second the memstore can take in and serve, with more assets
+// than its limits allow, like a server handing out lots of small textures and sounds.
+
+#define ASSET_COUNT 100000
+#define ASSET_SIZE 256
+
+static assetstore store;
+static char (*ids)[32];
+static uint8_t data[ASSET_SIZE];
+
+// Frozen, so that every asset was used too recently to be evicted however long the run takes, and
+// all of them can be read back. assetstore_cache_test checks what gets evicted.
+static double frozen_clock(void)
+{
+  return 0;
+}
+
+void setUp(void)
+{
+  assetstore_limits limits = { .max_count = ASSET_COUNT / 10, .max_bytes = 1024*1024*1024, .max_age = 600 };
+  asset_memstore_init(&store, &limits);
+  store.clock = frozen_clock;
+  ids = malloc(sizeof(*ids) * ASSET_COUNT);
+  for(int i = 0; i < ASSET_COUNT; i++)
+  {
+    snprintf(ids[i], sizeof(ids[i]), "asset:bench:%d", i);
+  }
+  memset(data, 7, sizeof(data));
+}
+
+void tearDown(void)
+{
+  asset_memstore_deinit(&store);
+  free(ids);
+}
+
+static void report(const char *name, double start)
+{
+  double duration = get_ts_monod() - start;
+  printf("%-24s %10.0f assets/s\n", name, ASSET_COUNT / duration);
+}
+
+void test_insert_and_read_small_assets(void)
+{
+  uint8_t *pinned = malloc(ASSET_SIZE);
+  memset(pinned, 1, ASSET_SIZE);
+  asset_memstore_register_asset_nocopy(&store, NULL, pinned, ASSET_SIZE);
+
+  double start = get_ts_monod();
+  for(int i = 0; i < ASSET_COUNT; i++)
+  {
+    // in two halves, as if received in two chunks
+    assetstore_write(&store, ids[i], 0, data, ASSET_SIZE/2, ASSET_SIZE);
+    assetstore_write(&store, ids[i], ASSET_SIZE/2, data, ASSET_SIZE/2, ASSET_SIZE);
+  }
+  report("write", start);
+
+  uint8_t buffer[ASSET_SIZE];
+  size_t total_size = 0;
+  start = get_ts_monod();
+  for(int i = 0; i < ASSET_COUNT; i++)
+  {
+    TEST_ASSERT_EQUAL_INT(ASSET_SIZE, assetstore_read(&store, ids[(i * 7919) % ASSET_COUNT], 0, buffer, sizeof(buffer), &total_size));
+  }
+  report("read", start);
+  TEST_ASSERT_EQUAL_MEMORY(data, buffer, ASSET_SIZE);
+
+  start = get_ts_monod();
+  for(int i = 0; i < ASSET_COUNT; i++)
+  {
+    TEST_ASSERT_TRUE(assetstore_get_is_asset_complete(&store, ids[i]));
+  }
+  report("get_state", start);
+}
+
+int main(void)
+{
+  UNITY_BEGIN();
+
+  RUN_TEST(test_insert_and_read_small_assets);
+
+  return UNITY_END();
+}
@@ -0,0 +1,139 @@
+#include <unity.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <allonet/assetstore.h>
+#include "../src/asset.h"
+
+// Fills a memstore past its limits on a clock the test controls, and checks which assets it lets go of.
+
+static assetstore store;
+static double now;
+static uint8_t bytes[400];
+
+static double fake_clock(void) {
+    return now;
+}
+
+static void start(size_t max_count, size_t max_bytes, double max_age) {
+    assetstore_limits limits = { max_count, max_bytes, max_age };
+    asset_memstore_init(&store, &limits);
+    store.clock = fake_clock;
+}
+
+static void put(const char *asset_id, double at) {
+    now = at;
+    TEST_ASSERT_EQUAL_INT(sizeof(bytes), assetstore_write(&store, asset_id, 0, bytes, sizeof(bytes), sizeof(bytes)));
+}
+
+static void use(const char *asset_id, double at) {
+    now = at;
+    uint8_t buffer[sizeof(bytes)];
+    size_t total_size = 0;
+    TEST_ASSERT_EQUAL_INT(sizeof(bytes), assetstore_read(&store, asset_id, 0, buffer, sizeof(buffer), &total_size));
+}
+
+static bool has(const char *asset_id) {
+    int exists = 0;
+    assetstore_get_state(&store, asset_id, &exists, NULL, NULL, NULL);
+    return exists;
+}
+
+void setUp(void) {
+    now = 0;
+    memset(bytes, 3, sizeof(bytes));
+}
+
+void tearDown(void) {
+    asset_memstore_deinit(&store);
+}
+
+void test_least_recently_used_goes_first(void) {
+    start(3, 1024*1024, 600);
+    put("a", 0);
+    put("b", 1);
+    put("c", 2);
+    use("a", 10);
+    put("d", 20);
+
+    TEST_ASSERT_TRUE(has("a"));
+    TEST_ASSERT_FALSE(has("b"));
+    TEST_ASSERT_TRUE(has("c"));
+    TEST_ASSERT_TRUE(has("d"));
+    TEST_ASSERT_EQUAL_INT(3, store.cache_count);
+
+    put("e", 30);
+    TEST_ASSERT_FALSE(has("c"));
+    TEST_ASSERT_TRUE(has("a"));
+}
+
+void test_recently_used_assets_stay_over_the_limits(void) {
+    start(2, 1024*1024, 600);
+    put("a", 0);
+    put("b", 1);
+    // a was used less than 5 seconds ago, so it might be in the middle of being sent
+    put("c", 3);
+    TEST_ASSERT_TRUE(has("a"));
+    TEST_ASSERT_EQUAL_INT(3, store.cache_count);
+
+    put("d", 10);
+    TEST_ASSERT_FALSE(has("a"));
+    TEST_ASSERT_FALSE(has("b"));
+    TEST_ASSERT_EQUAL_INT(2, store.cache_count);
+}
+
+void test_max_bytes(void) {
+    start(100, 2 * sizeof(bytes) + 1, 600);
+    put("a", 0);
+    put("b", 1);
+    TEST_ASSERT_EQUAL_INT(2 * sizeof(bytes), store.cache_size);
+    put("c", 10);
+    TEST_ASSERT_FALSE(has("a"));
+    TEST_ASSERT_TRUE(has("b"));
+    TEST_ASSERT_TRUE(has("c"));
+    TEST_ASSERT_EQUAL_INT(2 * sizeof(bytes), store.cache_size);
+}
+
+void test_max_age(void) {
+    start(100, 1024*1024, 60);
+    put("a", 0);
+    put("b", 50);
+    // well within the limits, but a hasn't been used for too long
+    use("b", 70);
+    TEST_ASSERT_FALSE(has("a"));
+    TEST_ASSERT_TRUE(has("b"));
+    TEST_ASSERT_EQUAL_INT(1, store.cache_count);
+}
+
+void test_pinned_assets_are_never_removed(void) {
+    start(1, sizeof(bytes), 60);
+    uint8_t *pinned = malloc(sizeof(bytes)); // owned by the store
+    memset(pinned, 1, sizeof(bytes));
+    asset_memstore_register_asset_nocopy(&store, NULL, pinned, sizeof(bytes));
+    TEST_ASSERT_EQUAL_INT(1, store.pinned_count);
+    TEST_ASSERT_EQUAL_INT(sizeof(bytes), store.pinned_size);
+    TEST_ASSERT_EQUAL_INT(0, store.cache_count);
+
+    put("a", 100);
+    put("b", 200);
+    put("c", 1000);
+    TEST_ASSERT_FALSE(has("a"));
+    TEST_ASSERT_FALSE(has("b"));
+    TEST_ASSERT_EQUAL_INT(1, store.cache_count);
+    TEST_ASSERT_EQUAL_INT(1, store.pinned_count);
+    char *pinned_id = asset_generate_identifier(pinned, sizeof(bytes));
+    TEST_ASSERT_EQUAL_PTR(pinned, asset_memstore_get_data_pointer(&store, pinned_id));
+    free(pinned_id);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_least_recently_used_goes_first);
+    RUN_TEST(test_recently_used_assets_stay_over_the_limits);
+    RUN_TEST(test_max_bytes);
+    RUN_TEST(test_max_age);
+    RUN_TEST(test_pinned_assets_are_never_removed);
+
+    return UNITY_END();
+}
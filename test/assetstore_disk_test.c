@@ -0,0 +1,245 @@
+#include <unity.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/stat.h>
+#if defined(_WIN32)
+    #include <direct.h>
+    #include <sys/utime.h>
+    #define rmdir _rmdir
+#else
+    #include <unistd.h>
+    #include <utime.h>
+#endif
+#include <allonet/assetstore.h>
+#include "../src/asset.h"
+
+// Stores assets on disk, and checks that they are still there, or still partially there,
+// after the store has been closed and opened again as on a server restart.
+
+#define MiB (1024*1024)
+
+static char dir[256];
+static assetstore store;
+
+static uint8_t *random_bytes(size_t size, unsigned seed) {
+    uint8_t *bytes = malloc(size);
+    srand(seed);
+    for (size_t i = 0; i < size; i++) bytes[i] = rand();
+    return bytes;
+}
+
+static char *file_for(const char *asset_id, const char *suffix) {
+    static char path[256];
+    snprintf(path, sizeof(path), "%s/%s%s", dir, asset_id + strlen("asset:sha256:"), suffix);
+    return path;
+}
+
+static bool exists(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0;
+}
+
+static void reopen(size_t max_bytes) {
+    asset_diskstore_deinit(&store);
+    TEST_ASSERT_EQUAL_INT(0, asset_diskstore_init(&store, dir, max_bytes));
+}
+
+void setUp(void) {
+    // the store creates it
+    const char *tmp = getenv("TMPDIR") ? getenv("TMPDIR") : getenv("TEMP") ? getenv("TEMP") : "/tmp";
+    static int count = 0;
+    snprintf(dir, sizeof(dir), "%s/allonet_assets_%ld_%d_%d", tmp, (long)time(NULL), rand(), count++);
+    TEST_ASSERT_FALSE(exists(dir));
+    TEST_ASSERT_EQUAL_INT(0, asset_diskstore_init(&store, dir, 100*MiB));
+}
+
+void tearDown(void) {
+    // a store with no room deletes everything it finds
+    reopen(0);
+    asset_diskstore_deinit(&store);
+    TEST_ASSERT_EQUAL_INT(0, rmdir(dir));
+}
+
+void test_asset_survives_restart(void) {
+    size_t size = 3*MiB + 17;
+    uint8_t *bytes = random_bytes(size, 1);
+    char *id = asset_generate_identifier(bytes, size);
+    for (size_t offset = 0; offset < size; offset += MiB) {
+        size_t length = size - offset < MiB ? size - offset : MiB;
+        TEST_ASSERT_EQUAL_INT(length, assetstore_write(&store, id, offset, bytes + offset, length, size));
+    }
+    TEST_ASSERT_TRUE(assetstore_get_is_asset_complete(&store, id));
+    TEST_ASSERT_TRUE(exists(file_for(id, "")));
+    TEST_ASSERT_FALSE(exists(file_for(id, ".part")));
+    TEST_ASSERT_FALSE(exists(file_for(id, ".ranges")));
+
+    reopen(100*MiB);
+
+    TEST_ASSERT_TRUE(assetstore_get_is_asset_complete(&store, id));
+    uint8_t *read = malloc(size);
+    size_t total_size = 0;
+    TEST_ASSERT_EQUAL_INT(MiB, assetstore_read(&store, id, 0, read, MiB, &total_size));
+    TEST_ASSERT_EQUAL_INT(size, total_size);
+    TEST_ASSERT_EQUAL_INT(size - MiB, assetstore_read(&store, id, MiB, read + MiB, size, &total_size));
+    TEST_ASSERT_EQUAL_MEMORY(bytes, read, size);
+    free(read);
+    free(bytes);
+    free(id);
+}
+
+void test_partial_download_resumes(void) {
+    size_t size = 4*MiB;
+    uint8_t *bytes = random_bytes(size, 2);
+    char *id = asset_generate_identifier(bytes, size);
+    assetstore_write(&store, id, 0, bytes, MiB, size);
+    assetstore_write(&store, id, 2*MiB, bytes + 2*MiB, MiB, size);
+
+    reopen(100*MiB);
+
+    int exists_ = 0, complete = 1;
+    size_t missing_count = 0;
+    assetstore_get_state(&store, id, &exists_, &complete, &missing_count, NULL);
+    TEST_ASSERT_TRUE(exists_);
+    TEST_ASSERT_FALSE(complete);
+    TEST_ASSERT_EQUAL_INT(2, missing_count);
+    size_t ranges[4];
+    TEST_ASSERT_EQUAL_INT(2, assetstore_get_missing_ranges(&store, id, ranges, 2));
+    TEST_ASSERT_EQUAL_INT(MiB, ranges[0]);
+    TEST_ASSERT_EQUAL_INT(MiB, ranges[1]);
+    TEST_ASSERT_EQUAL_INT(3*MiB, ranges[2]);
+    TEST_ASSERT_EQUAL_INT(MiB, ranges[3]);
+
+    // and the rest completes it
+    assetstore_write(&store, id, MiB, bytes + MiB, MiB, size);
+    assetstore_write(&store, id, 3*MiB, bytes + 3*MiB, MiB, size);
+    TEST_ASSERT_TRUE(assetstore_get_is_asset_complete(&store, id));
+    free(bytes);
+    free(id);
+}
+
+void test_data_without_saved_ranges_is_discarded(void) {
+    // as if the process died before it saved what it had received
+    size_t size = 2*MiB;
+    uint8_t *bytes = random_bytes(size, 3);
+    char *id = asset_generate_identifier(bytes, size);
+    FILE *f = fopen(file_for(id, ".part"), "wb");
+    fwrite(bytes, 1, MiB, f);
+    fclose(f);
+
+    reopen(100*MiB);
+
+    int exists_ = 1;
+    assetstore_get_state(&store, id, &exists_, NULL, NULL, NULL);
+    TEST_ASSERT_FALSE(exists_);
+    TEST_ASSERT_FALSE(exists(file_for(id, ".part")));
+    free(bytes);
+    free(id);
+}
+
+void test_bytes_that_dont_match_the_id_are_discarded(void) {
+    size_t size = MiB;
+    uint8_t *bytes = random_bytes(size, 4);
+    char *id = asset_generate_identifier(bytes, size);
+    bytes[1000] ^= 1;
+    TEST_ASSERT_TRUE(assetstore_write(&store, id, 0, bytes, size, size) < 0);
+    TEST_ASSERT_FALSE(assetstore_get_is_asset_complete(&store, id));
+    TEST_ASSERT_FALSE(exists(file_for(id, "")));
+    TEST_ASSERT_FALSE(exists(file_for(id, ".part")));
+    free(bytes);
+    free(id);
+}
+
+void test_other_ids_are_only_tracked(void) {
+    uint8_t bytes[] = "Hello World!";
+    TEST_ASSERT_FALSE(asset_diskstore_can_keep("hello"));
+    TEST_ASSERT_FALSE(asset_diskstore_can_keep("asset:sha256:../../etc/passwd"));
+    // like a store without a cache: it knows what has arrived, for whoever keeps the bytes
+    TEST_ASSERT_EQUAL_INT(6, assetstore_write(&store, "hello", 0, bytes, 6, sizeof(bytes)));
+    size_t ranges[2];
+    TEST_ASSERT_EQUAL_INT(1, assetstore_get_missing_ranges(&store, "hello", ranges, 1));
+    TEST_ASSERT_EQUAL_INT(6, ranges[0]);
+    TEST_ASSERT_EQUAL_INT(sizeof(bytes) - 6, ranges[1]);
+    uint8_t read[sizeof(bytes)];
+    size_t total_size = 0;
+    TEST_ASSERT_TRUE(assetstore_read(&store, "hello", 0, read, sizeof(read), &total_size) < 0);
+
+    reopen(100*MiB);
+
+    int exists_ = 1;
+    assetstore_get_state(&store, "hello", &exists_, NULL, NULL, NULL);
+    TEST_ASSERT_FALSE(exists_);
+}
+
+void test_least_recently_used_is_evicted_on_startup(void) {
+    char *ids[3];
+    for (int i = 0; i < 3; i++) {
+        uint8_t *bytes = random_bytes(MiB, 10 + i);
+        ids[i] = asset_generate_identifier(bytes, MiB);
+        assetstore_write(&store, ids[i], 0, bytes, MiB, MiB);
+        free(bytes);
+    }
+    asset_diskstore_deinit(&store);
+    // last used an hour, a minute and a day ago
+    time_t now = time(NULL);
+    time_t used[3] = { now - 3600, now - 60, now - 24*3600 };
+    for (int i = 0; i < 3; i++) {
+        struct utimbuf times = { used[i], used[i] };
+        utime(file_for(ids[i], ""), &times);
+    }
+    TEST_ASSERT_EQUAL_INT(0, asset_diskstore_init(&store, dir, 2*MiB + MiB/2));
+
+    TEST_ASSERT_TRUE(assetstore_get_is_asset_complete(&store, ids[0]));
+    TEST_ASSERT_TRUE(assetstore_get_is_asset_complete(&store, ids[1]));
+    TEST_ASSERT_FALSE(assetstore_get_is_asset_complete(&store, ids[2]));
+    TEST_ASSERT_FALSE(exists(file_for(ids[2], "")));
+    for (int i = 0; i < 3; i++) free(ids[i]);
+}
+
+static double now;
+static double fake_clock(void) {
+    return now;
+}
+
+void test_least_recently_used_is_evicted_when_full(void) {
+    reopen(2*MiB + MiB/2);
+    store.clock = fake_clock;
+    char *ids[3];
+    uint8_t *bytes[3];
+    for (int i = 0; i < 3; i++) {
+        bytes[i] = random_bytes(MiB, 20 + i);
+        ids[i] = asset_generate_identifier(bytes[i], MiB);
+    }
+    now = 0;
+    assetstore_write(&store, ids[0], 0, bytes[0], MiB, MiB);
+    now = 10;
+    assetstore_write(&store, ids[1], 0, bytes[1], MiB, MiB);
+    now = 20;
+    uint8_t buffer[16];
+    size_t total_size = 0;
+    TEST_ASSERT_EQUAL_INT(sizeof(buffer), assetstore_read(&store, ids[0], 0, buffer, sizeof(buffer), &total_size));
+    now = 30;
+    assetstore_write(&store, ids[2], 0, bytes[2], MiB, MiB);
+
+    TEST_ASSERT_TRUE(assetstore_get_is_asset_complete(&store, ids[0]));
+    TEST_ASSERT_FALSE(assetstore_get_is_asset_complete(&store, ids[1]));
+    TEST_ASSERT_FALSE(exists(file_for(ids[1], "")));
+    TEST_ASSERT_TRUE(assetstore_get_is_asset_complete(&store, ids[2]));
+    for (int i = 0; i < 3; i++) { free(ids[i]); free(bytes[i]); }
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_asset_survives_restart);
+    RUN_TEST(test_partial_download_resumes);
+    RUN_TEST(test_data_without_saved_ranges_is_discarded);
+    RUN_TEST(test_bytes_that_dont_match_the_id_are_discarded);
+    RUN_TEST(test_other_ids_are_only_tracked);
+    RUN_TEST(test_least_recently_used_is_evicted_on_startup);
+    RUN_TEST(test_least_recently_used_is_evicted_when_full);
+
+    return UNITY_END();
+}
@@ -0,0 +1,111 @@
+#include <unity.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <allonet/assetstore.h>
+
+// Tracks which bytes of assets have been received, without keeping the bytes.
+
+#define GiB (1024ULL*1024*1024)
+
+static assetstore store;
+static uint8_t chunk[4096];
+
+void setUp(void) {
+    assetstore_init(&store, NULL);
+}
+
+void tearDown(void) {
+    assetstore_deinit(&store);
+}
+
+static size_t missing(const char *asset_id, size_t ranges[], size_t count) {
+    memset(ranges, 0, sizeof(size_t) * count * 2);
+    return assetstore_get_missing_ranges(&store, asset_id, ranges, count);
+}
+
+void test_ranges_received_out_of_order_are_merged(void) {
+    size_t ranges[8];
+    assetstore_write(&store, "a", 3000, chunk, 1000, 5000);
+    assetstore_write(&store, "a", 1000, chunk, 1000, 5000);
+    
+    size_t count = 0;
+    assetstore_get_state(&store, "a", NULL, NULL, &count, NULL);
+    TEST_ASSERT_EQUAL_INT(3, count);
+    TEST_ASSERT_EQUAL_INT(3, missing("a", ranges, 4));
+    size_t expected[] = { 0, 1000, 2000, 1000, 4000, 1000 };
+    TEST_ASSERT_EQUAL_MEMORY(expected, ranges, sizeof(expected));
+    
+    // fills the gap between the two, and overlaps both
+    assetstore_write(&store, "a", 1500, chunk, 2000, 5000);
+    TEST_ASSERT_EQUAL_INT(2, missing("a", ranges, 4));
+    size_t expected_after[] = { 0, 1000, 4000, 1000 };
+    TEST_ASSERT_EQUAL_MEMORY(expected_after, ranges, sizeof(expected_after));
+    
+    assetstore_write(&store, "a", 0, chunk, 1000, 5000);
+    assetstore_write(&store, "a", 4000, chunk, 1000, 5000);
+    TEST_ASSERT_TRUE(assetstore_get_is_asset_complete(&store, "a"));
+    TEST_ASSERT_EQUAL_INT(0, missing("a", ranges, 4));
+}
+
+void test_one_write_can_cover_many_ranges(void) {
+    size_t ranges[4];
+    for (size_t offset = 0; offset < 100*100; offset += 100) {
+        assetstore_write(&store, "a", offset, chunk, 50, 100*100);
+    }
+    size_t count = 0;
+    assetstore_get_state(&store, "a", NULL, NULL, &count, NULL);
+    TEST_ASSERT_EQUAL_INT(100, count);
+    
+    assetstore_write(&store, "a", 25, chunk, 100*100 - 50, 100*100);
+    TEST_ASSERT_EQUAL_INT(1, missing("a", ranges, 2));
+    TEST_ASSERT_EQUAL_INT(100*100 - 25, ranges[0]);
+    TEST_ASSERT_EQUAL_INT(25, ranges[1]);
+}
+
+void test_offsets_past_4_gib(void) {
+    if (sizeof(size_t) < 8) {
+        TEST_IGNORE_MESSAGE("needs 64-bit size_t");
+    }
+    size_t total_size = 6*GiB;
+    size_t ranges[4];
+    assetstore_write(&store, "big", 5*GiB, chunk, sizeof(chunk), total_size);
+    TEST_ASSERT_EQUAL_INT(2, missing("big", ranges, 2));
+    TEST_ASSERT_EQUAL_UINT64(0, ranges[0]);
+    TEST_ASSERT_EQUAL_UINT64(5*GiB, ranges[1]);
+    TEST_ASSERT_EQUAL_UINT64(5*GiB + sizeof(chunk), ranges[2]);
+    TEST_ASSERT_EQUAL_UINT64(GiB - sizeof(chunk), ranges[3]);
+    
+    size_t size = 0;
+    assetstore_get_state(&store, "big", NULL, NULL, NULL, &size);
+    TEST_ASSERT_EQUAL_UINT64(total_size, size);
+}
+
+void test_many_assets(void) {
+    char asset_id[32];
+    for (int i = 0; i < 1000; i++) {
+        snprintf(asset_id, sizeof(asset_id), "asset %d", i);
+        assetstore_write(&store, asset_id, 0, chunk, i % 2 ? 10 : 20, 20);
+    }
+    for (int i = 0; i < 1000; i++) {
+        snprintf(asset_id, sizeof(asset_id), "asset %d", i);
+        int exists = 0;
+        assetstore_get_state(&store, asset_id, &exists, NULL, NULL, NULL);
+        TEST_ASSERT_TRUE(exists);
+        TEST_ASSERT_EQUAL_INT(i % 2 == 0, assetstore_get_is_asset_complete(&store, asset_id));
+    }
+    int exists = 1;
+    assetstore_get_state(&store, "asset 1000", &exists, NULL, NULL, NULL);
+    TEST_ASSERT_FALSE(exists);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_ranges_received_out_of_order_are_merged);
+    RUN_TEST(test_one_write_can_cover_many_ranges);
+    RUN_TEST(test_offsets_past_4_gib);
+    RUN_TEST(test_many_assets);
+
+    return UNITY_END();
+}
@@ -160,7 +160,7 @@ void test_receive_request_respond_with_some_data() {
     test_context context = {0};
     context.respondWithText = "Hello, this is the asset";
     
-    asset_handle((uint8_t*)packet, sizeof(packet), __asset_request_func, __asset_write_func, __asset_send_func, __asset_state_func, (void*)&context);
+    asset_handle((uint8_t*)packet, sizeof(packet), NULL, NULL, __asset_request_func, __asset_write_func, __asset_send_func, __asset_state_func, (void*)&context);
     
     TEST_ASSERT_EQUAL_STRING_MESSAGE("abc123", context.requestedAssetId, "Should call request callback with the asset id of the request");
     TEST_ASSERT_EQUAL(context.requestedLength, 20);
@@ -188,7 +188,7 @@ void test_receive_all_data() {
     
     test_context context = {0};
     
-    asset_handle((uint8_t*)packet, sizeof(packet), __asset_request_func, __asset_write_func, __asset_send_func, __asset_state_func, (void*)&context);
+    asset_handle((uint8_t*)packet, sizeof(packet), NULL, NULL, __asset_request_func, __asset_write_func, __asset_send_func, __asset_state_func, (void*)&context);
     
     TEST_ASSERT_FALSE(context.didCallRequestMethod);
     TEST_ASSERT_FALSE(context.didCallSendMethod);
@@ -211,7 +211,7 @@ void test_receive_partial_data() {
     
     test_context context = {0};
     
-    asset_handle((uint8_t*)packet, sizeof(packet), __asset_request_func, __asset_write_func, __asset_send_func, __asset_state_func, (void*)&context);
+    asset_handle((uint8_t*)packet, sizeof(packet), NULL, NULL, __asset_request_func, __asset_write_func, __asset_send_func, __asset_state_func, (void*)&context);
     
     TEST_ASSERT_TRUE(context.didCallWriteMethod);
     TEST_ASSERT_EQUAL(context.writtenDataLength, 10);
@@ -243,7 +243,7 @@ void test_request_error() {
     
     test_context context = {0};
     
-    asset_handle((uint8_t*)packet, sizeof(packet), __asset_request_func, __asset_write_func, __asset_send_func, __asset_state_func, (void*)&context);
+    asset_handle((uint8_t*)packet, sizeof(packet), NULL, NULL, __asset_request_func, __asset_write_func, __asset_send_func, __asset_state_func, (void*)&context);
     
     TEST_ASSERT_FALSE(context.didCallWriteMethod);
     TEST_ASSERT_FALSE(context.didCallRequestMethod);
@@ -0,0 +1,135 @@
+#include <unity.h>
+#include "../src/media/audio/culling.h"
+#include "../src/media/audio/jitter.h"
+
+// Puts a listener and speakers at known positions and levels, and checks which of them the
+// place would forward to the listener when culling audio.
+
+#define MAX_SOURCES 8
+
+static allo_audio_source sources[MAX_SOURCES];
+static size_t source_count;
+static allo_audible_source audible[MAX_SOURCES];
+static const allo_vector ears = {{ 1, 1.6, 1 }};
+
+void setUp(void)
+{
+    source_count = 0;
+}
+
+void tearDown(void)
+{
+}
+
+/// A speaker `x` meters in front of the listener, at `loudness` dBov
+static void speaker(double x, float loudness)
+{
+    allo_audio_source source = { {{ ears.x + x, ears.y, ears.z }}, loudness, true };
+    sources[source_count++] = source;
+}
+
+static size_t pick(double radius, int loudest)
+{
+    return allo_audio_select_audible(sources, source_count, ears, radius, loudest, audible);
+}
+
+void test_everyone_is_heard_without_culling(void)
+{
+    speaker(2, -20);
+    speaker(200, -60);
+    speaker(-5, -127);
+    TEST_ASSERT_EQUAL_INT(3, pick(0, 0));
+    for(size_t i = 0; i < 3; i++) TEST_ASSERT_EQUAL_INT(i, audible[i].index);
+    TEST_ASSERT_DOUBLE_WITHIN(1e-9, 200, audible[1].distance);
+    TEST_ASSERT_DOUBLE_WITHIN(1e-9, 5, audible[2].distance);
+}
+
+void test_audible_radius(void)
+{
+    speaker(5, -20);
+    speaker(10, -20);
+    speaker(10.01, -10);
+    speaker(-3, -20);
+    TEST_ASSERT_EQUAL_INT(3, pick(10, 0));
+    TEST_ASSERT_EQUAL_INT(0, audible[0].index);
+    TEST_ASSERT_EQUAL_INT(1, audible[1].index);
+    TEST_ASSERT_EQUAL_INT(3, audible[2].index);
+    TEST_ASSERT_DOUBLE_WITHIN(1e-9, 3, audible[2].distance);
+}
+
+void test_only_subscribed_tracks_of_others(void)
+{
+    speaker(1, -10);
+    speaker(2, -20);
+    sources[0].hearable = false;
+    TEST_ASSERT_EQUAL_INT(1, pick(0, 0));
+    TEST_ASSERT_EQUAL_INT(1, audible[0].index);
+}
+
+void test_loudest_speakers(void)
+{
+    speaker(1, -40);
+    speaker(2, -10);
+    speaker(3, -50);
+    speaker(4, -20);
+    speaker(5, -20);
+    TEST_ASSERT_EQUAL_INT(3, pick(0, 3));
+    // loudest first, and the first of equals
+    TEST_ASSERT_EQUAL_INT(1, audible[0].index);
+    TEST_ASSERT_EQUAL_INT(3, audible[1].index);
+    TEST_ASSERT_EQUAL_INT(4, audible[2].index);
+
+    // fewer speakers than that are all heard, as they are
+    source_count = 2;
+    TEST_ASSERT_EQUAL_INT(2, pick(0, 3));
+    TEST_ASSERT_EQUAL_INT(0, audible[0].index);
+}
+
+void test_loudest_within_the_radius(void)
+{
+    // the loudest of all is too far away to count
+    speaker(20, 0);
+    speaker(1, -40);
+    speaker(2, -30);
+    speaker(3, -50);
+    TEST_ASSERT_EQUAL_INT(2, pick(10, 2));
+    TEST_ASSERT_EQUAL_INT(2, audible[0].index);
+    TEST_ASSERT_EQUAL_INT(1, audible[1].index);
+}
+
+void test_level_byte(void)
+{
+    TEST_ASSERT_EQUAL_FLOAT(-20, allo_audio_level_db(ALLO_AUDIO_LEVEL_VOICE | 20));
+    TEST_ASSERT_EQUAL_FLOAT(0, allo_audio_level_db(ALLO_AUDIO_LEVEL_VOICE | 0));
+    // without voice in it, however loud, it's silence as far as ranking goes
+    TEST_ASSERT_EQUAL_FLOAT(-ALLO_AUDIO_LEVEL_SILENT, allo_audio_level_db(20));
+}
+
+void test_loudness_decays_after_speaking(void)
+{
+    TEST_ASSERT_EQUAL_FLOAT(-20, allo_audio_loudness_at(-20, 10, 10, 20));
+    TEST_ASSERT_EQUAL_FLOAT(-30, allo_audio_loudness_at(-20, 10, 10.5, 20));
+    TEST_ASSERT_EQUAL_FLOAT(-40, allo_audio_loudness_at(-20, 10, 11, 20));
+
+    // someone who was loudest a second ago drops below someone talking now
+    double now = 11;
+    speaker(1, allo_audio_loudness_at(-10, 10, now, 20));
+    speaker(2, allo_audio_loudness_at(-25, now, now, 20));
+    TEST_ASSERT_EQUAL_INT(1, pick(0, 1));
+    TEST_ASSERT_EQUAL_INT(1, audible[0].index);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_everyone_is_heard_without_culling);
+    RUN_TEST(test_audible_radius);
+    RUN_TEST(test_only_subscribed_tracks_of_others);
+    RUN_TEST(test_loudest_speakers);
+    RUN_TEST(test_loudest_within_the_radius);
+    RUN_TEST(test_level_byte);
+    RUN_TEST(test_loudness_decays_after_speaking);
+
+    return UNITY_END();
+}
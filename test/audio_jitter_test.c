@@ -0,0 +1,195 @@
+#include <unity.h>
+#include <opus.h>
+#include "../src/media/audio/jitter.h"
+#include "../src/media/audio/pcm_pool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+// Sends Opus audio through a simulated lossy, jittery network into the jitter buffer,
+// like an unreliable CHANNEL_AUDIO between two clients.
+
+#define FRAME_SAMPLES 960 // 20ms
+#define FRAME_COUNT 1500
+
+static OpusEncoder *encoder;
+static OpusDecoder *decoder;
+static allo_jitter_buffer jitter;
+
+typedef struct sent_packet {
+    double arrival;
+    size_t length;
+    uint8_t data[ALLO_AUDIO_SEQ_HEADER_SIZE + ALLO_AUDIO_MAX_PACKET_SIZE];
+} sent_packet;
+
+static sent_packet packets[FRAME_COUNT];
+
+void setUp(void)
+{
+    int err;
+    encoder = opus_encoder_create(48000, 1, OPUS_APPLICATION_VOIP, &err);
+    opus_encoder_ctl(encoder, OPUS_SET_INBAND_FEC(1));
+    opus_encoder_ctl(encoder, OPUS_SET_PACKET_LOSS_PERC(10));
+    decoder = opus_decoder_create(48000, 1, &err);
+    allo_jitter_init(&jitter);
+    srand(1);
+}
+
+void tearDown(void)
+{
+    opus_encoder_destroy(encoder);
+    opus_decoder_destroy(decoder);
+}
+
+static void encode(sent_packet *packet, uint16_t seq)
+{
+    int16_t pcm[FRAME_SAMPLES];
+    uint32_t timestamp = seq * FRAME_SAMPLES;
+    for(int i = 0; i < FRAME_SAMPLES; i++)
+    {
+        pcm[i] = (int16_t)(8000 * sin((timestamp + i) * 2 * M_PI * 440 / 48000.0));
+    }
+    allo_audio_write_seq_header(packet->data, seq, timestamp, allo_audio_level(pcm, FRAME_SAMPLES));
+    int len = opus_encode(encoder, pcm, FRAME_SAMPLES, packet->data + ALLO_AUDIO_SEQ_HEADER_SIZE, ALLO_AUDIO_MAX_PACKET_SIZE);
+    TEST_ASSERT_GREATER_THAN(0, len);
+    packet->length = ALLO_AUDIO_SEQ_HEADER_SIZE + len;
+}
+
+static int push(sent_packet *packet, allo_jitter_frame *frames)
+{
+    return allo_jitter_push(&jitter, decoder, packet->data, packet->length, frames);
+}
+
+static void free_frames(allo_jitter_frame *frames, int count)
+{
+    for(int i = 0; i < count; i++) allo_pcm_buffer_return(frames[i].pcm);
+}
+
+static int compare_arrival(const void *a, const void *b)
+{
+    double d = ((const sent_packet*)a)->arrival - ((const sent_packet*)b)->arrival;
+    return d < 0 ? -1 : d > 0 ? 1 : 0;
+}
+
+void test_in_order_passes_straight_through(void)
+{
+    allo_jitter_frame frames[ALLO_JITTER_MAX_OUTPUT];
+    for(int i = 0; i < 10; i++)
+    {
+        encode(&packets[i], i);
+        int count = push(&packets[i], frames);
+        TEST_ASSERT_EQUAL_INT(1, count);
+        TEST_ASSERT_EQUAL_INT(FRAME_SAMPLES, frames[0].sample_count);
+        TEST_ASSERT_EQUAL_UINT32(i * FRAME_SAMPLES, frames[0].timestamp);
+        free_frames(frames, count);
+    }
+    TEST_ASSERT_EQUAL_UINT64(10, jitter.stats.decoded);
+    TEST_ASSERT_EQUAL_UINT64(0, jitter.stats.recovered + jitter.stats.concealed);
+}
+
+void test_reordering_makes_it_wait_longer(void)
+{
+    allo_jitter_frame frames[ALLO_JITTER_MAX_OUTPUT];
+    for(int i = 0; i < 8; i++) encode(&packets[i], i);
+
+    free_frames(frames, push(&packets[0], frames));
+    // 1 is late; 2 gives up on it and rebuilds it from 2's FEC
+    int count = push(&packets[2], frames);
+    TEST_ASSERT_EQUAL_INT(2, count);
+    TEST_ASSERT_EQUAL_UINT32(1 * FRAME_SAMPLES, frames[0].timestamp);
+    TEST_ASSERT_EQUAL_UINT32(2 * FRAME_SAMPLES, frames[1].timestamp);
+    free_frames(frames, count);
+    TEST_ASSERT_EQUAL_UINT64(1, jitter.stats.recovered);
+
+    TEST_ASSERT_EQUAL_INT(0, push(&packets[1], frames));
+    TEST_ASSERT_EQUAL_UINT64(1, jitter.stats.late);
+    TEST_ASSERT_EQUAL_INT(2, jitter.depth);
+
+    free_frames(frames, push(&packets[3], frames));
+    // next time the same reordering is waited out instead
+    TEST_ASSERT_EQUAL_INT(0, push(&packets[5], frames));
+    count = push(&packets[4], frames);
+    TEST_ASSERT_EQUAL_INT(2, count);
+    TEST_ASSERT_EQUAL_UINT32(4 * FRAME_SAMPLES, frames[0].timestamp);
+    TEST_ASSERT_EQUAL_UINT32(5 * FRAME_SAMPLES, frames[1].timestamp);
+    free_frames(frames, count);
+    TEST_ASSERT_EQUAL_UINT64(1, jitter.stats.recovered + jitter.stats.concealed);
+}
+
+void test_returned_buffers_are_reused(void)
+{
+    allo_jitter_frame frames[ALLO_JITTER_MAX_OUTPUT];
+    encode(&packets[0], 0);
+    encode(&packets[1], 1);
+    TEST_ASSERT_EQUAL_INT(1, push(&packets[0], frames));
+    int16_t *first = frames[0].pcm;
+    free_frames(frames, 1);
+    TEST_ASSERT_EQUAL_INT(1, push(&packets[1], frames));
+    TEST_ASSERT_EQUAL_PTR(first, frames[0].pcm);
+    free_frames(frames, 1);
+}
+
+void test_lossy_jittery_loopback(void)
+{
+    const double loss = 0.1, base_delay = 0.030, max_jitter = 0.040;
+    size_t sent = 0;
+    for(int i = 0; i < FRAME_COUNT; i++)
+    {
+        if(rand() < loss * RAND_MAX) continue;
+        sent_packet *packet = &packets[sent++];
+        encode(packet, i);
+        // can't send a frame until all of it has been recorded
+        double send_time = (i + 1) * FRAME_SAMPLES / 48000.0;
+        packet->arrival = send_time + base_delay + max_jitter * rand() / RAND_MAX;
+    }
+    qsort(packets, sent, sizeof(sent_packet), compare_arrival);
+
+    allo_jitter_frame frames[ALLO_JITTER_MAX_OUTPUT];
+    uint32_t expected_timestamp = 0;
+    double total_latency = 0, worst_latency = 0;
+    int played = 0;
+    for(size_t p = 0; p < sent; p++)
+    {
+        int count = push(&packets[p], frames);
+        for(int f = 0; f < count; f++)
+        {
+            // no holes or overlaps in what comes out
+            TEST_ASSERT_EQUAL_UINT32(expected_timestamp, frames[f].timestamp);
+            expected_timestamp += frames[f].sample_count;
+            // from when the first sample was spoken to when the frame can be played
+            double latency = packets[p].arrival - frames[f].timestamp / 48000.0;
+            total_latency += latency;
+            if(latency > worst_latency) worst_latency = latency;
+            played++;
+        }
+        free_frames(frames, count);
+    }
+
+    double concealment = allo_jitter_loss_percent(&jitter.stats);
+    printf("mouth-to-ear latency before playout: %.1fms average, %.1fms worst\n", 1000 * total_latency / played, 1000 * worst_latency);
+    printf("concealment rate: %.1f%% (%llu fec, %llu plc, %llu late) with %.0f%% loss, waiting for %d\n",
+        concealment,
+        (unsigned long long)jitter.stats.recovered, (unsigned long long)jitter.stats.concealed, (unsigned long long)jitter.stats.late,
+        loss * 100, jitter.depth
+    );
+
+    TEST_ASSERT_GREATER_THAN(FRAME_COUNT - 5, played);
+    TEST_ASSERT_TRUE(jitter.stats.recovered > 0);
+    // packets that turned up after we'd given up on them count as lost, but the buffer
+    // should have learnt to wait for most of them
+    TEST_ASSERT_TRUE(concealment < 2 * loss * 100);
+    TEST_ASSERT_TRUE(worst_latency < 0.020 + base_delay + max_jitter + ALLO_JITTER_SLOT_COUNT * 0.020);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_in_order_passes_straight_through);
+    RUN_TEST(test_reordering_makes_it_wait_longer);
+    RUN_TEST(test_returned_buffers_are_reused);
+    RUN_TEST(test_lossy_jittery_loopback);
+
+    return UNITY_END();
+}
@@ -0,0 +1,170 @@
+#include <unity.h>
+#include <opus.h>
+#include "../src/media/audio/mixer.h"
+#include "../src/media/audio/jitter.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// Feeds Opus audio into a place-side mixer that only mixes when told to, one 20ms frame at a
+// time, and checks what each listener gets.
+
+#define MAX_TICKS 64
+
+static allo_audio_mixer *mixer;
+static OpusEncoder *encoder;
+static uint32_t encoded_samples;
+static int alice, bob; // listeners
+
+typedef struct received_mix {
+    void *listener;
+    uint8_t level;
+} received_mix;
+
+static received_mix received[2 * MAX_TICKS];
+static int received_count;
+
+void setUp(void)
+{
+    int err;
+    mixer = allo_audio_mixer_create_unclocked(0);
+    encoder = opus_encoder_create(48000, 1, OPUS_APPLICATION_VOIP, &err);
+    encoded_samples = 0;
+    received_count = 0;
+}
+
+void tearDown(void)
+{
+    allo_audio_mixer_destroy(mixer);
+    opus_encoder_destroy(encoder);
+}
+
+/// A frame of a 440Hz tone from `track_id`, as handle_media would pass it on
+static void speak(uint32_t track_id, int samples)
+{
+    int16_t pcm[ALLO_AUDIO_MAX_FRAME_SAMPLES];
+    for(int i = 0; i < samples; i++)
+    {
+        pcm[i] = (int16_t)(8000 * sin((encoded_samples + i) * 2 * M_PI * 440 / 48000.0));
+    }
+    encoded_samples += samples;
+    uint8_t packet[ALLO_AUDIO_MAX_PACKET_SIZE];
+    int len = opus_encode(encoder, pcm, samples, packet, sizeof(packet));
+    TEST_ASSERT_GREATER_THAN(0, len);
+    allo_audio_mixer_push(mixer, track_id, false, packet, len);
+}
+
+static void keep(void *ctx, void *listener, ENetPacket *packet)
+{
+    TEST_ASSERT_TRUE(packet->dataLength > sizeof(uint32_t) + ALLO_AUDIO_SEQ_HEADER_SIZE);
+    received_mix mix = { listener, packet->data[sizeof(uint32_t) + ALLO_AUDIO_SEQ_HEADER_SIZE - 1] };
+    received[received_count++] = mix;
+    enet_packet_destroy(packet);
+}
+
+static int received_by(void *listener)
+{
+    int count = 0;
+    for(int i = 0; i < received_count; i++)
+    {
+        if(received[i].listener == listener) count++;
+    }
+    return count;
+}
+
+void test_sources_are_summed_at_their_gains(void)
+{
+    int16_t a[4] = { 1000, -1000, 30000, 0 };
+    int16_t b[4] = { -300, 200, 20000, -32768 };
+    float mix[4] = { 0 };
+    allo_audio_mix_add(mix, a, 4, 0.5f);
+    allo_audio_mix_add(mix, b, 4, 2.0f);
+
+    int16_t pcm[4];
+    allo_audio_mix_to_pcm(mix, pcm, 4);
+    TEST_ASSERT_EQUAL_INT(500 - 600, pcm[0]);
+    TEST_ASSERT_EQUAL_INT(-500 + 400, pcm[1]);
+    // too loud either way is clipped rather than wrapped around
+    TEST_ASSERT_EQUAL_INT(INT16_MAX, pcm[2]);
+    TEST_ASSERT_EQUAL_INT(INT16_MIN, pcm[3]);
+
+    // and silence at a gain of 0
+    memset(mix, 0, sizeof(mix));
+    allo_audio_mix_add(mix, a, 4, 0.0f);
+    allo_audio_mix_to_pcm(mix, pcm, 4);
+    for(int i = 0; i < 4; i++) TEST_ASSERT_EQUAL_INT(0, pcm[i]);
+}
+
+void test_removed_listener_gets_no_pending_mixes(void)
+{
+    allo_audio_mix_gain gains[] = { { &alice, 1, 1.0f }, { &bob, 1, 0.5f } };
+    allo_audio_mixer_set_gains(mixer, gains, 2);
+    // mixed, but not sent yet
+    for(int i = 0; i < 4; i++)
+    {
+        speak(1, ALLO_MIX_FRAME_SAMPLES);
+        allo_audio_mixer_tick(mixer);
+    }
+    allo_audio_mixer_remove_listener(mixer, &alice);
+    allo_audio_mixer_send_pending(mixer, keep, NULL);
+    TEST_ASSERT_EQUAL_INT(0, received_by(&alice));
+    TEST_ASSERT_TRUE(received_by(&bob) > 0);
+
+    // nor later ones
+    received_count = 0;
+    speak(1, ALLO_MIX_FRAME_SAMPLES);
+    allo_audio_mixer_tick(mixer);
+    allo_audio_mixer_send_pending(mixer, keep, NULL);
+    TEST_ASSERT_EQUAL_INT(0, received_by(&alice));
+    TEST_ASSERT_EQUAL_INT(1, received_by(&bob));
+}
+
+void test_long_frames_are_prebuffered(void)
+{
+    // 60ms frames, so one for every three mixes, but one of them a mix late
+    const int frame = 3 * ALLO_MIX_FRAME_SAMPLES, frames = 10, late = 3;
+    allo_audio_mix_gain gains[] = { { &alice, 1, 1.0f } };
+    allo_audio_mixer_set_gains(mixer, gains, 1);
+    int first = -1;
+    for(int tick = 0; tick < 3 * frames; tick++)
+    {
+        if(tick % 3 == 0 && tick / 3 < frames && tick / 3 != late) speak(1, frame);
+        if(tick == 3 * late + 1) speak(1, frame);
+        allo_audio_mixer_tick(mixer);
+
+        int before = received_count;
+        allo_audio_mixer_send_pending(mixer, keep, NULL);
+        if(first < 0 && received_count > before) first = tick;
+        if(first >= 0)
+        {
+            // once it has started, it carries on without running dry
+            TEST_ASSERT_EQUAL_INT(before + 1, received_count);
+            TEST_ASSERT_NOT_EQUAL(ALLO_AUDIO_LEVEL_SILENT, received[before].level & ~ALLO_AUDIO_LEVEL_VOICE);
+        }
+    }
+    TEST_ASSERT_TRUE(first >= 0);
+}
+
+void test_distance_gain(void)
+{
+    TEST_ASSERT_EQUAL_FLOAT(1.0f, allo_audio_mix_distance_gain(0));
+    TEST_ASSERT_EQUAL_FLOAT(1.0f, allo_audio_mix_distance_gain(1.0));
+    TEST_ASSERT_EQUAL_FLOAT(0.5f, allo_audio_mix_distance_gain(2.0));
+    TEST_ASSERT_EQUAL_FLOAT(1.0f / ALLO_MIX_MAX_DISTANCE, allo_audio_mix_distance_gain(ALLO_MIX_MAX_DISTANCE));
+    TEST_ASSERT_EQUAL_FLOAT(0.0f, allo_audio_mix_distance_gain(ALLO_MIX_MAX_DISTANCE + 0.01));
+    TEST_ASSERT_EQUAL_FLOAT(0.0f, allo_audio_mix_distance_gain(INFINITY));
+    // never louder than the source, however close
+    TEST_ASSERT_EQUAL_FLOAT(1.0f, allo_audio_mix_distance_gain(0.01));
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_sources_are_summed_at_their_gains);
+    RUN_TEST(test_removed_listener_gets_no_pending_mixes);
+    RUN_TEST(test_long_frames_are_prebuffered);
+    RUN_TEST(test_distance_gain);
+
+    return UNITY_END();
+}
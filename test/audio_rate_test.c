@@ -0,0 +1,90 @@
+#include <unity.h>
+#include "../src/media/audio/ratecontrol.h"
+#include <stdlib.h>
+
+static allo_audio_rate_controller *ctl;
+static const allo_audio_link_stats clean = { 0.0, 0.030, 1.0 };
+
+void setUp(void)
+{
+    ctl = allo_audio_rate_controller_create();
+}
+
+void tearDown(void)
+{
+    allo_audio_rate_controller_destroy(ctl);
+}
+
+static allo_audio_encoder_settings update(const allo_audio_link_stats *stats, int times)
+{
+    for(int i = 0; i < times; i++) allo_audio_rate_update(ctl, stats);
+    allo_audio_encoder_settings settings;
+    allo_audio_rate_settings(ctl, &settings);
+    return settings;
+}
+
+void test_first_settings_need_applying(void)
+{
+    allo_audio_encoder_settings settings;
+    TEST_ASSERT_TRUE(allo_audio_rate_settings(ctl, &settings));
+    TEST_ASSERT_EQUAL_INT(960, settings.frame_samples);
+    TEST_ASSERT_FALSE(allo_audio_rate_settings(ctl, &settings));
+}
+
+void test_congestion_backs_off_and_clean_link_recovers(void)
+{
+    allo_audio_encoder_settings start = update(&clean, 1);
+
+    allo_audio_link_stats throttled = clean;
+    throttled.throttle = 0.5;
+    allo_audio_encoder_settings congested = update(&throttled, 10);
+    TEST_ASSERT_TRUE(congested.bitrate < start.bitrate / 2);
+    // fewer, longer packets when there's little bandwidth
+    TEST_ASSERT_EQUAL_INT(2880, congested.frame_samples);
+
+    allo_audio_link_stats queueing = clean;
+    queueing.rtt = 0.300;
+    TEST_ASSERT_TRUE(update(&queueing, 1).bitrate <= congested.bitrate);
+
+    allo_audio_encoder_settings recovered = update(&clean, 30);
+    TEST_ASSERT_TRUE(recovered.bitrate >= start.bitrate);
+    TEST_ASSERT_EQUAL_INT(960, recovered.frame_samples);
+}
+
+void test_loss_adds_fec(void)
+{
+    int before = update(&clean, 10).loss_percent;
+    allo_audio_link_stats lossy = clean;
+    lossy.loss = 0.15;
+    int after = update(&lossy, 10).loss_percent;
+    TEST_ASSERT_TRUE(after > before);
+    TEST_ASSERT_TRUE(after >= 15);
+}
+
+void test_slow_encoding_lowers_complexity(void)
+{
+    allo_audio_encoder_settings settings;
+    allo_audio_rate_settings(ctl, &settings);
+    int start = settings.complexity;
+    // 5ms to encode 20ms is way too much
+    for(int i = 0; i < 1000; i++) allo_audio_rate_encoded(ctl, 0.005, 960);
+    TEST_ASSERT_TRUE(allo_audio_rate_settings(ctl, &settings));
+    TEST_ASSERT_TRUE(settings.complexity < start);
+
+    int slow = settings.complexity;
+    for(int i = 0; i < 1000; i++) allo_audio_rate_encoded(ctl, 0.0001, 960);
+    allo_audio_rate_settings(ctl, &settings);
+    TEST_ASSERT_TRUE(settings.complexity > slow);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_first_settings_need_applying);
+    RUN_TEST(test_congestion_backs_off_and_clean_link_recovers);
+    RUN_TEST(test_loss_adds_fec);
+    RUN_TEST(test_slow_encoding_lowers_complexity);
+
+    return UNITY_END();
+}
@@ -0,0 +1,152 @@
+#include <unity.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+    #include <direct.h>
+    #define rmdir _rmdir
+#else
+    #include <unistd.h>
+#endif
+#include <allonet/client.h>
+#include <allonet/assetstore.h>
+#include "../src/client/_client.h"
+#include "../src/asset.h"
+
+// Downloads assets into a client's disk cache, as the place would send them, and checks that the
+// app gets every byte of them through asset_receive_callback, including those that were on disk already.
+
+#define MiB (1024*1024)
+#define ASSET_SIZE (2*MiB + 17)
+
+static char dir[256];
+static alloclient *client;
+static uint8_t *asset;
+static char *asset_id;
+static uint8_t *received;
+static size_t received_bytes;
+static int available;
+
+static void receive(alloclient *client, const char *asset_id, const uint8_t *buffer, size_t offset, size_t length, size_t total_size) {
+    TEST_ASSERT_EQUAL_INT(ASSET_SIZE, total_size);
+    TEST_ASSERT_TRUE(offset + length <= ASSET_SIZE);
+    memcpy(received + offset, buffer, length);
+    received_bytes += length;
+}
+
+static void state_changed(alloclient *client, const char *asset_id, client_asset_state state) {
+    if (state == client_asset_state_now_available) available++;
+}
+
+static ENetPacket *packet;
+static void keep_packet(asset_mid mid, const cJSON *header, const uint8_t *data, size_t data_length, void *user) {
+    packet = asset_build_enet_packet(mid, header, data, data_length);
+}
+
+/// As if the place had sent these bytes
+static void arrive(size_t offset, size_t length) {
+    asset_deliver_bytes(asset_id, asset + offset, offset, length, ASSET_SIZE, keep_packet, NULL);
+    _alloclient_handle_assets(client, packet->data, packet->dataLength);
+    enet_packet_destroy(packet);
+}
+
+static void arrive_from(size_t offset) {
+    for (; offset < ASSET_SIZE; offset += ASSET_CHUNK_SIZE) {
+        arrive(offset, ASSET_SIZE - offset < ASSET_CHUNK_SIZE ? ASSET_SIZE - offset : ASSET_CHUNK_SIZE);
+    }
+}
+
+/// What alloclient_poll does besides talking to the place
+static void poll_until_available(void) {
+    for (int i = 0; i < 1000 && !available; i++) {
+        scheduler_tick(&_internal(client)->jobs);
+    }
+    TEST_ASSERT_EQUAL_INT(1, available);
+}
+
+void setUp(void) {
+    const char *tmp = getenv("TMPDIR") ? getenv("TMPDIR") : getenv("TEMP") ? getenv("TEMP") : "/tmp";
+    static int count = 0;
+    snprintf(dir, sizeof(dir), "%s/allonet_client_assets_%ld_%d_%d", tmp, (long)time(NULL), rand(), count++);
+
+    asset = malloc(ASSET_SIZE);
+    srand(3);
+    for (size_t i = 0; i < ASSET_SIZE; i++) asset[i] = rand();
+    asset_id = asset_generate_identifier(asset, ASSET_SIZE);
+    received = calloc(1, ASSET_SIZE);
+    received_bytes = 0;
+    available = 0;
+}
+
+static void start_client(void) {
+    client = alloclient_create(false);
+    client->asset_receive_callback = receive;
+    client->asset_state_callback = state_changed;
+    alloclient_set_asset_cache(client, dir, 100*MiB);
+}
+
+void tearDown(void) {
+    alloclient_disconnect(client, 0);
+    // a store with no room deletes everything it finds
+    assetstore store;
+    asset_diskstore_init(&store, dir, 0);
+    asset_diskstore_deinit(&store);
+    TEST_ASSERT_EQUAL_INT(0, rmdir(dir));
+    free(asset);
+    free(asset_id);
+    free(received);
+}
+
+void test_downloaded_asset_reaches_the_app(void) {
+    start_client();
+    alloclient_asset_request(client, asset_id, NULL);
+    arrive_from(0);
+    poll_until_available();
+    TEST_ASSERT_EQUAL_MEMORY(asset, received, ASSET_SIZE);
+}
+
+void test_resumed_download_reaches_the_app_whole(void) {
+    // half of it was downloaded last time
+    assetstore store;
+    TEST_ASSERT_EQUAL_INT(0, asset_diskstore_init(&store, dir, 100*MiB));
+    TEST_ASSERT_EQUAL_INT(MiB, assetstore_write(&store, asset_id, 0, asset, MiB, ASSET_SIZE));
+    asset_diskstore_deinit(&store);
+
+    start_client();
+    alloclient_asset_request(client, asset_id, NULL);
+    // only what's missing is asked for, and arrives
+    arrive_from(MiB);
+    poll_until_available();
+    TEST_ASSERT_EQUAL_MEMORY(asset, received, ASSET_SIZE);
+    TEST_ASSERT_EQUAL_INT(ASSET_SIZE, received_bytes);
+}
+
+void test_cached_asset_reaches_the_app(void) {
+    start_client();
+    alloclient_asset_request(client, asset_id, NULL);
+    arrive_from(0);
+    poll_until_available();
+    alloclient_disconnect(client, 0);
+
+    memset(received, 0, ASSET_SIZE);
+    received_bytes = 0;
+    available = 0;
+    start_client();
+    alloclient_asset_request(client, asset_id, NULL);
+    poll_until_available();
+    TEST_ASSERT_EQUAL_MEMORY(asset, received, ASSET_SIZE);
+    TEST_ASSERT_EQUAL_INT(ASSET_SIZE, received_bytes);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_downloaded_asset_reaches_the_app);
+    RUN_TEST(test_resumed_download_reaches_the_app_whole);
+    RUN_TEST(test_cached_asset_reaches_the_app);
+
+    return UNITY_END();
+}
@@ -0,0 +1,133 @@
+#include <unity.h>
+#include <stdlib.h>
+#include <string.h>
+#include <allonet/client.h>
+#include "../src/client/_client.h"
+
+// Feeds a client's transform history with states as the place would send them, on a clock
+// the test controls, and checks what alloclient_get_interpolated_transform makes of them.
+
+#define TICK 0.2 // a place that updates at 5 Hz
+
+static alloclient *client;
+static allo_entity *entity;
+static double now;
+
+static double fake_clock(alloclient *client) {
+    return now;
+}
+
+void setUp(void) {
+    now = 100;
+    client = alloclient_create(false);
+    client->alloclient_get_time = fake_clock;
+    client->clock_latency = 0;
+    alloclient_set_interpolation_enabled(client, true);
+
+    entity = entity_create("mover");
+    entity->components = cJSON_CreateObject();
+    LIST_INSERT_HEAD(&client->_state.entities, entity, pointers);
+}
+
+void tearDown(void) {
+    alloclient_disconnect(client, 0);
+}
+
+/// A state from the place at `at`, moving the entity to `x` if it's given, or with nothing changed
+static void state_at(double at, const double *x) {
+    now = at;
+    allo_state_diff diff;
+    allo_state_diff_init(&diff);
+    if (x) {
+        entity_set_transform(entity, allo_m4x4_translate((allo_vector){{*x, 0, 0}}));
+        allo_state_diff_mark_component_updated(&diff, entity->id, "transform", cJSON_GetObjectItemCaseSensitive(entity->components, "transform"));
+    }
+    _alloclient_interpolation_record(client, &diff);
+    allo_state_diff_free(&diff);
+}
+
+static void move_at(double at, double x) {
+    state_at(at, &x);
+}
+
+static double x_at(double render_time) {
+    return allo_m4x4_get_position(alloclient_get_interpolated_transform(client, entity, render_time)).x;
+}
+
+void test_interpolates_between_states(void) {
+    move_at(100, 0);
+    move_at(100 + TICK, 1);
+    move_at(100 + 2*TICK, 3);
+
+    TEST_ASSERT_DOUBLE_WITHIN(1e-6, 0, x_at(100));
+    TEST_ASSERT_DOUBLE_WITHIN(1e-6, 0.5, x_at(100 + TICK/2));
+    TEST_ASSERT_DOUBLE_WITHIN(1e-6, 1, x_at(100 + TICK));
+    TEST_ASSERT_DOUBLE_WITHIN(1e-6, 2.5, x_at(100 + 1.75*TICK));
+    // before the oldest state, it stays there
+    TEST_ASSERT_DOUBLE_WITHIN(1e-6, 0, x_at(50));
+}
+
+void test_extrapolation_is_bounded(void) {
+    move_at(100, 0);
+    move_at(100 + TICK, 1);
+
+    // 5 m/s for a little while past the newest state...
+    TEST_ASSERT_DOUBLE_WITHIN(1e-6, 1.5, x_at(100 + TICK + 0.1));
+    // ...but no further than ALLO_INTERPOLATION_MAX_EXTRAPOLATION
+    double limit = 1 + ALLO_INTERPOLATION_MAX_EXTRAPOLATION / TICK;
+    TEST_ASSERT_DOUBLE_WITHIN(1e-6, limit, x_at(100 + TICK + ALLO_INTERPOLATION_MAX_EXTRAPOLATION));
+    TEST_ASSERT_DOUBLE_WITHIN(1e-6, limit, x_at(100 + TICK + 10));
+}
+
+void test_stopping_is_not_extrapolated(void) {
+    move_at(100, 0);
+    move_at(100 + TICK, 1);
+    // stopped: the place sends states without this entity in them
+    state_at(100 + 2*TICK, NULL);
+
+    TEST_ASSERT_DOUBLE_WITHIN(1e-6, 1, x_at(100 + 2*TICK));
+    TEST_ASSERT_DOUBLE_WITHIN(1e-6, 1, x_at(100 + 2*TICK + 0.1));
+}
+
+void test_moving_after_standing_still(void) {
+    move_at(100, 0);
+    for (int i = 1; i <= 20; i++) {
+        state_at(100 + i*TICK, NULL);
+    }
+    // four seconds later it moves; it was still at 0 one state ago
+    double moved = 100 + 21*TICK;
+    move_at(moved, 1);
+
+    TEST_ASSERT_DOUBLE_WITHIN(1e-6, 0, x_at(moved - TICK));
+    TEST_ASSERT_DOUBLE_WITHIN(1e-6, 0.5, x_at(moved - TICK/2));
+    TEST_ASSERT_DOUBLE_WITHIN(1e-6, 1, x_at(moved));
+    // and it keeps going at the speed it set off with, not the average since it last moved
+    TEST_ASSERT_DOUBLE_WITHIN(1e-6, 1.5, x_at(moved + TICK/2));
+}
+
+void test_deleted_entities_are_forgotten(void) {
+    move_at(100, 0);
+    move_at(100 + TICK, 1);
+    TEST_ASSERT_EQUAL_INT(1, _internal(client)->transform_histories.length);
+
+    LIST_REMOVE(entity, pointers);
+    allo_state_diff diff;
+    allo_state_diff_init(&diff);
+    arr_push(&diff.deleted_entities, entity->id);
+    _alloclient_interpolation_record(client, &diff);
+    allo_state_diff_free(&diff);
+    entity_destroy(entity);
+    TEST_ASSERT_EQUAL_INT(0, _internal(client)->transform_histories.length);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_interpolates_between_states);
+    RUN_TEST(test_extrapolation_is_bounded);
+    RUN_TEST(test_stopping_is_not_extrapolated);
+    RUN_TEST(test_moving_after_standing_still);
+    RUN_TEST(test_deleted_entities_are_forgotten);
+
+    return UNITY_END();
+}
@@ -0,0 +1,120 @@
+#include <unity.h>
+#include <allonet/state.h>
+#include "../src/util.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// Measures how many intents per second the place can take in, like received_from_client does.
+
+#define ITERATIONS 20000
+
+static allo_client_intent *sample;
+static char *json;
+
+static allo_client_intent *create_hand_tracked_intent(void)
+{
+  allo_client_intent *intent = allo_client_intent_create();
+  intent->xmovement = 0.3;
+  intent->zmovement = -0.7;
+  intent->poses.head.matrix = allo_m4x4_translate((allo_vector){{0.1, 1.7, 0.2}});
+  intent->poses.left_hand.matrix = allo_m4x4_translate((allo_vector){{-0.3, 1.2, -0.4}});
+  intent->poses.right_hand.matrix = allo_m4x4_translate((allo_vector){{0.3, 1.2, -0.4}});
+  for(int i = 0; i < ALLO_HAND_SKELETON_JOINT_COUNT; i++)
+  {
+    intent->poses.left_hand.skeleton[i] = allo_m4x4_translate((allo_vector){{-0.3 + i*0.01, 1.2, -0.4}});
+    intent->poses.right_hand.skeleton[i] = allo_m4x4_translate((allo_vector){{0.3 - i*0.01, 1.2, -0.4}});
+  }
+  intent->poses.right_hand.grab.entity = strdup("grabbedentity");
+  intent->poses.right_hand.grab.grabber_from_entity_transform = allo_m4x4_translate((allo_vector){{0, 0, 0.1}});
+  intent->ack_state_rev = 12345;
+  return intent;
+}
+
+void setUp(void)
+{
+  sample = create_hand_tracked_intent();
+  cJSON *cmdrep = cjson_create_object(
+    "cmd", cJSON_CreateString("intent"),
+    "intent", allo_client_intent_to_cjson(sample),
+    NULL
+  );
+  json = cJSON_Print(cmdrep);
+  cJSON_Delete(cmdrep);
+}
+
+void tearDown(void)
+{
+  allo_client_intent_free(sample);
+  free(json);
+}
+
+static void report(const char *name, double start, size_t bytes)
+{
+  double duration = get_ts_monod() - start;
+  printf("%-24s %10.0f intents/s (%zu bytes each)\n", name, ITERATIONS / duration, bytes);
+}
+
+void test_intent_parse_and_clone(void)
+{
+  allo_client_intent *destination = allo_client_intent_create();
+  size_t length = strlen(json);
+  double start = get_ts_monod();
+  for(int i = 0; i < ITERATIONS; i++)
+  {
+    cJSON *cmd = cJSON_ParseWithLength(json, length);
+    allo_client_intent *intent = allo_client_intent_parse_cjson(cJSON_GetObjectItemCaseSensitive(cmd, "intent"));
+    allo_client_intent_clone(intent, destination);
+    allo_client_intent_free(intent);
+    cJSON_Delete(cmd);
+  }
+  report("json parse+clone", start, length);
+  TEST_ASSERT_TRUE(allo_m4x4_equal(sample->poses.left_hand.skeleton[5], destination->poses.left_hand.skeleton[5], 0.0001));
+  allo_client_intent_free(destination);
+}
+
+void test_intent_parse_into(void)
+{
+  allo_client_intent *destination = allo_client_intent_create();
+  size_t length = strlen(json);
+  double start = get_ts_monod();
+  for(int i = 0; i < ITERATIONS; i++)
+  {
+    cJSON *cmd = cJSON_ParseWithLength(json, length);
+    allo_client_intent_parse_cjson_into(destination, cJSON_GetObjectItemCaseSensitive(cmd, "intent"));
+    cJSON_Delete(cmd);
+  }
+  report("json parse_into", start, length);
+  TEST_ASSERT_TRUE(allo_m4x4_equal(sample->poses.left_hand.skeleton[5], destination->poses.left_hand.skeleton[5], 0.0001));
+  TEST_ASSERT_EQUAL_STRING("grabbedentity", destination->poses.right_hand.grab.entity);
+  allo_client_intent_free(destination);
+}
+
+void test_intent_decode_binary(void)
+{
+  uint8_t buffer[ALLO_INTENT_BINARY_MAX_SIZE];
+  allo_client_intent *destination = allo_client_intent_create();
+  uint32_t seq = 0;
+  size_t length = 0;
+  double start = get_ts_monod();
+  for(int i = 0; i < ITERATIONS; i++)
+  {
+    // every packet is a full intent; a real client mostly sends less than this
+    length = allo_client_intent_encode_binary(sample, allo_intent_part_all, i+1, 0, buffer, sizeof(buffer));
+    TEST_ASSERT_TRUE(allo_client_intent_decode_binary(destination, &seq, buffer, length));
+  }
+  report("binary encode+decode", start, length);
+  TEST_ASSERT_TRUE(allo_m4x4_equal(sample->poses.left_hand.skeleton[5], destination->poses.left_hand.skeleton[5], 0.001));
+  allo_client_intent_free(destination);
+}
+
+int main(void)
+{
+  UNITY_BEGIN();
+
+  RUN_TEST(test_intent_parse_and_clone);
+  RUN_TEST(test_intent_parse_into);
+  RUN_TEST(test_intent_decode_binary);
+
+  return UNITY_END();
+}
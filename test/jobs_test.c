@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <allonet/arr.h>
 #include <stdbool.h>
+#include "../src/workpool.h"
 
 static scheduler jobs;
 
@@ -46,6 +47,23 @@ void test_remove_all() {
     TEST_ASSERT_EQUAL_INT(value, 0);
 }
 
+static void square(void *ctx, size_t index) {
+    int *values = (int*)ctx;
+    values[index] = (int)(index * index);
+}
+
+void test_workpool_runs_every_item() {
+    allo_workpool *pool = allo_workpool_create(3);
+    int values[100];
+    for (int round = 0; round < 10; round++) {
+        for (int i = 0; i < 100; i++) values[i] = -1;
+        allo_workpool_run(pool, 100, square, values);
+        for (int i = 0; i < 100; i++) {
+            TEST_ASSERT_EQUAL_INT(i * i, values[i]);
+        }
+    }
+    allo_workpool_destroy(pool);
+}
 
 void setUp() {
     scheduler_init(&jobs);
@@ -61,6 +79,7 @@ int main(void) {
 
     RUN_TEST(test_tick);
     RUN_TEST(test_remove_all);
+    RUN_TEST(test_workpool_runs_every_item);
 
     return UNITY_END();
 }
@@ -0,0 +1,111 @@
+#include <unity.h>
+#include "../src/media/media.h"
+#include <stdlib.h>
+#include <stdbool.h>
+
+static allo_media_track_list *tracks;
+
+void setUp(void)
+{
+    tracks = _media_tracks_create();
+}
+
+void tearDown(void)
+{
+    _media_tracks_destroy(tracks);
+}
+
+void test_tracks_keep_their_address(void)
+{
+    allo_media_track *first = _media_track_create(tracks, 1, allo_media_type_audio);
+    for(uint32_t i = 2; i <= 1000; i++)
+    {
+        _media_track_create(tracks, i, i % 2 ? allo_media_type_audio : allo_media_type_video);
+    }
+    TEST_ASSERT_EQUAL_PTR(first, _media_track_find(tracks, 1));
+    for(uint32_t i = 1; i <= 1000; i++)
+    {
+        allo_media_track *track = _media_track_find(tracks, i);
+        TEST_ASSERT_NOT_NULL(track);
+        TEST_ASSERT_EQUAL_UINT32(i, track->track_id);
+    }
+    TEST_ASSERT_NULL(_media_track_find(tracks, 1001));
+
+    _media_track_destroy(tracks, _media_track_find(tracks, 500));
+    TEST_ASSERT_NULL(_media_track_find(tracks, 500));
+    TEST_ASSERT_EQUAL_PTR(first, _media_track_find(tracks, 1));
+    TEST_ASSERT_EQUAL_UINT32(501, _media_track_find(tracks, 501)->track_id);
+}
+
+void test_readers_keep_destroyed_tracks_alive(void)
+{
+    allo_media_track *track = _media_track_create(tracks, 7, allo_media_type_audio);
+
+    const allo_media_track_table *table = _media_tracks_read_begin(tracks);
+    _media_track_destroy(tracks, track);
+    _media_tracks_reclaim(tracks);
+    // gone for new lookups, but whoever is still reading can keep using it
+    TEST_ASSERT_NULL(_media_track_find(tracks, 7));
+    TEST_ASSERT_EQUAL_PTR(track, _media_track_table_find(table, 7));
+    TEST_ASSERT_EQUAL_UINT32(7, track->track_id);
+    _media_tracks_read_end(tracks);
+
+    _media_tracks_reclaim(tracks);
+    table = _media_tracks_read_begin(tracks);
+    TEST_ASSERT_EQUAL_size_t(0, table->count);
+    _media_tracks_read_end(tracks);
+}
+
+static int reader(void *arg)
+{
+    bool *running = (bool*)arg;
+    int found = 0;
+    while(*(volatile bool*)running)
+    {
+        const allo_media_track_table *table = _media_tracks_read_begin(tracks);
+        allo_media_track *track = _media_track_table_find(table, 1 + rand() % 64);
+        // read from it, so that a track freed too early shows up under a sanitizer
+        if(track && track->track_id != 0)
+        {
+            found++;
+        }
+        _media_tracks_read_end(tracks);
+    }
+    return found;
+}
+
+void test_lookups_from_another_thread_while_tracks_come_and_go(void)
+{
+    bool running = true;
+    thrd_t thread;
+    TEST_ASSERT_EQUAL_INT(thrd_success, thrd_create(&thread, reader, &running));
+    for(int round = 0; round < 2000; round++)
+    {
+        uint32_t track_id = 1 + round % 64;
+        allo_media_track *track = _media_track_find(tracks, track_id);
+        if(track)
+        {
+            _media_track_destroy(tracks, track);
+        }
+        else
+        {
+            _media_track_create(tracks, track_id, allo_media_type_video);
+        }
+        _media_tracks_reclaim(tracks);
+    }
+    running = false;
+    int found;
+    thrd_join(thread, &found);
+    TEST_ASSERT_GREATER_THAN(0, found);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_tracks_keep_their_address);
+    RUN_TEST(test_readers_keep_destroyed_tracks_alive);
+    RUN_TEST(test_lookups_from_another_thread_while_tracks_come_and_go);
+
+    return UNITY_END();
+}
@@ -0,0 +1,109 @@
+#include <unity.h>
+#include "../src/media/video/mjpeg_encoder.h"
+#include "../src/media/video/mjpeg.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+// Encodes a synthetic picture and checks that a regular JPEG decoder reads it back.
+
+#define WIDTH 333  // not a multiple of 16, to exercise the edges
+#define HEIGHT 250
+#define RESERVE 4
+
+static uint8_t *picture;
+
+void setUp(void)
+{
+    picture = malloc(WIDTH * HEIGHT * 4);
+    for(int y = 0; y < HEIGHT; y++)
+    {
+        for(int x = 0; x < WIDTH; x++)
+        {
+            uint8_t *p = picture + (y * WIDTH + x) * 4;
+            // smooth gradients with a few hard edges, like a UI
+            p[0] = (uint8_t)(x * 255 / WIDTH);
+            p[1] = (uint8_t)(y * 255 / HEIGHT);
+            p[2] = (x / 40 + y / 40) % 2 ? 200 : 40;
+            p[3] = 255;
+        }
+    }
+}
+
+void tearDown(void)
+{
+    free(picture);
+}
+
+static double psnr(const uint8_t *a, const uint8_t *b)
+{
+    double error = 0;
+    for(int i = 0; i < WIDTH * HEIGHT * 4; i++)
+    {
+        if(i % 4 == 3) continue;
+        double d = (double)a[i] - b[i];
+        error += d * d;
+    }
+    error /= WIDTH * HEIGHT * 3;
+    return 10 * log10(255.0 * 255.0 / error);
+}
+
+static ENetPacket *encode(int quality, int threads)
+{
+    allo_mjpeg_encoder *encoder = allo_mjpeg_encoder_create(quality, threads);
+    ENetPacket *packet = allo_mjpeg_encoder_encode(encoder, picture, WIDTH, HEIGHT, WIDTH * 4, RESERVE);
+    allo_mjpeg_encoder_destroy(encoder);
+    TEST_ASSERT_NOT_NULL(packet);
+    return packet;
+}
+
+void test_round_trip(void)
+{
+    ENetPacket *packet = encode(80, 3);
+    int32_t wide = 0, high = 0;
+    allopixel *decoded = allo_mjpeg_decode(packet->data + RESERVE, packet->dataLength - RESERVE, &wide, &high);
+    TEST_ASSERT_NOT_NULL(decoded);
+    TEST_ASSERT_EQUAL_INT(WIDTH, wide);
+    TEST_ASSERT_EQUAL_INT(HEIGHT, high);
+    double quality = psnr(picture, (const uint8_t *)decoded);
+    printf("%d bytes, %.1f dB\n", (int)packet->dataLength, quality);
+    TEST_ASSERT_TRUE(quality > 28);
+    free(decoded);
+    enet_packet_destroy(packet);
+}
+
+void test_slicing_does_not_change_output(void)
+{
+    // slices are cut by thread count, so compare pixels rather than bytes
+    ENetPacket *single = encode(60, 0), *sliced = encode(60, 7);
+    int32_t wide, high;
+    allopixel *a = allo_mjpeg_decode(single->data + RESERVE, single->dataLength - RESERVE, &wide, &high);
+    allopixel *b = allo_mjpeg_decode(sliced->data + RESERVE, sliced->dataLength - RESERVE, &wide, &high);
+    TEST_ASSERT_NOT_NULL(a);
+    TEST_ASSERT_NOT_NULL(b);
+    TEST_ASSERT_EQUAL_MEMORY(a, b, WIDTH * HEIGHT * 4);
+    free(a);
+    free(b);
+    enet_packet_destroy(single);
+    enet_packet_destroy(sliced);
+}
+
+void test_lower_quality_is_smaller(void)
+{
+    ENetPacket *high = encode(90, 1), *low = encode(30, 1);
+    TEST_ASSERT_TRUE(low->dataLength < high->dataLength);
+    enet_packet_destroy(high);
+    enet_packet_destroy(low);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_round_trip);
+    RUN_TEST(test_slicing_does_not_change_output);
+    RUN_TEST(test_lower_quality_is_smaller);
+
+    return UNITY_END();
+}
@@ -98,6 +98,75 @@ void tearDown()
   free(state);
 }
 
+void test_intent_binary_should_roundtrip(void)
+{
+  allo_client_intent *intent = allo_client_intent_create();
+  intent->wants_stick_movement = true;
+  intent->xmovement = 0.5;
+  intent->yaw = 1.25;
+  intent->ack_state_rev = 1234567890123;
+  intent->poses.head.matrix = allo_m4x4_concat(allo_m4x4_translate((allo_vector){{1, 1.7, -2}}), allo_m4x4_rotate(0.3, (allo_vector){{0, 1, 0}}));
+  intent->poses.left_hand.skeleton[3] = allo_m4x4_translate((allo_vector){{0.1, 0.2, 0.3}});
+  intent->poses.right_hand.grab.entity = strdup("abc");
+  intent->poses.right_hand.grab.grabber_from_entity_transform = allo_m4x4_translate((allo_vector){{0, 0, 1}});
+
+  uint8_t buffer[ALLO_INTENT_BINARY_MAX_SIZE];
+  size_t length = allo_client_intent_encode_binary(intent, allo_intent_part_all, 1, 0, buffer, sizeof(buffer));
+  TEST_ASSERT_GREATER_THAN(0, length);
+
+  allo_client_intent *decoded = allo_client_intent_create();
+  uint32_t seq = 0;
+  TEST_ASSERT_TRUE(allo_client_intent_decode_binary(decoded, &seq, buffer, length));
+  TEST_ASSERT_EQUAL(1, seq);
+  TEST_ASSERT_EQUAL(1, decoded->wants_stick_movement);
+  TEST_ASSERT_DOUBLE_WITHIN(0.0001, 0.5, decoded->xmovement);
+  TEST_ASSERT_DOUBLE_WITHIN(0.0001, 1.25, decoded->yaw);
+  TEST_ASSERT_TRUE(decoded->ack_state_rev == 1234567890123);
+  TEST_ASSERT_TRUE(allo_m4x4_equal(intent->poses.head.matrix, decoded->poses.head.matrix, 0.001));
+  TEST_ASSERT_TRUE(allo_m4x4_equal(intent->poses.left_hand.skeleton[3], decoded->poses.left_hand.skeleton[3], 0.001));
+  TEST_ASSERT_EQUAL_STRING("abc", decoded->poses.right_hand.grab.entity);
+
+  // the same packet again is stale and must be dropped
+  TEST_ASSERT_FALSE(allo_client_intent_decode_binary(decoded, &seq, buffer, length));
+  // so must a truncated one
+  length = allo_client_intent_encode_binary(intent, allo_intent_part_all, 2, 1, buffer, sizeof(buffer));
+  TEST_ASSERT_FALSE(allo_client_intent_decode_binary(decoded, &seq, buffer, length - 10));
+  TEST_ASSERT_EQUAL(1, seq);
+
+  allo_client_intent_free(intent);
+  allo_client_intent_free(decoded);
+}
+
+void test_intent_binary_should_keep_unchanged_parts(void)
+{
+  allo_client_intent *intent = allo_client_intent_create();
+  intent->poses.left_hand.skeleton[3] = allo_m4x4_translate((allo_vector){{0.1, 0.2, 0.3}});
+  uint8_t buffer[ALLO_INTENT_BINARY_MAX_SIZE];
+  size_t full = allo_client_intent_encode_binary(intent, allo_intent_part_all, 1, 0, buffer, sizeof(buffer));
+  allo_client_intent *decoded = allo_client_intent_create();
+  uint32_t seq = 0;
+  TEST_ASSERT_TRUE(allo_client_intent_decode_binary(decoded, &seq, buffer, full));
+
+  // only the head moved; skeleton is left out and must be kept from before
+  allo_client_intent *moved = allo_client_intent_create();
+  allo_client_intent_clone(intent, moved);
+  moved->poses.head.matrix = allo_m4x4_translate((allo_vector){{0, 1.8, 0}});
+  uint16_t changed = allo_client_intent_changed_parts(moved, intent);
+  TEST_ASSERT_EQUAL(allo_intent_part_head, changed);
+  size_t delta = allo_client_intent_encode_binary(moved, changed, 2, 1, buffer, sizeof(buffer));
+  TEST_ASSERT_LESS_THAN(full, delta);
+  TEST_ASSERT_TRUE(allo_client_intent_decode_binary(decoded, &seq, buffer, delta));
+  TEST_ASSERT_TRUE(allo_m4x4_equal(moved->poses.head.matrix, decoded->poses.head.matrix, 0.001));
+  TEST_ASSERT_TRUE(allo_m4x4_equal(intent->poses.left_hand.skeleton[3], decoded->poses.left_hand.skeleton[3], 0.001));
+
+  // a delta against a baseline we never received can't be applied
+  delta = allo_client_intent_encode_binary(moved, changed, 10, 5, buffer, sizeof(buffer));
+  TEST_ASSERT_FALSE(allo_client_intent_decode_binary(decoded, &seq, buffer, delta));
+
+  allo_client_intent_free(intent);
+  allo_client_intent_free(moved);
+  allo_client_intent_free(decoded);
+}
 
 int main(void)
 {
@@ -105,6 +174,8 @@ int main(void)
 
   RUN_TEST(test_allostate_should_ascendCoordinateSpaces);
   RUN_TEST(test_allostate_should_descendCoordinateSpaces);
+  RUN_TEST(test_intent_binary_should_roundtrip);
+  RUN_TEST(test_intent_binary_should_keep_unchanged_parts);
 
   return UNITY_END();
 }
@@ -0,0 +1,246 @@
+#include <unity.h>
+#include "../src/media/video/decode_queue.h"
+#include "../src/media/video/pixel_pool.h"
+#include "../src/threading.h"
+#include "../src/atomics.h"
+#include <stdlib.h>
+#include <string.h>
+
+// "Decodes" frames that are just a frame number, and holds every decode until released,
+// so that tests can line up what's queued against what's being decoded.
+
+static allo_video_decode_queue *queue;
+static allo_atomic_int started;
+static allo_atomic_int released;
+
+static bool fake_decode(const uint8_t *data, size_t length, allo_decoded_video_frame *frame)
+{
+    allo_atomic_int_fetch_add(&started, 1);
+    while(!allo_atomic_int_load(&released)) thrd_yield();
+    int32_t number;
+    memcpy(&number, data, sizeof(number));
+    frame->pixels = allo_pixel_buffer_get(1);
+    frame->wide = 1;
+    frame->high = 1;
+    frame->pixels[0].r = (uint8_t)number;
+    return true;
+}
+
+static void push(uint32_t track_id, int32_t number)
+{
+    allo_video_decode_queue_push(queue, track_id, (const uint8_t *)&number, sizeof(number));
+}
+
+static void wait_until(bool (*done)(void))
+{
+    for(int i = 0; i < 5000 && !done(); i++)
+    {
+        thrd_sleep(&(struct timespec){.tv_nsec = 1000000}, NULL);
+    }
+    TEST_ASSERT_TRUE(done());
+}
+
+static bool one_started(void) { return allo_atomic_int_load(&started) >= 1; }
+static bool two_started(void) { return allo_atomic_int_load(&started) >= 2; }
+static bool two_decoded(void) { return allo_video_decode_queue_stats(queue).decoded >= 2; }
+static bool two_dropped(void) { return allo_video_decode_queue_stats(queue).dropped >= 2; }
+
+void setUp(void)
+{
+    allo_atomic_int_store(&started, 0);
+    allo_atomic_int_store(&released, 0);
+    queue = allo_video_decode_queue_create(2, fake_decode);
+}
+
+void tearDown(void)
+{
+    allo_atomic_int_store(&released, 1);
+    allo_video_decode_queue_destroy(queue);
+}
+
+void test_only_the_newest_frame_is_delivered(void)
+{
+    push(1, 1);
+    wait_until(one_started);
+    // 2 and 3 are replaced before anyone gets to them
+    push(1, 2);
+    push(1, 3);
+    push(1, 4);
+    allo_atomic_int_store(&released, 1);
+    wait_until(two_decoded);
+
+    allo_decoded_video_frame frame;
+    TEST_ASSERT_TRUE(allo_video_decode_queue_pop(queue, &frame));
+    TEST_ASSERT_EQUAL_UINT32(1, frame.track_id);
+    TEST_ASSERT_EQUAL_INT(4, frame.pixels[0].r);
+    allo_pixel_buffer_return(frame.pixels, 1);
+    TEST_ASSERT_FALSE(allo_video_decode_queue_pop(queue, &frame));
+
+    allo_video_decode_stats stats = allo_video_decode_queue_stats(queue);
+    TEST_ASSERT_EQUAL_UINT64(4, stats.queued);
+    TEST_ASSERT_EQUAL_UINT64(2, stats.decoded);
+    // 2 and 3 before decoding, 1 after
+    TEST_ASSERT_EQUAL_UINT64(3, stats.dropped);
+}
+
+void test_tracks_decode_in_parallel(void)
+{
+    push(1, 10);
+    push(2, 20);
+    // both threads are busy at once
+    wait_until(two_started);
+    allo_atomic_int_store(&released, 1);
+    wait_until(two_decoded);
+
+    int seen = 0;
+    allo_decoded_video_frame frame;
+    while(allo_video_decode_queue_pop(queue, &frame))
+    {
+        TEST_ASSERT_EQUAL_INT(frame.track_id * 10, frame.pixels[0].r);
+        seen |= 1 << frame.track_id;
+        allo_pixel_buffer_return(frame.pixels, 1);
+    }
+    TEST_ASSERT_EQUAL_INT((1 << 1) | (1 << 2), seen);
+}
+
+void test_forgotten_tracks_deliver_nothing(void)
+{
+    push(5, 1);
+    wait_until(one_started);
+    push(5, 2);
+    // forgetting while a frame is being decoded
+    allo_video_decode_queue_forget(queue, 5);
+    allo_atomic_int_store(&released, 1);
+    wait_until(two_dropped);
+    allo_decoded_video_frame frame;
+    TEST_ASSERT_FALSE(allo_video_decode_queue_pop(queue, &frame));
+}
+
+typedef struct counting_state {
+    int32_t sum;
+    bool freed;
+    // hold decodes until released, like fake_decode
+    bool hold;
+} counting_state;
+
+/// Decodes into the sum of all the track's frames so far, as a decoder that keeps a framebuffer would.
+/// Negative numbers don't decode, and leave it needing a keyframe.
+static bool counting_decode(void *state, const uint8_t *data, size_t length, allo_decoded_video_frame *frame)
+{
+    counting_state *counter = state;
+    if(counter->hold)
+    {
+        allo_atomic_int_fetch_add(&started, 1);
+        while(!allo_atomic_int_load(&released)) thrd_yield();
+    }
+    int32_t number;
+    memcpy(&number, data, sizeof(number));
+    if(number < 0)
+    {
+        frame->needs_keyframe = true;
+        return false;
+    }
+    counter->sum += number;
+    frame->pixels = allo_pixel_buffer_get(1);
+    frame->wide = 1;
+    frame->high = 1;
+    frame->pixels[0].r = (uint8_t)counter->sum;
+    frame->needs_keyframe = true;
+    return true;
+}
+
+static void counting_free(void *state)
+{
+    ((counting_state *)state)->freed = true;
+}
+
+static bool one_decoded(void) { return allo_video_decode_queue_stats(queue).decoded >= 1; }
+
+void test_tracks_can_have_decoders_of_their_own(void)
+{
+    counting_state counter = { 100, false, false };
+    allo_video_decode_queue_set_decoder(queue, 7, counting_decode, &counter, counting_free);
+    push(7, 5);
+    wait_until(one_decoded);
+
+    allo_decoded_video_frame frame;
+    TEST_ASSERT_TRUE(allo_video_decode_queue_pop(queue, &frame));
+    TEST_ASSERT_EQUAL_INT(105, frame.pixels[0].r);
+    TEST_ASSERT_TRUE(frame.needs_keyframe);
+    allo_pixel_buffer_return(frame.pixels, 1);
+    // fake_decode never ran
+    TEST_ASSERT_EQUAL_INT(0, allo_atomic_int_load(&started));
+
+    TEST_ASSERT_FALSE(counter.freed);
+    allo_video_decode_queue_forget(queue, 7);
+    TEST_ASSERT_TRUE(counter.freed);
+}
+
+void test_frames_that_build_on_each_other_are_never_replaced(void)
+{
+    counting_state counter = { 0, false, true };
+    allo_video_decode_queue_set_decoder(queue, 7, counting_decode, &counter, counting_free);
+    push(7, 1);
+    wait_until(one_started);
+    // both arrive while 1 is decoding, and both count
+    push(7, 2);
+    push(7, 4);
+    allo_atomic_int_store(&released, 1);
+    wait_until(two_decoded);
+
+    allo_decoded_video_frame frame;
+    TEST_ASSERT_TRUE(allo_video_decode_queue_pop(queue, &frame));
+    TEST_ASSERT_EQUAL_INT(1 + 2 + 4, frame.pixels[0].r);
+    allo_pixel_buffer_return(frame.pixels, 1);
+    TEST_ASSERT_FALSE(allo_video_decode_queue_pop(queue, &frame));
+
+    allo_video_decode_stats stats = allo_video_decode_queue_stats(queue);
+    TEST_ASSERT_EQUAL_UINT64(3, stats.queued);
+    TEST_ASSERT_EQUAL_UINT64(0, stats.failed);
+    allo_video_decode_queue_forget(queue, 7);
+}
+
+static bool one_failed(void) { return allo_video_decode_queue_stats(queue).failed >= 1; }
+
+void test_failed_frames_still_ask_for_a_keyframe(void)
+{
+    counting_state counter = { 0, false, false };
+    allo_video_decode_queue_set_decoder(queue, 7, counting_decode, &counter, counting_free);
+    push(7, -1);
+    wait_until(one_failed);
+
+    allo_decoded_video_frame frame;
+    TEST_ASSERT_TRUE(allo_video_decode_queue_pop(queue, &frame));
+    TEST_ASSERT_EQUAL_UINT32(7, frame.track_id);
+    TEST_ASSERT_NULL(frame.pixels);
+    TEST_ASSERT_TRUE(frame.needs_keyframe);
+    TEST_ASSERT_FALSE(allo_video_decode_queue_pop(queue, &frame));
+    allo_video_decode_queue_forget(queue, 7);
+}
+
+void test_freed_pictures_give_their_pixels_back(void)
+{
+    allopixel *pixels = allo_pixel_buffer_get(64 * 48);
+    allopicture *picture = allo_pixel_buffer_picture(pixels, 64, 48);
+    TEST_ASSERT_EQUAL_INT(allopicture_format_rgba8888, picture->format);
+    TEST_ASSERT_EQUAL_INT(64 * sizeof(allopixel), picture->plane_strides[0]);
+    allopicture_free(picture);
+    allopixel *again = allo_pixel_buffer_get(64 * 48);
+    TEST_ASSERT_EQUAL_PTR(pixels, again);
+    allo_pixel_buffer_return(again, 64 * 48);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_only_the_newest_frame_is_delivered);
+    RUN_TEST(test_tracks_decode_in_parallel);
+    RUN_TEST(test_forgotten_tracks_deliver_nothing);
+    RUN_TEST(test_tracks_can_have_decoders_of_their_own);
+    RUN_TEST(test_frames_that_build_on_each_other_are_never_replaced);
+    RUN_TEST(test_failed_frames_still_ask_for_a_keyframe);
+    RUN_TEST(test_freed_pictures_give_their_pixels_back);
+
+    return UNITY_END();
+}
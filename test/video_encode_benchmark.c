@@ -0,0 +1,124 @@
+#include <unity.h>
+#include <allonet/state.h>
+#include "../src/media/media.h"
+#include "../src/util.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// Measures how fast H.264 video tracks encode, like alloclient_send_video does, at common
+// screen sharing sizes and with each kind of threading.
+
+#define FRAME_COUNT 120
+
+static allo_media_subsystem *h264;
+static allopixel *pixels;
+
+static void keep_pixels(allopicture *picture)
+{
+    free(picture);
+}
+
+static allopicture *create_picture(int width, int height, int frame)
+{
+    // something that moves, so every frame has something to encode
+    for(int y = 0; y < height; y++)
+    {
+        for(int x = 0; x < width; x++)
+        {
+            allopixel *p = &pixels[y * width + x];
+            p->r = (uint8_t)(x + frame * 4);
+            p->g = (uint8_t)(y - frame * 2);
+            p->b = (uint8_t)((x ^ y) + frame);
+            p->a = 255;
+        }
+    }
+    allopicture *picture = calloc(1, sizeof(allopicture));
+    picture->format = allopicture_format_rgba8888;
+    picture->width = width;
+    picture->height = height;
+    picture->plane_count = 1;
+    picture->planes[0].rgba = pixels;
+    picture->plane_strides[0] = width * sizeof(allopixel);
+    picture->plane_byte_lengths[0] = width * height * sizeof(allopixel);
+    picture->free = keep_pixels;
+    return picture;
+}
+
+static void benchmark(int width, int height, allo_video_threading threading)
+{
+    TEST_ASSERT_NOT_NULL(h264);
+    alloclient_set_video_encoder_threads(0, threading);
+    allo_media_track *track = calloc(1, sizeof(allo_media_track));
+    track->type = allo_media_type_video;
+    cJSON *comp = cjson_create_object(
+        "type", cJSON_CreateString("video"),
+        "format", cJSON_CreateString("h264"),
+        "metadata", cjson_create_object("width", cJSON_CreateNumber(width), "height", cJSON_CreateNumber(height), NULL),
+        NULL
+    );
+    TEST_ASSERT_TRUE(h264->track_initialize(track, comp));
+    cJSON_Delete(comp);
+    pixels = malloc(sizeof(allopixel) * width * height);
+
+    double sent_at[FRAME_COUNT];
+    double total_latency = 0, worst_latency = 0, encoding = 0;
+    int received = 0;
+    for(int i = 0; i < FRAME_COUNT; i++)
+    {
+        allopicture *picture = create_picture(width, height, i);
+        double start = get_ts_monod();
+        sent_at[i] = start;
+        ENetPacket *packet = h264->create_video_packet(track, picture);
+        while(packet)
+        {
+            double latency = get_ts_monod() - sent_at[received++];
+            total_latency += latency;
+            if(latency > worst_latency) worst_latency = latency;
+            enet_packet_destroy(packet);
+            packet = h264->drain_video_packet(track);
+        }
+        encoding += get_ts_monod() - start;
+    }
+    printf("%dx%d, %s threading: %.1f fps, %.2fms average and %.2fms worst from picture to packet, %d frames still in the encoder\n",
+        width, height, threading == allo_video_threading_frame ? "frame" : "slice",
+        FRAME_COUNT / encoding, 1000 * total_latency / received, 1000 * worst_latency, FRAME_COUNT - received
+    );
+    TEST_ASSERT_TRUE(received > 0);
+
+    // flushes what's left
+    h264->track_destroy(track);
+    free(track);
+    free(pixels);
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+void test_720p_slice(void) { benchmark(1280, 720, allo_video_threading_slice); }
+void test_720p_frame(void) { benchmark(1280, 720, allo_video_threading_frame); }
+void test_1080p_slice(void) { benchmark(1920, 1080, allo_video_threading_slice); }
+void test_1080p_frame(void) { benchmark(1920, 1080, allo_video_threading_frame); }
+
+int main(void)
+{
+    allo_libav_initialize();
+    for(int i = 0; allo_media_subsystems[i]; i++)
+    {
+        if(allo_media_subsystems[i]->drain_video_packet) h264 = allo_media_subsystems[i];
+    }
+
+    UNITY_BEGIN();
+
+    RUN_TEST(test_720p_slice);
+    RUN_TEST(test_720p_frame);
+    RUN_TEST(test_1080p_slice);
+    RUN_TEST(test_1080p_frame);
+
+    return UNITY_END();
+}
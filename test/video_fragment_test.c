@@ -0,0 +1,230 @@
+#include <unity.h>
+#include "../src/media/video/fragment.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+// Sends video frames as fragments through a simulated lossy, reordering network into the
+// reassembler, like fragmented video on CHANNEL_VIDEO between two clients. Unlike ENet's own
+// fragmentation, a frame that can't be completed in time mustn't hold up the ones after it, and
+// the receiver must know when to ask for a keyframe to get its picture back.
+
+#define FRAME_COUNT 600
+#define FRAME_INTERVAL (1/30.0)
+#define MAX_FRAME_SIZE 40000
+
+typedef struct sent_fragment {
+    double arrival;
+    size_t length;
+    uint8_t data[ALLO_VIDEO_FRAGMENT_HEADER_SIZE + ALLO_VIDEO_FRAGMENT_PAYLOAD];
+} sent_fragment;
+
+static allo_video_reassembler *reassembler;
+static sent_fragment *fragments;
+static size_t fragment_count;
+static uint8_t frame_data[MAX_FRAME_SIZE];
+static int shown; // frames delivered that could be decoded, because none were lost since the last keyframe
+
+void setUp(void)
+{
+    reassembler = allo_video_reassembler_create(0.2);
+    fragments = malloc(sizeof(sent_fragment) * FRAME_COUNT * allo_video_fragment_count(MAX_FRAME_SIZE));
+    fragment_count = 0;
+    shown = 0;
+    srand(1);
+}
+
+void tearDown(void)
+{
+    allo_video_reassembler_destroy(reassembler);
+    free(fragments);
+}
+
+static size_t frame_size(int frame_id, bool keyframe)
+{
+    // every frame different, and keyframes big
+    return keyframe ? MAX_FRAME_SIZE : 5000 + (frame_id * 7919) % 15000;
+}
+
+static uint8_t frame_byte(int frame_id, size_t offset)
+{
+    return (uint8_t)(frame_id * 31 + offset * 7);
+}
+
+/// Fragment a frame, dropping each fragment with probability `loss`
+static void send_frame(int frame_id, bool keyframe, double now, double loss, double max_jitter)
+{
+    size_t length = frame_size(frame_id, keyframe);
+    for(size_t i = 0; i < length; i++) frame_data[i] = frame_byte(frame_id, i);
+    allo_video_fragment_header header = { keyframe ? ALLO_VIDEO_FRAGMENT_KEYFRAME : 0, (uint16_t)frame_id, 0, (uint16_t)allo_video_fragment_count(length) };
+    for(; header.index < header.count; header.index++)
+    {
+        if(rand() < loss * RAND_MAX) continue;
+        size_t offset = (size_t)header.index * ALLO_VIDEO_FRAGMENT_PAYLOAD;
+        size_t chunk = length - offset < ALLO_VIDEO_FRAGMENT_PAYLOAD ? length - offset : ALLO_VIDEO_FRAGMENT_PAYLOAD;
+        sent_fragment *fragment = &fragments[fragment_count++];
+        allo_video_write_fragment_header(fragment->data, &header);
+        memcpy(fragment->data + ALLO_VIDEO_FRAGMENT_HEADER_SIZE, frame_data + offset, chunk);
+        fragment->length = ALLO_VIDEO_FRAGMENT_HEADER_SIZE + chunk;
+        fragment->arrival = now + 0.020 + max_jitter * rand() / RAND_MAX;
+    }
+}
+
+static int compare_arrival(const void *a, const void *b)
+{
+    double d = ((const sent_fragment*)a)->arrival - ((const sent_fragment*)b)->arrival;
+    return d < 0 ? -1 : d > 0 ? 1 : 0;
+}
+
+/// Deliver everything sent so far that has arrived by `until`, in order of arrival. Returns how many frames came out.
+static int receive_until(int *last_frame_id, double until)
+{
+    qsort(fragments, fragment_count, sizeof(sent_fragment), compare_arrival);
+    int delivered = 0;
+    size_t i = 0;
+    for(; i < fragment_count && fragments[i].arrival <= until; i++)
+    {
+        allo_video_fragment_header header;
+        TEST_ASSERT_TRUE(allo_video_read_fragment_header(fragments[i].data, fragments[i].length, &header));
+        const uint8_t *frame;
+        size_t length;
+        if(allo_video_reassembler_push(reassembler, &header, fragments[i].data + ALLO_VIDEO_FRAGMENT_HEADER_SIZE, fragments[i].length - ALLO_VIDEO_FRAGMENT_HEADER_SIZE, fragments[i].arrival, &frame, &length))
+        {
+            // frames come out whole, and only ever newer than the last
+            TEST_ASSERT_EQUAL_size_t(frame_size(header.frame_id, header.flags & ALLO_VIDEO_FRAGMENT_KEYFRAME), length);
+            for(size_t b = 0; b < length; b++)
+            {
+                if(frame[b] != frame_byte(header.frame_id, b)) TEST_ASSERT_EQUAL_INT(frame_byte(header.frame_id, b), frame[b]);
+            }
+            TEST_ASSERT_TRUE(header.frame_id > *last_frame_id);
+            *last_frame_id = header.frame_id;
+            delivered++;
+            if(!allo_video_reassembler_needs_keyframe(reassembler)) shown++;
+        }
+    }
+    memmove(fragments, fragments + i, (fragment_count - i) * sizeof(sent_fragment));
+    fragment_count -= i;
+    return delivered;
+}
+
+static int receive(int *last_frame_id)
+{
+    return receive_until(last_frame_id, INFINITY);
+}
+
+void test_header_round_trip(void)
+{
+    uint8_t data[ALLO_VIDEO_FRAGMENT_HEADER_SIZE];
+    allo_video_fragment_header in = { ALLO_VIDEO_FRAGMENT_KEYFRAME, 0xbeef, 513, 1024 }, out;
+    allo_video_write_fragment_header(data, &in);
+    TEST_ASSERT_FALSE(allo_video_read_fragment_header(data, sizeof(data) - 1, &out));
+    TEST_ASSERT_TRUE(allo_video_read_fragment_header(data, sizeof(data), &out));
+    TEST_ASSERT_EQUAL_INT(in.flags, out.flags);
+    TEST_ASSERT_EQUAL_INT(in.frame_id, out.frame_id);
+    TEST_ASSERT_EQUAL_INT(in.index, out.index);
+    TEST_ASSERT_EQUAL_INT(in.count, out.count);
+}
+
+void test_reordered_fragments_make_whole_frames(void)
+{
+    int last = -1;
+    for(int i = 0; i < 30; i++) send_frame(i, i == 0, i * FRAME_INTERVAL, 0, 0.010);
+    TEST_ASSERT_EQUAL_INT(30, receive(&last));
+    TEST_ASSERT_FALSE(allo_video_reassembler_needs_keyframe(reassembler));
+    TEST_ASSERT_EQUAL_UINT64(0, allo_video_reassembler_stats(reassembler).incomplete);
+}
+
+void test_lost_frame_asks_for_keyframe(void)
+{
+    int last = -1;
+    send_frame(0, true, 0, 0, 0);
+    TEST_ASSERT_EQUAL_INT(1, receive(&last));
+    // frame 1 never arrives
+    send_frame(2, false, 2 * FRAME_INTERVAL, 0, 0);
+    TEST_ASSERT_EQUAL_INT(1, receive(&last));
+    TEST_ASSERT_TRUE(allo_video_reassembler_needs_keyframe(reassembler));
+    send_frame(3, true, 3 * FRAME_INTERVAL, 0, 0);
+    TEST_ASSERT_EQUAL_INT(1, receive(&last));
+    TEST_ASSERT_FALSE(allo_video_reassembler_needs_keyframe(reassembler));
+
+    // and joining in the middle of a group of pictures needs one too
+    allo_video_reassembler_destroy(reassembler);
+    reassembler = allo_video_reassembler_create(0.2);
+    last = -1;
+    send_frame(4, false, 4 * FRAME_INTERVAL, 0, 0);
+    TEST_ASSERT_EQUAL_INT(1, receive(&last));
+    TEST_ASSERT_TRUE(allo_video_reassembler_needs_keyframe(reassembler));
+}
+
+void test_incomplete_frame_does_not_hold_up_newer_ones(void)
+{
+    int last = -1;
+    send_frame(0, true, 0, 0, 0);
+    TEST_ASSERT_EQUAL_INT(1, receive(&last));
+    // the last fragment of frame 1 is held up in the network for longer than it takes frame 2 to arrive
+    send_frame(1, false, FRAME_INTERVAL, 0, 0);
+    fragments[fragment_count - 1].arrival += 4 * FRAME_INTERVAL;
+    send_frame(2, false, 2 * FRAME_INTERVAL, 0, 0);
+    TEST_ASSERT_EQUAL_INT(1, receive_until(&last, 3 * FRAME_INTERVAL));
+    TEST_ASSERT_EQUAL_INT(2, last);
+    TEST_ASSERT_TRUE(allo_video_reassembler_needs_keyframe(reassembler));
+
+    // and when it does turn up, it's too late to show
+    TEST_ASSERT_EQUAL_INT(0, receive(&last));
+    TEST_ASSERT_EQUAL_UINT64(1, allo_video_reassembler_stats(reassembler).stale);
+}
+
+/// Send FRAME_COUNT frames with a keyframe every `keyframe_interval`, and also right after the
+/// receiver asks for one if `request_keyframes`. Returns how many frames could be shown.
+static int stream(double loss, double max_jitter, int keyframe_interval, bool request_keyframes)
+{
+    int last = -1;
+    bool requested = false;
+    for(int i = 0; i < FRAME_COUNT; i++)
+    {
+        double now = i * FRAME_INTERVAL;
+        send_frame(i, i % keyframe_interval == 0 || requested, now, loss, max_jitter);
+        requested = false;
+        // the request reaches the sender before its next frame
+        receive_until(&last, now + FRAME_INTERVAL / 2);
+        requested = request_keyframes && allo_video_reassembler_needs_keyframe(reassembler);
+    }
+    receive(&last);
+
+    allo_video_reassembly_stats stats = allo_video_reassembler_stats(reassembler);
+    printf("%s keyframe requests: showed %d/%d frames; %llu fragments, %llu frames, %llu incomplete, %llu stale fragments\n",
+        request_keyframes ? "with" : "without", shown, FRAME_COUNT, (unsigned long long)stats.fragments,
+        (unsigned long long)stats.frames, (unsigned long long)stats.incomplete, (unsigned long long)stats.stale);
+    TEST_ASSERT_EQUAL_UINT64(0, stats.invalid);
+    return shown;
+}
+
+void test_keyframe_requests_recover_the_picture(void)
+{
+    // 1% of fragments lost loses about one frame in ten. With a keyframe only every 10 seconds, the
+    // picture would be broken for most of the time after each of them.
+    const double loss = 0.01, max_jitter = 0.030;
+    int without = stream(loss, max_jitter, 300, false);
+
+    tearDown();
+    setUp();
+    int with = stream(loss, max_jitter, 300, true);
+
+    // keyframes are big enough to be lost more often, so a few requests are needed now and then
+    TEST_ASSERT_TRUE(with > 0.6 * FRAME_COUNT);
+    TEST_ASSERT_TRUE(with > 10 * without);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_header_round_trip);
+    RUN_TEST(test_reordered_fragments_make_whole_frames);
+    RUN_TEST(test_lost_frame_asks_for_keyframe);
+    RUN_TEST(test_incomplete_frame_does_not_hold_up_newer_ones);
+    RUN_TEST(test_keyframe_requests_recover_the_picture);
+
+    return UNITY_END();
+}
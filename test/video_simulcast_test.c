@@ -0,0 +1,110 @@
+#include <unity.h>
+#include "../src/media/video/simulcast.h"
+#include "../src/media/video/fragment.h"
+#include <string.h>
+
+// How the place picks and switches the layer of a simulcast video track that each subscriber gets.
+
+static const allo_video_link good_link = { 0, 1 };
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+void test_layer_is_in_fragment_flags(void)
+{
+    uint8_t flags = ALLO_VIDEO_FRAGMENT_KEYFRAME | 2 << ALLO_VIDEO_FRAGMENT_LAYER_SHIFT;
+    TEST_ASSERT_EQUAL_INT(2, allo_video_fragment_layer(flags));
+    TEST_ASSERT_EQUAL_INT(0, allo_video_fragment_layer(ALLO_VIDEO_FRAGMENT_KEYFRAME));
+}
+
+void test_nothing_is_forwarded_before_a_keyframe(void)
+{
+    allo_video_subscriber subscriber = { NULL, 0, 0, -1 };
+    TEST_ASSERT_FALSE(allo_video_subscriber_forward(&subscriber, 0, false));
+    TEST_ASSERT_FALSE(allo_video_subscriber_forward(&subscriber, 1, true));
+    TEST_ASSERT_TRUE(allo_video_subscriber_forward(&subscriber, 0, true));
+    TEST_ASSERT_TRUE(allo_video_subscriber_forward(&subscriber, 0, false));
+    TEST_ASSERT_FALSE(allo_video_subscriber_forward(&subscriber, 1, false));
+    TEST_ASSERT_EQUAL_INT(0, subscriber.current);
+}
+
+void test_layers_switch_at_keyframes_only(void)
+{
+    allo_video_subscriber subscriber = { NULL, ALLO_VIDEO_LAYER_AUTO, 0, 0 };
+    subscriber.target = 2;
+    // keeps getting layer 0 until layer 2 has a keyframe
+    TEST_ASSERT_TRUE(allo_video_subscriber_forward(&subscriber, 0, false));
+    TEST_ASSERT_FALSE(allo_video_subscriber_forward(&subscriber, 2, false));
+    TEST_ASSERT_FALSE(allo_video_subscriber_forward(&subscriber, 1, true));
+    TEST_ASSERT_TRUE(allo_video_subscriber_forward(&subscriber, 0, true));
+    TEST_ASSERT_TRUE(allo_video_subscriber_forward(&subscriber, 2, true));
+    TEST_ASSERT_EQUAL_INT(2, subscriber.current);
+    TEST_ASSERT_FALSE(allo_video_subscriber_forward(&subscriber, 0, false));
+    TEST_ASSERT_FALSE(allo_video_subscriber_forward(&subscriber, 0, true));
+}
+
+void test_further_away_gets_smaller_layers(void)
+{
+    TEST_ASSERT_EQUAL_INT(0, allo_video_auto_layer(3, 0, 1, good_link));
+    TEST_ASSERT_EQUAL_INT(1, allo_video_auto_layer(3, 0, 4, good_link));
+    TEST_ASSERT_EQUAL_INT(2, allo_video_auto_layer(3, 0, 20, good_link));
+    // only as many as there are
+    TEST_ASSERT_EQUAL_INT(1, allo_video_auto_layer(2, 0, 20, good_link));
+    TEST_ASSERT_EQUAL_INT(0, allo_video_auto_layer(1, 0, 20, good_link));
+}
+
+void test_layers_dont_flip_at_the_edge(void)
+{
+    // stepping back past 3m moves down to layer 1 right away...
+    TEST_ASSERT_EQUAL_INT(1, allo_video_auto_layer(3, 0, 3.1, good_link));
+    // ...but stepping closer only moves back up once well inside layer 0's range
+    TEST_ASSERT_EQUAL_INT(1, allo_video_auto_layer(3, 1, 2.9, good_link));
+    TEST_ASSERT_EQUAL_INT(0, allo_video_auto_layer(3, 1, 2.0, good_link));
+}
+
+void test_congested_links_get_smaller_layers(void)
+{
+    allo_video_link lossy = { 0.1, 1 };
+    allo_video_link throttled = { 0, 0.3 };
+    TEST_ASSERT_EQUAL_INT(1, allo_video_auto_layer(3, 0, 1, lossy));
+    TEST_ASSERT_EQUAL_INT(2, allo_video_auto_layer(3, 0, 1, throttled));
+    TEST_ASSERT_EQUAL_INT(2, allo_video_auto_layer(3, 0, 5, lossy));
+}
+
+void test_halving_averages_blocks(void)
+{
+    const int width = 4, height = 2, stride = width * 4 + 8;
+    uint8_t src[2 * (4 * 4 + 8)];
+    memset(src, 0xee, sizeof(src)); // the padding past each row mustn't be read into the picture
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width * 4; x++) {
+            src[y * stride + x] = (uint8_t)(x < 8 ? (y == 0 ? 10 : 20) : 100 + x % 4);
+        }
+    }
+    uint8_t dst[2 * 4];
+    allo_video_halve(src, width, height, stride, dst);
+    for (int c = 0; c < 4; c++) {
+        TEST_ASSERT_EQUAL_INT(15, dst[c]);
+        TEST_ASSERT_EQUAL_INT(100 + c, dst[4 + c]);
+    }
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_layer_is_in_fragment_flags);
+    RUN_TEST(test_nothing_is_forwarded_before_a_keyframe);
+    RUN_TEST(test_layers_switch_at_keyframes_only);
+    RUN_TEST(test_further_away_gets_smaller_layers);
+    RUN_TEST(test_layers_dont_flip_at_the_edge);
+    RUN_TEST(test_congested_links_get_smaller_layers);
+    RUN_TEST(test_halving_averages_blocks);
+
+    return UNITY_END();
+}
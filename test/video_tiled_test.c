@@ -0,0 +1,296 @@
+#include <unity.h>
+#include "../src/media/video/tiled.h"
+#include "../src/media/video/decode_queue.h"
+#include "../src/media/video/pixel_pool.h"
+#include "../src/threading.h"
+#include "../src/atomics.h"
+#include "../src/util.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+// Streams a UI-like picture through a tiled track: a mostly static window, with a blinking
+// cursor and the odd redraw.
+
+#define RESERVE 4
+
+static allo_tiled_encoder *encoder;
+static allo_tiled_decoder *decoder;
+
+void setUp(void)
+{
+    encoder = allo_tiled_encoder_create(85, 2);
+    decoder = allo_tiled_decoder_create();
+}
+
+void tearDown(void)
+{
+    allo_tiled_encoder_destroy(encoder);
+    allo_tiled_decoder_destroy(decoder);
+}
+
+static allopixel *draw_window(int width, int height)
+{
+    allopixel *pixels = malloc(sizeof(allopixel) * width * height);
+    for(int y = 0; y < height; y++)
+    {
+        for(int x = 0; x < width; x++)
+        {
+            allopixel *p = &pixels[y * width + x];
+            bool titlebar = y < 24;
+            bool text = !titlebar && (y / 12) % 2 == 0 && (x / 6) % 3 != 0 && x % 97 < 80;
+            uint8_t v = titlebar ? 60 : text ? 30 : 235;
+            p->r = v; p->g = v; p->b = titlebar ? 140 : v; p->a = 255;
+        }
+    }
+    return pixels;
+}
+
+static void draw_cursor(allopixel *pixels, int width, int x, int y, bool on)
+{
+    for(int cy = y; cy < y + 16; cy++)
+    {
+        for(int cx = x; cx < x + 2; cx++)
+        {
+            uint8_t v = on ? 0 : 235;
+            pixels[cy * width + cx] = (allopixel){v, v, v, 255};
+        }
+    }
+}
+
+static ENetPacket *encode(allopixel *pixels, int width, int height, bool keyframe)
+{
+    return allo_tiled_encoder_encode(encoder, (const uint8_t*)pixels, width, height, width * sizeof(allopixel), keyframe, RESERVE);
+}
+
+static bool apply(ENetPacket *packet)
+{
+    bool changed = allo_tiled_decoder_apply(decoder, packet->data + RESERVE, packet->dataLength - RESERVE);
+    enet_packet_destroy(packet);
+    return changed;
+}
+
+static int tiles_in(ENetPacket *packet, int width, int height)
+{
+    int total = ((width + ALLO_TILED_TILE_SIZE - 1) / ALLO_TILED_TILE_SIZE) * ((height + ALLO_TILED_TILE_SIZE - 1) / ALLO_TILED_TILE_SIZE);
+    const uint8_t *bitmap = packet->data + RESERVE + ALLO_TILED_HEADER_SIZE;
+    int count = 0;
+    for(int i = 0; i < total; i++) count += (bitmap[i / 8] >> (i % 8)) & 1;
+    return count;
+}
+
+static double psnr(const allopixel *a, const allopixel *b, size_t count)
+{
+    double error = 0;
+    for(size_t i = 0; i < count; i++)
+    {
+        double dr = a[i].r - b[i].r, dg = a[i].g - b[i].g, db = a[i].b - b[i].b;
+        error += dr * dr + dg * dg + db * db;
+    }
+    error /= count * 3;
+    return error > 0 ? 10 * log10(255.0 * 255.0 / error) : 100;
+}
+
+void test_first_frame_is_all_of_it(void)
+{
+    // not a whole number of tiles either way
+    const int width = 200, height = 150;
+    allopixel *pixels = draw_window(width, height);
+    ENetPacket *packet = encode(pixels, width, height, false);
+    TEST_ASSERT_NOT_NULL(packet);
+    TEST_ASSERT_TRUE(packet->data[RESERVE] & ALLO_TILED_KEYFRAME);
+    TEST_ASSERT_EQUAL_INT(4 * 3, tiles_in(packet, width, height));
+
+    TEST_ASSERT_TRUE(apply(packet));
+    TEST_ASSERT_EQUAL_INT(width, decoder->width);
+    TEST_ASSERT_EQUAL_INT(height, decoder->height);
+    TEST_ASSERT_FALSE(decoder->needs_keyframe);
+    TEST_ASSERT_TRUE(psnr(pixels, decoder->framebuffer, width * height) > 30);
+    free(pixels);
+}
+
+void test_unchanged_pictures_send_nothing(void)
+{
+    const int width = 320, height = 240;
+    allopixel *pixels = draw_window(width, height);
+    apply(encode(pixels, width, height, false));
+    TEST_ASSERT_NULL(encode(pixels, width, height, false));
+    // unless asked to
+    ENetPacket *packet = encode(pixels, width, height, true);
+    TEST_ASSERT_NOT_NULL(packet);
+    TEST_ASSERT_EQUAL_INT(5 * 4, tiles_in(packet, width, height));
+    enet_packet_destroy(packet);
+    free(pixels);
+}
+
+void test_only_damaged_tiles_are_sent_and_patched(void)
+{
+    const int width = 640, height = 480;
+    allopixel *pixels = draw_window(width, height);
+    ENetPacket *keyframe = encode(pixels, width, height, false);
+    size_t keyframe_length = keyframe->dataLength;
+    apply(keyframe);
+    allopixel *before = malloc(sizeof(allopixel) * width * height);
+    memcpy(before, decoder->framebuffer, sizeof(allopixel) * width * height);
+
+    // the cursor straddles two tiles
+    draw_cursor(pixels, width, 127, 100, true);
+    ENetPacket *delta = encode(pixels, width, height, false);
+    TEST_ASSERT_NOT_NULL(delta);
+    TEST_ASSERT_FALSE(delta->data[RESERVE] & ALLO_TILED_KEYFRAME);
+    TEST_ASSERT_EQUAL_INT(2, tiles_in(delta, width, height));
+    TEST_ASSERT_TRUE(delta->dataLength * 10 < keyframe_length);
+    TEST_ASSERT_TRUE(apply(delta));
+    TEST_ASSERT_FALSE(decoder->needs_keyframe);
+
+    for(int y = 0; y < height; y++)
+    {
+        for(int x = 0; x < width; x++)
+        {
+            const allopixel *was = &before[y * width + x], *is = &decoder->framebuffer[y * width + x];
+            bool damaged = y >= 64 && y < 128 && x >= 64 && x < 192;
+            if(!damaged) TEST_ASSERT_EQUAL_MEMORY(was, is, sizeof(allopixel));
+        }
+    }
+    // the cursor is drawn
+    TEST_ASSERT_TRUE(decoder->framebuffer[108 * width + 128].r < 100);
+    free(before);
+    free(pixels);
+}
+
+void test_lost_frames_need_a_keyframe(void)
+{
+    const int width = 256, height = 128;
+    allopixel *pixels = draw_window(width, height);
+    apply(encode(pixels, width, height, false));
+
+    draw_cursor(pixels, width, 10, 40, true);
+    enet_packet_destroy(encode(pixels, width, height, false)); // lost
+    draw_cursor(pixels, width, 10, 40, false);
+    draw_cursor(pixels, width, 200, 40, true);
+    TEST_ASSERT_TRUE(apply(encode(pixels, width, height, false)));
+    TEST_ASSERT_TRUE(decoder->needs_keyframe);
+
+    TEST_ASSERT_TRUE(apply(encode(pixels, width, height, true)));
+    TEST_ASSERT_FALSE(decoder->needs_keyframe);
+    TEST_ASSERT_TRUE(psnr(pixels, decoder->framebuffer, width * height) > 30);
+    free(pixels);
+}
+
+void test_joining_halfway_shows_what_it_gets(void)
+{
+    const int width = 256, height = 128;
+    allopixel *pixels = draw_window(width, height);
+    enet_packet_destroy(encode(pixels, width, height, false)); // before we joined
+    draw_cursor(pixels, width, 10, 40, true);
+    TEST_ASSERT_TRUE(apply(encode(pixels, width, height, false)));
+    TEST_ASSERT_EQUAL_INT(width, decoder->width);
+    TEST_ASSERT_TRUE(decoder->needs_keyframe);
+    free(pixels);
+}
+
+static allo_atomic_int busy, released;
+
+/// Keeps the queue's only thread busy until released
+static bool blocking_decode(const uint8_t *data, size_t length, allo_decoded_video_frame *frame)
+{
+    allo_atomic_int_store(&busy, 1);
+    while(!allo_atomic_int_load(&released)) thrd_yield();
+    return false;
+}
+
+static void free_decoder(void *state)
+{
+    allo_tiled_decoder_destroy(state);
+}
+
+static void push(allo_video_decode_queue *queue, ENetPacket *packet)
+{
+    allo_video_decode_queue_push(queue, 1, packet->data + RESERVE, packet->dataLength - RESERVE);
+    enet_packet_destroy(packet);
+}
+
+void test_queued_deltas_all_reach_the_picture(void)
+{
+    const int width = 256, height = 128;
+    allopixel *pixels = draw_window(width, height);
+    allo_video_decode_queue *queue = allo_video_decode_queue_create(1, blocking_decode);
+    allo_video_decode_queue_set_decoder(queue, 1, allo_tiled_decoder_decode, allo_tiled_decoder_create(), free_decoder);
+    allo_atomic_int_store(&busy, 0);
+    allo_atomic_int_store(&released, 0);
+    uint8_t nothing = 0;
+    allo_video_decode_queue_push(queue, 2, &nothing, 1);
+    while(!allo_atomic_int_load(&busy)) thrd_yield();
+
+    // all three wait for the thread, and each delta has tiles the other doesn't
+    push(queue, encode(pixels, width, height, false));
+    draw_cursor(pixels, width, 10, 40, true);
+    push(queue, encode(pixels, width, height, false));
+    draw_cursor(pixels, width, 200, 40, true);
+    push(queue, encode(pixels, width, height, false));
+    allo_atomic_int_store(&released, 1);
+
+    allo_decoded_video_frame frame = { 0 };
+    for(int i = 0; i < 5000 && allo_video_decode_queue_stats(queue).decoded < 1; i++)
+    {
+        thrd_sleep(&(struct timespec){.tv_nsec = 1000000}, NULL);
+    }
+    TEST_ASSERT_TRUE(allo_video_decode_queue_pop(queue, &frame));
+    TEST_ASSERT_EQUAL_UINT32(1, frame.track_id);
+    TEST_ASSERT_FALSE(frame.needs_keyframe);
+    TEST_ASSERT_EQUAL_INT(width, frame.wide);
+    // both cursors
+    TEST_ASSERT_TRUE(frame.pixels[48 * width + 10].r < 100);
+    TEST_ASSERT_TRUE(frame.pixels[48 * width + 200].r < 100);
+    TEST_ASSERT_TRUE(psnr(pixels, frame.pixels, width * height) > 30);
+    allo_pixel_buffer_return(frame.pixels, (size_t)width * height);
+
+    allo_video_decode_stats stats = allo_video_decode_queue_stats(queue);
+    TEST_ASSERT_EQUAL_UINT64(4, stats.queued);
+    // the thread blocker
+    TEST_ASSERT_EQUAL_UINT64(1, stats.failed);
+    allo_video_decode_queue_destroy(queue);
+    free(pixels);
+}
+
+void test_blinking_cursor_at_1080p(void)
+{
+    const int width = 1920, height = 1080, frames = 60;
+    allopixel *pixels = draw_window(width, height);
+    double start = get_ts_monod();
+    ENetPacket *keyframe = encode(pixels, width, height, false);
+    double keyframe_time = get_ts_monod() - start;
+    size_t keyframe_length = keyframe->dataLength;
+    apply(keyframe);
+
+    size_t delta_bytes = 0;
+    start = get_ts_monod();
+    for(int i = 0; i < frames; i++)
+    {
+        draw_cursor(pixels, width, 700, 500, i % 2 == 0);
+        ENetPacket *delta = encode(pixels, width, height, false);
+        delta_bytes += delta->dataLength;
+        enet_packet_destroy(delta);
+    }
+    double delta_time = (get_ts_monod() - start) / frames;
+    printf("1080p keyframe: %zu bytes in %.2fms. cursor blink: %zu bytes in %.2fms per frame\n",
+        keyframe_length, keyframe_time * 1000, delta_bytes / frames, delta_time * 1000);
+    TEST_ASSERT_TRUE(delta_bytes / frames * 50 < keyframe_length);
+    free(pixels);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_first_frame_is_all_of_it);
+    RUN_TEST(test_unchanged_pictures_send_nothing);
+    RUN_TEST(test_only_damaged_tiles_are_sent_and_patched);
+    RUN_TEST(test_lost_frames_need_a_keyframe);
+    RUN_TEST(test_joining_halfway_shows_what_it_gets);
+    RUN_TEST(test_queued_deltas_all_reach_the_picture);
+    RUN_TEST(test_blinking_cursor_at_1080p);
+
+    return UNITY_END();
+}